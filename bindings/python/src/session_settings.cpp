@@ -140,6 +140,24 @@ void bind_session_settings()
         .def_readwrite("seeding_outgoing_connections", &session_settings::seeding_outgoing_connections)
         .def_readwrite("no_connect_privileged_ports", &session_settings::no_connect_privileged_ports)
         .def_readwrite("alert_queue_size", &session_settings::alert_queue_size)
+        .def_readwrite("disk_io_threads", &session_settings::disk_io_threads)
+        .def_readwrite("hashing_threads", &session_settings::hashing_threads)
+        .def_readwrite("use_io_uring", &session_settings::use_io_uring)
+        .def_readwrite("io_uring_queue_depth", &session_settings::io_uring_queue_depth)
+        .def_readwrite("use_sendfile", &session_settings::use_sendfile)
+        .def_readwrite("read_cache_algorithm", &session_settings::read_cache_algorithm)
+        .def_readwrite("read_cache_admission_filter", &session_settings::read_cache_admission_filter)
+        .def_readwrite("adaptive_read_ahead", &session_settings::adaptive_read_ahead)
+        .def_readwrite("active_checking", &session_settings::active_checking)
+        .def_readwrite("mmap_sync_writes", &session_settings::mmap_sync_writes)
+        .def_readwrite("direct_io", &session_settings::direct_io)
+        .def_readwrite("max_coalesced_write_size", &session_settings::max_coalesced_write_size)
+        .def_readwrite("disk_write_latency_target", &session_settings::disk_write_latency_target)
+        .def_readwrite("disk_read_weight", &session_settings::disk_read_weight)
+        .def_readwrite("disk_write_weight", &session_settings::disk_write_weight)
+        .def_readwrite("disk_hash_weight", &session_settings::disk_hash_weight)
+        .def_readwrite("disk_move_weight", &session_settings::disk_move_weight)
+        .def_readwrite("checking_batch_size", &session_settings::checking_batch_size)
     ;
 
     enum_<proxy_settings::proxy_type>("proxy_type")
@@ -156,6 +174,11 @@ void bind_session_settings()
         .value("largest_contiguous", session_settings::largest_contiguous)
     ;
 
+    enum_<session_settings::read_cache_algo_t>("read_cache_algo_t")
+        .value("read_cache_lru", session_settings::read_cache_lru)
+        .value("read_cache_2q", session_settings::read_cache_2q)
+    ;
+
     enum_<session_settings::choking_algorithm_t>("choking_algorithm_t")
         .value("fixed_slots_choker", session_settings::fixed_slots_choker)
         .value("auto_expand_choker", session_settings::auto_expand_choker)
@@ -0,0 +1,104 @@
+/*
+
+Copyright (c) 2012, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/time.hpp"
+
+#include <boost/cstdint.hpp>
+#include <vector>
+#include <algorithm>
+#include <stdio.h>
+
+using namespace libtorrent;
+
+// hashes 64 MiB, in 8 pieces of 8 MiB, and prints the throughput
+void benchmark(char const* name, bool batch)
+{
+	int const piece_size = 8 * 1024 * 1024;
+	int const num_pieces = 8;
+	std::vector<char> data(piece_size * num_pieces);
+	for (int i = 0; i < int(data.size()); ++i) data[i] = char(i);
+
+	char const* bufs[num_pieces];
+	int lens[num_pieces];
+	sha1_hash digests[num_pieces];
+	for (int i = 0; i < num_pieces; ++i)
+	{
+		bufs[i] = &data[0] + i * piece_size;
+		lens[i] = piece_size;
+	}
+
+	ptime start = time_now_hires();
+	if (batch)
+	{
+		hash_buffers(bufs, lens, digests, num_pieces);
+	}
+	else
+	{
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			hasher h(bufs[i], lens[i]);
+			digests[i] = h.final();
+		}
+	}
+	boost::int64_t us = (std::max)(total_microseconds(time_now_hires() - start), boost::int64_t(1));
+	fprintf(stderr, "%-26s %.1f MB/s\n", name, double(data.size()) / us);
+}
+
+int main()
+{
+	char name[100];
+#if !defined TORRENT_USE_OPENSSL && !defined TORRENT_USE_GCRYPT
+	// the built-in SHA-1 implementation can be switched between the
+	// portable C code and the x86 SHA extensions
+	bool sha_ni = SHA1_has_sha_ni();
+	fprintf(stderr, "SHA extensions: %s\n", sha_ni ? "yes" : "no");
+
+	SHA1_use_sha_ni(false);
+	snprintf(name, sizeof(name), "hash_buffers (%d lanes):", hash_batch_lanes());
+	benchmark("portable C:", false);
+	benchmark(name, true);
+
+	SHA1_use_sha_ni(true);
+	if (sha_ni) benchmark("SHA extensions:", false);
+#else
+	snprintf(name, sizeof(name), "hash_buffers (%d lanes):", hash_batch_lanes());
+#ifdef TORRENT_USE_GCRYPT
+	benchmark("gcrypt:", false);
+#else
+	benchmark("openssl:", false);
+#endif
+	benchmark(name, true);
+#endif
+	return 0;
+}
+
@@ -282,6 +282,8 @@ namespace libtorrent
 			
 			void queue_check_torrent(boost::shared_ptr<torrent> const& t);
 			void dequeue_check_torrent(boost::shared_ptr<torrent> const& t);
+			// starts checking queued torrents, up to active_checking
+			void start_queued_checks();
 
 			void set_alert_mask(int m);
 			size_t set_alert_queue_size_limit(size_t queue_size_limit_);
@@ -320,6 +322,8 @@ namespace libtorrent
 			void choke_peer(peer_connection& c);
 
 			session_status status() const;
+			void get_torrent_cache_status(sha1_hash const& ih
+				, torrent_cache_status* st);
 			void set_peer_id(peer_id const& id);
 			void set_key(int key);
 			address listen_address() const;
@@ -426,8 +430,11 @@ namespace libtorrent
 				, int source_type, address const& source);
 			address const& external_address() const { return m_external_address; }
 
-			bool can_write_to_disk() const
-			{ return m_disk_thread.can_write(); }
+			// returns false if the write queue of the drive the files
+			// of the storage are on is full. A torrent without a
+			// storage passes 0, it doesn't write anything
+			bool can_write_to_disk(piece_manager const* s) const
+			{ return s == 0 || m_disk_thread.can_write(s); }
 
 			// used when posting synchronous function
 			// calls to session_impl and torrent objects
@@ -593,10 +600,19 @@ namespace libtorrent
 			torrent_map m_torrents;
 			std::map<std::string, boost::shared_ptr<torrent> > m_uuids;
 
-			typedef std::list<boost::shared_ptr<torrent> > check_queue_t;
+			struct queued_check
+			{
+				boost::shared_ptr<torrent> t;
+				// the device the torrent is saved to. Torrents on
+				// different devices are checked in parallel first
+				boost::uint64_t device;
+			};
+			typedef std::list<queued_check> check_queue_t;
 
-			// this has all torrents that wants to be checked in it
+			// this has all torrents that wants to be checked in it,
+			// including the ones being checked
 			check_queue_t m_queued_for_checking;
+			check_queue_t::iterator find_queued_check(torrent const* t);
 
 			// this maps sockets to their peer_connection
 			// object. It is the complete list of all connected
@@ -0,0 +1,142 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_BINARY_RESUME_HPP_INCLUDED
+#define TORRENT_BINARY_RESUME_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include "libtorrent/entry.hpp"
+#include "libtorrent/lazy_entry.hpp"
+#include "libtorrent/error_code.hpp"
+#include "libtorrent/size_type.hpp"
+
+#include <vector>
+#include <utility>
+#include <ctime>
+
+namespace libtorrent
+{
+	// resume data in the binary format. The parts that are needed to
+	// verify the resume data against the files on disk (the pieces
+	// bitfield, the file sizes and modification times and the slot map)
+	// are stored as fixed size fields that are used in place, without
+	// being parsed. The rest of the resume data is kept as a bencoded
+	// dictionary at the end.
+	//
+	// This only refers to the buffer it was parsed from, which must
+	// stay valid as long as it's used
+	struct TORRENT_EXPORT binary_resume_data
+	{
+		binary_resume_data() { clear(); }
+
+		// the version of the format written by write_binary_resume_data()
+		enum { current_version = 1 };
+
+		enum flags_t
+		{
+			// the storage uses compact allocation
+			compact_allocation = 1,
+			// there is a bitfield of the pieces that have been verified
+			// (for torrents in seed mode) after the pieces bitfield
+			has_verified = 2,
+			// there is a slot map
+			has_slots = 4
+		};
+
+		// returns true if the buffer starts with the binary resume data
+		// tag, i.e. it isn't a bencoded dictionary
+		static bool is_binary(char const* buf, int size);
+
+		// checks the header, the size of every section and the checksum.
+		// The dictionary at the end (holding everything not stored in the
+		// fixed fields) is decoded into extra, which must outlive this
+		// object as well. Returns false and sets ec on failure
+		bool parse(char const* buf, int size, lazy_entry& extra, error_code& ec);
+
+		void clear();
+
+		bool valid() const { return m_buf != 0; }
+
+		sha1_hash const& info_hash() const { return m_info_hash; }
+		bool compact() const { return (m_flags & compact_allocation) != 0; }
+		// 0 if the resume data didn't specify it
+		int blocks_per_piece() const { return m_blocks_per_piece; }
+
+		// 0 if the resume data only has a slot map
+		int num_pieces() const { return m_num_pieces; }
+		// the have bitfield, in the same bit order as libtorrent::bitfield
+		char const* pieces() const { return m_pieces; }
+		bool have_piece(int index) const;
+		bool verified_piece(int index) const;
+
+		bool has_slot_map() const { return (m_flags & binary_resume_data::has_slots) != 0; }
+		int num_slots() const { return m_num_slots; }
+		// the piece in the slot, or one of piece_manager's
+		// unassigned (-2) or unallocated (-1)
+		int slot_at(int index) const;
+
+		int num_files() const { return m_num_files; }
+		std::pair<size_type, std::time_t> file_size_at(int index) const;
+		void file_sizes(std::vector<std::pair<size_type, std::time_t> >& fs) const;
+
+		// the dictionary with the rest of the resume data
+		lazy_entry const* extra() const { return m_extra; }
+
+		// rebuilds the bencoded form of the resume data
+		void to_entry(entry& rd) const;
+
+	private:
+
+		char const* m_buf;
+		char const* m_pieces;
+		char const* m_verified;
+		char const* m_slots;
+		char const* m_file_sizes;
+		lazy_entry const* m_extra;
+		int m_flags;
+		int m_num_pieces;
+		int m_num_slots;
+		int m_num_files;
+		int m_blocks_per_piece;
+		sha1_hash m_info_hash;
+	};
+
+	// converts resume data, as returned by save_resume_data_alert, to the
+	// binary format. The result can be passed in add_torrent_params::resume_data
+	// like bencoded resume data
+	TORRENT_EXPORT bool write_binary_resume_data(entry const& rd
+		, std::vector<char>& buf, error_code& ec);
+}
+
+#endif // TORRENT_BINARY_RESUME_HPP_INCLUDED
+
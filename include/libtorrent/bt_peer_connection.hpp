@@ -225,6 +225,10 @@ namespace libtorrent
 		void write_bitfield();
 		void write_have(int index);
 		void write_piece(peer_request const& r, disk_buffer_holder& buffer);
+		void write_piece(peer_request const& r
+			, boost::intrusive_ptr<file> const& f, size_type file_offset);
+		void write_piece(peer_request const& r, char const* view
+			, boost::shared_ptr<void> const& mapping);
 		void write_handshake();
 #ifndef TORRENT_DISABLE_EXTENSIONS
 		void write_extensions();
@@ -293,6 +297,9 @@ public:
 		// peer_connection functions of the same names
 		virtual void append_const_send_buffer(char const* buffer, int size);
 		void send_buffer(char const* buf, int size, int flags = 0);
+
+		// payload can't be sent straight from files if it's encrypted
+		virtual bool can_send_file() const;
 		template <class Destructor>
 		void append_send_buffer(char* buffer, int size, Destructor const& destructor)
 		{
@@ -305,6 +312,9 @@ public:
 
 private:
 
+		// writes the piece message, up to the payload
+		void write_piece_header(peer_request const& r);
+
 		// Returns offset at which bytestream (src, src + src_size)
 		// matches bytestream(target, target + target_size).
 		// If no sync found, return -1
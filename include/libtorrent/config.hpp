@@ -131,6 +131,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #ifndef TORRENT_USE_ICONV
 #define TORRENT_USE_ICONV 0
 #endif
+#define TORRENT_USE_MMAP 0
 
 // ==== Darwin/BSD ===
 #elif (defined __APPLE__ && defined __MACH__) || defined __FreeBSD__ || defined __NetBSD__ \
@@ -158,6 +159,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_USE_NETLINK 1
 #define TORRENT_USE_IFCONF 1
 #define TORRENT_HAS_SALEN 0
+#define TORRENT_USE_SENDFILE 1
+// io_uring requires the kernel headers from linux 5.1 or later
+#if !defined TORRENT_USE_IO_URING && defined __has_include
+#if __has_include(<linux/io_uring.h>)
+#define TORRENT_USE_IO_URING 1
+#endif
+#endif
 
 // ==== MINGW ===
 #elif defined __MINGW32__
@@ -172,6 +180,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #define TORRENT_USE_GETADAPTERSADDRESSES 1
 #define TORRENT_HAS_SALEN 0
 #define TORRENT_USE_GETIPFORWARDTABLE 1
+#define TORRENT_USE_MMAP 0
 
 // ==== WINDOWS ===
 #elif defined WIN32
@@ -190,6 +199,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 #define TORRENT_USE_RLIMIT 0
 #define TORRENT_HAS_FALLOCATE 0
+#define TORRENT_USE_MMAP 0
 
 // ==== SOLARIS ===
 #elif defined sun || defined __sun 
@@ -203,6 +213,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <storage/StorageDefs.h> // B_PATH_NAME_LENGTH
 #define TORRENT_HAS_FALLOCATE 0
 #define TORRENT_USE_MLOCK 0
+#define TORRENT_USE_MMAP 0
 #ifndef TORRENT_USE_ICONV
 #define TORRENT_USE_ICONV 0
 #endif
@@ -334,6 +345,18 @@ inline int snprintf(char* buf, int len, char const* fmt, ...)
 #define TORRENT_USE_RLIMIT 1
 #endif
 
+#ifndef TORRENT_USE_IO_URING
+#define TORRENT_USE_IO_URING 0
+#endif
+
+#ifndef TORRENT_USE_SENDFILE
+#define TORRENT_USE_SENDFILE 0
+#endif
+
+#ifndef TORRENT_USE_MMAP
+#define TORRENT_USE_MMAP 1
+#endif
+
 #ifndef TORRENT_USE_IFADDRS
 #define TORRENT_USE_IFADDRS 0
 #endif
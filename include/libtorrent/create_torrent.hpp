@@ -265,50 +265,69 @@ namespace libtorrent
 		int file_idx = 0;
 		size_type left_in_file = t.files().at(0).size;
 
-		// calculate the hash for all pieces
+		// calculate the hash for all pieces. Pieces are read in batches
+		// and hashed in parallel, as many as the CPU can hash at a time
+		// while keeping the buffer at a reasonable size
 		int num = t.num_pieces();
-		piece_holder buf(t.piece_length());
-		for (int i = 0; i < num; ++i)
+		enum { max_batch = 8 };
+		int batch = (std::min)(hash_batch_lanes(), 16 * 1024 * 1024 / t.piece_length());
+		batch = (std::max)(1, (std::min)(batch, int(max_batch)));
+		piece_holder buf(t.piece_length() * batch);
+		char const* bufs[max_batch];
+		int lens[max_batch];
+		sha1_hash digests[max_batch];
+		for (int first = 0; first < num; first += batch)
 		{
-			// read hits the disk and will block. Progress should
-			// be updated in between reads
-			st->read(buf.bytes(), i, 0, t.piece_size(i));
-			if (st->error())
-			{
-				ec = st->error();
-				return;
-			}
-			
-			if (t.should_add_file_hashes())
+			int num_bufs = (std::min)(batch, num - first);
+			for (int k = 0; k < num_bufs; ++k)
 			{
-				int left_in_piece = t.piece_size(i);
-				int this_piece_size = left_in_piece;
-				// the number of bytes from this file we just read
-				while (left_in_piece > 0)
+				int i = first + k;
+				char* piece = buf.bytes() + k * t.piece_length();
+				// read hits the disk and will block. Progress should
+				// be updated in between reads
+				st->read(piece, i, 0, t.piece_size(i));
+				if (st->error())
 				{
-					int to_hash_for_file = int((std::min)(size_type(left_in_piece), left_in_file));
-					if (to_hash_for_file > 0)
-					{
-						int offset = this_piece_size - left_in_piece;
-						filehash.update(buf.bytes() + offset, to_hash_for_file);
-					}
-					left_in_file -= to_hash_for_file;
-					left_in_piece -= to_hash_for_file;
-					if (left_in_file == 0)
+					ec = st->error();
+					return;
+				}
+				bufs[k] = piece;
+				lens[k] = t.piece_size(i);
+
+				if (t.should_add_file_hashes())
+				{
+					int left_in_piece = t.piece_size(i);
+					int this_piece_size = left_in_piece;
+					// the number of bytes from this file we just read
+					while (left_in_piece > 0)
 					{
-						if (!t.files().at(file_idx).pad_file)
-							t.set_file_hash(file_idx, filehash.final());
-						filehash.reset();
-						file_idx++;
-						if (file_idx >= t.files().num_files()) break;
-						left_in_file = t.files().at(file_idx).size;
+						int to_hash_for_file = int((std::min)(size_type(left_in_piece), left_in_file));
+						if (to_hash_for_file > 0)
+						{
+							int offset = this_piece_size - left_in_piece;
+							filehash.update(piece + offset, to_hash_for_file);
+						}
+						left_in_file -= to_hash_for_file;
+						left_in_piece -= to_hash_for_file;
+						if (left_in_file == 0)
+						{
+							if (!t.files().at(file_idx).pad_file)
+								t.set_file_hash(file_idx, filehash.final());
+							filehash.reset();
+							file_idx++;
+							if (file_idx >= t.files().num_files()) break;
+							left_in_file = t.files().at(file_idx).size;
+						}
 					}
 				}
 			}
 
-			hasher h(buf.bytes(), t.piece_size(i));
-			t.set_hash(i, h.final());
-			f(i);
+			hash_buffers(bufs, lens, digests, num_bufs);
+			for (int k = 0; k < num_bufs; ++k)
+			{
+				t.set_hash(first + k, digests[k]);
+				f(first + k);
+			}
 		}
 	}
 
@@ -41,32 +41,32 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/allocator.hpp"
 #include "libtorrent/io_service.hpp"
 #include "libtorrent/sliding_average.hpp"
+#include "libtorrent/latency_histogram.hpp"
 
 #include <boost/function/function0.hpp>
 #include <boost/function/function2.hpp>
 #include <boost/noncopyable.hpp>
 #include <boost/shared_array.hpp>
+#include <boost/shared_ptr.hpp>
 #include <deque>
+#include <map>
+#include <set>
 #include "libtorrent/config.hpp"
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
 #include <boost/pool/pool.hpp>
 #endif
 #include "libtorrent/session_settings.hpp"
 #include "libtorrent/thread.hpp"
-
-#include <boost/multi_index_container.hpp>
-#include <boost/multi_index/member.hpp>
-#include <boost/multi_index/ordered_index.hpp>
-#include <boost/multi_index/mem_fun.hpp>
+#include "libtorrent/hash_thread.hpp"
+#include "libtorrent/io_uring.hpp"
+#include "libtorrent/piece_cache.hpp"
+#include "libtorrent/mpsc_queue.hpp"
+#include "libtorrent/frequency_sketch.hpp"
+#include "libtorrent/write_throttle.hpp"
 
 namespace libtorrent
 {
-	using boost::multi_index::multi_index_container;
-	using boost::multi_index::ordered_non_unique;
-	using boost::multi_index::ordered_unique;
-	using boost::multi_index::indexed_by;
-	using boost::multi_index::member;
-	using boost::multi_index::const_mem_fun;
+	struct binary_resume_data;
 
 	struct cached_piece_info
 	{
@@ -77,19 +77,82 @@ namespace libtorrent
 		enum kind_t { read_cache = 0, write_cache = 1 };
 		kind_t kind;
 	};
+
+	// the disk cache usage and quotas of a single torrent
+	struct torrent_cache_status
+	{
+		torrent_cache_status()
+			: cached_blocks(0)
+			, soft_quota(0)
+			, hard_quota(0)
+			, hits(0)
+			, misses(0)
+		{}
+
+		// the number of blocks in the read and write cache
+		int cached_blocks;
+		// the quotas set with torrent_handle::set_cache_quota()
+		int soft_quota;
+		int hard_quota;
+		// the number of blocks read from the cache and from disk
+		size_type hits;
+		size_type misses;
+	};
 	
+	// the fields of disk_io_job that only a few kinds of jobs use.
+	// They are kept out of line, to keep the job small for the
+	// common read and write jobs
+	struct disk_io_job_extra
+	{
+		disk_io_job_extra(): view(0), device(0), binary_resume(0) {}
+
+		// used for move_storage and rename_file. On errors, this is set
+		// to the error message
+		std::string str;
+
+		// on error, this is set to the path of the
+		// file the disk operation failed on
+		std::string error_file;
+
+		boost::shared_ptr<entry> resume_data;
+
+		// read jobs on storages that map their files may return the
+		// block as a pointer into the mapping instead of in a buffer.
+		// 'mapping' keeps the mapping alive while the view is used
+		char const* view;
+		boost::shared_ptr<void> mapping;
+
+		// check_fastresume and move_storage jobs set this to the
+		// device the files of the storage are on, 0 if unknown
+		boost::uint64_t device;
+
+		// check_fastresume jobs verifying binary resume data point
+		// to it here. Otherwise buffer points to a lazy_entry
+		binary_resume_data const* binary_resume;
+	};
+
 	struct disk_io_job
 	{
 		disk_io_job()
 			: action(read)
-			, buffer(0)
 			, buffer_size(0)
+			, buffer(0)
 			, piece(0)
 			, offset(0)
 			, max_cache_line(0)
 			, cache_min_time(0)
+			, file_offset(0)
+			, m_extra(0)
 		{}
 
+		disk_io_job(disk_io_job const& j);
+		disk_io_job& operator=(disk_io_job const& j);
+		~disk_io_job() { delete m_extra; }
+
+		// exchanges the contents of the two jobs. This is how jobs are
+		// moved between the job queues, without copying the callback
+		void swap(disk_io_job& j);
+
 		enum action_t
 		{
 			read
@@ -109,22 +172,18 @@ namespace libtorrent
 			, read_and_hash
 			, cache_piece
 			, finalize_file
+			// this must stay the last action, cache_status::num_job_types
+			// is derived from it
+			, open_block
 		};
 
 		action_t action;
 
-		char* buffer;
 		int buffer_size;
+		char* buffer;
 		boost::intrusive_ptr<piece_manager> storage;
 		// arguments used for read and write
 		int piece, offset;
-		// used for move_storage and rename_file. On errors, this is set
-		// to the error message
-		std::string str;
-
-		// on error, this is set to the path of the
-		// file the disk operation failed on
-		std::string error_file;
 
 		// if this is > 0, it specifies the max number of blocks to read
 		// ahead in the read cache for this access. This is only valid
@@ -135,7 +194,11 @@ namespace libtorrent
 		// line caused by this operation stays in the cache
 		int cache_min_time;
 
-		boost::shared_ptr<entry> resume_data;
+		// for open_block jobs that don't fall back to reading the
+		// block into a buffer, this is the file the block is stored
+		// in and the offset in that file it starts at
+		boost::intrusive_ptr<file> file_handle;
+		size_type file_offset;
 
 		// the error code from the file operation
 		error_code error;
@@ -146,8 +209,41 @@ namespace libtorrent
 		// the time when this job was issued. This is used to
 		// keep track of disk I/O congestion
 		ptime start_time;
+
+		// returns the out of line fields, allocating them
+		// the first time they're asked for
+		disk_io_job_extra& extra();
+
+		// these return empty values for jobs that don't have
+		// the out of line fields
+		std::string const& str() const { return get_extra().str; }
+		std::string const& error_file() const { return get_extra().error_file; }
+		boost::shared_ptr<entry> const& resume_data() const
+		{ return get_extra().resume_data; }
+		char const* view() const { return get_extra().view; }
+		boost::shared_ptr<void> const& mapping() const
+		{ return get_extra().mapping; }
+		boost::uint64_t device() const { return get_extra().device; }
+		binary_resume_data const* binary_resume() const
+		{ return get_extra().binary_resume; }
+
+		// the block a read job returned. Either the buffer or a view
+		// into the storage's memory mapping
+		char const* data() const { return m_extra && m_extra->view ? m_extra->view : buffer; }
+
+		// clears the string fields, without allocating the
+		// out of line fields if there aren't any
+		void clear_strings();
+
+	private:
+
+		disk_io_job_extra const& get_extra() const;
+
+		disk_io_job_extra* m_extra;
 	};
 
+	inline void swap(disk_io_job& lhs, disk_io_job& rhs) { lhs.swap(rhs); }
+
 	// returns true if the fundamental operation
 	// of the given disk job is a read operation
 	bool is_read_operation(disk_io_job const& j);
@@ -156,6 +252,143 @@ namespace libtorrent
 	// points to a disk buffer
 	bool operation_has_buffer(disk_io_job const& j);
 
+	// the job queue of a disk thread. Jobs are queued per torrent, and the
+	// torrents take turns by deficit round robin, so that a torrent with a
+	// deep queue (or one being checked) doesn't hold up the jobs of the
+	// others. Each torrent has two queues: one for its peer reads, which
+	// may be reordered and are run like an elevator, sweeping up and down
+	// the drive, and one for all its other jobs, which are run in the
+	// order they were queued.
+	//
+	// Every time a queue gets its turn, it's allowed the weight of the
+	// class of the job at its front, in blocks. It keeps running jobs as
+	// long as their cost (also in blocks) is within what it has been
+	// allowed, what's left over is carried over to its next turn. This
+	// gives each class a share of the disk in proportion to its weight.
+	// Jobs without a storage, and abort_torrent jobs, jump the queue.
+	// abort_torrent is run ahead of the jobs the torrent already has
+	// queued, like it was by the single queue this replaces, so that
+	// it can cancel them rather than wait for them. The ones that
+	// aren't cancelled (writes, hash and move jobs, see remove_jobs())
+	// stay queued, in order, and still run after it
+	struct TORRENT_EXPORT disk_job_queue
+	{
+		enum job_class_t
+		{
+			// read, read_and_hash, cache_piece and open_block
+			read_class,
+			write_class,
+			// hash, check_fastresume and check_files
+			hash_class,
+			// move_storage and the other jobs on whole files
+			move_class,
+			num_job_classes
+		};
+
+		disk_job_queue(int block_size);
+
+		static job_class_t job_class(disk_io_job const& j);
+
+		// the number of blocks a job is charged for
+		int job_cost(disk_io_job const& j) const;
+
+		// takes the weights of the job classes from the
+		// disk_*_weight settings. They're at least 1
+		void set_weights(session_settings const& s);
+
+		// queues the job, by swapping it with j. Peer reads of a torrent
+		// are run in order of sort_key, in the direction the elevator is
+		// going from the sort key of the previous one. Reads with a
+		// negative sort key are run before the sorted ones, in the order
+		// they were queued. The sort key of other jobs is ignored
+		void push(disk_io_job& j, size_type sort_key = -1);
+
+		// takes the next job to run out of the queue and
+		// swaps it into j. Returns false if the queue is empty
+		bool pop(disk_io_job& j);
+
+		// moves the jobs of the storage that are cancelled when it's
+		// aborted (i.e. not writes, or other jobs that have to run)
+		// to jobs. If s is 0, the jobs of every storage are moved.
+		// The queues of the storage are removed once they're empty
+		void remove_jobs(piece_manager const* s, std::vector<disk_io_job>& jobs);
+
+		void clear();
+
+		bool empty() const { return m_size == 0; }
+		int size() const { return m_size; }
+		// the number of queued peer reads
+		int num_reads() const { return m_num_reads; }
+
+	private:
+
+		typedef std::multimap<size_type, disk_io_job> jobs_t;
+
+		struct flow
+		{
+			flow(): storage(0), deficit(0), scan_pos(0)
+				, direction(1), active(false) {}
+
+			// returns the job to run next
+			jobs_t::iterator next();
+
+			jobs_t jobs;
+			piece_manager const* storage;
+			// the number of blocks the queue has been allowed
+			// and hasn't used yet
+			int deficit;
+			// the sort key of the last job that was run, and the
+			// direction the elevator is going, 1 = up, -1 = down
+			size_type scan_pos;
+			int direction;
+			// true while the queue is in m_active
+			bool active;
+		};
+
+		// the queues of a torrent are kept when they run out of
+		// jobs, for the elevator to continue where it was, until
+		// the torrent is aborted
+		struct torrent_queues
+		{
+			torrent_queues(): aborted(false) {}
+			flow reads;
+			flow jobs;
+			bool aborted;
+		};
+
+		// takes the queue out of m_active once it's empty, and
+		// removes the queues of an aborted torrent once both are
+		void queue_emptied(flow& f);
+
+		// called when every active queue has had its turn without
+		// being allowed enough to run its next job. Gives each of
+		// them what they would be allowed over the turns it takes
+		// until one of them can, but the last one
+		void skip_turns();
+
+		// jobs that jump the queue
+		std::deque<disk_io_job> m_immediate;
+
+		std::map<piece_manager const*, torrent_queues> m_torrents;
+
+		// the queues that have jobs, in the order they take turns.
+		// It's the turn of the one at the front
+		std::deque<flow*> m_active;
+
+		// true if the queue at the front of m_active has
+		// been given its weight for this turn
+		bool m_turn_started;
+
+		int m_weights[num_job_classes];
+		int m_block_size;
+
+		// the sort key of the next job that's run in order
+		size_type m_sequence;
+
+		int m_size;
+		int m_num_reads;
+	};
+
 	struct cache_status
 	{
 		cache_status()
@@ -165,6 +398,7 @@ namespace libtorrent
 			, blocks_read_hit(0)
 			, reads(0)
 			, queued_bytes(0)
+			, queued_bytes_limit(0)
 			, cache_size(0)
 			, read_cache_size(0)
 			, total_used_buffers(0)
@@ -182,6 +416,10 @@ namespace libtorrent
 			, cumulative_sort_time(0)
 			, total_read_back(0)
 			, read_queue_size(0)
+			, probation_hits(0)
+			, protected_hits(0)
+			, ghost_hits(0)
+			, admission_rejects(0)
 		{}
 
 		// the number of 16kB blocks written
@@ -201,6 +439,11 @@ namespace libtorrent
 
 		mutable size_type queued_bytes;
 
+		// the sum of the write queue limits of all drives. This is
+		// adjusted to the write latency of each drive, unless
+		// disk_write_latency_target is 0
+		size_type queued_bytes_limit;
+
 		// the number of blocks in the cache (both read and write)
 		int cache_size;
 
@@ -227,6 +470,28 @@ namespace libtorrent
 		boost::uint32_t cumulative_sort_time;
 		int total_read_back;
 		int read_queue_size;
+
+		// the number of blocks served from pieces in the probationary
+		// and in the protected segment of the read cache. With the lru
+		// read cache algorithm, all pieces are in the protected segment
+		size_type probation_hits;
+		size_type protected_hits;
+		// the number of pieces read into the read cache that had
+		// been evicted from the probationary segment recently
+		size_type ghost_hits;
+		// the number of read cache misses that were read straight
+		// from disk because the piece wasn't requested more often
+		// than the piece it would have evicted
+		size_type admission_rejects;
+
+		// the number of disk_io_job::action_t values
+		enum { num_job_types = disk_io_job::open_block + 1 };
+
+		// latency histograms, indexed by disk_io_job::action_t, of the
+		// time jobs spent in the job queue and the time it took to run
+		// them once they were picked from it
+		latency_histogram queue_time_histogram[num_job_types];
+		latency_histogram job_time_histogram[num_job_types];
 	};
 	
 	struct TORRENT_EXPORT disk_buffer_pool : boost::noncopyable
@@ -246,6 +511,18 @@ namespace libtorrent
 		void free_buffer(char* buf);
 		void free_multiple_buffers(char** bufvec, int numbufs);
 
+		// adds a reference to the buffer. Every reference
+		// is released by a call to free_buffer(), the buffer
+		// is only returned to the pool by the last one.
+		// This is used to hand out cached blocks without
+		// copying them
+		void add_ref(char* buf);
+
+		// returns true if there are other references to
+		// this buffer than the caller's. Shared buffers must
+		// not be modified
+		bool is_shared(char* buf) const;
+
 		int block_size() const { return m_block_size; }
 
 #ifdef TORRENT_STATS
@@ -278,6 +555,13 @@ namespace libtorrent
 
 		mutable mutex m_pool_mutex;
 
+		// buffers that have been added references to, mapped
+		// to the number of references in addition to the owner's.
+		// Buffers that were never shared are not in here, so
+		// freeing them only costs a lookup while some other
+		// buffer is shared
+		std::map<char*, int> m_refs;
+
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
 		// memory pool for read and write operations
 		// and disk cache
@@ -301,38 +585,19 @@ namespace libtorrent
 #endif
 	};
 
-	// this is a singleton consisting of the thread and a queue
-	// of disk io jobs
-	struct TORRENT_EXPORT disk_io_thread : disk_buffer_pool
-	{
-		disk_io_thread(io_service& ios
-			, boost::function<void()> const& queue_callback
-			, file_pool& fp
-			, int block_size = 16 * 1024);
-		~disk_io_thread();
-
-		void abort();
-		void join();
-
-		// aborts read operations
-		void stop(boost::intrusive_ptr<piece_manager> s);
-
-		// returns the disk write queue size
-		int add_job(disk_io_job const& j
-			, boost::function<void(int, disk_io_job const&)> const& f
-			= boost::function<void(int, disk_io_job const&)>());
+	struct disk_io_thread;
 
-		// keep track of the number of bytes in the job queue
-		// at any given time. i.e. the sum of all buffer_size.
-		// this is used to slow down the download global download
-		// speed when the queue buffer size is too big.
-		size_type queue_buffer_size() const;
-		bool can_write() const;
-
-		void get_cache_info(sha1_hash const& ih
-			, std::vector<cached_piece_info>& ret) const;
+	// one thread of the disk I/O thread pool. Every storage is bound to
+	// a single worker, which runs all of its jobs in the order they were
+	// issued and owns the cache entries for its pieces. This is what
+	// keeps the jobs for a piece_manager ordered, and it means the cache
+	// never has to be shared between threads
+	struct TORRENT_EXPORT disk_io_worker : boost::noncopyable
+	{
+	friend struct disk_io_thread;
 
-		cache_status status() const;
+		disk_io_worker(disk_io_thread& t, int index);
+		~disk_io_worker();
 
 		void thread_fun();
 
@@ -340,73 +605,72 @@ namespace libtorrent
 		void check_invariant() const;
 #endif
 		
-		struct cached_block_entry
-		{
-			cached_block_entry(): buf(0) {}
-			// the buffer pointer (this is a disk_pool buffer)
-			// or 0
-			char* buf;
+		typedef libtorrent::cached_block_entry cached_block_entry;
+		typedef libtorrent::cached_piece_entry cached_piece_entry;
+		typedef piece_cache cache_t;
 
-			// callback for when this block is flushed to disk
-			boost::function<void(int, disk_io_job const&)> callback;
-		};
+	private:
 
-		struct cached_piece_entry
-		{
-			int piece;
-			// storage this piece belongs to
-			boost::intrusive_ptr<piece_manager> storage;
-			// the pointers to the block data
-			boost::shared_array<cached_block_entry> blocks;
-			// the last time a block was writting to this piece
-			// plus the minimum amount of time the block is guaranteed
-			// to stay in the cache
-			ptime expire;
-			// the number of blocks in the cache for this piece
-			int num_blocks;
-			// used to determine if this piece should be flushed
-			int num_contiguous_blocks;
-			// this is the first block that has not yet been hashed
-			// by the partial hasher. When minimizing read-back, this
-			// is used to determine if flushing a range would force us
-			// to read it back later when hashing
-			int next_block_to_hash;
-			
-			std::pair<void*, int> storage_piece_pair() const
-			{ return std::pair<void*, int>(storage.get(), piece); }
-		};
+		// these may be called from any thread, without
+		// holding the queue mutex. The job, along with its
+		// callback, is moved into the queue, j is left default
+		// constructed
+		void add_job(disk_io_job& j);
+		void stop(boost::intrusive_ptr<piece_manager> s);
+		void abort();
 
-		typedef multi_index_container<
-			cached_piece_entry, indexed_by<
-				ordered_unique<const_mem_fun<cached_piece_entry, std::pair<void*, int>
-				, &cached_piece_entry::storage_piece_pair> >
-				, ordered_non_unique<member<cached_piece_entry, ptime
-					, &cached_piece_entry::expire> >
-				> 
-			> cache_t;
+		// moves the jobs posted to m_intake into m_queue
+		void drain_intake();
 
-		typedef cache_t::nth_index<0>::type cache_piece_index_t;
-		typedef cache_t::nth_index<1>::type cache_lru_index_t;
+		void get_cache_info(sha1_hash const& ih
+			, std::vector<cached_piece_info>& ret) const;
+		cache_status status() const;
 
-	private:
+		// the number of pieces hashed by this thread. This is the
+		// weight of its average_hash_time
+		boost::uint32_t num_hashed() const;
 
-		int add_job(disk_io_job const& j
-			, mutex::scoped_lock& l
-			, boost::function<void(int, disk_io_job const&)> const& f
-			= boost::function<void(int, disk_io_job const&)>());
+		void set_cache_quota(piece_manager* s, int soft, int hard);
+		void get_torrent_cache_status(piece_manager const* s
+			, torrent_cache_status& st) const;
 
 		bool test_error(disk_io_job& j);
-		void post_callback(boost::function<void(int, disk_io_job const&)> const& handler
+
+		// posts the handler to the network thread, to be called with a
+		// copy of j. The handler is moved into the posted call, leaving
+		// it empty
+		void post_callback(boost::function<void(int, disk_io_job const&)>& handler
 			, disk_io_job const& j, int ret);
 
+		// posts the job's callback to the network thread. The job
+		// itself is moved into the posted call, leaving it empty
+		void post_callback(disk_io_job& j, int ret);
+
+		// posts the callbacks of jobs taken out of the
+		// queue when their storage was aborted, with -3
+		void cancel_jobs(std::vector<disk_io_job>& jobs);
+
+		// returned by a job handler in thread_fun() when the job
+		// will complete later (on a hash thread), and its callback
+		// must not be posted yet
+		enum { defer_handler = -200 };
+
+		// called by a hash thread once the piece of a hash or
+		// read_and_hash job has been hashed. Completes the job
+		void on_piece_hashed(sha1_hash const& h, disk_io_job j, int ret);
+
+		// opens or closes m_ring according to the settings. If
+		// the ring can't be opened, the blocking calls are used
+		void update_io_uring(session_settings const& s);
+
 		// cache operations
-		cache_piece_index_t::iterator find_cached_piece(
+		cache_t::iterator find_cached_piece(
 			cache_t& cache, disk_io_job const& j
 			, mutex::scoped_lock& l);
 		bool is_cache_hit(cached_piece_entry& p
 			, disk_io_job const& j, mutex::scoped_lock& l);
 		int copy_from_piece(cached_piece_entry& p, bool& hit
-			, disk_io_job const& j, mutex::scoped_lock& l);
+			, disk_io_job& j, mutex::scoped_lock& l);
 
 		// write cache operations
 		enum options_t { dont_flush_write_blocks = 1, ignore_cache_size = 2 };
@@ -416,12 +680,33 @@ namespace libtorrent
 		int flush_contiguous_blocks(cached_piece_entry& p
 			, mutex::scoped_lock& l, int lower_limit = 0);
 		int flush_range(cached_piece_entry& p, int start, int end, mutex::scoped_lock& l);
+		// appends the blocks at the start of the pieces following p (of the
+		// same storage) in the write cache to iov, for them to be written
+		// together with the blocks at the end of p. Stops at the first block
+		// that's missing, or after max_blocks blocks. The pieces and the number
+		// of blocks taken from each are appended to span
+		int take_following_blocks(cached_piece_entry const& p, file::iovec_t* iov
+			, int max_blocks, std::vector<std::pair<cache_t::iterator, int> >& span);
+		// posts the callbacks of the blocks in [start, end) that have
+		// been written, and frees them. Returns the number of blocks
+		int post_flushed_blocks(cached_piece_entry& p, int start, int end
+			, disk_io_job& j);
 		int cache_block(disk_io_job& j
 			, boost::function<void(int,disk_io_job const&)>& handler
 			, int cache_expire
 			, mutex::scoped_lock& l);
 
 		// read cache operations
+		cache_t::iterator insert_read_piece(cached_piece_entry const& pe
+			, mutex::scoped_lock& l);
+		cache_t::iterator read_cache_victim();
+
+		// adds n (which may be negative) to the number of blocks
+		// the storage has in the cache
+		void add_cached_blocks(piece_manager& s, int n);
+		bool enforce_hard_quota(piece_manager* s, int blocks, int ignore
+			, mutex::scoped_lock& l);
+		bool admit_read_piece(disk_io_job const& j, mutex::scoped_lock& l);
 		int clear_oldest_read_piece(int num_blocks, int ignore
 			, mutex::scoped_lock& l);
 		int read_into_piece(cached_piece_entry& p, int start_block
@@ -430,19 +715,51 @@ namespace libtorrent
 		int free_piece(cached_piece_entry& p, mutex::scoped_lock& l);
 		int drain_piece_bufs(cached_piece_entry& p, std::vector<char*>& buf
 			, mutex::scoped_lock& l);
-		int try_read_from_cache(disk_io_job const& j, bool& hit);
-		int read_piece_from_cache_and_hash(disk_io_job const& j, sha1_hash& h);
-		int cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
+		int try_read_from_cache(disk_io_job& j, bool& hit);
+		// sets the view of a read job to the block in the storage's
+		// memory mapping, if it has one and the block isn't dirty
+		bool map_block(disk_io_job& j);
+
+		// adaptive read-ahead. Limits the cache line of a read job to
+		// the window of the read stream it's part of, and records the
+		// outcome of the read, issuing prefetch hints to the kernel
+		int read_ahead_window(disk_io_job& j);
+		void read_ahead_done(disk_io_job const& j, int stream
+			, bool hit, bool filled_cache);
+		int read_piece_from_cache_and_hash(disk_io_job& j, sha1_hash& h
+			, hash_thread::job* hj = 0);
+		int cache_piece(disk_io_job const& j, cache_t::iterator& p
 			, bool& hit, int options, mutex::scoped_lock& l);
 
-		// this mutex only protects m_jobs, m_queue_buffer_size,
-		// m_exceeded_write_queue and m_abort
-		mutable mutex m_queue_mutex;
+		// the pool this worker belongs to. It owns the disk
+		// buffers and the write queue accounting
+		disk_io_thread& m_io_thread;
+
+		// the index of this worker in the pool
+		int m_index;
+
+		// number of bytes per block (same as the buffer pool's)
+		const int m_block_size;
+
+		// this is the queue mutex of the disk_io_thread, it's
+		// shared by all workers. The worker only takes it to
+		// sleep on m_signal, and to update the write queue
+		// accounting of the disk_io_thread
+		mutex& m_queue_mutex;
 		event m_signal;
 		bool m_abort;
-		bool m_waiting_to_shutdown;
-		std::deque<disk_io_job> m_jobs;
-		size_type m_queue_buffer_size;
+
+		// jobs are posted here by other threads, without locking.
+		// The worker moves them over to m_queue in batches
+		mpsc_queue<disk_io_job> m_intake;
+
+		// the batch of jobs taken off of m_intake, while they're
+		// sorted into m_queue. It's only kept to reuse its memory
+		std::deque<disk_io_job> m_new_jobs;
+
+		// the jobs that have been taken off of m_intake. This is
+		// only ever touched by the worker thread
+		disk_job_queue m_queue;
 
 		ptime m_last_file_check;
 
@@ -454,9 +771,18 @@ namespace libtorrent
 		// read cache
 		cache_t m_read_pieces;
 
+		// how often pieces have been read recently. Used to decide
+		// whether a piece is worth evicting another one from the read
+		// cache for, when read_cache_admission_filter is enabled
+		frequency_sketch m_read_frequency;
+
+		// the storages with more blocks in the cache than their
+		// soft quota. As long as there are any, read cache
+		// evictions are taken from them first
+		std::set<piece_manager const*> m_storages_over_quota;
+
 		// total number of blocks in use by both the read
-		// and the write cache. This is not supposed to
-		// exceed m_cache_size
+		// and the write cache of this worker
 		cache_status m_cache_stats;
 
 		// keeps average queue time for disk jobs (in microseconds)
@@ -468,8 +794,10 @@ namespace libtorrent
 		// average write time (in microseconds)
 		sliding_average<512> m_write_time;
 
-		// average hash time (in microseconds)
+		// average hash time (in microseconds), and the
+		// number of samples it's made of
 		sliding_average<512> m_hash_time;
+		boost::uint32_t m_num_hashed;
 
 		// average time to serve a job (any job) in microseconds
 		sliding_average<512> m_job_time;
@@ -478,8 +806,14 @@ namespace libtorrent
 		// and insert into queue
 		sliding_average<512> m_sort_time;
 
-		typedef std::multimap<size_type, disk_io_job> read_jobs_t;
-		read_jobs_t m_sorted_read_jobs;
+		// each worker keeps its own copy of the settings, to not
+		// race with other workers when they are updated
+		session_settings m_settings;
+
+		// the number of blocks this worker may keep in its cache.
+		// Every worker caches the pieces of its own torrents, so
+		// cache_size is split evenly between them
+		int m_cache_limit;
 
 #ifdef TORRENT_DISK_STATS
 		std::ofstream m_log;
@@ -488,10 +822,134 @@ namespace libtorrent
 		// the amount of physical ram in the machine
 		boost::uint64_t m_physical_ram;
 
-		// if we exceeded the max queue disk write size
-		// this is set to true. It remains true until the
-		// queue is smaller than the low watermark
-		bool m_exceeded_write_queue;
+		io_service& m_ios;
+
+		// reference to the file_pool which is a member of
+		// the session_impl object
+		file_pool& m_file_pool;
+
+		// the io_uring the file operations of this thread are
+		// submitted through, if use_io_uring is enabled
+		io_uring_queue m_ring;
+
+		// thread for performing blocking disk io operations
+		thread m_disk_io_thread;
+	};
+
+	// this is a singleton consisting of a pool of disk threads,
+	// each with its own queue of disk io jobs
+	struct TORRENT_EXPORT disk_io_thread : disk_buffer_pool
+	{
+	friend struct disk_io_worker;
+
+		disk_io_thread(io_service& ios
+			, boost::function<void()> const& queue_callback
+			, file_pool& fp
+			, int block_size = 16 * 1024);
+		~disk_io_thread();
+
+		void abort();
+		void join();
+
+		// aborts read operations
+		void stop(boost::intrusive_ptr<piece_manager> s);
+
+		// returns the disk write queue size, for write jobs. The job
+		// is moved into the queue, j is left default constructed. If
+		// f is set, it replaces the job's callback. All jobs must be
+		// added from the same thread (the network thread), since the
+		// common case doesn't take any lock
+		int add_job(disk_io_job& j
+			, boost::function<void(int, disk_io_job const&)> f
+			= boost::function<void(int, disk_io_job const&)>());
+
+		// keep track of the number of bytes in the job queue
+		// at any given time. i.e. the sum of all buffer_size.
+		// this is used to slow down the download global download
+		// speed when the queue buffer size is too big.
+		size_type queue_buffer_size() const;
+
+		// the number of worker threads. Torrents stay on the
+		// worker they were assigned to even when disk_io_threads
+		// is lowered, so this never goes down
+		int num_workers() const;
+
+		// returns false if the write queue of the drive the
+		// files of the storage are on is full
+		bool can_write(piece_manager const* s) const;
+
+		void get_cache_info(sha1_hash const& ih
+			, std::vector<cached_piece_info>& ret) const;
+
+		cache_status status() const;
+
+		// sets the soft and hard cache quotas of the storage, in
+		// blocks. 0 means no quota
+		void set_cache_quota(piece_manager* s, int soft, int hard);
+		void get_torrent_cache_status(piece_manager* s
+			, torrent_cache_status& st);
+
+		// the threads hashing pieces. The full check of
+		// a torrent spreads its hashing across them too
+		hash_thread& hash_threads() { return m_hash_thread; }
+
+	private:
+
+		// returns the worker the jobs for the given storage
+		// are issued to. Storages are assigned to workers
+		// round-robin the first time they issue a job
+		disk_io_worker& worker_for(piece_manager* s, mutex::scoped_lock& l);
+
+		// called by each worker thread as it exits
+		void worker_exited();
+
+		// returns the write queue of the drive with the given device
+		// number, creating it if there isn't one yet. Device 0 is used
+		// for storages whose drive isn't known yet
+		write_throttle& write_queue_for(boost::uint64_t device, mutex::scoped_lock& l);
+
+		// sets the limits of the write queue from the settings. Returns
+		// true if it unblocked the queue
+		bool set_write_queue_limits(write_throttle& q);
+
+		// moves the storage, and the bytes it has queued, to the
+		// write queue of the given drive
+		void set_device(piece_manager* s, boost::uint64_t device);
+
+		// removes the bytes of a write job that was picked from
+		// the job queue, or cancelled, from the write queue of its
+		// storage. The queue mutex must be held
+		void dequeue_write(piece_manager* s, int bytes, mutex::scoped_lock& l);
+
+		// records a write job that completed latency microseconds
+		// after it was queued
+		void write_done(piece_manager* s, int bytes, int latency);
+
+		// this mutex protects m_workers, m_queue_buffer_size,
+		// m_write_queues and m_running_threads. Jobs
+		// for storages that are already bound to a worker are
+		// posted without it, unless they're writes
+		mutable mutex m_queue_mutex;
+		bool m_waiting_to_shutdown;
+		size_type m_queue_buffer_size;
+
+		// the write queues of the drives storages are on, indexed by
+		// device number. Peers downloading to a drive whose queue is
+		// full stop reading from their sockets until it has drained.
+		// Queues are never removed, since storages point to them
+		std::map<boost::uint64_t, write_throttle> m_write_queues;
+
+		// the number of threads new storages are spread
+		// across. This is disk_io_threads from the settings.
+		// the pool never shrinks, since existing storages
+		// stay on the thread they were assigned
+		int m_num_threads;
+
+		// the worker the next new storage will be assigned to
+		int m_next_worker;
+
+		// the number of worker threads that haven't exited yet
+		int m_running_threads;
 
 		io_service& m_ios;
 
@@ -513,8 +971,30 @@ namespace libtorrent
 		// the session_impl object
 		file_pool& m_file_pool;
 
-		// thread for performing blocking disk io operations
-		thread m_disk_io_thread;
+		// the threads verifying piece hashes for the workers,
+		// when hashing_threads is greater than 0
+		hash_thread m_hash_thread;
+
+#if defined TORRENT_DEBUG || TORRENT_RELEASE_ASSERTS
+#if defined BOOST_HAS_PTHREADS
+		// the thread jobs are added from
+		mutable pthread_t m_adding_thread;
+#endif
+		bool is_adding_thread() const
+		{
+#if defined BOOST_HAS_PTHREADS
+			if (m_adding_thread == 0)
+				m_adding_thread = pthread_self();
+			return m_adding_thread == pthread_self();
+#endif
+			return true;
+		}
+#endif
+
+		// the worker threads performing the blocking disk
+		// io operations. This is last, to make sure all other
+		// members are initialized before any thread starts
+		std::vector<boost::shared_ptr<disk_io_worker> > m_workers;
 	};
 
 }
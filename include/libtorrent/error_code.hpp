@@ -204,8 +204,8 @@ namespace libtorrent
 			invalid_slot_list,
 			invalid_piece_index,
 			pieces_need_reorder,
-			reserved143,
-			reserved144,
+			invalid_binary_resume_data,
+			unsupported_resume_version,
 			reserved145,
 			reserved146,
 			reserved147,
@@ -106,6 +106,8 @@ namespace libtorrent
 #endif
 		} modes_t;
 		int mode;
+		// the device the file is stored on
+		boost::uint64_t device;
 	};
 
 	enum stat_flags_t { dont_follow_links = 1 };
@@ -223,6 +225,9 @@ namespace libtorrent
 		// On windows this will clear the sparse bit
 		void finalize();
 
+		// flushes the file's data to the disk (fsync())
+		bool sync(error_code& ec);
+
 		int open_mode() const { return m_open_mode; }
 
 		// when opened in unbuffered mode, this is the
@@ -38,12 +38,13 @@ POSSIBILITY OF SUCH DAMAGE.
 #endif
 
 #include <boost/intrusive_ptr.hpp>
+#include <boost/detail/atomic_count.hpp>
 
 #ifdef _MSC_VER
 #pragma warning(pop)
 #endif
 
-#include <map>
+#include <vector>
 #include "libtorrent/file.hpp"
 #include "libtorrent/ptime.hpp"
 #include "libtorrent/thread.hpp"
@@ -51,41 +52,84 @@ POSSIBILITY OF SUCH DAMAGE.
 
 namespace libtorrent
 {
+	// keeps at most size_limit() files open, closing the least recently
+	// used one when another one needs to be opened. The files are kept in
+	// shards, picked by the storage they belong to, each with its own
+	// mutex, hash table and LRU list. Disk threads working on different
+	// storages don't contend for the same lock, and files are opened and
+	// closed without holding any lock
 	struct TORRENT_EXPORT file_pool : boost::noncopyable
 	{
-		file_pool(int size = 40): m_size(size), m_low_prio_io(true) {}
+		file_pool(int size = 40);
+		~file_pool();
 
 		boost::intrusive_ptr<file> open_file(void* st, std::string const& p
 			, file_storage::iterator fe, file_storage const& fs, int m, error_code& ec);
 		void release(void* st);
 		void release(void* st, int file_index);
 		void resize(int size);
-		int size_limit() const { return m_size; }
+		int size_limit() const;
 		void set_low_prio_io(bool b) { m_low_prio_io = b; }
 
 	private:
 		file_pool(file_pool const&);
 
-		void remove_oldest();
-
-		int m_size;
-		bool m_low_prio_io;
-
 		struct lru_file_entry
 		{
-			lru_file_entry(): key(0), last_use(time_now()), mode(0) {}
-			mutable boost::intrusive_ptr<file> file_ptr;
+			lru_file_entry(): key(0), file_index(0), last_use(time_now()), mode(0)
+				, hash_next(0), lru_prev(0), lru_next(0) {}
+			boost::intrusive_ptr<file> file_ptr;
 			void* key;
+			int file_index;
 			ptime last_use;
 			int mode;
+
+			// these link the entry into the hash table and
+			// the LRU list of its shard
+			lru_file_entry* hash_next;
+			lru_file_entry* lru_prev;
+			lru_file_entry* lru_next;
+		};
+
+		struct shard
+		{
+			shard(): lru_head(0), lru_tail(0), num_files(0) {}
+
+			lru_file_entry* find(void* st, int file_index) const;
+			void insert(lru_file_entry* e);
+			void erase(lru_file_entry* e);
+			// moves the entry to the back of the LRU list
+			void touch(lru_file_entry* e);
+			int bucket(void* st, int file_index) const;
+			void rehash(int num_buckets);
+
+			// the hash table buckets. The size is always a power of 2
+			std::vector<lru_file_entry*> buckets;
+			// the least and most recently used files
+			lru_file_entry* lru_head;
+			lru_file_entry* lru_tail;
+			int num_files;
+			mutex mtx;
 		};
 
-		// maps storage pointer, file index pairs to the
-		// lru entry for the file
-		typedef std::map<std::pair<void*, int>, lru_file_entry> file_set;
-		
-		file_set m_files;
-		mutex m_mutex;
+		enum { num_shards = 16 };
+
+		shard& shard_for(void* st);
+
+		// closes the least recently used file of all the shards.
+		// Must be called without holding any shard mutex
+		void remove_oldest();
+
+		// the maximum number of open files. It's set by the network
+		// thread while the disk threads open files
+		int m_size;
+		mutable mutex m_size_mutex;
+		bool m_low_prio_io;
+
+		// the total number of files in all shards
+		boost::detail::atomic_count m_num_files;
+
+		shard m_shards[num_shards];
 	};
 }
 
@@ -0,0 +1,83 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_FREQUENCY_SKETCH_HPP_INCLUDED
+#define TORRENT_FREQUENCY_SKETCH_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include <boost/cstdint.hpp>
+#include <vector>
+
+namespace libtorrent
+{
+	// a count-min sketch with 4 bit counters, used to estimate how many
+	// times a key has been seen recently. Each key maps to one counter
+	// in each of 4 rows, and the estimate is the smallest of them. Once
+	// the number of increments reaches 10 times the width of the table,
+	// all counters are halved, so that old popularity fades away
+	struct TORRENT_EXPORT frequency_sketch
+	{
+		frequency_sketch();
+
+		// sizes the table for tracking about the given number
+		// of keys. This clears the counters if the size changes
+		void resize(int keys);
+
+		void increment(boost::uint32_t key);
+		int estimate(boost::uint32_t key) const;
+
+		void clear();
+
+		// the largest value a counter can have
+		enum { max_count = 15 };
+
+	private:
+
+		int index(boost::uint32_t key, int row) const;
+		void age();
+
+		// the counters of all the rows, two per byte
+		std::vector<boost::uint8_t> m_table;
+
+		// the number of counters per row minus one. The width
+		// is always a power of 2
+		int m_mask;
+
+		// the number of increments since the counters were last
+		// halved, and the number that triggers halving them
+		int m_samples;
+		int m_sample_size;
+	};
+}
+
+#endif // TORRENT_FREQUENCY_SKETCH_HPP_INCLUDED
+
@@ -0,0 +1,129 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_HASH_THREAD_HPP_INCLUDED
+#define TORRENT_HASH_THREAD_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/thread.hpp"
+#include "libtorrent/storage.hpp" // for partial_hash
+#include "libtorrent/file.hpp"
+#include "libtorrent/sliding_average.hpp"
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+
+#include <boost/function/function1.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <deque>
+#include <vector>
+
+namespace libtorrent
+{
+	struct disk_buffer_pool;
+
+	// a pool of threads computing SHA-1 digests of disk buffers.
+	// This keeps the CPU bound hashing of pieces off of the disk
+	// threads, so that they can keep serving reads while pieces
+	// are being verified
+	struct TORRENT_EXPORT hash_thread : boost::noncopyable
+	{
+		hash_thread(disk_buffer_pool& pool);
+		~hash_thread();
+
+		struct job
+		{
+			job(): num_pieces(1) {}
+
+			// the hash context to continue from. The offset
+			// is the number of bytes already hashed
+			partial_hash ph;
+
+			// disk buffers holding the rest of the piece, in order.
+			// Each buffer is freed back to the pool once it has
+			// been hashed, so the job holds one reference to each
+			std::vector<file::iovec_t> bufs;
+
+			// called from the hash thread with the
+			// digest of the whole piece
+			boost::function<void(sha1_hash const&)> handler;
+
+			// if set, this is called instead of hashing bufs. It's
+			// used to spread other hashing work across the threads,
+			// like the full check of a torrent
+			boost::function<void()> work;
+
+			// the number of pieces the job hashes. A job hashing
+			// a batch of pieces counts as this many in the statistics
+			int num_pieces;
+		};
+
+		// queues the job to be hashed by one of the threads
+		void async_hash(job const& j);
+
+		// makes sure there are at least this many threads.
+		// Threads are never stopped until stop() is called
+		void set_num_threads(int n);
+		int num_threads() const;
+
+		// hashes all jobs left in the queue and
+		// then joins all the threads
+		void stop();
+
+		// average time to hash a piece, in microseconds, and the
+		// total time spent hashing, in milliseconds
+		int average_hash_time() const;
+		boost::uint32_t cumulative_hash_time() const;
+		// the number of pieces hashed
+		boost::uint32_t num_hashed() const;
+
+	private:
+
+		void thread_fun();
+
+		disk_buffer_pool& m_pool;
+
+		// protects all members below
+		mutable mutex m_mutex;
+		condition m_cond;
+		std::deque<job> m_jobs;
+		bool m_abort;
+
+		sliding_average<512> m_hash_time;
+		boost::uint32_t m_cumulative_hash_time;
+		boost::uint32_t m_num_hashed;
+
+		std::vector<boost::shared_ptr<thread> > m_threads;
+	};
+}
+
+#endif
+
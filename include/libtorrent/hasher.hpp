@@ -59,6 +59,13 @@ TORRENT_EXPORT void SHA1_Init(SHA_CTX* context);
 TORRENT_EXPORT void SHA1_Update(SHA_CTX* context, boost::uint8_t const* data, boost::uint32_t len);
 TORRENT_EXPORT void SHA1_Final(boost::uint8_t* digest, SHA_CTX* context);
 
+// returns true if SHA1_Update() uses the x86 SHA extensions. They
+// are used when the CPU supports them, unless disabled by calling
+// SHA1_use_sha_ni(false). That's meant for tests and benchmarks, and
+// must not be called while other threads may be hashing
+TORRENT_EXPORT bool SHA1_has_sha_ni();
+TORRENT_EXPORT void SHA1_use_sha_ni(bool enable);
+
 #endif
 
 namespace libtorrent
@@ -150,6 +157,25 @@ namespace libtorrent
 		SHA_CTX m_context;
 #endif
 	};
+
+	// returns the number of buffers hash_buffers() hashes in parallel
+	// on this CPU. 1 means buffers are hashed one at a time, either
+	// because there is no SIMD implementation available, or because
+	// hashing them one at a time with hasher was measured to be faster
+	// (typically when the SHA-1 backend uses the SHA instructions of
+	// the CPU)
+	TORRENT_EXPORT int hash_batch_lanes();
+
+	// computes the SHA-1 digests of num independent buffers. bufs[i]
+	// is lens[i] bytes long and its digest is written to digests[i].
+	// Where the CPU supports it, several buffers are hashed at a time
+	// in SIMD lanes. If prefix_digests is set, prefix_digests[i] is set
+	// to the digest of the first prefix_len bytes of buffer i (or all of
+	// it, if it's shorter). This is used for the last piece of a torrent,
+	// which may be stored in any slot in compact storage
+	TORRENT_EXPORT void hash_buffers(char const* const* bufs, int const* lens
+		, sha1_hash* digests, int num
+		, int prefix_len = 0, sha1_hash* prefix_digests = 0);
 }
 
 #endif // TORRENT_HASHER_HPP_INCLUDED
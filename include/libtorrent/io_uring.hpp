@@ -0,0 +1,146 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_IO_URING_HPP_INCLUDED
+#define TORRENT_IO_URING_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/file.hpp"
+#include "libtorrent/size_type.hpp"
+#include "libtorrent/error_code.hpp"
+
+#include <boost/noncopyable.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <vector>
+
+namespace libtorrent
+{
+	// a linux io_uring submission and completion queue. Reads and writes
+	// are queued up and then submitted to the kernel in one call, which
+	// lets the device work on all of them concurrently. This is used by
+	// default_storage to issue all the file operations of one read or
+	// write job at once, instead of one blocking call at a time.
+	// An io_uring_queue must only be used by one thread at a time.
+	struct TORRENT_EXPORT io_uring_queue : boost::noncopyable
+	{
+		io_uring_queue();
+		~io_uring_queue();
+
+		// sets up the ring with room for depth operations in flight.
+		// Fails if the kernel doesn't support io_uring, in which case
+		// the blocking file operations should be used instead
+		bool open(int depth, error_code& ec);
+		void close();
+		bool is_open() const { return m_ring_fd >= 0; }
+		int depth() const { return m_depth; }
+
+		// queues a vectored read or write at offset of the file f. The
+		// iovecs are copied and f is kept open, but the memory the iovecs
+		// point to must stay valid until submit() returns. tag is not
+		// used by the queue. Returns the index of the operation, to be
+		// passed to result()
+		int queue_readv(boost::intrusive_ptr<file> const& f, size_type offset
+			, file::iovec_t const* bufs, int num_bufs, int tag = 0);
+		int queue_writev(boost::intrusive_ptr<file> const& f, size_type offset
+			, file::iovec_t const* bufs, int num_bufs, int tag = 0);
+
+		// submits all queued operations and waits for them to complete.
+		// Returns false if they could not be submitted, with ec set
+		bool submit(error_code& ec);
+
+		// the number of bytes transferred by operation op, or -errno
+		// if it failed. Valid once submit() has returned
+		int result(int op) const { return m_ops[op].result; }
+
+		// the number of bytes operation op was queued with
+		int size(int op) const { return m_ops[op].size; }
+		int tag(int op) const { return m_ops[op].tag; }
+
+		int num_queued() const { return int(m_ops.size()); }
+
+		// forgets all queued and completed operations
+		void clear();
+
+	private:
+
+		int queue_op(int opcode, boost::intrusive_ptr<file> const& f
+			, size_type offset, file::iovec_t const* bufs, int num_bufs, int tag);
+
+		struct op_t
+		{
+			int opcode;
+			boost::intrusive_ptr<file> f;
+			size_type offset;
+			// index into m_iovecs
+			int first_buf;
+			int num_bufs;
+			int size;
+			int tag;
+			int result;
+		};
+
+		// the queued operations and their buffers
+		std::vector<op_t> m_ops;
+		std::vector<file::iovec_t> m_iovecs;
+
+		int m_ring_fd;
+		int m_depth;
+
+#if TORRENT_USE_IO_URING
+		// the mapped submission and completion rings
+		void* m_sq_ring;
+		size_t m_sq_ring_size;
+		void* m_cq_ring;
+		size_t m_cq_ring_size;
+		void* m_sqes;
+		size_t m_sqes_size;
+
+		unsigned* m_sq_head;
+		unsigned* m_sq_tail;
+		unsigned* m_sq_mask;
+		unsigned* m_sq_array;
+		unsigned* m_cq_head;
+		unsigned* m_cq_tail;
+		unsigned* m_cq_mask;
+		void* m_cqes;
+#endif
+	};
+
+	// the io_uring_queue of the calling thread, or 0 if it doesn't
+	// have one. Every disk thread sets its own queue when io_uring
+	// is enabled
+	TORRENT_EXPORT io_uring_queue* thread_io_uring();
+	TORRENT_EXPORT void set_thread_io_uring(io_uring_queue* q);
+}
+
+#endif // TORRENT_IO_URING_HPP_INCLUDED
+
@@ -0,0 +1,116 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_LATENCY_HISTOGRAM_HPP_INCLUDED
+#define TORRENT_LATENCY_HISTOGRAM_HPP_INCLUDED
+
+#include <boost/cstdint.hpp>
+
+namespace libtorrent
+{
+	// counts latency samples, in microseconds, in buckets of
+	// exponentially growing size. Bucket 0 holds samples below 2 us,
+	// bucket i holds samples in the range [2^i, 2^(i+1)) and the last
+	// bucket everything from 2^(num_buckets-1) us (about 8 seconds)
+	// and up. This keeps the tail of the distribution, that an average
+	// hides, at a fixed cost per sample.
+	// The counters wrap around, but the difference between two
+	// snapshots of the same histogram is still correct
+	struct latency_histogram
+	{
+		enum { num_buckets = 24 };
+
+		latency_histogram() { clear(); }
+
+		void add_sample(int us)
+		{
+			int b = 0;
+			while (us > 1 && b < num_buckets - 1)
+			{
+				us >>= 1;
+				++b;
+			}
+			++buckets[b];
+		}
+
+		boost::uint32_t num_samples() const
+		{
+			boost::uint32_t ret = 0;
+			for (int i = 0; i < num_buckets; ++i) ret += buckets[i];
+			return ret;
+		}
+
+		// returns the upper bound, in microseconds, of the bucket the
+		// given percentile (0 - 1) of the samples falls in. i.e. the
+		// returned value is at most twice the actual latency (except
+		// for the last bucket, which has no upper bound). Returns 0
+		// if there are no samples
+		int percentile(float p) const
+		{
+			boost::uint32_t total = num_samples();
+			if (total == 0) return 0;
+			boost::uint32_t rank = boost::uint32_t(total * double(p));
+			if (rank >= total) rank = total - 1;
+			boost::uint32_t seen = 0;
+			int b = 0;
+			for (; b < num_buckets - 1; ++b)
+			{
+				seen += buckets[b];
+				if (seen > rank) break;
+			}
+			return 2 << b;
+		}
+
+		void clear()
+		{
+			for (int i = 0; i < num_buckets; ++i) buckets[i] = 0;
+		}
+
+		latency_histogram& operator+=(latency_histogram const& h)
+		{
+			for (int i = 0; i < num_buckets; ++i) buckets[i] += h.buckets[i];
+			return *this;
+		}
+
+		latency_histogram& operator-=(latency_histogram const& h)
+		{
+			for (int i = 0; i < num_buckets; ++i) buckets[i] -= h.buckets[i];
+			return *this;
+		}
+
+		// the number of samples in each bucket
+		boost::uint32_t buckets[num_buckets];
+	};
+}
+
+#endif // TORRENT_LATENCY_HISTOGRAM_HPP_INCLUDED
+
@@ -0,0 +1,119 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_MMAP_STORAGE_HPP_INCLUDED
+#define TORRENT_MMAP_STORAGE_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+
+#if TORRENT_USE_MMAP
+
+#include "libtorrent/storage.hpp"
+#include "libtorrent/thread.hpp"
+
+#include <vector>
+#include <boost/shared_ptr.hpp>
+
+namespace libtorrent
+{
+	// a storage that maps its files into memory with MAP_SHARED. Reads
+	// and writes copy straight to and from the page cache, without any
+	// read or write system calls, and blocks uploaded to peers are sent
+	// out of the mapping (see map_block()) instead of being copied into
+	// the disk cache first.
+	//
+	// Files are laid out, allocated and verified just like with
+	// default_storage. Files that can't be mapped (for instance when
+	// running out of address space) are read and written the regular way
+	class TORRENT_EXPORT mmap_storage : public default_storage
+	{
+	public:
+		mmap_storage(file_storage const& fs, file_storage const* mapped
+			, std::string const& path, file_pool& fp
+			, std::vector<boost::uint8_t> const& file_prio);
+		~mmap_storage();
+
+		void finalize_file(int file);
+		bool release_files();
+		bool delete_files();
+		bool move_storage(std::string const& save_path);
+		void hint_read(int slot, int offset, int len);
+		int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+		int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+		int writev_span(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
+		char const* map_block(int slot, int offset, int size
+			, boost::shared_ptr<void>& mapping);
+
+		// a mapping of a whole file. It's unmapped once the storage
+		// and every view handed out into it are done with it
+		struct file_mapping : boost::noncopyable
+		{
+			file_mapping(): base(0), size(0), writable(false) {}
+			~file_mapping();
+			char* base;
+			size_type size;
+			bool writable;
+		};
+
+	private:
+
+		// returns the mapping of the file, creating it if there isn't one,
+		// if it isn't writable when writing or if it ends before 'end'
+		// (the file may have grown since it was mapped). Returns an empty
+		// pointer if the file can't be mapped, and sets ec if it can't
+		// be opened either
+		boost::shared_ptr<file_mapping> map_file(file_storage::iterator fe
+			, bool write, size_type end, error_code& ec);
+
+		// copies between the buffers and the mappings of the files
+		// the range is stored in. Returns -2 if one of the files
+		// can't be mapped
+		int copy_bufs(file::iovec_t const* bufs, int slot, int offset
+			, int num_bufs, bool write);
+
+		// drops the mappings of all files, writing their dirty pages
+		// back with msync() first if 'flush' is true. The mappings
+		// stay valid for the views that are still in use
+		void unmap_files(bool flush);
+
+		// protects m_mappings
+		mutex m_mutex;
+
+		// indexed by file
+		std::vector<boost::shared_ptr<file_mapping> > m_mappings;
+	};
+}
+
+#endif // TORRENT_USE_MMAP
+
+#endif // TORRENT_MMAP_STORAGE_HPP_INCLUDED
+
@@ -0,0 +1,276 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_MPSC_QUEUE_HPP_INCLUDED
+#define TORRENT_MPSC_QUEUE_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/thread.hpp"
+#include <boost/noncopyable.hpp>
+#include <algorithm> // for std::swap
+
+#if defined TORRENT_WINDOWS && !defined __GNUC__
+#include <windows.h>
+#endif
+
+namespace libtorrent
+{
+	// a queue any number of threads can push to without taking a lock,
+	// drained by a single consumer thread. Pushing links a node onto a
+	// stack with a compare-and-swap, the consumer takes the whole stack
+	// at once and reverses it, to get the elements back in the order
+	// they were pushed.
+	// 
+	// The queue also keeps track of whether the consumer is asleep
+	// waiting for elements. Only the first push after it went to sleep
+	// is told to wake it up, so a burst of pushes costs a single wakeup.
+	//
+	// Nodes are recycled. Once the consumer has taken the elements
+	// out, the nodes are put on a free list that allocate() takes
+	// nodes from, so a queue in steady state doesn't allocate memory.
+	// Elements are moved in and out of the nodes with swap(), T must
+	// be default constructible and cheap to swap
+	template <class T>
+	struct mpsc_queue : boost::noncopyable
+	{
+		struct node
+		{
+			node(T const& v): value(v), next(0) {}
+			T value;
+			node* next;
+		};
+
+		// the max number of nodes kept on the free list. Nodes
+		// released beyond this are freed
+		enum { max_free_nodes = 1024 };
+
+		mpsc_queue(): m_head(0), m_waiting(0), m_free(0), m_num_free(0) {}
+
+		~mpsc_queue()
+		{
+			free_list(exchange(&m_head, 0));
+			free_list(exchange(&m_free, 0));
+		}
+
+		// returns a node holding a copy of v, to be pushed onto the
+		// queue. It's taken from the free list if there are any nodes
+		// on it. May be called from any thread
+		node* allocate(T const& v)
+		{
+			node* n = take_free();
+			if (n == 0) return new node(v);
+			n->value = v;
+			return n;
+		}
+
+		// like allocate(), but moves v into the node with swap(). v is
+		// left holding a default constructed element
+		node* allocate_swap(T& v)
+		{
+			node* n = take_free();
+			if (n == 0) n = new node(T());
+			using std::swap;
+			swap(n->value, v);
+			return n;
+		}
+
+		// links n into the queue, the queue takes over ownership
+		// of it. Returns true if the consumer is waiting for
+		// elements and the caller is responsible for waking it up
+		bool push(node* n)
+		{
+			node* old = m_head;
+			for (;;)
+			{
+				n->next = old;
+				node* prev = compare_exchange(&m_head, old, n);
+				if (prev == old) break;
+				old = prev;
+			}
+			// the compare-and-swap is a full barrier, so this load
+			// can't be reordered with it. Either we see m_waiting set,
+			// or the consumer sees our node before it goes to sleep
+			return old == 0 && m_waiting;
+		}
+
+		// moves all elements in the queue to the end of c, in the
+		// order they were pushed. Returns the number of elements moved.
+		// Must only be called by the consumer
+		template <class Container>
+		int pop_all(Container& c)
+		{
+			node* n = exchange(&m_head, 0);
+			if (n == 0) return 0;
+
+			// the stack has the most recently pushed node first
+			node* last = n;
+			node* prev = 0;
+			while (n)
+			{
+				node* next = n->next;
+				n->next = prev;
+				prev = n;
+				n = next;
+			}
+
+			int ret = 0;
+			for (n = prev; n; n = n->next)
+			{
+				using std::swap;
+				c.push_back(T());
+				swap(c.back(), n->value);
+				++ret;
+			}
+
+			// the nodes are left holding default constructed
+			// elements. Put them all on the free list in one go
+			if (m_num_free + ret > max_free_nodes)
+			{
+				free_list(prev);
+				return ret;
+			}
+			node* old = m_free;
+			for (;;)
+			{
+				last->next = old;
+				node* p = compare_exchange(&m_free, old, prev);
+				if (p == old) break;
+				old = p;
+			}
+			atomic_add(&m_num_free, ret);
+			return ret;
+		}
+
+		bool empty() const { return m_head == 0; }
+
+		// called by the consumer before it goes to sleep. Returns
+		// false if elements were pushed in the meantime, in which
+		// case it should not go to sleep. end_wait() must be called
+		// once it's woken up (or decided not to sleep)
+		bool start_wait()
+		{
+			m_waiting = 1;
+			full_barrier();
+			return m_head == 0;
+		}
+
+		void end_wait() { m_waiting = 0; }
+
+	private:
+
+		// pops a node off the free list, or returns 0 if it's empty.
+		// Nodes on the free list hold default constructed elements
+		node* take_free()
+		{
+			node* n = 0;
+			{
+				// nodes are only ever removed from the free list with this
+				// mutex held, so a node can't be taken and put back while
+				// we're looking at it (which could make the compare-and-swap
+				// succeed with a stale next pointer). The consumer never
+				// takes this mutex, it returns nodes with a compare-and-swap
+				mutex::scoped_lock l(m_alloc_mutex);
+				n = m_free;
+				while (n)
+				{
+					node* prev = compare_exchange(&m_free, n, n->next);
+					if (prev == n) break;
+					n = prev;
+				}
+			}
+			if (n == 0) return 0;
+			atomic_add(&m_num_free, -1);
+			n->next = 0;
+			return n;
+		}
+
+		static void free_list(node* n)
+		{
+			while (n)
+			{
+				node* next = n->next;
+				delete n;
+				n = next;
+			}
+		}
+
+#if defined __GNUC__
+		static node* compare_exchange(node* volatile* p, node* expected, node* n)
+		{ return __sync_val_compare_and_swap(p, expected, n); }
+
+		static node* exchange(node* volatile* p, node* n)
+		{
+			// __sync_lock_test_and_set is only an acquire barrier, which
+			// is all the consumer needs to see the nodes' contents
+			return __sync_lock_test_and_set(p, n);
+		}
+
+		static void atomic_add(volatile int* p, int n) { __sync_fetch_and_add(p, n); }
+
+		static void full_barrier() { __sync_synchronize(); }
+#elif defined TORRENT_WINDOWS
+		static node* compare_exchange(node* volatile* p, node* expected, node* n)
+		{
+			return (node*)InterlockedCompareExchangePointer(
+				(PVOID volatile*)p, n, expected);
+		}
+
+		static node* exchange(node* volatile* p, node* n)
+		{ return (node*)InterlockedExchangePointer((PVOID volatile*)p, n); }
+
+		static void atomic_add(volatile int* p, int n)
+		{ InterlockedExchangeAdd((LONG volatile*)p, n); }
+
+		static void full_barrier() { MemoryBarrier(); }
+#else
+#error "mpsc_queue needs atomic operations for this compiler"
+#endif
+
+		// the most recently pushed node
+		node* volatile m_head;
+
+		// set while the consumer is asleep, or about to go to sleep
+		volatile int m_waiting;
+
+		// nodes the consumer is done with, and the number of them.
+		// The count may be off for a short while, it's only used
+		// to bound the size of the free list
+		node* volatile m_free;
+		volatile int m_num_free;
+
+		// serializes taking nodes off of the free list
+		mutex m_alloc_mutex;
+	};
+}
+
+#endif // TORRENT_MPSC_QUEUE_HPP_INCLUDED
+
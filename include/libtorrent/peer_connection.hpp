@@ -74,6 +74,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/assert.hpp"
 #include "libtorrent/chained_buffer.hpp"
 #include "libtorrent/disk_buffer_holder.hpp"
+#include "libtorrent/file.hpp"
 #include "libtorrent/bitfield.hpp"
 #include "libtorrent/bandwidth_socket.hpp"
 #include "libtorrent/socket_type_fwd.hpp"
@@ -561,6 +562,16 @@ namespace libtorrent
 
 		virtual void append_const_send_buffer(char const* buffer, int size);
 
+		// queues 'size' bytes at 'file_offset' in file 'f' to be sent
+		// after what's currently in the send buffer. The bytes are sent
+		// straight from the file to the socket with sendfile()
+		void append_send_file(boost::intrusive_ptr<file> const& f
+			, size_type file_offset, int size);
+
+		// returns true if payload can be sent from files to this
+		// connection's socket, using append_send_file()
+		virtual bool can_send_file() const;
+
 #ifndef TORRENT_DISABLE_RESOLVE_COUNTRIES	
 		void set_country(char const* c)
 		{
@@ -574,7 +585,7 @@ namespace libtorrent
 		int outstanding_bytes() const { return m_outstanding_bytes; }
 
 		int send_buffer_size() const
-		{ return m_send_buffer.size(); }
+		{ return m_send_buffer.size() + m_send_file_bytes; }
 
 		int send_buffer_capacity() const
 		{ return m_send_buffer.capacity(); }
@@ -623,6 +634,16 @@ namespace libtorrent
 		virtual void write_have(int index) = 0;
 		virtual void write_keepalive() = 0;
 		virtual void write_piece(peer_request const& r, disk_buffer_holder& buffer) = 0;
+		// sends the piece payload from a file. This is only used if
+		// can_send_file() returns true. The default copies the block
+		// into a disk buffer and sends that
+		virtual void write_piece(peer_request const& r
+			, boost::intrusive_ptr<file> const& f, size_type file_offset);
+		// sends the piece payload from a view into a memory mapped
+		// file. The mapping is held on to until it has been sent.
+		// The default copies the block into a disk buffer
+		virtual void write_piece(peer_request const& r, char const* view
+			, boost::shared_ptr<void> const& mapping);
 		virtual void write_suggest(int piece) = 0;
 		
 		virtual void write_reject_request(peer_request const& r) = 0;
@@ -689,6 +710,7 @@ namespace libtorrent
 		// work to do.
 		void on_send_data(error_code const& error
 			, std::size_t bytes_transferred);
+		void on_send_file_ready(error_code const& error, int amount);
 		void on_receive_data(error_code const& error
 			, std::size_t bytes_transferred);
 
@@ -820,6 +842,21 @@ namespace libtorrent
 
 		chained_buffer m_send_buffer;
 
+		// payload that's sent straight from files. Each entry is
+		// sent once the first 'buffer_offset' bytes of m_send_buffer
+		// have been sent
+		struct send_file_t
+		{
+			boost::intrusive_ptr<file> handle;
+			size_type offset;
+			int size;
+			int buffer_offset;
+		};
+		std::deque<send_file_t> m_send_files;
+
+		// the number of bytes in m_send_files
+		int m_send_file_bytes;
+
 		boost::shared_ptr<socket_type> m_socket;
 		// this is the peer we're actually talking to
 		// it may not necessarily be the peer we're
@@ -1129,6 +1166,14 @@ namespace libtorrent
 		// when this is set, the transfer stats for this connection
 		// is not included in the torrent or session stats
 		bool m_ignore_stats:1;
+
+		// set while the outstanding write is sending from
+		// the first entry in m_send_files
+		bool m_sending_file:1;
+
+		// set once the socket has been made non-blocking for
+		// sendfile(), which is called outside of asio
+		bool m_sendfile_non_blocking:1;
 		
 		template <std::size_t Size>
 		struct handler_storage
@@ -0,0 +1,282 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_PIECE_CACHE_HPP_INCLUDED
+#define TORRENT_PIECE_CACHE_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/storage.hpp"
+#include "libtorrent/time.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <boost/function/function2.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/pool/pool.hpp>
+#include <boost/cstdint.hpp>
+#include <iterator>
+#include <vector>
+#include <map>
+#include <deque>
+
+namespace libtorrent
+{
+	struct disk_io_job;
+
+	struct cached_block_entry
+	{
+		cached_block_entry(): buf(0) {}
+		// the buffer pointer (this is a disk_pool buffer)
+		// or 0
+		char* buf;
+
+		// callback for when this block is flushed to disk
+		boost::function<void(int, disk_io_job const&)> callback;
+	};
+
+	struct cached_piece_entry
+	{
+		cached_piece_entry()
+			: probation(false), hash_next(0), lru_prev(0), lru_next(0)
+			, storage_prev(0), storage_next(0) {}
+
+		int piece;
+		// storage this piece belongs to
+		boost::intrusive_ptr<piece_manager> storage;
+		// the pointers to the block data
+		boost::shared_array<cached_block_entry> blocks;
+		// the last time a block was writting to this piece
+		// plus the minimum amount of time the block is guaranteed
+		// to stay in the cache
+		ptime expire;
+		// the number of blocks in the cache for this piece
+		int num_blocks;
+		// used to determine if this piece should be flushed
+		int num_contiguous_blocks;
+		// this is the first block that has not yet been hashed
+		// by the partial hasher. When minimizing read-back, this
+		// is used to determine if flushing a range would force us
+		// to read it back later when hashing
+		int next_block_to_hash;
+
+		// true while the piece is in the probationary segment
+		// of the cache, i.e. it has not been used since it was
+		// inserted. Set by piece_cache
+		bool probation;
+
+		// these link the entry into the hash table and the
+		// LRU list of the piece_cache it's in, and into the list
+		// of pieces of its storage
+		cached_piece_entry* hash_next;
+		cached_piece_entry* lru_prev;
+		cached_piece_entry* lru_next;
+		cached_piece_entry* storage_prev;
+		cached_piece_entry* storage_next;
+	};
+
+	// the cached pieces of a disk thread, indexed by (storage, piece)
+	// in a hash table and kept in a list in the order they were last
+	// used, least recently used first. Both are linked through the
+	// entries themselves, which are allocated from a pool. Lookups,
+	// inserts, erases and touching an entry are O(1)
+	//
+	// The list is split in two segments to support the 2Q replacement
+	// policy. The front of the list is the probationary segment, a FIFO
+	// of pieces that have been inserted but not promoted. The rest is
+	// the protected segment, in LRU order. The cache also remembers the
+	// keys of recently evicted probationary pieces (the ghost list), so
+	// that a piece that is requested again soon after being evicted can
+	// be inserted straight into the protected segment
+	//
+	// The pieces of each storage are also kept in a list of their own,
+	// in the order they were last used (or inserted), so that the pieces
+	// of a storage can be found without going through the whole cache
+	class TORRENT_EXPORT piece_cache : boost::noncopyable
+	{
+	public:
+
+		template <class T>
+		struct iterator_base
+		{
+			typedef std::forward_iterator_tag iterator_category;
+			typedef T value_type;
+			typedef std::ptrdiff_t difference_type;
+			typedef T* pointer;
+			typedef T& reference;
+
+			iterator_base(T* e = 0): m_entry(e) {}
+			template <class U>
+			iterator_base(iterator_base<U> const& i): m_entry(i.get()) {}
+
+			T& operator*() const { return *m_entry; }
+			T* operator->() const { return m_entry; }
+			T* get() const { return m_entry; }
+
+			iterator_base& operator++()
+			{ m_entry = m_entry->lru_next; return *this; }
+			iterator_base operator++(int)
+			{ iterator_base ret(*this); m_entry = m_entry->lru_next; return ret; }
+
+			template <class U>
+			bool operator==(iterator_base<U> const& rhs) const
+			{ return m_entry == rhs.get(); }
+			template <class U>
+			bool operator!=(iterator_base<U> const& rhs) const
+			{ return m_entry != rhs.get(); }
+
+		private:
+			T* m_entry;
+		};
+
+		typedef iterator_base<cached_piece_entry> iterator;
+		typedef iterator_base<cached_piece_entry const> const_iterator;
+
+		piece_cache();
+		~piece_cache();
+
+		// iterates over the pieces, least recently used first
+		iterator begin() { return iterator(m_lru_head); }
+		iterator end() { return iterator(); }
+		const_iterator begin() const { return const_iterator(m_lru_head); }
+		const_iterator end() const { return const_iterator(); }
+
+		int size() const { return m_size; }
+		bool empty() const { return m_size == 0; }
+
+		iterator find(void const* storage, int piece) const;
+
+		// the least recently used piece of the storage, or end() if it
+		// has none in the cache. next_of() returns the piece of the same
+		// storage that was used after i
+		iterator first_of(void const* storage) const;
+		static iterator next_of(iterator i) { return iterator(i->storage_next); }
+
+		// inserts a copy of the entry as the most recently used one.
+		// If probation is true, it's inserted at the back of the
+		// probationary segment instead. The piece must not already be
+		// in the cache. Returns end() if no memory could be allocated
+		// for the entry
+		iterator insert(cached_piece_entry const& e, bool probation = false);
+
+		// returns the entry after the erased one
+		iterator erase(iterator i);
+
+		// calls f on the entry and marks it as the most recently used.
+		// Pieces in the probationary segment keep their position, since
+		// repeated requests for the same piece right after it was read
+		// don't mean it's popular
+		template <class F>
+		void modify(iterator i, F f)
+		{
+			TORRENT_ASSERT(i != end());
+			f(*i);
+			if (i->probation) return;
+			unlink_lru(i.get());
+			link_lru(i.get());
+			unlink_storage(i.get());
+			link_storage(i.get());
+		}
+
+		// moves a piece from the probationary segment to the back of
+		// the protected segment
+		void promote(iterator i);
+
+		// the oldest piece in the probationary segment and the least
+		// recently used piece in the protected segment respectively.
+		// end() if the segment is empty
+		iterator oldest_probation() const;
+		iterator oldest_protected() const { return iterator(m_protected_head); }
+
+		int num_probation() const { return m_num_probation; }
+
+		// remembers the key of an evicted piece. The ghost list holds at
+		// most as many keys as there are pieces in the cache (but at
+		// least 64), the oldest keys are forgotten first
+		void add_ghost(void const* storage, int piece);
+
+		// returns true if the piece was in the ghost list, and removes it
+		bool remove_ghost(void const* storage, int piece);
+
+		void clear();
+
+	private:
+
+		// links the entry in at the back of the list, or at the back
+		// of the probationary segment if e->probation is set
+		void link_lru(cached_piece_entry* e);
+		void unlink_lru(cached_piece_entry* e);
+		// links the entry in at the back of its storage's list
+		void link_storage(cached_piece_entry* e);
+		void unlink_storage(cached_piece_entry* e);
+		int bucket(void const* storage, int piece) const;
+		void rehash(int num_buckets);
+
+		// the hash table buckets. The size is always a power of 2
+		std::vector<cached_piece_entry*> m_buckets;
+
+		// the least and most recently used entries
+		cached_piece_entry* m_lru_head;
+		cached_piece_entry* m_lru_tail;
+
+		// the first entry in the protected segment. Every entry in
+		// front of it is in the probationary segment
+		cached_piece_entry* m_protected_head;
+
+		// the first and last piece of each storage that has
+		// pieces in the cache
+		struct storage_list
+		{
+			storage_list(): head(0), tail(0) {}
+			cached_piece_entry* head;
+			cached_piece_entry* tail;
+		};
+		std::map<void const*, storage_list> m_storages;
+
+		int m_size;
+		int m_num_probation;
+
+		// the ghost list. The keys are mapped to the sequence number
+		// they were added with, so that entries in m_ghost_order that
+		// have been removed or re-added since can be told apart
+		typedef std::pair<void const*, int> ghost_key;
+		std::map<ghost_key, boost::uint32_t> m_ghosts;
+		std::deque<std::pair<ghost_key, boost::uint32_t> > m_ghost_order;
+		boost::uint32_t m_ghost_seq;
+
+		// the entries are allocated from here
+		boost::pool<> m_pool;
+	};
+}
+
+#endif // TORRENT_PIECE_CACHE_HPP_INCLUDED
+
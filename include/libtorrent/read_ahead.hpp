@@ -0,0 +1,111 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_READ_AHEAD_HPP_INCLUDED
+#define TORRENT_READ_AHEAD_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/size_type.hpp"
+#include <boost/cstdint.hpp>
+
+namespace libtorrent
+{
+	// tracks the sequential read streams of a torrent. A stream is a
+	// series of reads where each one starts where the previous one
+	// ended, which is what a peer requesting the blocks of a piece (or
+	// a file) in order looks like. Each stream has its own read-ahead
+	// window, in blocks. It doubles every time the stream misses the
+	// cache past what was read ahead for it, and is halved when the
+	// stream misses blocks that were read ahead for it, since that means
+	// they were evicted before they were requested
+	struct TORRENT_EXPORT read_ahead
+	{
+		read_ahead();
+
+		// the number of streams tracked per torrent, and the window a new
+		// stream starts out with. When a read doesn't continue any of the
+		// streams, it replaces the least recently used one
+		enum { max_streams = 8, initial_window = 4 };
+
+		// the number of reads in a row a stream needs before it's
+		// considered sequential and the kernel is asked to prefetch for it
+		enum { sequential_reads = 2 };
+
+		// returns the stream the read at offset (in bytes from the start
+		// of the torrent) continues, or starts a new one for it
+		int find_stream(size_type offset, int block_size);
+
+		// the number of blocks to read into the cache when a read
+		// in the stream misses it, at most max_window
+		int window(int stream, int max_window) const;
+
+		// records a read of size bytes at offset in the stream. hit is
+		// true if it was served from the cache. If it wasn't, cache_end is
+		// where the blocks read into the cache for it end. If the stream
+		// is sequential and the data prefetched for it is running out,
+		// prefetch_start and prefetch_size are set to the range to ask the
+		// kernel to read ahead. Otherwise prefetch_size is set to 0
+		void record_read(int stream, size_type offset, int size, bool hit
+			, size_type cache_end, int block_size, int max_window
+			, size_type& prefetch_start, int& prefetch_size);
+
+		void clear();
+
+	private:
+
+		struct stream
+		{
+			// where the next read in the stream is expected
+			size_type next_offset;
+			// the end of the blocks read into the cache for the
+			// stream, and of the range the kernel was asked to
+			// prefetch for it
+			size_type cache_end;
+			size_type prefetch_end;
+			// the read-ahead window, in blocks
+			int window;
+			// the number of reads in a row in the stream
+			int reads;
+			boost::uint32_t last_use;
+		};
+
+		stream m_streams[max_streams];
+		int m_num_streams;
+
+		// incremented on every read, used to find the
+		// least recently used stream
+		boost::uint32_t m_tick;
+	};
+}
+
+#endif // TORRENT_READ_AHEAD_HPP_INCLUDED
+
@@ -0,0 +1,157 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_RESUME_STORE_HPP_INCLUDED
+#define TORRENT_RESUME_STORE_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/peer_id.hpp" // for sha1_hash
+#include "libtorrent/entry.hpp"
+#include "libtorrent/error_code.hpp"
+#include "libtorrent/size_type.hpp"
+#include "libtorrent/file.hpp"
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <vector>
+#include <string>
+#include <map>
+
+namespace libtorrent
+{
+	// stores the resume data of all torrents in a session in a single,
+	// append-only log file. Saving the resume data of a torrent only
+	// appends the top level keys that changed since it was last saved,
+	// so periodic saves of a large session only write what changed. When
+	// the log has grown to more than twice the size of the resume data it
+	// holds, it's compacted, by rewriting it with one record per torrent.
+	//
+	// This is not thread safe. All calls must be made from the same
+	// thread (or be synchronized by the caller)
+	struct TORRENT_EXPORT resume_store : boost::noncopyable
+	{
+		resume_store();
+
+		// opens the log file, creating it if it doesn't exist, and reads
+		// all of it. The resume data of every torrent is then available
+		// through load(). A record that was only partially written (because
+		// of a crash) is discarded, along with anything following it
+		bool open(std::string const& path, error_code& ec);
+		void close();
+
+		// the resume data for the torrent, as read from the log by open(),
+		// in the form add_torrent_params::resume_data expects. It's passed on
+		// to check_fastresume when the torrent is added. Each torrent can
+		// only be loaded once, to not keep all the resume data in memory.
+		// Returns false if there is no resume data for the torrent
+		bool load(sha1_hash const& info_hash, std::vector<char>& buf);
+
+		// the info-hashes of all the torrents in the store
+		void torrents(std::vector<sha1_hash>& ret) const;
+
+		// records the resume data of a torrent (typically from a
+		// save_resume_data_alert). Only the keys whose values changed are
+		// added to the log. The records are written by the next flush()
+		void save(sha1_hash const& info_hash, entry const& rd);
+
+		// removes the torrent from the store
+		void remove(sha1_hash const& info_hash);
+
+		// writes all records saved since the last flush in a single
+		// write, and compacts the log if needed
+		bool flush(error_code& ec);
+
+		// rewrites the log with a single record per torrent
+		bool compact(error_code& ec);
+
+		// the size of the log file and an estimate of the size it will
+		// have after compacting, in bytes
+		size_type log_size() const { return m_log_size; }
+		size_type live_size() const { return m_live_size; }
+
+	private:
+
+		struct key_state
+		{
+			std::string key;
+			// the CRC32 of the bencoded value, to tell whether it
+			// changed, and its size, for the live size estimate
+			boost::uint32_t crc;
+			int size;
+			bool operator<(key_state const& k) const { return key < k.key; }
+		};
+
+		// the state of a torrent's resume data, as of its last record
+		struct torrent_state
+		{
+			torrent_state(): size(0) {}
+			std::vector<key_state> keys;
+			int size;
+		};
+
+		// reads all records in the log, applying them to ret. Returns
+		// the size of the valid part of the log
+		size_type replay(std::map<sha1_hash, entry>& ret, error_code& ec);
+
+		// applies a record to the resume data of a torrent, and
+		// updates its state
+		void apply(sha1_hash const& ih, entry const& record
+			, std::map<sha1_hash, entry>& rd);
+
+		// appends the records in m_pending to the log
+		bool write_pending(error_code& ec);
+
+		void add_record(std::vector<char>& out, sha1_hash const& ih
+			, entry const& record);
+
+		bool write_log(std::string const& path
+			, std::map<sha1_hash, entry> const& rd, error_code& ec);
+
+		std::string m_path;
+
+		// the file is kept open, records are appended at m_log_size
+		file m_file;
+		size_type m_log_size;
+		size_type m_live_size;
+
+		std::map<sha1_hash, torrent_state> m_state;
+
+		// the resume data read by open() that hasn't been loaded yet
+		std::map<sha1_hash, entry> m_loaded;
+
+		// records that haven't been written yet
+		std::vector<char> m_pending;
+	};
+}
+
+#endif // TORRENT_RESUME_STORE_HPP_INCLUDED
+
@@ -241,6 +241,9 @@ namespace libtorrent
 
 		void get_cache_info(sha1_hash const& ih
 			, std::vector<cached_piece_info>& ret) const;
+		void get_cache_info(sha1_hash const& ih
+			, std::vector<cached_piece_info>& ret
+			, torrent_cache_status& st) const;
 
 		feed_handle add_feed(feed_settings const& feed);
 		void remove_feed(feed_handle h);
@@ -269,6 +269,24 @@ namespace libtorrent
 			, apply_ip_filter_to_trackers(true)
 			, read_job_every(10)
 			, use_disk_read_ahead(true)
+			, disk_io_threads(4)
+			, hashing_threads(1)
+			, use_io_uring(false)
+			, io_uring_queue_depth(64)
+			, use_sendfile(false)
+			, read_cache_algorithm(read_cache_lru)
+			, read_cache_admission_filter(false)
+			, adaptive_read_ahead(false)
+			, active_checking(1)
+			, mmap_sync_writes(false)
+			, direct_io(false)
+			, max_coalesced_write_size(16 * 1024 * 1024)
+			, disk_write_latency_target(500)
+			, disk_read_weight(8)
+			, disk_write_weight(4)
+			, disk_hash_weight(2)
+			, disk_move_weight(1)
+			, checking_batch_size(8 * 1024 * 1024)
 		{}
 
 		// libtorrent version. Used for forward binary compatibility
@@ -443,7 +461,9 @@ namespace libtorrent
 		// to not completely disrupt normal downloads. If it's
 		// set to 0, you will be starving the disk thread and
 		// nothing will be written to disk.
-		// this is a per session setting.
+		// this is a per session setting. With disk_write_latency_target
+		// set, every drive has its own limit, adjusted to its write
+		// latency, that may grow past this
 		int max_queued_disk_bytes;
 
 		// this is the low watermark for the disk buffer queue.
@@ -1067,14 +1087,103 @@ namespace libtorrent
 		// filter, otherwise they are exempt
 		bool apply_ip_filter_to_trackers;
 
-		// to avoid write jobs starving read jobs, if this many
-		// write jobs have been taking priority in a row, service
-		// one read job
+		// this is not used anymore. Read jobs are kept from being
+		// starved by the disk_read_weight setting
 		int read_job_every;
 
 		// issue posix_fadvise() or fcntl(F_RDADVISE) for disk reads
 		// ahead of time
 		bool use_disk_read_ahead;
+
+		// the number of threads to use for disk I/O. Each
+		// torrent is assigned to one of them, so this only
+		// helps when there are multiple torrents, ideally on
+		// different drives
+		int disk_io_threads;
+
+		// the number of threads to use for verifying piece
+		// hashes. If 0, pieces are hashed by the disk threads
+		int hashing_threads;
+
+		// if true, the disk threads submit file reads and writes
+		// through io_uring on linux, to have many of them in flight
+		// at a time. If io_uring isn't supported, the regular
+		// blocking calls are used
+		bool use_io_uring;
+
+		// the max number of operations each disk thread has
+		// in flight when using io_uring
+		int io_uring_queue_depth;
+
+		// if true, uploaded blocks are sent straight from the files
+		// to plain TCP sockets with sendfile(), instead of being read
+		// into disk buffers first
+		bool use_sendfile;
+
+		enum read_cache_algo_t
+		{ read_cache_lru, read_cache_2q };
+
+		// the replacement policy of the read cache. read_cache_2q
+		// keeps pieces that have only been read once apart from the
+		// ones that are read repeatedly, so that a sequential scan
+		// can't evict the whole cache
+		read_cache_algo_t read_cache_algorithm;
+
+		// if true, a piece that misses the read cache only evicts
+		// another piece from it if it has been requested more often
+		// recently. Otherwise it's read straight from disk
+		bool read_cache_admission_filter;
+
+		// if true, the number of blocks read into the cache on a miss
+		// adapts to each sequential read stream of a torrent, and the
+		// kernel is asked to prefetch ahead of sequential streams
+		bool adaptive_read_ahead;
+
+		// the number of torrents that may check their files at the
+		// same time. Torrents saved to different devices are
+		// picked first
+		int active_checking;
+
+		// only used by mmap_storage. If true, the pages written to are
+		// flushed to disk with msync() before the write completes.
+		// Otherwise it's up to the kernel when dirty pages are written,
+		// until the files are complete or released
+		bool mmap_sync_writes;
+
+		// when true, all files are opened with the page cache disabled
+		// (O_DIRECT) regardless of disk_io_write_mode and disk_io_read_mode.
+		// libtorrent's own disk cache is the only cache, blocks are
+		// flushed as whole pieces and the kernel isn't asked to read ahead
+		bool direct_io;
+
+		// the largest write, in bytes, the write cache issues when it
+		// flushes the end of a piece together with the start of the
+		// pieces following it. 0 means pieces are written one at a time
+		int max_coalesced_write_size;
+
+		// the time, in milliseconds, blocks should take from being queued
+		// for writing until they are written. The number of bytes allowed
+		// in the write queue of each drive is adjusted to keep writes
+		// within this, instead of using max_queued_disk_bytes and its low
+		// watermark as fixed limits. 0 disables this
+		int disk_write_latency_target;
+
+		// the share of the disk threads' time the jobs of each class get,
+		// for every torrent. Torrents take turns, and in every turn each
+		// class is allowed to run jobs worth this many blocks. The classes
+		// are peer reads, writes, hashing and checking files, and
+		// move_storage (along with the other jobs operating on whole files)
+		int disk_read_weight;
+		int disk_write_weight;
+		int disk_hash_weight;
+		int disk_move_weight;
+
+		// the max number of bytes of pieces read and hashed at a time
+		// when checking files with optimize_hashing_for_speed. Every
+		// checking torrent may have two such batches in memory, one being
+		// hashed while the next is read. Batches of less than two pieces
+		// are not used
+		int checking_batch_size;
 	};
 
 #ifndef TORRENT_DISABLE_DHT
@@ -63,6 +63,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/thread.hpp"
 #include "libtorrent/storage_defs.hpp"
 #include "libtorrent/allocator.hpp"
+#include "libtorrent/read_ahead.hpp"
 
 namespace libtorrent
 {
@@ -71,6 +72,9 @@ namespace libtorrent
 	struct disk_io_job;
 	struct disk_buffer_pool;
 	struct session_settings;
+	struct check_batch;
+	struct binary_resume_data;
+	struct write_throttle;
 
 	TORRENT_EXPORT std::vector<std::pair<size_type, std::time_t> > get_filesizes(
 		file_storage const& t
@@ -115,7 +119,31 @@ namespace libtorrent
 		virtual int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
 		virtual int writev(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
 
+		// like writev(), except that the buffers may extend past the end
+		// of 'slot', into the slots following it. Returns -2 if the storage
+		// can't write across slots, in which case the caller writes one
+		// slot at a time
+		virtual int writev_span(file::iovec_t const* bufs, int slot, int offset
+			, int num_bufs) { return -2; }
+
 		virtual void hint_read(int slot, int offset, int len) {}
+
+		// if the 'size' bytes at 'offset' in 'slot' are stored contiguously
+		// in a single file, returns that file and sets 'file_offset' to
+		// where in it they start. This lets the bytes be sent to a socket
+		// straight from the file. Returns an empty pointer if that's not
+		// possible
+		virtual boost::intrusive_ptr<file> open_block(int slot, int offset, int size
+			, size_type& file_offset) { return boost::intrusive_ptr<file>(); }
+
+		// if the 'size' bytes at 'offset' in 'slot' are stored contiguously
+		// in a memory mapped file, returns a pointer to them in the mapping
+		// and sets 'mapping' to an object that keeps the mapping alive for
+		// as long as the pointer is used. Returns 0 if the storage doesn't
+		// map its files
+		virtual char const* map_block(int slot, int offset, int size
+			, boost::shared_ptr<void>& mapping) { return 0; }
+
 		// negative return value indicates an error
 		virtual int read(char* buf, int slot, int offset, int size) = 0;
 
@@ -135,6 +163,12 @@ namespace libtorrent
 		// verify storage dependent fast resume entries
 		virtual bool verify_resume_data(lazy_entry const& rd, error_code& error) = 0;
 
+		// verify resume data in the binary format. The default implementation
+		// converts it to a bencoded dictionary and passes it on to
+		// verify_resume_data()
+		virtual bool verify_binary_resume_data(binary_resume_data const& rd
+			, error_code& error);
+
 		// write storage dependent fast resume entries
 		virtual bool write_resume_data(entry& rd) const = 0;
 
@@ -203,13 +237,18 @@ namespace libtorrent
 		int write(char const* buf, int slot, int offset, int size);
 		int sparse_end(int start) const;
 		void hint_read(int slot, int offset, int len);
+		boost::intrusive_ptr<file> open_block(int slot, int offset, int size
+			, size_type& file_offset);
 		int readv(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
 		int writev(file::iovec_t const* buf, int slot, int offset, int num_bufs);
+		int writev_span(file::iovec_t const* bufs, int slot, int offset, int num_bufs);
 		size_type physical_offset(int slot, int offset);
 		bool move_slot(int src_slot, int dst_slot);
 		bool swap_slots(int slot1, int slot2);
 		bool swap_slots3(int slot1, int slot2, int slot3);
 		bool verify_resume_data(lazy_entry const& rd, error_code& error);
+		bool verify_binary_resume_data(binary_resume_data const& rd
+			, error_code& error);
 		bool write_resume_data(entry& rd) const;
 
 		// this identifies a read or write operation
@@ -224,9 +263,19 @@ namespace libtorrent
 				, error_code& ec);
 			int cache_setting;
 			int mode;
+			// if true, the operation isn't cut off at the end of
+			// the slot, but continues into the following ones
+			bool span_slots;
 		};
 
 		void delete_one_file(std::string const& p);
+
+		// helpers for verify_resume_data() and verify_binary_resume_data().
+		// read_file_mapping() picks up the renamed files and file priorities
+		void read_file_mapping(lazy_entry const& rd);
+		bool verify_file_sizes(std::vector<std::pair<size_type, std::time_t> > const& file_sizes
+			, bool seed, bool compact, error_code& error);
+
 		int readwritev(file::iovec_t const* bufs, int slot, int offset
 			, int num_bufs, fileop const&);
 
@@ -288,6 +337,7 @@ namespace libtorrent
 	};
 
 	struct disk_io_thread;
+	struct disk_io_worker;
 
 	class TORRENT_EXPORT piece_manager
 		: public intrusive_ptr_base<piece_manager>
@@ -295,6 +345,7 @@ namespace libtorrent
 	{
 	friend class invariant_access;
 	friend struct disk_io_thread;
+	friend struct disk_io_worker;
 	public:
 
 		piece_manager(
@@ -316,6 +367,8 @@ namespace libtorrent
 
 		void async_check_fastresume(lazy_entry const* resume_data
 			, boost::function<void(int, disk_io_job const&)> const& handler);
+		void async_check_fastresume(binary_resume_data const* resume_data
+			, boost::function<void(int, disk_io_job const&)> const& handler);
 		
 		void async_check_files(boost::function<void(int, disk_io_job const&)> const& handler);
 
@@ -328,6 +381,18 @@ namespace libtorrent
 			, int cache_line_size = 0
 			, int cache_expiry = 0);
 
+		// instead of reading the block into a buffer, this looks up
+		// the file and offset it's stored at, for it to be sent to a
+		// socket straight from the file. The job's file_handle and
+		// file_offset are set on success. If the block is cached, or
+		// not stored contiguously in one file, it's read into a buffer
+		// just like async_read()
+		void async_open_block(
+			peer_request const& r
+			, boost::function<void(int, disk_io_job const&)> const& handler
+			, int cache_line_size = 0
+			, int cache_expiry = 0);
+
 		void async_read_and_hash(
 			peer_request const& r
 			, boost::function<void(int, disk_io_job const&)> const& handler
@@ -405,6 +470,13 @@ namespace libtorrent
 		// if 'fatal_disk_error' is returned, the error message indicates what
 		// when wrong in the disk access
 		int check_fastresume(lazy_entry const& rd, error_code& error);
+		int check_fastresume(binary_resume_data const& rd, error_code& error);
+
+		// the parts of check_fastresume that don't depend on the format
+		// of the resume data. check_slot_map() sets up the storage from
+		// a slot map, check_piece_map() from the have bitfield
+		int check_slot_map(std::vector<int> const& slots, error_code& error);
+		void check_piece_map(bitfield const& have);
 
 		// this function returns true if the checking is complete
 		int check_files(int& current_slot, int& have_piece, error_code& error);
@@ -426,6 +498,12 @@ namespace libtorrent
 
 		void hint_read_impl(int piece_index, int offset, int size);
 
+		boost::intrusive_ptr<file> open_block_impl(int piece_index, int offset
+			, int size, size_type& file_offset);
+
+		char const* map_block_impl(int piece_index, int offset, int size
+			, boost::shared_ptr<void>& mapping);
+
 		int read_impl(
 			file::iovec_t* bufs
 			, int piece_index
@@ -438,6 +516,21 @@ namespace libtorrent
 			, int offset
 			, int num_bufs);
 
+		// writes buffers starting at 'offset' in 'piece_index' that may
+		// extend into the pieces following it. No buffer may straddle
+		// two pieces. Unless the storage is in compact mode, this is a
+		// single call to the storage
+		int write_span_impl(
+			file::iovec_t* bufs
+			, int piece_index
+			, int offset
+			, int num_bufs);
+
+		// feeds data that was just written to the partial hash of the
+		// piece, if it continues where the hash left off
+		void update_partial_hash(file::iovec_t const* bufs, int piece_index
+			, int offset, int num_bufs);
+
 		size_type physical_offset(int piece_index, int offset);
 
 		void finalize_file(int index);
@@ -447,6 +540,14 @@ namespace libtorrent
 		int skip_file() const;
 		// -1=error 0=ok >0=skip this many pieces
 		int check_one_piece(int& have_piece);
+		// reads and hashes the slots starting at m_current_slot in
+		// batches, and adds their digests to m_slot_hashes. While a
+		// batch is hashed by the hash threads, the next one is read
+		void hash_slot_batch(int small_piece_size);
+		boost::shared_ptr<check_batch> read_check_batch(int first_slot
+			, int num_slots, int small_piece_size);
+		void hash_check_batch(boost::shared_ptr<check_batch> const& b);
+		void clear_slot_hashes();
 		int identify_data(
 			sha1_hash const& large_hash
 			, sha1_hash const& small_hash
@@ -455,6 +556,13 @@ namespace libtorrent
 		void switch_to_full_mode();
 		sha1_hash hash_for_piece_impl(int piece, int* readback = 0);
 
+		// reads the part of the piece that hasn't been hashed yet
+		// into newly allocated disk buffers appended to bufs. ph
+		// is set to the partial hash of the piece. Returns the
+		// number of bytes read. On error, bufs is left empty
+		int read_piece_for_hash(int piece, partial_hash& ph
+			, std::vector<file::iovec_t>& bufs);
+
 		int release_files_impl() { return m_storage->release_files(); }
 		int delete_files_impl() { return m_storage->delete_files(); }
 		int rename_file_impl(int index, std::string const& new_filename)
@@ -538,6 +646,21 @@ namespace libtorrent
 		// build the first time it is used (to save time if it
 		// isn't needed)
 		std::multimap<sha1_hash, int> m_hash_to_piece;
+
+		// the digests of the slots following m_current_slot, when
+		// checking. Slots are read and hashed in batches, to let
+		// hash_buffers() hash several of them in parallel
+		struct slot_hash
+		{
+			int slot;
+			sha1_hash large_hash;
+			sha1_hash small_hash;
+		};
+		std::vector<slot_hash> m_slot_hashes;
+
+		// the batch of slots following the ones in m_slot_hashes,
+		// if it's being hashed in the background
+		boost::shared_ptr<check_batch> m_check_batch;
 	
 		// this map contains partial hashes for downloading
 		// pieces. This is only accessed from within the
@@ -546,6 +669,38 @@ namespace libtorrent
 
 		disk_io_thread& m_io_thread;
 
+		// the index of the disk thread all jobs for this storage
+		// are run on. It's assigned by the disk_io_thread when the
+		// first job is issued, and -1 until then
+		int m_disk_worker;
+
+		// the write queue of the drive the files of this storage are
+		// on, and the number of bytes this storage has queued in it.
+		// Both are protected by the queue mutex of the disk_io_thread.
+		// The write queue is assigned with the first write job
+		write_throttle* m_write_queue;
+		int m_queued_write_bytes;
+
+		// the disk cache quotas of this storage, in blocks. 0 means
+		// no quota. These and the counters below are protected by
+		// the piece mutex of the disk thread the storage is assigned to
+		int m_cache_soft_quota;
+		int m_cache_hard_quota;
+
+		// the number of blocks this storage has in the read and
+		// write cache
+		int m_cached_blocks;
+
+		// the number of blocks read that were found in the read
+		// cache and that had to be read from disk
+		size_type m_cache_hits;
+		size_type m_cache_misses;
+
+		// the sequential read streams of this storage and their
+		// read-ahead windows. Only used by the disk thread the
+		// storage is assigned to
+		read_ahead m_read_ahead;
+
 		// the reason for this to be a void pointer
 		// is to avoid creating a dependency on the
 		// torrent. This shared_ptr is here only
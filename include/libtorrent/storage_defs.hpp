@@ -57,6 +57,12 @@ namespace libtorrent
 		file_storage const&, file_storage const* mapped, std::string const&, file_pool&
 		, std::vector<boost::uint8_t> const&);
 
+	// memory maps the files. Where that's not supported, this
+	// is the same as default_storage_constructor
+	TORRENT_EXPORT storage_interface* mmap_storage_constructor(
+		file_storage const&, file_storage const* mapped, std::string const&, file_pool&
+		, std::vector<boost::uint8_t> const&);
+
 	TORRENT_EXPORT storage_interface* disabled_storage_constructor(
 		file_storage const&, file_storage const* mapped, std::string const&, file_pool&
 		, std::vector<boost::uint8_t> const&);
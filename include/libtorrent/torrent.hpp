@@ -70,6 +70,7 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/assert.hpp"
 #include "libtorrent/bitfield.hpp"
+#include "libtorrent/binary_resume.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 #include "libtorrent/deadline_timer.hpp"
 #include "libtorrent/union_endpoint.hpp"
@@ -689,6 +690,10 @@ namespace libtorrent
 		}
 
 		std::string save_path() const;
+		// the device the torrent's files are on, as found by the
+		// disk thread when checking the resume data or moving the
+		// storage. 0 if it's not known yet
+		boost::uint64_t device() const { return m_device; }
 		alert_manager& alerts() const;
 		piece_picker& picker()
 		{
@@ -701,6 +706,8 @@ namespace libtorrent
 		}
 		policy& get_policy() { return m_policy; }
 		piece_manager& filesystem();
+		// 0 if the torrent doesn't have a storage (yet)
+		piece_manager const* storage() const { return m_owning_storage.get(); }
 		torrent_info const& torrent_file() const
 		{ return *m_torrent_file; }
 
@@ -763,6 +770,10 @@ namespace libtorrent
 		void set_max_connections(int limit);
 		int max_connections() const { return m_max_connections; }
 
+		void set_cache_quota(int soft, int hard);
+		int cache_soft_quota() const { return m_cache_soft_quota; }
+		int cache_hard_quota() const { return m_cache_hard_quota; }
+
 		void move_storage(std::string const& save_path);
 
 		// renames the file with the given index to the new name
@@ -994,6 +1005,9 @@ namespace libtorrent
 
 		std::string m_save_path;
 
+		// the device m_save_path is on, see device()
+		boost::uint64_t m_device;
+
 		// if we don't have the metadata, this is a url to
 		// the torrent file
 		std::string m_url;
@@ -1021,9 +1035,12 @@ namespace libtorrent
 		// if the error ocurred on a file, this is the file
 		std::string m_error_file;
 
-		// used if there is any resume data
+		// used if there is any resume data. If it's in the binary
+		// format, m_binary_resume refers to m_resume_data and
+		// m_resume_entry only holds the dictionary at its end
 		std::vector<char> m_resume_data;
 		lazy_entry m_resume_entry;
+		binary_resume_data m_binary_resume;
 
 		// if the torrent is started without metadata, it may
 		// still be given a name until the metadata is received
@@ -1318,6 +1335,11 @@ namespace libtorrent
 		// if set to true, add tracker URLs loaded from resume
 		// data into this torrent instead of replacing them
 		bool m_merge_resume_trackers:1;
+
+		// the disk cache quotas, in blocks. These are kept here
+		// in case they're set before the storage is created
+		int m_cache_soft_quota;
+		int m_cache_hard_quota;
 	};
 }
 
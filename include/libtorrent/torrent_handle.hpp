@@ -373,6 +373,8 @@ namespace libtorrent
 		void set_max_connections(int max_connections) const;
 		int max_connections() const;
 
+		void set_cache_quota(int soft, int hard) const;
+
 		void set_tracker_login(std::string const& name
 			, std::string const& password) const;
 
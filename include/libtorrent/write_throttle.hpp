@@ -0,0 +1,109 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#ifndef TORRENT_WRITE_THROTTLE_HPP_INCLUDED
+#define TORRENT_WRITE_THROTTLE_HPP_INCLUDED
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/size_type.hpp"
+
+namespace libtorrent
+{
+	// limits the number of bytes queued for writing to one device.
+	// When the queue reaches the limit it's blocked (peers stop
+	// reading from their sockets) until it drops below the low
+	// watermark again. The limit is adjusted by how long writes
+	// take from being queued until they complete. For every limit
+	// worth of bytes written within the latency target the limit
+	// grows, doubling it until the target is first exceeded and by
+	// one step after that. A write exceeding the target cuts the
+	// limit by a quarter, at most once per limit worth of bytes
+	struct TORRENT_EXPORT write_throttle
+	{
+		write_throttle();
+
+		// the limit is kept within min_limit and max_limit. If they're
+		// the same, the limit is fixed. A max_limit of 0 means there is
+		// no limit. low_watermark is where a blocked queue is unblocked,
+		// 0 (or anything not below the limit) means 7/8 of the limit.
+		// latency_target is in microseconds. Returns true if the new
+		// limits unblocked the queue
+		bool set_limits(int min_limit, int max_limit, int low_watermark
+			, int step, int latency_target);
+
+		void queue(int bytes);
+
+		// returns true if the queue was blocked and
+		// dropping these bytes unblocked it
+		bool dequeue(int bytes);
+
+		// records that a write of the given number of bytes completed,
+		// latency microseconds after it was queued. Returns true if
+		// the new limit unblocked the queue
+		bool write_done(int bytes, int latency);
+
+		int limit() const { return m_limit; }
+		size_type queued() const { return m_queued; }
+		bool exceeded() const { return m_exceeded; }
+
+	private:
+
+		// blocks or unblocks the queue depending on how the queued
+		// bytes compare to the limit. Returns true if it was unblocked
+		bool update_exceeded();
+
+		size_type m_queued;
+		int m_limit;
+		int m_min_limit;
+		int m_max_limit;
+		int m_low_watermark;
+		int m_step;
+		int m_latency_target;
+
+		// the number of bytes written since the limit was last
+		// adjusted. The limit is adjusted every limit bytes
+		int m_window;
+
+		// true until the first write exceeding the latency target
+		bool m_slow_start;
+
+		// set when the limit has been cut in this window
+		bool m_cut;
+
+		// set when the queue reached the limit. It stays
+		// set until the queue drops below the low watermark
+		bool m_exceeded;
+	};
+}
+
+#endif // TORRENT_WRITE_THROTTLE_HPP_INCLUDED
+
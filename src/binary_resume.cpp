@@ -0,0 +1,425 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/binary_resume.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/error.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <boost/crc.hpp>
+#include <iterator>
+#include <cstring>
+
+// the layout of binary resume data:
+//
+//    4 bytes  tag, "ltbr"
+//    2 bytes  version
+//    2 bytes  flags (binary_resume_data::flags_t)
+//   20 bytes  info-hash
+//    4 bytes  blocks per piece
+//    4 bytes  number of pieces
+//    4 bytes  number of slots
+//    4 bytes  number of files
+//    4 bytes  size of the bencoded dictionary
+//
+// followed by the sections:
+//
+//    the have bitfield, (pieces + 7) / 8 bytes
+//    the verified bitfield, same size, if has_verified is set
+//    8 bytes file size and 8 bytes modification time, per file
+//    4 bytes per slot
+//    the bencoded dictionary with the rest of the resume data
+//    4 bytes  CRC32 of everything before it
+//
+// integers are big endian
+
+namespace
+{
+	char const resume_tag[] = "ltbr";
+	int const header_size = 4 + 2 + 2 + 20 + 5 * 4;
+	int const file_entry_size = 16;
+	int const slot_entry_size = 4;
+
+	// the keys stored in the fixed fields, which are left out of
+	// the bencoded dictionary
+	char const* fixed_keys[] =
+	{
+		"file-format", "file-version", "info-hash", "blocks per piece"
+		, "allocation", "pieces", "slots", "file sizes"
+	};
+}
+
+namespace libtorrent
+{
+	bool binary_resume_data::is_binary(char const* buf, int size)
+	{
+		return size >= 4 && std::memcmp(buf, resume_tag, 4) == 0;
+	}
+
+	void binary_resume_data::clear()
+	{
+		m_buf = 0;
+		m_pieces = 0;
+		m_verified = 0;
+		m_slots = 0;
+		m_file_sizes = 0;
+		m_extra = 0;
+		m_flags = 0;
+		m_num_pieces = 0;
+		m_num_slots = 0;
+		m_num_files = 0;
+		m_blocks_per_piece = 0;
+		m_info_hash.clear();
+	}
+
+	bool binary_resume_data::parse(char const* buf, int size
+		, lazy_entry& extra, error_code& ec)
+	{
+		clear();
+		extra.clear();
+
+		if (!is_binary(buf, size))
+		{
+			ec = errors::invalid_file_tag;
+			return false;
+		}
+		if (size < header_size + 4)
+		{
+			ec = errors::invalid_binary_resume_data;
+			return false;
+		}
+
+		char const* ptr = buf + 4;
+		int version = detail::read_uint16(ptr);
+		if (version != current_version)
+		{
+			ec = errors::unsupported_resume_version;
+			return false;
+		}
+
+		boost::crc_32_type crc;
+		crc.process_bytes(buf, size - 4);
+		char const* crc_ptr = buf + size - 4;
+		if (crc.checksum() != detail::read_uint32(crc_ptr))
+		{
+			ec = errors::invalid_binary_resume_data;
+			return false;
+		}
+
+		int flags = detail::read_uint16(ptr);
+		std::memcpy(m_info_hash.begin(), ptr, 20);
+		ptr += 20;
+		int blocks_per_piece = detail::read_int32(ptr);
+		int num_pieces = detail::read_int32(ptr);
+		int num_slots = detail::read_int32(ptr);
+		int num_files = detail::read_int32(ptr);
+		int extra_size = detail::read_int32(ptr);
+
+		if (blocks_per_piece < 0 || num_pieces < 0 || num_slots < 0
+			|| num_files < 0 || extra_size < 0)
+		{
+			ec = errors::invalid_binary_resume_data;
+			return false;
+		}
+
+		// the sections must add up to exactly the size of the buffer.
+		// Do the arithmetic in 64 bits, the counts come from the file
+		size_type bitfield_size = (size_type(num_pieces) + 7) / 8;
+		size_type expected = header_size + bitfield_size
+			+ ((flags & has_verified) ? bitfield_size : 0)
+			+ size_type(num_files) * file_entry_size
+			+ size_type(num_slots) * slot_entry_size
+			+ extra_size + 4;
+		if (expected != size)
+		{
+			ec = errors::invalid_binary_resume_data;
+			return false;
+		}
+
+		m_pieces = ptr;
+		ptr += bitfield_size;
+		if (flags & has_verified)
+		{
+			m_verified = ptr;
+			ptr += bitfield_size;
+		}
+		m_file_sizes = ptr;
+		ptr += num_files * file_entry_size;
+		m_slots = ptr;
+		ptr += num_slots * slot_entry_size;
+
+		if (lazy_bdecode(ptr, ptr + extra_size, extra, ec) != 0
+			|| extra.type() != lazy_entry::dict_t)
+		{
+			if (!ec) ec = errors::not_a_dictionary;
+			extra.clear();
+			clear();
+			return false;
+		}
+
+		m_buf = buf;
+		m_extra = &extra;
+		m_flags = flags;
+		m_num_pieces = num_pieces;
+		m_num_slots = num_slots;
+		m_num_files = num_files;
+		m_blocks_per_piece = blocks_per_piece;
+		return true;
+	}
+
+	bool binary_resume_data::have_piece(int index) const
+	{
+		TORRENT_ASSERT(index >= 0 && index < m_num_pieces);
+		return (m_pieces[index / 8] & (0x80 >> (index & 7))) != 0;
+	}
+
+	bool binary_resume_data::verified_piece(int index) const
+	{
+		TORRENT_ASSERT(index >= 0 && index < m_num_pieces);
+		if (m_verified == 0) return false;
+		return (m_verified[index / 8] & (0x80 >> (index & 7))) != 0;
+	}
+
+	int binary_resume_data::slot_at(int index) const
+	{
+		TORRENT_ASSERT(index >= 0 && index < m_num_slots);
+		char const* ptr = m_slots + index * slot_entry_size;
+		return detail::read_int32(ptr);
+	}
+
+	std::pair<size_type, std::time_t> binary_resume_data::file_size_at(int index) const
+	{
+		TORRENT_ASSERT(index >= 0 && index < m_num_files);
+		char const* ptr = m_file_sizes + index * file_entry_size;
+		size_type size = detail::read_int64(ptr);
+		std::time_t mtime = std::time_t(detail::read_int64(ptr));
+		return std::make_pair(size, mtime);
+	}
+
+	void binary_resume_data::file_sizes(std::vector<std::pair<size_type, std::time_t> >& fs) const
+	{
+		fs.clear();
+		fs.reserve(m_num_files);
+		for (int i = 0; i < m_num_files; ++i)
+			fs.push_back(file_size_at(i));
+	}
+
+	void binary_resume_data::to_entry(entry& rd) const
+	{
+		TORRENT_ASSERT(valid());
+		if (m_extra && m_extra->type() == lazy_entry::dict_t) rd = *m_extra;
+		else rd = entry(entry::dictionary_t);
+
+		rd["file-format"] = "libtorrent resume file";
+		rd["file-version"] = 1;
+		rd["info-hash"] = std::string(m_info_hash.begin(), m_info_hash.end());
+		if (m_blocks_per_piece > 0) rd["blocks per piece"] = m_blocks_per_piece;
+		rd["allocation"] = compact() ? "compact" : "full";
+
+		if (m_num_pieces > 0)
+		{
+			std::string& pieces = rd["pieces"].string();
+			pieces.resize(m_num_pieces);
+			for (int i = 0; i < m_num_pieces; ++i)
+				pieces[i] = (have_piece(i) ? 1 : 0) | (verified_piece(i) ? 2 : 0);
+		}
+
+		if (has_slot_map())
+		{
+			entry::list_type& slots = rd["slots"].list();
+			for (int i = 0; i < m_num_slots; ++i)
+				slots.push_back(entry(slot_at(i)));
+		}
+
+		entry::list_type& fl = rd["file sizes"].list();
+		for (int i = 0; i < m_num_files; ++i)
+		{
+			std::pair<size_type, std::time_t> fs = file_size_at(i);
+			entry::list_type p;
+			p.push_back(entry(fs.first));
+			p.push_back(entry(size_type(fs.second)));
+			fl.push_back(entry(p));
+		}
+	}
+
+	bool write_binary_resume_data(entry const& rd
+		, std::vector<char>& buf, error_code& ec)
+	{
+		ec.clear();
+		buf.clear();
+		if (rd.type() != entry::dictionary_t)
+		{
+			ec = errors::not_a_dictionary;
+			return false;
+		}
+
+		entry const* info_hash = rd.find_key("info-hash");
+		if (info_hash == 0 || info_hash->type() != entry::string_t
+			|| info_hash->string().size() != 20)
+		{
+			ec = errors::missing_info_hash;
+			return false;
+		}
+
+		int flags = 0;
+		entry const* e = rd.find_key("allocation");
+		if (e && e->type() == entry::string_t && e->string() == "compact")
+			flags |= binary_resume_data::compact_allocation;
+
+		int blocks_per_piece = 0;
+		e = rd.find_key("blocks per piece");
+		if (e && e->type() == entry::int_t) blocks_per_piece = int(e->integer());
+
+		// the pieces string has one byte per piece. Bit 1 is
+		// the have bit and bit 2 the verified bit
+		std::string const* pieces = 0;
+		e = rd.find_key("pieces");
+		if (e && e->type() == entry::string_t) pieces = &e->string();
+		int num_pieces = pieces ? int(pieces->size()) : 0;
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			if (((*pieces)[i] & 2) == 0) continue;
+			flags |= binary_resume_data::has_verified;
+			break;
+		}
+
+		entry::list_type const* slots = 0;
+		e = rd.find_key("slots");
+		if (e && e->type() == entry::list_t)
+		{
+			slots = &e->list();
+			flags |= binary_resume_data::has_slots;
+		}
+		int num_slots = slots ? int(slots->size()) : 0;
+
+		entry::list_type const* file_sizes = 0;
+		e = rd.find_key("file sizes");
+		if (e && e->type() == entry::list_t) file_sizes = &e->list();
+		int num_files = file_sizes ? int(file_sizes->size()) : 0;
+
+		entry extra(entry::dictionary_t);
+		for (entry::dictionary_type::const_iterator i = rd.dict().begin()
+			, end(rd.dict().end()); i != end; ++i)
+		{
+			char const** k = fixed_keys;
+			char const** k_end = fixed_keys + sizeof(fixed_keys) / sizeof(fixed_keys[0]);
+			for (; k != k_end; ++k) if (i->first == *k) break;
+			if (k != k_end) continue;
+			extra.dict().insert(*i);
+		}
+		std::vector<char> extra_buf;
+		bencode(std::back_inserter(extra_buf), extra);
+
+		int bitfield_size = (num_pieces + 7) / 8;
+		buf.resize(header_size + bitfield_size
+			+ ((flags & binary_resume_data::has_verified) ? bitfield_size : 0)
+			+ num_files * file_entry_size + num_slots * slot_entry_size
+			+ extra_buf.size() + 4, 0);
+
+		char* ptr = &buf[0];
+		std::memcpy(ptr, resume_tag, 4);
+		ptr += 4;
+		detail::write_uint16(binary_resume_data::current_version, ptr);
+		detail::write_uint16(flags, ptr);
+		std::memcpy(ptr, info_hash->string().c_str(), 20);
+		ptr += 20;
+		detail::write_int32(blocks_per_piece, ptr);
+		detail::write_int32(num_pieces, ptr);
+		detail::write_int32(num_slots, ptr);
+		detail::write_int32(num_files, ptr);
+		detail::write_int32(int(extra_buf.size()), ptr);
+
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			if ((*pieces)[i] & 1) ptr[i / 8] |= 0x80 >> (i & 7);
+		}
+		ptr += bitfield_size;
+		if (flags & binary_resume_data::has_verified)
+		{
+			for (int i = 0; i < num_pieces; ++i)
+			{
+				if ((*pieces)[i] & 2) ptr[i / 8] |= 0x80 >> (i & 7);
+			}
+			ptr += bitfield_size;
+		}
+
+		if (file_sizes)
+		{
+			for (entry::list_type::const_iterator i = file_sizes->begin()
+				, end(file_sizes->end()); i != end; ++i)
+			{
+				size_type size = 0;
+				size_type mtime = 0;
+				if (i->type() == entry::list_t && i->list().size() == 2
+					&& i->list().front().type() == entry::int_t
+					&& i->list().back().type() == entry::int_t)
+				{
+					size = i->list().front().integer();
+					mtime = i->list().back().integer();
+				}
+				detail::write_int64(size, ptr);
+				detail::write_int64(mtime, ptr);
+			}
+		}
+
+		if (slots)
+		{
+			for (entry::list_type::const_iterator i = slots->begin()
+				, end(slots->end()); i != end; ++i)
+			{
+				if (i->type() != entry::int_t)
+				{
+					ec = errors::invalid_slot_list;
+					buf.clear();
+					return false;
+				}
+				detail::write_int32(int(i->integer()), ptr);
+			}
+		}
+
+		if (!extra_buf.empty())
+		{
+			std::memcpy(ptr, &extra_buf[0], extra_buf.size());
+			ptr += extra_buf.size();
+		}
+
+		boost::crc_32_type crc;
+		crc.process_bytes(&buf[0], ptr - &buf[0]);
+		detail::write_uint32(crc.checksum(), ptr);
+		TORRENT_ASSERT(ptr == &buf[0] + buf.size());
+		return true;
+	}
+}
+
@@ -2216,6 +2216,80 @@ namespace libtorrent
 	{
 		INVARIANT_CHECK;
 
+		write_piece_header(r);
+
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		// blocks shared with the read cache can't be encrypted in
+		// place. Copy them into the send buffer instead
+		if (m_rc4_encrypted && m_ses.m_disk_thread.is_shared(buffer.get()))
+			send_buffer(buffer.get(), r.length);
+		else
+#endif
+		{
+			append_send_buffer(buffer.get(), r.length
+				, boost::bind(&session_impl::free_disk_buffer
+				, boost::ref(m_ses), _1));
+			buffer.release();
+		}
+
+		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
+		setup_send();
+	}
+
+	void bt_peer_connection::write_piece(peer_request const& r
+		, boost::intrusive_ptr<file> const& f, size_type file_offset)
+	{
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(can_send_file());
+
+		write_piece_header(r);
+		append_send_file(f, file_offset, r.length);
+
+		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
+		setup_send();
+	}
+
+	namespace
+	{
+		// the mapping is bound to this, to be released along
+		// with the send buffer
+		void release_mapping(boost::shared_ptr<void> const&, char*) {}
+	}
+
+	void bt_peer_connection::write_piece(peer_request const& r, char const* view
+		, boost::shared_ptr<void> const& mapping)
+	{
+		INVARIANT_CHECK;
+
+		write_piece_header(r);
+
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		// the view is the file itself, it can't be encrypted
+		// in place. Copy it into the send buffer instead
+		if (m_rc4_encrypted)
+			send_buffer(view, r.length);
+		else
+#endif
+		{
+			append_send_buffer(const_cast<char*>(view), r.length
+				, boost::bind(&release_mapping, mapping, _1));
+		}
+
+		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
+		setup_send();
+	}
+
+	bool bt_peer_connection::can_send_file() const
+	{
+#ifndef TORRENT_DISABLE_ENCRYPTION
+		if (m_rc4_encrypted) return false;
+#endif
+		return peer_connection::can_send_file();
+	}
+
+	void bt_peer_connection::write_piece_header(peer_request const& r)
+	{
 		TORRENT_ASSERT(m_sent_handshake && m_sent_bitfield);
 
 		boost::shared_ptr<torrent> t = associated_torrent().lock();
@@ -2268,14 +2342,6 @@ namespace libtorrent
 		{
 			send_buffer(msg, 13);
 		}
-
-		append_send_buffer(buffer.get(), r.length
-			, boost::bind(&session_impl::free_disk_buffer
-			, boost::ref(m_ses), _1));
-		buffer.release();
-
-		m_payloads.push_back(range(send_buffer_size() - r.length, r.length));
-		setup_send();
 	}
 
 	namespace
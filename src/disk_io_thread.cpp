@@ -153,6 +153,10 @@ namespace libtorrent
 		m_log << log_time() << " " << category << ": " << m_categories[category] << "\n";
 #endif
 		TORRENT_ASSERT(ret == 0 || is_disk_buffer(ret, l));
+		// the blocks are carved out of page aligned chunks, which is what
+		// lets them be used for direct I/O without copying
+		TORRENT_ASSERT(ret == 0 || (m_block_size & (page_size()-1)) != 0
+			|| (uintptr_t(ret) & (page_size()-1)) == 0);
 		return ret;
 	}
 
@@ -196,11 +200,43 @@ namespace libtorrent
 		free_buffer_impl(buf, l);
 	}
 
+	void disk_buffer_pool::add_ref(char* buf)
+	{
+		mutex::scoped_lock l(m_pool_mutex);
+		TORRENT_ASSERT(is_disk_buffer(buf, l));
+		++m_refs[buf];
+	}
+
+	bool disk_buffer_pool::is_shared(char* buf) const
+	{
+		mutex::scoped_lock l(m_pool_mutex);
+		TORRENT_ASSERT(is_disk_buffer(buf, l));
+		return !m_refs.empty() && m_refs.find(buf) != m_refs.end();
+	}
+
 	void disk_buffer_pool::free_buffer_impl(char* buf, mutex::scoped_lock& l)
 	{
 		TORRENT_ASSERT(buf);
 		TORRENT_ASSERT(m_magic == 0x1337);
 		TORRENT_ASSERT(is_disk_buffer(buf, l));
+
+		// only buffers handed out from the cache without copying
+		// are in m_refs, and only while a peer is still sending
+		// them. Most of the time it's empty, and then there's no
+		// need to look the buffer up
+		if (!m_refs.empty())
+		{
+			std::map<char*, int>::iterator i = m_refs.find(buf);
+			if (i != m_refs.end())
+			{
+				// there are other references to this buffer,
+				// just drop this one
+				TORRENT_ASSERT(i->second > 0);
+				if (--i->second == 0) m_refs.erase(i);
+				return;
+			}
+		}
+
 #if defined TORRENT_DISK_STATS || defined TORRENT_STATS
 		--m_allocations;
 #endif
@@ -247,58 +283,423 @@ namespace libtorrent
 		, file_pool& fp
 		, int block_size)
 		: disk_buffer_pool(block_size)
-		, m_abort(false)
 		, m_waiting_to_shutdown(false)
 		, m_queue_buffer_size(0)
-		, m_last_file_check(time_now_hires())
-		, m_physical_ram(0)
-		, m_exceeded_write_queue(false)
+		, m_num_threads(1)
+		, m_next_worker(0)
+		, m_running_threads(1)
 		, m_ios(ios)
 		, m_queue_callback(queue_callback)
 		, m_work(io_service::work(m_ios))
 		, m_file_pool(fp)
-		, m_disk_io_thread(boost::bind(&disk_io_thread::thread_fun, this))
+		, m_hash_thread(*this)
 	{
-		// don't do anything in here. Essentially all members
-		// of this object are owned by the newly created thread.
-		// initialize stuff in thread_fun().
+#if (defined TORRENT_DEBUG || TORRENT_RELEASE_ASSERTS) && defined BOOST_HAS_PTHREADS
+		m_adding_thread = 0;
+#endif
+		// start out with a single thread. More threads are
+		// started once the settings ask for them
+		m_workers.push_back(boost::shared_ptr<disk_io_worker>(
+			new disk_io_worker(*this, 0)));
 	}
 
 	disk_io_thread::~disk_io_thread()
 	{
-		TORRENT_ASSERT(m_abort == true);
+		TORRENT_ASSERT(m_running_threads == 0);
 	}
 
 	void disk_io_thread::abort()
 	{
 		mutex::scoped_lock l(m_queue_mutex);
-		disk_io_job j;
 		m_waiting_to_shutdown = true;
-		j.action = disk_io_job::abort_thread;
-		j.start_time = time_now_hires();
-		m_jobs.insert(m_jobs.begin(), j);
-		m_signal.signal(l);
+		l.unlock();
+
+		// waking up a worker takes the queue mutex, so
+		// it can't be held while posting jobs to them
+		for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+			, end(m_workers.end()); i != end; ++i)
+			(*i)->abort();
 	}
 
 	void disk_io_thread::join()
 	{
-		m_disk_io_thread.join();
+		// no threads are added once we're shutting down,
+		// so m_workers won't change under our feet here
+		for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+			, end(m_workers.end()); i != end; ++i)
+			(*i)->m_disk_io_thread.join();
+
 		mutex::scoped_lock l(m_queue_mutex);
-		TORRENT_ASSERT(m_abort == true);
-		m_jobs.clear();
+		TORRENT_ASSERT(m_running_threads == 0);
+		for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+			, end(m_workers.end()); i != end; ++i)
+		{
+			TORRENT_ASSERT((*i)->m_abort == true);
+			(*i)->m_queue.clear();
+		}
+	}
+
+	void disk_io_thread::worker_exited()
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		TORRENT_ASSERT(m_running_threads > 0);
+		--m_running_threads;
+		if (m_running_threads > 0) return;
+		l.unlock();
+
+		// pieces still being hashed will post their callbacks
+		// when they complete. Wait for them before releasing
+		// the io_service, to allow the run() call to return
+		// once the last thread has stopped posting callbacks to it
+		m_hash_thread.stop();
+		m_work.reset();
+	}
+
+	bool disk_io_thread::can_write(piece_manager const* s) const
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		// a storage that hasn't issued any writes yet is on
+		// the queue for storages whose drive isn't known yet
+		if (s->m_write_queue) return !s->m_write_queue->exceeded();
+		std::map<boost::uint64_t, write_throttle>::const_iterator i
+			= m_write_queues.find(0);
+		return i == m_write_queues.end() || !i->second.exceeded();
+	}
+
+	write_throttle& disk_io_thread::write_queue_for(boost::uint64_t device
+		, mutex::scoped_lock& l)
+	{
+		std::map<boost::uint64_t, write_throttle>::iterator i
+			= m_write_queues.find(device);
+		if (i != m_write_queues.end()) return i->second;
+		write_throttle& q = m_write_queues[device];
+		set_write_queue_limits(q);
+		return q;
+	}
+
+	bool disk_io_thread::set_write_queue_limits(write_throttle& q)
+	{
+		int max_queued = (std::max)(m_settings.max_queued_disk_bytes, 0);
+		if (m_settings.disk_write_latency_target <= 0 || max_queued == 0)
+		{
+			// the limit is fixed at max_queued_disk_bytes
+			return q.set_limits(max_queued, max_queued
+				, m_settings.max_queued_disk_bytes_low_watermark, m_block_size, 0);
+		}
+
+		// the limit may drop to a few blocks on slow drives, and grow
+		// up to half the disk cache on fast ones. max_queued_disk_bytes
+		// is always within the range
+		int min_limit = (std::min)(max_queued, 4 * m_block_size);
+		size_type cache_limit = size_type((std::max)(m_settings.cache_size, 0))
+			* m_block_size / 2;
+		int max_limit = int((std::min)((std::max)(size_type(max_queued), cache_limit)
+			, size_type(INT_MAX)));
+		return q.set_limits(min_limit, max_limit, 0, m_block_size
+			, int((std::min)(m_settings.disk_write_latency_target, INT_MAX / 1000) * 1000));
+	}
+
+	void disk_io_thread::set_device(piece_manager* s, boost::uint64_t device)
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		write_throttle& q = write_queue_for(device, l);
+		if (s->m_write_queue == &q) return;
+
+		bool unblocked = false;
+		if (s->m_write_queue && s->m_queued_write_bytes > 0)
+			unblocked = s->m_write_queue->dequeue(s->m_queued_write_bytes);
+		s->m_write_queue = &q;
+		if (s->m_queued_write_bytes > 0) q.queue(s->m_queued_write_bytes);
+		if (unblocked && m_queue_callback) m_ios.post(m_queue_callback);
+	}
+
+	void disk_io_thread::dequeue_write(piece_manager* s, int bytes
+		, mutex::scoped_lock& l)
+	{
+		TORRENT_ASSERT(m_queue_buffer_size >= bytes);
+		TORRENT_ASSERT(s->m_queued_write_bytes >= bytes);
+		TORRENT_ASSERT(s->m_write_queue);
+		m_queue_buffer_size -= bytes;
+		s->m_queued_write_bytes -= bytes;
+		// we just dropped below the low watermark of the number of bytes
+		// queued for writing to the drive. Notify the session so that it
+		// can trigger all the connections waiting for this event
+		if (s->m_write_queue->dequeue(bytes) && m_queue_callback)
+			m_ios.post(m_queue_callback);
 	}
 
-	bool disk_io_thread::can_write() const
+	void disk_io_thread::write_done(piece_manager* s, int bytes, int latency)
 	{
 		mutex::scoped_lock l(m_queue_mutex);
-		return !m_exceeded_write_queue;
+		TORRENT_ASSERT(s->m_write_queue);
+		if (s->m_write_queue->write_done(bytes, latency) && m_queue_callback)
+			m_ios.post(m_queue_callback);
 	}
 
 	void disk_io_thread::get_cache_info(sha1_hash const& ih, std::vector<cached_piece_info>& ret) const
 	{
-		mutex::scoped_lock l(m_piece_mutex);
+		mutex::scoped_lock l(m_queue_mutex);
+		std::vector<boost::shared_ptr<disk_io_worker> > workers = m_workers;
+		l.unlock();
+
 		ret.clear();
-		ret.reserve(m_pieces.size());
+		for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = workers.begin()
+			, end(workers.end()); i != end; ++i)
+			(*i)->get_cache_info(ih, ret);
+	}
+	
+	void disk_io_thread::set_cache_quota(piece_manager* s, int soft, int hard)
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		disk_io_worker& w = worker_for(s, l);
+		l.unlock();
+		w.set_cache_quota(s, soft, hard);
+	}
+
+	void disk_io_thread::get_torrent_cache_status(piece_manager* s
+		, torrent_cache_status& st)
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		disk_io_worker& w = worker_for(s, l);
+		l.unlock();
+		w.get_torrent_cache_status(s, st);
+	}
+
+	cache_status disk_io_thread::status() const
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		std::vector<boost::shared_ptr<disk_io_worker> > workers = m_workers;
+		cache_status ret;
+		ret.queued_bytes = m_queue_buffer_size;
+		for (std::map<boost::uint64_t, write_throttle>::const_iterator i = m_write_queues.begin()
+			, end(m_write_queues.end()); i != end; ++i)
+			ret.queued_bytes_limit += i->second.limit();
+		l.unlock();
+
+		ret.total_used_buffers = in_use();
+
+		// the averages are averaged over the threads
+		// that have done any work. The hash times are weighted
+		// by the number of pieces each thread hashed
+		int num_active = 0;
+		double hash_time_sum = 0;
+		double num_hashed = 0;
+		for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = workers.begin()
+			, end(workers.end()); i != end; ++i)
+		{
+			cache_status s = (*i)->status();
+			ret.blocks_written += s.blocks_written;
+			ret.writes += s.writes;
+			ret.blocks_read += s.blocks_read;
+			ret.blocks_read_hit += s.blocks_read_hit;
+			ret.reads += s.reads;
+			ret.cache_size += s.cache_size;
+			ret.read_cache_size += s.read_cache_size;
+			ret.job_queue_length += s.job_queue_length;
+			ret.cumulative_job_time += s.cumulative_job_time;
+			ret.cumulative_read_time += s.cumulative_read_time;
+			ret.cumulative_write_time += s.cumulative_write_time;
+			ret.cumulative_hash_time += s.cumulative_hash_time;
+			ret.cumulative_sort_time += s.cumulative_sort_time;
+			ret.total_read_back += s.total_read_back;
+			ret.read_queue_size += s.read_queue_size;
+			ret.probation_hits += s.probation_hits;
+			ret.protected_hits += s.protected_hits;
+			ret.ghost_hits += s.ghost_hits;
+			ret.admission_rejects += s.admission_rejects;
+			for (int k = 0; k < cache_status::num_job_types; ++k)
+			{
+				ret.queue_time_histogram[k] += s.queue_time_histogram[k];
+				ret.job_time_histogram[k] += s.job_time_histogram[k];
+			}
+
+			if (s.average_job_time == 0) continue;
+			++num_active;
+			ret.average_queue_time += s.average_queue_time;
+			ret.average_read_time += s.average_read_time;
+			ret.average_write_time += s.average_write_time;
+			boost::uint32_t hashed = (*i)->num_hashed();
+			hash_time_sum += double(s.average_hash_time) * hashed;
+			num_hashed += hashed;
+			ret.average_job_time += s.average_job_time;
+			ret.average_sort_time += s.average_sort_time;
+		}
+
+		if (num_active > 1)
+		{
+			ret.average_queue_time /= num_active;
+			ret.average_read_time /= num_active;
+			ret.average_write_time /= num_active;
+			ret.average_job_time /= num_active;
+			ret.average_sort_time /= num_active;
+		}
+
+		// pieces hashed by the hash threads are not included
+		// in the disk threads' hash times
+		ret.cumulative_hash_time += m_hash_thread.cumulative_hash_time();
+		boost::uint32_t hashed = m_hash_thread.num_hashed();
+		hash_time_sum += double(m_hash_thread.average_hash_time()) * hashed;
+		num_hashed += hashed;
+		if (num_hashed > 0) ret.average_hash_time = int(hash_time_sum / num_hashed);
+
+		return ret;
+	}
+
+	// aborts read operations
+	void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		disk_io_worker& w = worker_for(s.get(), l);
+		l.unlock();
+		w.stop(s);
+	}
+
+	disk_io_worker& disk_io_thread::worker_for(piece_manager* s
+		, mutex::scoped_lock& l)
+	{
+		TORRENT_ASSERT(s);
+		if (s->m_disk_worker < 0)
+		{
+			s->m_disk_worker = m_next_worker;
+			m_next_worker = (m_next_worker + 1) % m_num_threads;
+		}
+		TORRENT_ASSERT(s->m_disk_worker < int(m_workers.size()));
+		return *m_workers[s->m_disk_worker];
+	}
+
+	size_type disk_io_thread::queue_buffer_size() const
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		return m_queue_buffer_size;
+	}
+
+	int disk_io_thread::num_workers() const
+	{
+		mutex::scoped_lock l(m_queue_mutex);
+		return m_workers.size();
+	}
+
+	int disk_io_thread::add_job(disk_io_job& j
+		, boost::function<void(int, disk_io_job const&)> f)
+	{
+		if (f) j.callback.swap(f);
+
+		TORRENT_ASSERT(is_adding_thread());
+		TORRENT_ASSERT(j.storage
+			|| j.action == disk_io_job::abort_thread
+			|| j.action == disk_io_job::update_settings);
+		TORRENT_ASSERT(j.buffer_size <= m_block_size);
+
+		// this is the common case, a job for a storage that's already
+		// bound to a worker, and that doesn't affect the write queue.
+		// It's posted straight to the worker's queue without taking
+		// the queue mutex. Jobs are only added from the network thread,
+		// which is also the only thread modifying m_workers
+		if (j.storage && j.storage->m_disk_worker >= 0
+			&& j.action != disk_io_job::write
+			&& j.action != disk_io_job::update_settings)
+		{
+			TORRENT_ASSERT(j.storage->m_disk_worker < int(m_workers.size()));
+			m_workers[j.storage->m_disk_worker]->add_job(j);
+			// the queue size is only returned for write jobs
+			return 0;
+		}
+
+		mutex::scoped_lock l(m_queue_mutex);
+
+		if (j.action == disk_io_job::update_settings)
+		{
+			// every thread keeps its own copy of the settings, so
+			// this job is posted to all of them. This is also where
+			// more threads are started, if the settings asks for it
+			TORRENT_ASSERT(!j.callback);
+			session_settings const& s = *((session_settings*)j.buffer);
+			m_settings = s;
+			m_num_threads = (std::max)(s.disk_io_threads, 1);
+			bool unblocked = false;
+			for (std::map<boost::uint64_t, write_throttle>::iterator i = m_write_queues.begin()
+				, end(m_write_queues.end()); i != end; ++i)
+				unblocked |= set_write_queue_limits(i->second);
+			if (unblocked && m_queue_callback) m_ios.post(m_queue_callback);
+			m_hash_thread.set_num_threads(s.hashing_threads);
+			if (m_next_worker >= m_num_threads) m_next_worker = 0;
+			while (int(m_workers.size()) < m_num_threads)
+			{
+				++m_running_threads;
+				m_workers.push_back(boost::shared_ptr<disk_io_worker>(
+					new disk_io_worker(*this, m_workers.size())));
+			}
+			int ret = m_queue_buffer_size;
+			l.unlock();
+
+			for (std::vector<boost::shared_ptr<disk_io_worker> >::iterator i = m_workers.begin()
+				, end(m_workers.end()); i != end; ++i)
+			{
+				disk_io_job copy(j);
+				(*i)->add_job(copy);
+			}
+			return ret;
+		}
+
+		if (j.action == disk_io_job::write)
+		{
+			// until the drive of the storage is known, its
+			// writes are queued on the queue of device 0
+			piece_manager* s = j.storage.get();
+			if (s->m_write_queue == 0) s->m_write_queue = &write_queue_for(0, l);
+			s->m_write_queue->queue(j.buffer_size);
+			s->m_queued_write_bytes += j.buffer_size;
+			m_queue_buffer_size += j.buffer_size;
+		}
+		disk_io_worker& w = worker_for(j.storage.get(), l);
+		int ret = m_queue_buffer_size;
+		l.unlock();
+
+		// waking up the worker may take the queue mutex
+		w.add_job(j);
+		return ret;
+	}
+
+// ------- disk_io_worker ------
+
+	disk_io_worker::disk_io_worker(disk_io_thread& t, int index)
+		: m_io_thread(t)
+		, m_index(index)
+		, m_block_size(t.block_size())
+		, m_queue_mutex(t.m_queue_mutex)
+		, m_abort(false)
+		, m_queue(t.block_size())
+		, m_last_file_check(time_now_hires())
+		, m_num_hashed(0)
+		, m_cache_limit(m_settings.cache_size)
+		, m_physical_ram(0)
+		, m_ios(t.m_ios)
+		, m_file_pool(t.m_file_pool)
+		, m_disk_io_thread(boost::bind(&disk_io_worker::thread_fun, this))
+	{
+		// don't do anything in here. Essentially all members
+		// of this object are owned by the newly created thread.
+		// initialize stuff in thread_fun().
+	}
+
+	disk_io_worker::~disk_io_worker()
+	{
+		TORRENT_ASSERT(m_abort == true);
+	}
+
+	void disk_io_worker::abort()
+	{
+		// this job is moved to the front of the
+		// queue once the worker picks it up
+		disk_io_job j;
+		j.action = disk_io_job::abort_thread;
+		add_job(j);
+	}
+
+	void disk_io_worker::get_cache_info(sha1_hash const& ih, std::vector<cached_piece_info>& ret) const
+	{
+		mutex::scoped_lock l(m_piece_mutex);
+		ret.reserve(ret.size() + m_pieces.size());
 		for (cache_t::const_iterator i = m_pieces.begin()
 			, end(m_pieces.end()); i != end; ++i)
 		{
@@ -333,12 +734,83 @@ namespace libtorrent
 		}
 	}
 	
-	cache_status disk_io_thread::status() const
+	void disk_io_worker::set_cache_quota(piece_manager* s, int soft, int hard)
+	{
+		mutex::scoped_lock l(m_piece_mutex);
+		// re-apply the block count to update m_storages_over_quota
+		int blocks = s->m_cached_blocks;
+		add_cached_blocks(*s, -blocks);
+		s->m_cache_soft_quota = soft;
+		s->m_cache_hard_quota = hard;
+		add_cached_blocks(*s, blocks);
+		// the new hard quota is enforced as the storage
+		// adds more blocks to the cache
+	}
+
+	void disk_io_worker::get_torrent_cache_status(piece_manager const* s
+		, torrent_cache_status& st) const
 	{
 		mutex::scoped_lock l(m_piece_mutex);
-		m_cache_stats.total_used_buffers = in_use();
-		m_cache_stats.queued_bytes = m_queue_buffer_size;
+		st.cached_blocks = s->m_cached_blocks;
+		st.soft_quota = s->m_cache_soft_quota;
+		st.hard_quota = s->m_cache_hard_quota;
+		st.hits = s->m_cache_hits;
+		st.misses = s->m_cache_misses;
+	}
+
+	void disk_io_worker::add_cached_blocks(piece_manager& s, int n)
+	{
+		bool was_over = s.m_cache_soft_quota > 0 && s.m_cached_blocks > s.m_cache_soft_quota;
+		s.m_cached_blocks += n;
+		TORRENT_ASSERT(s.m_cached_blocks >= 0);
+		bool over = s.m_cache_soft_quota > 0 && s.m_cached_blocks > s.m_cache_soft_quota;
+		if (over == was_over) return;
+		if (over) m_storages_over_quota.insert(&s);
+		else m_storages_over_quota.erase(&s);
+	}
+
+	// evicts read pieces of the storage, and then flushes its write
+	// pieces, oldest first, until adding the given number of blocks
+	// won't take it past its hard quota. Returns false if it still would
+	bool disk_io_worker::enforce_hard_quota(piece_manager* s, int blocks
+		, int ignore, mutex::scoped_lock& l)
+	{
+		if (s->m_cache_hard_quota <= 0) return true;
+		int limit = s->m_cache_hard_quota - blocks;
+		if (s->m_cached_blocks <= limit) return true;
+
+		std::vector<char*> buffers;
+		for (cache_t::iterator i = m_read_pieces.first_of(s);
+			i != m_read_pieces.end() && s->m_cached_blocks > limit;)
+		{
+			cache_t::iterator next = cache_t::next_of(i);
+			if (i->piece != ignore)
+			{
+				drain_piece_bufs(*i, buffers, l);
+				m_read_pieces.erase(i);
+			}
+			i = next;
+		}
+		if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
+
+		// flush_range() writes the end of a piece together with the start
+		// of the following ones, and erases those it empties. They may be
+		// the next pieces of this storage, so no iterator is kept across
+		// it. Every piece is erased once flushed, which makes progress
+		while (s->m_cached_blocks > limit)
+		{
+			cache_t::iterator i = m_pieces.first_of(s);
+			if (i == m_pieces.end()) break;
+			if (i->num_blocks > 0) flush_range(*i, 0, INT_MAX, l);
+			if (i->num_blocks > 0) break;
+			m_pieces.erase(i);
+		}
+		return s->m_cached_blocks <= limit;
+	}
 
+	cache_status disk_io_worker::status() const
+	{
+		mutex::scoped_lock l(m_piece_mutex);
 		cache_status ret = m_cache_stats;
 
 		ret.average_queue_time = m_queue_time.mean();
@@ -347,48 +819,94 @@ namespace libtorrent
 		ret.average_hash_time = m_hash_time.mean();
 		ret.average_job_time = m_job_time.mean();
 		ret.average_sort_time = m_sort_time.mean();
-		ret.job_queue_length = m_jobs.size() + m_sorted_read_jobs.size();
-		ret.read_queue_size = m_sorted_read_jobs.size();
+		ret.job_queue_length = m_queue.size();
+		ret.read_queue_size = m_queue.num_reads();
 
 		return ret;
 	}
 
+	boost::uint32_t disk_io_worker::num_hashed() const
+	{
+		mutex::scoped_lock l(m_piece_mutex);
+		return m_num_hashed;
+	}
+
 	// aborts read operations
-	void disk_io_thread::stop(boost::intrusive_ptr<piece_manager> s)
+	void disk_io_worker::stop(boost::intrusive_ptr<piece_manager> s)
+	{
+		// read jobs are aborted, write and move jobs are syncronized.
+		// The queued jobs are owned by the worker thread, so they're
+		// cancelled by the abort_torrent job, which is moved to the
+		// front of the queue once the worker picks it up
+		disk_io_job j;
+		j.action = disk_io_job::abort_torrent;
+		j.storage = s;
+		add_job(j);
+	}
+
+	void disk_io_worker::add_job(disk_io_job& j)
 	{
+		TORRENT_ASSERT(!m_abort);
+		mpsc_queue<disk_io_job>::node* n = m_intake.allocate_swap(j);
+		n->value.start_time = time_now_hires();
+		if (!m_intake.push(n)) return;
+
+		// the worker is asleep and this is the first job posted
+		// since. Any jobs posted after this one, before the worker
+		// gets around to drain the queue, won't have to wake it up
 		mutex::scoped_lock l(m_queue_mutex);
-		// read jobs are aborted, write and move jobs are syncronized
-		for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
-			i != m_jobs.end();)
+		m_signal.signal(l);
+	}
+
+	void disk_io_worker::drain_intake()
+	{
+		m_intake.pop_all(m_new_jobs);
+
+		while (!m_new_jobs.empty())
 		{
-			if (i->storage != s)
-			{
-				++i;
-				continue;
-			}
-			if (should_cancel_on_abort(*i))
+			disk_io_job& j = m_new_jobs.front();
+
+			// peer reads that can be fully satisfied by the read cache
+			// are run first. The others are sorted by where they are
+			// on the drive, if we're allowed to reorder them
+			size_type sort_key = -1;
+			if (disk_job_queue::job_class(j) == disk_job_queue::read_class
+				&& is_read_operation(j))
 			{
-				if (i->action == disk_io_job::write)
+				bool hit = false;
+				if (m_settings.use_read_cache)
 				{
-					TORRENT_ASSERT(m_queue_buffer_size >= i->buffer_size);
-					m_queue_buffer_size -= i->buffer_size;
+					mutex::scoped_lock l(m_piece_mutex);
+					cache_t::iterator p = find_cached_piece(m_read_pieces, j, l);
+					hit = p != m_read_pieces.end() && is_cache_hit(*p, j, l);
+				}
+
+				if (m_settings.use_disk_read_ahead && !hit && !m_settings.direct_io)
+					j.storage->hint_read_impl(j.piece, j.offset, j.buffer_size);
+
+				TORRENT_ASSERT(j.offset >= 0);
+				if (m_settings.allow_reordered_disk_operations && !hit)
+				{
+#ifdef TORRENT_DISK_STATS
+					m_log << log_time() << " sorting_job" << std::endl;
+#endif
+					ptime sort_start = time_now_hires();
+					sort_key = j.storage->physical_offset(j.piece, j.offset);
+					ptime now = time_now_hires();
+					m_sort_time.add_sample(total_microseconds(now - sort_start));
+					m_cache_stats.cumulative_sort_time += total_milliseconds(now - sort_start);
 				}
-				post_callback(i->callback, *i, -3);
-				i = m_jobs.erase(i);
-				continue;
 			}
-			++i;
+
+			m_queue.push(j, sort_key);
+			m_new_jobs.pop_front();
 		}
-		disk_io_job j;
-		j.action = disk_io_job::abort_torrent;
-		j.storage = s;
-		add_job(j, l);
 	}
 
 	struct update_last_use
 	{
 		update_last_use(int exp): expire(exp) {}
-		void operator()(disk_io_thread::cached_piece_entry& p)
+		void operator()(disk_io_worker::cached_piece_entry& p)
 		{
 			TORRENT_ASSERT(p.storage);
 			p.expire = time_now() + seconds(expire);
@@ -396,18 +914,90 @@ namespace libtorrent
 		int expire;
 	};
 
-	disk_io_thread::cache_piece_index_t::iterator disk_io_thread::find_cached_piece(
-		disk_io_thread::cache_t& cache
+	disk_io_worker::cache_t::iterator disk_io_worker::find_cached_piece(
+		disk_io_worker::cache_t& cache
 		, disk_io_job const& j, mutex::scoped_lock& l)
 	{
-		cache_piece_index_t& idx = cache.get<0>();
-		cache_piece_index_t::iterator i
-			= idx.find(std::pair<void*, int>(j.storage.get(), j.piece));
-		TORRENT_ASSERT(i == idx.end() || (i->storage == j.storage && i->piece == j.piece));
+		cache_t::iterator i = cache.find(j.storage.get(), j.piece);
+		TORRENT_ASSERT(i == cache.end() || (i->storage == j.storage && i->piece == j.piece));
 		return i;
 	}
 	
-	void disk_io_thread::flush_expired_pieces()
+	disk_io_worker::cache_t::iterator disk_io_worker::insert_read_piece(
+		cached_piece_entry const& pe, mutex::scoped_lock& l)
+	{
+		bool probation = false;
+		if (m_settings.read_cache_algorithm == session_settings::read_cache_2q)
+		{
+			// a piece that was evicted from the probationary segment
+			// not long ago and is read again goes straight into the
+			// protected segment
+			if (m_read_pieces.remove_ghost(pe.storage.get(), pe.piece))
+				++m_cache_stats.ghost_hits;
+			else
+				probation = true;
+		}
+		return m_read_pieces.insert(pe, probation);
+	}
+
+	namespace
+	{
+		// the key of a piece in the read frequency sketch
+		boost::uint32_t piece_key(void const* storage, int piece)
+		{
+			boost::uint64_t p = boost::uint64_t(std::size_t(storage));
+			boost::uint32_t h = boost::uint32_t(p >> 4) ^ boost::uint32_t(p >> 36);
+			return h * 31 + boost::uint32_t(piece);
+		}
+	}
+
+	// returns true if the piece of the read job may evict the next read
+	// cache victim, i.e. if it has been requested more often recently
+	bool disk_io_worker::admit_read_piece(disk_io_job const& j, mutex::scoped_lock& l)
+	{
+		if (!m_settings.read_cache_admission_filter) return true;
+
+		cache_t::iterator victim = read_cache_victim();
+		// if there's nothing to evict from the read cache, the space
+		// is taken by the write cache, and will be freed by flushing
+		if (victim == m_read_pieces.end()) return true;
+
+		if (m_read_frequency.estimate(piece_key(j.storage.get(), j.piece))
+			> m_read_frequency.estimate(piece_key(victim->storage.get(), victim->piece)))
+			return true;
+		++m_cache_stats.admission_rejects;
+		return false;
+	}
+
+	// returns the read cache piece to evict blocks from next
+	disk_io_worker::cache_t::iterator disk_io_worker::read_cache_victim()
+	{
+		// storages over their soft quota are evicted from first. Those
+		// that only have blocks in the write cache are skipped
+		for (std::set<piece_manager const*>::const_iterator s
+			= m_storages_over_quota.begin(), end(m_storages_over_quota.end());
+			s != end; ++s)
+		{
+			cache_t::iterator i = m_read_pieces.first_of(*s);
+			if (i != m_read_pieces.end()) return i;
+		}
+
+		if (m_settings.read_cache_algorithm != session_settings::read_cache_2q)
+			return m_read_pieces.begin();
+
+		// keep the probationary segment down to a quarter
+		// of the pieces, and evict from the protected
+		// segment once it's smaller than that
+		cache_t::iterator i = m_read_pieces.oldest_probation();
+		if (i != m_read_pieces.end()
+			&& m_read_pieces.num_probation() * 4 > m_read_pieces.size())
+			return i;
+		i = m_read_pieces.oldest_protected();
+		if (i != m_read_pieces.end()) return i;
+		return m_read_pieces.begin();
+	}
+
+	void disk_io_worker::flush_expired_pieces()
 	{
 		ptime now = time_now();
 
@@ -415,13 +1005,12 @@ namespace libtorrent
 
 		INVARIANT_CHECK;
 		// flush write cache
-		cache_lru_index_t& widx = m_pieces.get<1>();
-		cache_lru_index_t::iterator i = widx.begin();
+		cache_t::iterator i = m_pieces.begin();
 		time_duration cut_off = seconds(m_settings.cache_expiry);
-		while (i != widx.end() && now - i->expire > cut_off)
+		while (i != m_pieces.end() && now - i->expire > cut_off)
 		{
 			TORRENT_ASSERT(i->storage);
-			flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+			flush_range(*i, 0, INT_MAX, l);
 			TORRENT_ASSERT(i->num_blocks == 0);
 
 			// we want to keep the piece in here to have an accurate
@@ -437,7 +1026,7 @@ namespace libtorrent
 				erase = i->next_block_to_hash == blocks_in_piece;
 			}
 
-			if (erase) widx.erase(i++);
+			if (erase) i = m_pieces.erase(i);
 			else ++i;
 		}
 
@@ -445,17 +1034,24 @@ namespace libtorrent
 
 		// flush read cache
 		std::vector<char*> bufs;
-		cache_lru_index_t& ridx = m_read_pieces.get<1>();
-		i = ridx.begin();
-		while (i != ridx.end() && now - i->expire > cut_off)
+		i = m_read_pieces.begin();
+		while (i != m_read_pieces.end() && now - i->expire > cut_off)
+		{
+			drain_piece_bufs(*i, bufs, l);
+			i = m_read_pieces.erase(i);
+		}
+		// with the 2Q policy, the list starts with the probationary
+		// segment. The protected segment is in LRU order on its own
+		i = m_read_pieces.oldest_protected();
+		while (i != m_read_pieces.end() && now - i->expire > cut_off)
 		{
-			drain_piece_bufs(const_cast<cached_piece_entry&>(*i), bufs, l);
-			ridx.erase(i++);
+			drain_piece_bufs(*i, bufs, l);
+			i = m_read_pieces.erase(i);
 		}
-		if (!bufs.empty()) free_multiple_buffers(&bufs[0], bufs.size());
+		if (!bufs.empty()) m_io_thread.free_multiple_buffers(&bufs[0], bufs.size());
 	}
 
-	int disk_io_thread::drain_piece_bufs(cached_piece_entry& p, std::vector<char*>& buf
+	int disk_io_worker::drain_piece_bufs(cached_piece_entry& p, std::vector<char*>& buf
 		, mutex::scoped_lock& l)
 	{
 		int piece_size = p.storage->info()->piece_size(p.piece);
@@ -471,12 +1067,13 @@ namespace libtorrent
 			--p.num_blocks;
 			--m_cache_stats.cache_size;
 			--m_cache_stats.read_cache_size;
+			add_cached_blocks(*p.storage, -1);
 		}
 		return ret;
 	}
 
 	// returns the number of blocks that were freed
-	int disk_io_thread::free_piece(cached_piece_entry& p, mutex::scoped_lock& l)
+	int disk_io_worker::free_piece(cached_piece_entry& p, mutex::scoped_lock& l)
 	{
 		int piece_size = p.storage->info()->piece_size(p.piece);
 		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
@@ -494,25 +1091,25 @@ namespace libtorrent
 			--p.num_blocks;
 			--m_cache_stats.cache_size;
 			--m_cache_stats.read_cache_size;
+			add_cached_blocks(*p.storage, -1);
 		}
-		if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+		if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
 		return ret;
 	}
 
 	// returns the number of blocks that were freed
-	int disk_io_thread::clear_oldest_read_piece(
+	int disk_io_worker::clear_oldest_read_piece(
 		int num_blocks, int ignore, mutex::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
 
-		cache_lru_index_t& idx = m_read_pieces.get<1>();
-		if (idx.empty()) return 0;
+		if (m_read_pieces.empty()) return 0;
 
-		cache_lru_index_t::iterator i = idx.begin();
+		cache_t::iterator i = read_cache_victim();
 		if (i->piece == ignore)
 		{
 			++i;
-			if (i == idx.end()) return 0;
+			if (i == m_read_pieces.end()) return 0;
 		}
 
 		// don't replace an entry that hasn't expired yet
@@ -524,7 +1121,7 @@ namespace libtorrent
 		std::vector<char*> buffers;
 		if (num_blocks >= i->num_blocks)
 		{
-			blocks = drain_piece_bufs(const_cast<cached_piece_entry&>(*i), buffers, l);
+			blocks = drain_piece_bufs(*i, buffers, l);
 		}
 		else
 		{
@@ -545,9 +1142,10 @@ namespace libtorrent
 					buffers.push_back(i->blocks[start].buf);
 					i->blocks[start].buf = 0;
 					++blocks;
-					--const_cast<cached_piece_entry&>(*i).num_blocks;
+					--i->num_blocks;
 					--m_cache_stats.cache_size;
 					--m_cache_stats.read_cache_size;
+					add_cached_blocks(*i->storage, -1);
 					--num_blocks;
 					if (!num_blocks) break;
 				}
@@ -557,19 +1155,27 @@ namespace libtorrent
 				buffers.push_back(i->blocks[end].buf);
 				i->blocks[end].buf = 0;
 				++blocks;
-				--const_cast<cached_piece_entry&>(*i).num_blocks;
+				--i->num_blocks;
 				--m_cache_stats.cache_size;
 				--m_cache_stats.read_cache_size;
+				add_cached_blocks(*i->storage, -1);
 				--num_blocks;
 			}
 		}
-		if (i->num_blocks == 0) idx.erase(i);
+		if (i->num_blocks == 0)
+		{
+			// pieces evicted from the probationary segment are
+			// remembered, if they're requested again soon they
+			// go into the protected segment
+			if (i->probation) m_read_pieces.add_ghost(i->storage.get(), i->piece);
+			m_read_pieces.erase(i);
+		}
 
-		if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+		if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
 		return blocks;
 	}
 
-	int contiguous_blocks(disk_io_thread::cached_piece_entry const& b)
+	int contiguous_blocks(disk_io_worker::cached_piece_entry const& b)
 	{
 		int ret = 0;
 		int current = 0;
@@ -587,7 +1193,7 @@ namespace libtorrent
 		return ret;
 	}
 
-	int disk_io_thread::flush_contiguous_blocks(cached_piece_entry& p
+	int disk_io_worker::flush_contiguous_blocks(cached_piece_entry& p
 		, mutex::scoped_lock& l, int lower_limit)
 	{
 		// first find the largest range of contiguous  blocks
@@ -622,14 +1228,14 @@ namespace libtorrent
 		return len;
 	}
 
-	bool cmp_contiguous(disk_io_thread::cached_piece_entry const& lhs
-		, disk_io_thread::cached_piece_entry const& rhs)
+	bool cmp_contiguous(disk_io_worker::cached_piece_entry const& lhs
+		, disk_io_worker::cached_piece_entry const& rhs)
 	{
 		return lhs.num_contiguous_blocks < rhs.num_contiguous_blocks;
 	}
 
 	// flushes 'blocks' blocks from the cache
-	int disk_io_thread::flush_cache_blocks(mutex::scoped_lock& l
+	int disk_io_worker::flush_cache_blocks(mutex::scoped_lock& l
 		, int blocks, int ignore, int options)
 	{
 		// first look if there are any read cache entries that can
@@ -651,37 +1257,38 @@ namespace libtorrent
 
 		if (m_settings.disk_cache_algorithm == session_settings::lru)
 		{
-			cache_lru_index_t& idx = m_pieces.get<1>();
 			while (blocks > 0)
 			{
-				cache_lru_index_t::iterator i = idx.begin();
-				if (i == idx.end()) return ret;
-				tmp = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
-				idx.erase(i);
+				cache_t::iterator i = m_pieces.begin();
+				if (i == m_pieces.end()) return ret;
+				tmp = flush_range(*i, 0, INT_MAX, l);
+				m_pieces.erase(i);
 				blocks -= tmp;
 				ret += tmp;
 			}
 		}
 		else if (m_settings.disk_cache_algorithm == session_settings::largest_contiguous)
 		{
-			cache_lru_index_t& idx = m_pieces.get<1>();
 			while (blocks > 0)
 			{
-				cache_lru_index_t::iterator i = std::max_element(idx.begin(), idx.end(), &cmp_contiguous);
-				if (i == idx.end()) return ret;
-				tmp = flush_contiguous_blocks(const_cast<cached_piece_entry&>(*i), l);
-				if (i->num_blocks == 0) idx.erase(i);
+				cache_t::iterator i = std::max_element(m_pieces.begin(), m_pieces.end(), &cmp_contiguous);
+				if (i == m_pieces.end()) return ret;
+				tmp = flush_contiguous_blocks(*i, l);
+				if (i->num_blocks == 0) m_pieces.erase(i);
 				blocks -= tmp;
 				ret += tmp;
 			}
 		}
 		else if (m_settings.disk_cache_algorithm == session_settings::avoid_readback)
 		{
-			cache_lru_index_t& idx = m_pieces.get<1>();
-			for (cache_lru_index_t::iterator i = idx.begin(); i != idx.end(); ++i)
+			for (cache_t::iterator i = m_pieces.begin(); i != m_pieces.end();)
 			{
-				cached_piece_entry& p = const_cast<cached_piece_entry&>(*i);
-				if (!i->blocks[i->next_block_to_hash].buf) continue;
+				cached_piece_entry& p = *i;
+				if (!i->blocks[i->next_block_to_hash].buf)
+				{
+					++i;
+					continue;
+				}
 				int piece_size = i->storage->info()->piece_size(i->piece);
 				int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
 				int start = i->next_block_to_hash;
@@ -690,7 +1297,9 @@ namespace libtorrent
 				tmp = flush_range(p, start, end, l);
 				p.num_contiguous_blocks = contiguous_blocks(p);
 				if (i->num_blocks == 0 && i->next_block_to_hash == blocks_in_piece)
-					idx.erase(i);
+					i = m_pieces.erase(i);
+				else
+					++i;
 				blocks -= tmp;
 				ret += tmp;
 				if (blocks <= 0) break;
@@ -700,13 +1309,13 @@ namespace libtorrent
 			// regardless of if we'll have to read them back later
 			while (blocks > 0)
 			{
-				cache_lru_index_t::iterator i = std::max_element(idx.begin(), idx.end(), &cmp_contiguous);
-				if (i == idx.end() || i->num_blocks == 0) return ret;
-				tmp = flush_contiguous_blocks(const_cast<cached_piece_entry&>(*i), l);
+				cache_t::iterator i = std::max_element(m_pieces.begin(), m_pieces.end(), &cmp_contiguous);
+				if (i == m_pieces.end() || i->num_blocks == 0) return ret;
+				tmp = flush_contiguous_blocks(*i, l);
 				// at this point, we will for sure need a read-back for
 				// this piece anyway. We might as well save some time looping
 				// over the disk cache by deleting the entry
-				if (i->num_blocks == 0) idx.erase(i);
+				if (i->num_blocks == 0) m_pieces.erase(i);
 				blocks -= tmp;
 				ret += tmp;
 			}
@@ -714,7 +1323,71 @@ namespace libtorrent
 		return ret;
 	}
 
-	int disk_io_thread::flush_range(cached_piece_entry& p
+	namespace
+	{
+		// the most buffers handed to a single vectored write. writev()
+		// fails with more than IOV_MAX of them, which is 1024 on linux
+		enum { max_write_buffers = 1024 };
+	}
+
+	int disk_io_worker::take_following_blocks(cached_piece_entry const& p
+		, file::iovec_t* iov, int max_blocks
+		, std::vector<std::pair<cache_t::iterator, int> >& span)
+	{
+		piece_manager* s = p.storage.get();
+		int num_pieces = s->info()->num_pieces();
+		int ret = 0;
+		for (int piece = p.piece + 1; ret < max_blocks && piece < num_pieces; ++piece)
+		{
+			cache_t::iterator i = m_pieces.find(s, piece);
+			if (i == m_pieces.end()) break;
+
+			int piece_size = s->info()->piece_size(piece);
+			int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
+			int n = 0;
+			for (; n < blocks_in_piece && ret < max_blocks && i->blocks[n].buf; ++n, ++ret)
+			{
+				iov[ret].iov_base = i->blocks[n].buf;
+				iov[ret].iov_len = (std::min)(piece_size - n * m_block_size, m_block_size);
+				TORRENT_ASSERT(i->num_blocks > 0);
+				--i->num_blocks;
+				++m_cache_stats.blocks_written;
+				--m_cache_stats.cache_size;
+				add_cached_blocks(*s, -1);
+				if (n == i->next_block_to_hash) ++i->next_block_to_hash;
+			}
+			if (n == 0) break;
+			span.push_back(std::make_pair(i, n));
+			// the run only continues into the next piece if
+			// this one is complete
+			if (n < blocks_in_piece) break;
+		}
+		return ret;
+	}
+
+	int disk_io_worker::post_flushed_blocks(cached_piece_entry& p
+		, int start, int end, disk_io_job& j)
+	{
+		int piece_size = p.storage->info()->piece_size(p.piece);
+		j.piece = p.piece;
+		int ret = 0;
+		std::vector<char*> buffers;
+		for (int i = start; i < end; ++i)
+		{
+			if (p.blocks[i].buf == 0) continue;
+			j.buffer_size = (std::min)(piece_size - i * m_block_size, m_block_size);
+			int result = j.error ? -1 : j.buffer_size;
+			j.offset = i * m_block_size;
+			buffers.push_back(p.blocks[i].buf);
+			post_callback(p.blocks[i].callback, j, result);
+			p.blocks[i].buf = 0;
+			++ret;
+		}
+		if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
+		return ret;
+	}
+
+	int disk_io_worker::flush_range(cached_piece_entry& p
 		, int start, int end, mutex::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
@@ -731,11 +1404,23 @@ namespace libtorrent
 		int buffer_size = 0;
 		int offset = 0;
 
+		// the run of blocks at the end of the piece is written together
+		// with the blocks at the start of the pieces following it, up to
+		// this many blocks in total
+		int max_span = (std::min)(m_settings.max_coalesced_write_size / m_block_size
+			, int(max_write_buffers));
+		// the blocks taken from the following pieces, and how many
+		// were taken from each
+		std::vector<std::pair<cache_t::iterator, int> > span;
+
 		boost::scoped_array<char> buf;
 		file::iovec_t* iov = 0;
 		int iov_counter = 0;
-		if (m_settings.coalesce_writes) buf.reset(new (std::nothrow) char[piece_size]);
-		else iov = TORRENT_ALLOCA(file::iovec_t, blocks_in_piece);
+		// in direct I/O mode the cache blocks are already aligned, copying
+		// them into a heap buffer would make every write unaligned
+		if (m_settings.coalesce_writes && !m_settings.direct_io)
+			buf.reset(new (std::nothrow) char[piece_size]);
+		else iov = TORRENT_ALLOCA(file::iovec_t, (std::max)(blocks_in_piece, max_span));
 
 		end = (std::min)(end, blocks_in_piece);
 		int num_write_calls = 0;
@@ -747,18 +1432,24 @@ namespace libtorrent
 				if (buffer_size == 0) continue;
 			
 				TORRENT_ASSERT(buffer_size <= i * m_block_size);
+				int following = 0;
+				if (iov && i == blocks_in_piece && iov_counter < max_span)
+				{
+					following = take_following_blocks(p, iov + iov_counter
+						, max_span - iov_counter, span);
+				}
 				l.unlock();
 				if (iov)
 				{
-					int ret = p.storage->write_impl(iov, p.piece, (std::min)(
-						i * m_block_size, piece_size) - buffer_size, iov_counter);
+					int ret = p.storage->write_span_impl(iov, p.piece, (std::min)(
+						i * m_block_size, piece_size) - buffer_size, iov_counter + following);
 					iov_counter = 0;
 					if (ret > 0) ++num_write_calls;
 				}
 				else
 				{
 					TORRENT_ASSERT(buf);
-					file::iovec_t b = { buf.get(), buffer_size };
+					file::iovec_t b = { buf.get(), size_t(buffer_size) };
 					int ret = p.storage->write_impl(&b, p.piece, (std::min)(
 						i * m_block_size, piece_size) - buffer_size, 1);
 					if (ret > 0) ++num_write_calls;
@@ -792,32 +1483,36 @@ namespace libtorrent
 			--p.num_blocks;
 			++m_cache_stats.blocks_written;
 			--m_cache_stats.cache_size;
+			add_cached_blocks(*p.storage, -1);
 			if (i == p.next_block_to_hash) ++p.next_block_to_hash;
 		}
 
 		ptime done = time_now_hires();
 
-		int ret = 0;
 		disk_io_job j;
 		j.storage = p.storage;
 		j.action = disk_io_job::write;
 		j.buffer = 0;
 		j.piece = p.piece;
 		test_error(j);
-		std::vector<char*> buffers;
-		for (int i = start; i < end; ++i)
+		int ret = post_flushed_blocks(p, start, end, j);
+
+		for (std::vector<std::pair<cache_t::iterator, int> >::iterator k = span.begin()
+			, span_end(span.end()); k != span_end; ++k)
 		{
-			if (p.blocks[i].buf == 0) continue;
-			j.buffer_size = (std::min)(piece_size - i * m_block_size, m_block_size);
-			int result = j.error ? -1 : j.buffer_size;
-			j.offset = i * m_block_size;
-			buffers.push_back(p.blocks[i].buf);
-			post_callback(p.blocks[i].callback, j, result);
-			p.blocks[i].callback.clear();
-			p.blocks[i].buf = 0;
-			++ret;
+			cached_piece_entry& f = *k->first;
+			ret += post_flushed_blocks(f, 0, k->second, j);
+			int blocks = (f.storage->info()->piece_size(f.piece) + m_block_size - 1)
+				/ m_block_size;
+			// in avoid_readback mode, the piece is kept to have an
+			// accurate next_block_to_hash (see flush_expired_pieces())
+			if (f.num_blocks == 0
+				&& (m_settings.disk_cache_algorithm != session_settings::avoid_readback
+				|| f.next_block_to_hash == blocks))
+				m_pieces.erase(k->first);
+			else
+				f.num_contiguous_blocks = contiguous_blocks(f);
 		}
-		if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
 
 		if (num_write_calls > 0)
 		{
@@ -836,7 +1531,7 @@ namespace libtorrent
 	}
 
 	// returns -1 on failure
-	int disk_io_thread::cache_block(disk_io_job& j
+	int disk_io_worker::cache_block(disk_io_job& j
 		, boost::function<void(int,disk_io_job const&)>& handler
 		, int cache_expire
 		, mutex::scoped_lock& l)
@@ -854,7 +1549,7 @@ namespace libtorrent
 		if (blocks_in_piece <= 1) return -1;
 
 #ifdef TORRENT_DISK_STATS
-		rename_buffer(j.buffer, "write cache");
+		m_io_thread.rename_buffer(j.buffer, "write cache");
 #endif
 
 		p.piece = j.piece;
@@ -869,16 +1564,22 @@ namespace libtorrent
 //		std::cerr << " adding cache entry for p: " << j.piece << " block: " << block << " cached_blocks: " << m_cache_stats.cache_size << std::endl;
 		p.blocks[block].buf = j.buffer;
 		p.blocks[block].callback.swap(handler);
-		++m_cache_stats.cache_size;
-		cache_lru_index_t& idx = m_pieces.get<1>();
 		TORRENT_ASSERT(p.storage);
-		idx.insert(p);
+		if (m_pieces.insert(p) == m_pieces.end())
+		{
+			// hand the callback back to the caller, it will
+			// write the block to disk directly
+			p.blocks[block].callback.swap(handler);
+			return -1;
+		}
+		++m_cache_stats.cache_size;
+		add_cached_blocks(*p.storage, 1);
 		return 0;
 	}
 
 	// fills a piece with data from disk, returns the total number of bytes
 	// read or -1 if there was an error
-	int disk_io_thread::read_into_piece(cached_piece_entry& p, int start_block
+	int disk_io_worker::read_into_piece(cached_piece_entry& p, int start_block
 		, int options, int num_blocks, mutex::scoped_lock& l)
 	{
 		TORRENT_ASSERT(num_blocks > 0);
@@ -898,7 +1599,7 @@ namespace libtorrent
 		boost::scoped_array<char> buf;
 		for (int i = start_block; i < blocks_in_piece
 			&& ((options & ignore_cache_size)
-				|| in_use() < m_settings.cache_size); ++i)
+				|| m_cache_stats.cache_size < m_cache_limit); ++i)
 		{
 			int block_size = (std::min)(piece_size - piece_offset, m_block_size);
 			TORRENT_ASSERT(piece_offset <= piece_size);
@@ -907,12 +1608,13 @@ namespace libtorrent
 			// free it and allocate a new one
 			if (p.blocks[i].buf)
 			{
-				free_buffer(p.blocks[i].buf);
+				m_io_thread.free_buffer(p.blocks[i].buf);
 				--p.num_blocks;
 				--m_cache_stats.cache_size;
 				--m_cache_stats.read_cache_size;
+				add_cached_blocks(*p.storage, -1);
 			}
-			p.blocks[i].buf = allocate_buffer("read cache");
+			p.blocks[i].buf = m_io_thread.allocate_buffer("read cache");
 
 			// the allocation failed, break
 			if (p.blocks[i].buf == 0)
@@ -923,6 +1625,7 @@ namespace libtorrent
 			++p.num_blocks;
 			++m_cache_stats.cache_size;
 			++m_cache_stats.read_cache_size;
+			add_cached_blocks(*p.storage, 1);
 			++end_block;
 			++num_read;
 			iov[iov_counter].iov_base = p.blocks[i].buf;
@@ -950,7 +1653,7 @@ namespace libtorrent
 		TORRENT_ASSERT(buffer_size <= piece_size);
 		TORRENT_ASSERT(buffer_size + start_block * m_block_size <= piece_size);
 
-		if (m_settings.coalesce_reads)
+		if (m_settings.coalesce_reads && !m_settings.direct_io)
 			buf.reset(new (std::nothrow) char[buffer_size]);
 
 		if (buf)
@@ -1013,7 +1716,7 @@ namespace libtorrent
 
 	// returns -1 on read error, -2 if there isn't any space in the cache
 	// or the number of bytes read
-	int disk_io_thread::cache_read_block(disk_io_job const& j, mutex::scoped_lock& l)
+	int disk_io_worker::cache_read_block(disk_io_job const& j, mutex::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
 
@@ -1021,8 +1724,7 @@ namespace libtorrent
 
 		// this function will create a new cached_piece_entry
 		// and requires that it doesn't already exist
-		cache_piece_index_t& idx = m_read_pieces.get<0>();
-		TORRENT_ASSERT(find_cached_piece(m_read_pieces, j, l) == idx.end());
+		TORRENT_ASSERT(find_cached_piece(m_read_pieces, j, l) == m_read_pieces.end());
 
 		int piece_size = j.storage->info()->piece_size(j.piece);
 		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
@@ -1030,14 +1732,25 @@ namespace libtorrent
 		int start_block = j.offset / m_block_size;
 
 		int blocks_to_read = blocks_in_piece - start_block;
-		blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
-			+ m_cache_stats.read_cache_size - in_use())/2, 3));
+		blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_cache_limit
+			+ m_cache_stats.read_cache_size - m_cache_stats.cache_size)/2, 3));
 		blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
 		if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
 
-		if (in_use() + blocks_to_read > m_settings.cache_size)
+		// if the torrent can't make room within its hard quota, the
+		// piece is read straight into the job's buffer instead
+		if (j.storage->m_cache_hard_quota > 0)
+			blocks_to_read = (std::min)(blocks_to_read, j.storage->m_cache_hard_quota);
+		if (!enforce_hard_quota(j.storage.get(), blocks_to_read, j.piece, l))
+			return -2;
+
+		if (m_cache_stats.cache_size + blocks_to_read > m_cache_limit)
 		{
-			int clear = in_use() + blocks_to_read - m_settings.cache_size;
+			// the piece is read straight into the job's buffer
+			// instead, without touching the read cache
+			if (!admit_read_piece(j, l)) return -2;
+
+			int clear = m_cache_stats.cache_size + blocks_to_read - m_cache_limit;
 			if (flush_cache_blocks(l, clear, j.piece, dont_flush_write_blocks) < clear)
 				return -2;
 		}
@@ -1055,18 +1768,21 @@ namespace libtorrent
 		int ret = read_into_piece(p, start_block, 0, blocks_to_read, l);
 
 		TORRENT_ASSERT(p.storage);
-		if (ret >= 0) idx.insert(p);
+		if (ret >= 0 && insert_read_piece(p, l) == m_read_pieces.end())
+		{
+			free_piece(p, l);
+			return -2;
+		}
 
 		return ret;
 	}
 
 #ifdef TORRENT_DEBUG
-	void disk_io_thread::check_invariant() const
+	void disk_io_worker::check_invariant() const
 	{
 		int cached_write_blocks = 0;
-		cache_piece_index_t const& idx = m_pieces.get<0>();
-		for (cache_piece_index_t::const_iterator i = idx.begin()
-			, end(idx.end()); i != end; ++i)
+		for (cache_t::const_iterator i = m_pieces.begin()
+			, end(m_pieces.end()); i != end; ++i)
 		{
 			cached_piece_entry const& p = *i;
 			TORRENT_ASSERT(p.blocks);
@@ -1081,7 +1797,7 @@ namespace libtorrent
 				if (p.blocks[k].buf)
 				{
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
-					TORRENT_ASSERT(is_disk_buffer(p.blocks[k].buf));
+					TORRENT_ASSERT(m_io_thread.is_disk_buffer(p.blocks[k].buf));
 #endif
 					++blocks;
 				}
@@ -1105,7 +1821,7 @@ namespace libtorrent
 				if (p.blocks[k].buf)
 				{
 #ifndef TORRENT_DISABLE_POOL_ALLOCATOR
-					TORRENT_ASSERT(is_disk_buffer(p.blocks[k].buf));
+					TORRENT_ASSERT(m_io_thread.is_disk_buffer(p.blocks[k].buf));
 #endif
 					++blocks;
 				}
@@ -1118,29 +1834,33 @@ namespace libtorrent
 		TORRENT_ASSERT(cached_read_blocks + cached_write_blocks == m_cache_stats.cache_size);
 
 #ifdef TORRENT_DISK_STATS
-		int read_allocs = m_categories.find(std::string("read cache"))->second;
-		int write_allocs = m_categories.find(std::string("write cache"))->second;
-		TORRENT_ASSERT(cached_read_blocks == read_allocs);
-		TORRENT_ASSERT(cached_write_blocks == write_allocs);
+		// the buffer categories are counted for the whole pool,
+		// they only match our cache if we're the only thread
+		if (m_io_thread.m_workers.size() == 1)
+		{
+			int read_allocs = m_io_thread.m_categories.find(std::string("read cache"))->second;
+			int write_allocs = m_io_thread.m_categories.find(std::string("write cache"))->second;
+			TORRENT_ASSERT(cached_read_blocks == read_allocs);
+			TORRENT_ASSERT(cached_write_blocks == write_allocs);
+		}
 #endif
 
 		// when writing, there may be a one block difference, right before an old piece
 		// is flushed
-		TORRENT_ASSERT(m_cache_stats.cache_size <= m_settings.cache_size + 1);
+		TORRENT_ASSERT(m_cache_stats.cache_size <= m_cache_limit + 1);
 	}
 #endif
 
 	// reads the full piece specified by j into the read cache
 	// returns the iterator to it and whether or not it already
 	// was in the cache (hit).
-	int disk_io_thread::cache_piece(disk_io_job const& j, cache_piece_index_t::iterator& p
+	int disk_io_worker::cache_piece(disk_io_job const& j, cache_t::iterator& p
 		, bool& hit, int options, mutex::scoped_lock& l)
 	{
 		INVARIANT_CHECK;
 
 		TORRENT_ASSERT(j.cache_min_time >= 0);
 
-		cache_piece_index_t& idx = m_read_pieces.get<0>();
 		p = find_cached_piece(m_read_pieces, j, l);
 
 		hit = true;
@@ -1153,11 +1873,10 @@ namespace libtorrent
 		{
 			INVARIANT_CHECK;
 			// we have the piece in the cache, but not all of the blocks
-			ret = read_into_piece(const_cast<cached_piece_entry&>(*p), 0
-				, options, blocks_in_piece, l);
+			ret = read_into_piece(*p, 0, options, blocks_in_piece, l);
 			hit = false;
 			if (ret < 0) return ret;
-			idx.modify(p, update_last_use(j.cache_min_time));
+			m_read_pieces.modify(p, update_last_use(j.cache_min_time));
 		}
 		else if (p == m_read_pieces.end())
 		{
@@ -1180,11 +1899,16 @@ namespace libtorrent
 			hit = false;
 			if (ret < 0) return ret;
 			TORRENT_ASSERT(pe.storage);
-			p = idx.insert(pe).first;
+			p = insert_read_piece(pe, l);
+			if (p == m_read_pieces.end())
+			{
+				free_piece(pe, l);
+				return -1;
+			}
 		}
 		else
 		{
-			idx.modify(p, update_last_use(j.cache_min_time));
+			m_read_pieces.modify(p, update_last_use(j.cache_min_time));
 		}
 		TORRENT_ASSERT(!m_read_pieces.empty());
 		TORRENT_ASSERT(p->piece == j.piece);
@@ -1193,7 +1917,11 @@ namespace libtorrent
 	}
 
 	// cache the entire piece and hash it
-	int disk_io_thread::read_piece_from_cache_and_hash(disk_io_job const& j, sha1_hash& h)
+	// if hj is set, the blocks of the piece are not hashed here. Instead
+	// they are referenced and added to hj->bufs, to be hashed by a
+	// hash thread. The references are released once they are hashed
+	int disk_io_worker::read_piece_from_cache_and_hash(disk_io_job& j, sha1_hash& h
+		, hash_thread::job* hj)
 	{
 		TORRENT_ASSERT(j.buffer);
 
@@ -1201,7 +1929,7 @@ namespace libtorrent
 
 		mutex::scoped_lock l(m_piece_mutex);
 	
-		cache_piece_index_t::iterator p;
+		cache_t::iterator p;
 		bool hit;
 		int ret = cache_piece(j, p, hit, ignore_cache_size, l);
 		if (ret < 0) return ret;
@@ -1209,7 +1937,20 @@ namespace libtorrent
 		int piece_size = j.storage->info()->piece_size(j.piece);
 		int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
 
-		if (!m_settings.disable_hash_checks)
+		if (hj)
+		{
+			TORRENT_ASSERT(hj->bufs.empty());
+			hj->bufs.resize(blocks_in_piece);
+			for (int i = 0; i < blocks_in_piece; ++i)
+			{
+				TORRENT_ASSERT(p->blocks[i].buf);
+				m_io_thread.add_ref(p->blocks[i].buf);
+				hj->bufs[i].iov_base = p->blocks[i].buf;
+				hj->bufs[i].iov_len = (std::min)(piece_size, m_block_size);
+				piece_size -= m_block_size;
+			}
+		}
+		else if (!m_settings.disable_hash_checks)
 		{
 			hasher ctx;
 
@@ -1222,35 +1963,58 @@ namespace libtorrent
 			h = ctx.final();
 		}
 
-		ret = copy_from_piece(const_cast<cached_piece_entry&>(*p), hit, j, l);
+		ret = copy_from_piece(*p, hit, j, l);
 		TORRENT_ASSERT(ret > 0);
-		if (ret < 0) return ret;
-		cache_piece_index_t& idx = m_read_pieces.get<0>();
-		if (p->num_blocks == 0) idx.erase(p);
-		else idx.modify(p, update_last_use(j.cache_min_time));
+		bool probation = p->probation;
+		if (ret < 0)
+		{
+			if (hj)
+			{
+				for (std::vector<file::iovec_t>::iterator i = hj->bufs.begin()
+					, end(hj->bufs.end()); i != end; ++i)
+					m_io_thread.free_buffer((char*)i->iov_base);
+				hj->bufs.clear();
+			}
+			return ret;
+		}
+		if (p->num_blocks == 0)
+		{
+			m_read_pieces.erase(p);
+			p = m_read_pieces.end();
+		}
+		else m_read_pieces.modify(p, update_last_use(j.cache_min_time));
 
 		// if read cache is disabled or we exceeded the
 		// limit, remove this piece from the cache
 		// also, if the piece wasn't in the cache when
 		// the function was called, and we're using an
 		// explicit read cache, remove it again
-		if (in_use() >= m_settings.cache_size
+		if (m_cache_stats.cache_size >= m_cache_limit
 			|| !m_settings.use_read_cache
 			|| (m_settings.explicit_read_cache && !hit))
 		{
-			TORRENT_ASSERT(!m_read_pieces.empty());
-			TORRENT_ASSERT(p->piece == j.piece);
-			TORRENT_ASSERT(p->storage == j.storage);
 			if (p != m_read_pieces.end())
 			{
-				free_piece(const_cast<cached_piece_entry&>(*p), l);
+				TORRENT_ASSERT(p->piece == j.piece);
+				TORRENT_ASSERT(p->storage == j.storage);
+				free_piece(*p, l);
 				m_read_pieces.erase(p);
 			}
 		}
 
 		ret = j.buffer_size;
 		++m_cache_stats.blocks_read;
-		if (hit) ++m_cache_stats.blocks_read_hit;
+		if (hit)
+		{
+			++m_cache_stats.blocks_read_hit;
+			++j.storage->m_cache_hits;
+			if (probation) ++m_cache_stats.probation_hits;
+			else ++m_cache_stats.protected_hits;
+		}
+		else
+		{
+			++j.storage->m_cache_misses;
+		}
 		return ret;
 	}
 
@@ -1260,7 +2024,7 @@ namespace libtorrent
 	// this is similar to copy_from_piece() but it
 	// doesn't do anything but determining if it's a
 	// cache hit or not
-	bool disk_io_thread::is_cache_hit(cached_piece_entry& p
+	bool disk_io_worker::is_cache_hit(cached_piece_entry& p
 		, disk_io_job const& j, mutex::scoped_lock& l)
 	{
 		int block = j.offset / m_block_size;
@@ -1284,11 +2048,12 @@ namespace libtorrent
 		return p.blocks[start_block].buf != 0;
 	}
 
-	int disk_io_thread::copy_from_piece(cached_piece_entry& p, bool& hit
-		, disk_io_job const& j, mutex::scoped_lock& l)
+	// if j.buffer is 0, it's set to the block itself, with a reference
+	// added, when the request starts at a block boundary, and to a copy
+	// of the requested range otherwise
+	int disk_io_worker::copy_from_piece(cached_piece_entry& p, bool& hit
+		, disk_io_job& j, mutex::scoped_lock& l)
 	{
-		TORRENT_ASSERT(j.buffer);
-
 		// copy from the cache and update the last use timestamp
 		int block = j.offset / m_block_size;
 		int block_offset = j.offset & (m_block_size-1);
@@ -1317,16 +2082,16 @@ namespace libtorrent
 			while (end_block < blocks_in_piece && p.blocks[end_block].buf == 0) ++end_block;
 
 			int blocks_to_read = end_block - block;
-			blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_settings.cache_size
-				+ m_cache_stats.read_cache_size - in_use())/2, 3));
+			blocks_to_read = (std::min)(blocks_to_read, (std::max)((m_cache_limit
+				+ m_cache_stats.read_cache_size - m_cache_stats.cache_size)/2, 3));
 			blocks_to_read = (std::min)(blocks_to_read, m_settings.read_cache_line_size);
 			blocks_to_read = (std::max)(blocks_to_read, min_blocks_to_read);
 			if (j.max_cache_line > 0) blocks_to_read = (std::min)(blocks_to_read, j.max_cache_line);
 			
 			// if we don't have enough space for the new piece, try flushing something else
-			if (in_use() + blocks_to_read > m_settings.cache_size)
+			if (m_cache_stats.cache_size + blocks_to_read > m_cache_limit)
 			{
-				int clear = in_use() + blocks_to_read - m_settings.cache_size;
+				int clear = m_cache_stats.cache_size + blocks_to_read - m_cache_limit;
 				if (flush_cache_blocks(l, clear, p.piece, dont_flush_write_blocks) < clear)
 					return -2;
 			}
@@ -1338,6 +2103,26 @@ namespace libtorrent
 			TORRENT_ASSERT(p.blocks[block].buf);
 		}
 
+		// cached blocks are never modified, so a request that starts
+		// at a block boundary (and so fits in that block) is served
+		// by sharing the cached block, instead of copying it
+		bool shared = false;
+		if (j.buffer == 0)
+		{
+			if (block_offset == 0)
+			{
+				TORRENT_ASSERT(p.blocks[block].buf);
+				j.buffer = p.blocks[block].buf;
+				m_io_thread.add_ref(j.buffer);
+				shared = true;
+			}
+			else
+			{
+				j.buffer = m_io_thread.allocate_buffer("send buffer");
+				if (j.buffer == 0) return -2;
+			}
+		}
+
 		// build a vector of all the buffers we need to free
 		// and free them all in one go
 		std::vector<char*> buffers;
@@ -1346,9 +2131,12 @@ namespace libtorrent
 			TORRENT_ASSERT(p.blocks[block].buf);
 			int to_copy = (std::min)(m_block_size
 					- block_offset, size);
-			std::memcpy(j.buffer + buffer_offset
-				, p.blocks[block].buf + block_offset
-				, to_copy);
+			if (!shared)
+			{
+				std::memcpy(j.buffer + buffer_offset
+					, p.blocks[block].buf + block_offset
+					, to_copy);
+			}
 			size -= to_copy;
 			block_offset = 0;
 			buffer_offset += to_copy;
@@ -1366,25 +2154,101 @@ namespace libtorrent
 					--p.num_blocks;
 					--m_cache_stats.cache_size;
 					--m_cache_stats.read_cache_size;
+					add_cached_blocks(*p.storage, -1);
 				}
 			}
 			++block;
 		}
-		if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
+		if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
 		return j.buffer_size;
 	}
 
-	int disk_io_thread::try_read_from_cache(disk_io_job const& j, bool& hit)
+	int disk_io_worker::read_ahead_window(disk_io_job& j)
 	{
-		TORRENT_ASSERT(j.buffer);
+		piece_manager& s = *j.storage;
+		size_type offset = size_type(j.piece) * s.info()->piece_length() + j.offset;
+		int stream = s.m_read_ahead.find_stream(offset, m_block_size);
+		int window = s.m_read_ahead.window(stream, m_settings.read_cache_line_size);
+		// the peer's preferred cache line is an upper limit
+		if (j.max_cache_line <= 0 || j.max_cache_line > window)
+			j.max_cache_line = window;
+		return stream;
+	}
+
+	void disk_io_worker::read_ahead_done(disk_io_job const& j, int stream
+		, bool hit, bool filled_cache)
+	{
+		piece_manager& s = *j.storage;
+		torrent_info const& ti = *s.info();
+		size_type piece_start = size_type(j.piece) * ti.piece_length();
+		size_type offset = piece_start + j.offset;
+
+		// a miss reads up to one window of blocks into the
+		// cache, but never past the end of the piece
+		size_type cache_end = offset + j.buffer_size;
+		if (!hit && filled_cache)
+		{
+			cache_end = (std::max)(cache_end, (std::min)(piece_start + ti.piece_size(j.piece)
+				, offset + size_type(j.max_cache_line) * m_block_size));
+		}
+
+		size_type start;
+		int size;
+		s.m_read_ahead.record_read(stream, offset, j.buffer_size, hit, cache_end
+			, m_block_size, m_settings.read_cache_line_size, start, size);
+		// there's no page cache to prefetch into in direct I/O mode
+		if (size == 0 || m_settings.direct_io) return;
+
+		// ask the kernel to prefetch the range in the background,
+		// it may span several pieces
+		int piece = int(start / ti.piece_length());
+		int piece_offset = int(start % ti.piece_length());
+		while (size > 0 && piece < ti.num_pieces())
+		{
+			int len = (std::min)(size, ti.piece_size(piece) - piece_offset);
+			s.hint_read_impl(piece, piece_offset, len);
+			size -= len;
+			piece_offset = 0;
+			++piece;
+		}
+	}
+
+	bool disk_io_worker::map_block(disk_io_job& j)
+	{
+		boost::shared_ptr<void> mapping;
+		char const* view = j.storage->map_block_impl(j.piece, j.offset
+			, j.buffer_size, mapping);
+		if (view == 0) return false;
+
+		// blocks in the write cache haven't made it into the
+		// mapping yet
+		{
+			mutex::scoped_lock l(m_piece_mutex);
+			if (find_cached_piece(m_pieces, j, l) != m_pieces.end())
+				return false;
+		}
+
+		disk_io_job_extra& e = j.extra();
+		e.view = view;
+		e.mapping.swap(mapping);
+		return true;
+	}
+
+	int disk_io_worker::try_read_from_cache(disk_io_job& j, bool& hit)
+	{
+		TORRENT_ASSERT(j.buffer == 0);
 		TORRENT_ASSERT(j.cache_min_time >= 0);
 
 		mutex::scoped_lock l(m_piece_mutex);
 		if (!m_settings.use_read_cache) return -2;
 
-		cache_piece_index_t& idx = m_read_pieces.get<0>();
-		cache_piece_index_t::iterator p
-			= find_cached_piece(m_read_pieces, j, l);
+		// peers request the blocks of a piece one at a time, mostly
+		// in order. Only count the first block, to count the number
+		// of times the piece is downloaded rather than its size
+		if (m_settings.read_cache_admission_filter && j.offset == 0)
+			m_read_frequency.increment(piece_key(j.storage.get(), j.piece));
+
+		cache_t::iterator p = find_cached_piece(m_read_pieces, j, l);
 
 		hit = true;
 		int ret = 0;
@@ -1392,7 +2256,7 @@ namespace libtorrent
 		// if the piece cannot be found in the cache,
 		// read the whole piece starting at the block
 		// we got a request for.
-		if (p == idx.end())
+		if (p == m_read_pieces.end())
 		{
 			// if we use an explicit read cache and we
 			// couldn't find the block in the cache,
@@ -1411,134 +2275,584 @@ namespace libtorrent
 			TORRENT_ASSERT(p->storage == j.storage);
 		}
 
-		TORRENT_ASSERT(p != idx.end());
+		TORRENT_ASSERT(p != m_read_pieces.end());
 
-		ret = copy_from_piece(const_cast<cached_piece_entry&>(*p), hit, j, l);
+		ret = copy_from_piece(*p, hit, j, l);
 		if (ret < 0) return ret;
-		if (p->num_blocks == 0) idx.erase(p);
-		else idx.modify(p, update_last_use(j.cache_min_time));
+		bool probation = p->probation;
+		if (p->num_blocks == 0) m_read_pieces.erase(p);
+		else m_read_pieces.modify(p, update_last_use(j.cache_min_time));
 
 		ret = j.buffer_size;
 		++m_cache_stats.blocks_read;
-		if (hit) ++m_cache_stats.blocks_read_hit;
+		if (hit)
+		{
+			++m_cache_stats.blocks_read_hit;
+			++j.storage->m_cache_hits;
+			if (probation) ++m_cache_stats.probation_hits;
+			else ++m_cache_stats.protected_hits;
+		}
+		else
+		{
+			++j.storage->m_cache_misses;
+		}
 		return ret;
 	}
 
-	size_type disk_io_thread::queue_buffer_size() const
+	bool disk_io_worker::test_error(disk_io_job& j)
 	{
-		mutex::scoped_lock l(m_queue_mutex);
-		return m_queue_buffer_size;
+		TORRENT_ASSERT(j.storage);
+		error_code const& ec = j.storage->error();
+		if (ec)
+		{
+			j.buffer = 0;
+			j.error = ec;
+			disk_io_job_extra& e = j.extra();
+			e.str.clear();
+			e.error_file = j.storage->error_file();
+#ifdef TORRENT_DEBUG
+			printf("ERROR: '%s' in %s\n", ec.message().c_str(), e.error_file.c_str());
+#endif
+			j.storage->clear_error();
+			return true;
+		}
+		return false;
 	}
 
-	int disk_io_thread::add_job(disk_io_job const& j
-		, mutex::scoped_lock& l
-		, boost::function<void(int, disk_io_job const&)> const& f)
+	namespace
 	{
-		m_jobs.push_back(j);
-		m_jobs.back().callback.swap(const_cast<boost::function<void(int, disk_io_job const&)>&>(f));
-		m_jobs.back().start_time = time_now_hires();
+		// the call posted to the network thread when a job completes.
+		// Copying it moves the handler and the job over to the copy,
+		// like std::auto_ptr. However many times the call is copied
+		// on its way through the io_service, the handler is never
+		// cloned
+		struct job_completion
+		{
+			job_completion(int r): ret(r) {}
+			job_completion(job_completion const& c): ret(c.ret)
+			{
+				handler.swap(c.handler);
+				job.swap(c.job);
+			}
+			void operator()() const { handler(ret, job); }
 
-		if (j.action == disk_io_job::write)
+			mutable boost::function<void(int, disk_io_job const&)> handler;
+			mutable disk_io_job job;
+			int ret;
+
+		private:
+			job_completion& operator=(job_completion const&);
+		};
+	}
+
+	void disk_io_worker::post_callback(
+		boost::function<void(int, disk_io_job const&)>& handler
+		, disk_io_job const& j, int ret)
+	{
+		if (!handler) return;
+
+		job_completion c(ret);
+		c.handler.swap(handler);
+		c.job = j;
+		m_ios.post(c);
+	}
+
+	void disk_io_worker::post_callback(disk_io_job& j, int ret)
+	{
+		if (!j.callback) return;
+
+		job_completion c(ret);
+		c.job.swap(j);
+		c.handler.swap(c.job.callback);
+		m_ios.post(c);
+	}
+
+	void disk_io_worker::cancel_jobs(std::vector<disk_io_job>& jobs)
+	{
+		mutex::scoped_lock jl(m_queue_mutex);
+		for (std::vector<disk_io_job>::iterator i = jobs.begin()
+			, end(jobs.end()); i != end; ++i)
 		{
-			m_queue_buffer_size += j.buffer_size;
-			if (m_queue_buffer_size >= m_settings.max_queued_disk_bytes
-				&& m_settings.max_queued_disk_bytes > 0)
-				m_exceeded_write_queue = true;
+			if (i->action == disk_io_job::write)
+				m_io_thread.dequeue_write(i->storage.get(), i->buffer_size, jl);
+			post_callback(*i, -3);
 		}
-		m_signal.signal(l);
-		return m_queue_buffer_size;
 	}
 
-	int disk_io_thread::add_job(disk_io_job const& j
-		, boost::function<void(int, disk_io_job const&)> const& f)
+	void disk_io_worker::update_io_uring(session_settings const& s)
 	{
-		TORRENT_ASSERT(!m_abort);
-		TORRENT_ASSERT(j.storage
-			|| j.action == disk_io_job::abort_thread
-			|| j.action == disk_io_job::update_settings);
-		TORRENT_ASSERT(j.buffer_size <= m_block_size);
-		mutex::scoped_lock l(m_queue_mutex);
-		return add_job(j, l, f);
+		set_thread_io_uring(0);
+		m_ring.close();
+		if (!s.use_io_uring) return;
+
+		error_code ec;
+		if (!m_ring.open((std::max)(s.io_uring_queue_depth, 1), ec))
+		{
+#ifdef TORRENT_DISK_STATS
+			m_log << log_time() << " io_uring not available: " << ec.message() << std::endl;
+#endif
+			return;
+		}
+		set_thread_io_uring(&m_ring);
 	}
 
-	bool disk_io_thread::test_error(disk_io_job& j)
+	void disk_io_worker::on_piece_hashed(sha1_hash const& h, disk_io_job j, int ret)
 	{
-		TORRENT_ASSERT(j.storage);
-		error_code const& ec = j.storage->error();
-		if (ec)
+		// this is called from a hash thread. Only touch
+		// state that's safe to access from any thread
+		TORRENT_ASSERT(j.action == disk_io_job::hash
+			|| j.action == disk_io_job::read_and_hash);
+
+		if (h != j.storage->info()->hash_for_piece(j.piece))
 		{
-			j.buffer = 0;
-			j.str.clear();
-			j.error = ec;
-			j.error_file = j.storage->error_file();
-#ifdef TORRENT_DEBUG
-			printf("ERROR: '%s' in %s\n", ec.message().c_str(), j.error_file.c_str());
+			j.storage->mark_failed(j.piece);
+			if (j.action == disk_io_job::hash)
+			{
+				ret = -2;
+			}
+			else
+			{
+				j.error = errors::failed_hash_check;
+				j.clear_strings();
+				m_io_thread.free_buffer(j.buffer);
+				j.buffer = 0;
+				ret = -3;
+			}
+		}
+		else if (j.action == disk_io_job::hash)
+		{
+			ret = 0;
+		}
+#ifdef TORRENT_DISK_STATS
+		if (j.buffer) m_io_thread.rename_buffer(j.buffer, "posted send buffer");
 #endif
-			j.storage->clear_error();
+		post_callback(j, ret);
+	}
+
+	enum action_flags_t
+	{
+		read_operation = 1
+		, buffer_operation = 2
+		, cancel_on_abort = 4
+	};
+
+	static const boost::uint8_t action_flags[] =
+	{
+		read_operation + buffer_operation + cancel_on_abort // read
+		, buffer_operation // write
+		, 0 // hash
+		, 0 // move_storage
+		, 0 // release_files
+		, 0 // delete_files
+		, 0 // check_fastresume
+		, read_operation + cancel_on_abort // check_files
+		, 0 // save_resume_data
+		, 0 // rename_file
+		, 0 // abort_thread
+		, 0 // clear_read_cache
+		, 0 // abort_torrent
+		, cancel_on_abort // update_settings
+		, read_operation + cancel_on_abort // read_and_hash
+		, read_operation + cancel_on_abort // cache_piece
+		, 0 // finalize_file
+		, buffer_operation + cancel_on_abort // open_block
+	};
+
+	bool should_cancel_on_abort(disk_io_job const& j)
+	{
+		TORRENT_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
+		return action_flags[j.action] & cancel_on_abort;
+	}
+
+	namespace
+	{
+		// what jobs without the out of line fields return
+		disk_io_job_extra const empty_extra;
+
+		// the device number of the drive the path is on. The save path
+		// may not have been created yet, in which case the closest parent
+		// directory that exists is used. Returns 0 if none could be found
+		boost::uint64_t device_of(std::string path)
+		{
+			for (;;)
+			{
+				file_status st;
+				error_code ec;
+				stat_file(path, &st, ec);
+				if (!ec) return st.device;
+				if (!has_parent_path(path)) return 0;
+				std::string parent = parent_path(path);
+				if (parent == path) return 0;
+				path = parent;
+			}
+		}
+	}
+
+	disk_io_job::disk_io_job(disk_io_job const& j)
+		: action(j.action)
+		, buffer_size(j.buffer_size)
+		, buffer(j.buffer)
+		, storage(j.storage)
+		, piece(j.piece)
+		, offset(j.offset)
+		, max_cache_line(j.max_cache_line)
+		, cache_min_time(j.cache_min_time)
+		, file_handle(j.file_handle)
+		, file_offset(j.file_offset)
+		, error(j.error)
+		, callback(j.callback)
+		, start_time(j.start_time)
+		, m_extra(j.m_extra ? new disk_io_job_extra(*j.m_extra) : 0)
+	{}
+
+	disk_io_job& disk_io_job::operator=(disk_io_job const& j)
+	{
+		if (&j == this) return *this;
+		disk_io_job tmp(j);
+		swap(tmp);
+		return *this;
+	}
+
+	void disk_io_job::swap(disk_io_job& j)
+	{
+		using std::swap;
+		swap(action, j.action);
+		swap(buffer, j.buffer);
+		swap(buffer_size, j.buffer_size);
+		storage.swap(j.storage);
+		swap(piece, j.piece);
+		swap(offset, j.offset);
+		swap(max_cache_line, j.max_cache_line);
+		swap(cache_min_time, j.cache_min_time);
+		file_handle.swap(j.file_handle);
+		swap(file_offset, j.file_offset);
+		swap(error, j.error);
+		callback.swap(j.callback);
+		swap(start_time, j.start_time);
+		swap(m_extra, j.m_extra);
+	}
+
+	disk_io_job_extra& disk_io_job::extra()
+	{
+		if (m_extra == 0) m_extra = new disk_io_job_extra;
+		return *m_extra;
+	}
+
+	disk_io_job_extra const& disk_io_job::get_extra() const
+	{
+		return m_extra ? *m_extra : empty_extra;
+	}
+
+	void disk_io_job::clear_strings()
+	{
+		if (m_extra == 0) return;
+		m_extra->str.clear();
+		m_extra->error_file.clear();
+	}
+
+	bool is_read_operation(disk_io_job const& j)
+	{
+		TORRENT_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
+		return action_flags[j.action] & read_operation;
+	}
+
+	bool operation_has_buffer(disk_io_job const& j)
+	{
+		TORRENT_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
+		return action_flags[j.action] & buffer_operation;
+	}
+
+// ------- disk_job_queue ------
+
+	disk_job_queue::disk_job_queue(int block_size)
+		: m_turn_started(false)
+		, m_block_size(block_size)
+		, m_sequence(0)
+		, m_size(0)
+		, m_num_reads(0)
+	{
+		for (int i = 0; i < num_job_classes; ++i) m_weights[i] = 1;
+	}
+
+	disk_job_queue::job_class_t disk_job_queue::job_class(disk_io_job const& j)
+	{
+		switch (j.action)
+		{
+			case disk_io_job::read:
+			case disk_io_job::read_and_hash:
+			case disk_io_job::cache_piece:
+			case disk_io_job::open_block:
+				return read_class;
+			case disk_io_job::write:
+				return write_class;
+			case disk_io_job::hash:
+			case disk_io_job::check_fastresume:
+			case disk_io_job::check_files:
+				return hash_class;
+			default:
+				return move_class;
+		}
+	}
+
+	int disk_job_queue::job_cost(disk_io_job const& j) const
+	{
+		switch (j.action)
+		{
+			// these read an entire piece
+			case disk_io_job::read_and_hash:
+			case disk_io_job::cache_piece:
+				return (j.storage->info()->piece_length() + m_block_size - 1)
+					/ m_block_size;
+			// every check_files job checks up to 4 MiB
+			case disk_io_job::check_files:
+				return 4 * 1024 * 1024 / m_block_size;
+			default:
+				return 1;
+		}
+	}
+
+	void disk_job_queue::set_weights(session_settings const& s)
+	{
+		m_weights[read_class] = (std::max)(s.disk_read_weight, 1);
+		m_weights[write_class] = (std::max)(s.disk_write_weight, 1);
+		m_weights[hash_class] = (std::max)(s.disk_hash_weight, 1);
+		m_weights[move_class] = (std::max)(s.disk_move_weight, 1);
+	}
+
+	void disk_job_queue::push(disk_io_job& j, size_type sort_key)
+	{
+		++m_size;
+		if (!j.storage || j.action == disk_io_job::abort_torrent)
+		{
+			m_immediate.push_back(disk_io_job());
+			m_immediate.back().swap(j);
+			return;
+		}
+
+		torrent_queues& q = m_torrents[j.storage.get()];
+		flow* f = &q.jobs;
+		if (job_class(j) == read_class)
+		{
+			f = &q.reads;
+			++m_num_reads;
+		}
+		else
+		{
+			sort_key = m_sequence++;
+		}
+
+		f->storage = j.storage.get();
+		f->jobs.insert(std::make_pair(sort_key, disk_io_job()))->second.swap(j);
+		if (f->active) return;
+		f->active = true;
+		m_active.push_back(f);
+	}
+
+	disk_job_queue::jobs_t::iterator disk_job_queue::flow::next()
+	{
+		TORRENT_ASSERT(!jobs.empty());
+		// the unsorted jobs are at the front. The jobs that are run in
+		// order have increasing sort keys, so they're always found
+		// going up from the previous one
+		jobs_t::iterator i = jobs.begin();
+		if (i->first < 0) return i;
+
+		if (direction > 0)
+		{
+			i = jobs.lower_bound(scan_pos);
+			if (i != jobs.end()) return i;
+			// we've reached the top, turn around
+			direction = -1;
+		}
+
+		i = jobs.upper_bound(scan_pos);
+		if (i != jobs.begin()) return --i;
+		// we've reached the bottom, turn around
+		direction = 1;
+		return i;
+	}
+
+	void disk_job_queue::skip_turns()
+	{
+		// the number of turns it takes until the first of the
+		// queues is allowed enough to run its next job
+		int turns = INT_MAX;
+		for (std::deque<flow*>::iterator k = m_active.begin();
+			k != m_active.end(); ++k)
+		{
+			flow& f = **k;
+			jobs_t::iterator i = f.next();
+			int weight = m_weights[job_class(i->second)];
+			int left = job_cost(i->second) - f.deficit;
+			TORRENT_ASSERT(left > 0);
+			turns = (std::min)(turns, (left + weight - 1) / weight);
+		}
+		TORRENT_ASSERT(turns > 0);
+
+		// every queue is allowed what it would have been in all
+		// but the last of those turns, the last one is taken by
+		// going around once more
+		for (std::deque<flow*>::iterator k = m_active.begin();
+			k != m_active.end(); ++k)
+		{
+			flow& f = **k;
+			jobs_t::iterator i = f.next();
+			f.deficit += (turns - 1) * m_weights[job_class(i->second)];
+		}
+	}
+
+	bool disk_job_queue::pop(disk_io_job& j)
+	{
+		if (!m_immediate.empty())
+		{
+			j.swap(m_immediate.front());
+			m_immediate.pop_front();
+			--m_size;
+			return true;
+		}
+
+		// the number of queues in a row that had their
+		// turn without being able to run a job
+		int skipped = 0;
+		while (!m_active.empty())
+		{
+			flow& f = *m_active.front();
+			jobs_t::iterator i = f.next();
+			if (!m_turn_started)
+			{
+				f.deficit += m_weights[job_class(i->second)];
+				m_turn_started = true;
+			}
+
+			int cost = job_cost(i->second);
+			if (cost > f.deficit)
+			{
+				// the queue has used up its turn, the
+				// rest is left for its next one
+				m_active.pop_front();
+				m_active.push_back(&f);
+				m_turn_started = false;
+				// a job may cost many turns' worth (check_files does),
+				// rather than going around empty until it's allowed
+				// enough, skip ahead to the turn where the first job
+				// can run
+				if (++skipped < int(m_active.size())) continue;
+				skip_turns();
+				skipped = 0;
+				continue;
+			}
+
+			f.deficit -= cost;
+			if (i->first >= 0) f.scan_pos = i->first;
+			j.swap(i->second);
+			f.jobs.erase(i);
+			--m_size;
+			if (job_class(j) == read_class) --m_num_reads;
+			if (f.jobs.empty()) queue_emptied(f);
 			return true;
 		}
+		TORRENT_ASSERT(m_size == 0);
 		return false;
 	}
 
-	void disk_io_thread::post_callback(
-		boost::function<void(int, disk_io_job const&)> const& handler
-		, disk_io_job const& j, int ret)
+	void disk_job_queue::queue_emptied(flow& f)
 	{
-		if (!handler) return;
-
-		m_ios.post(boost::bind(handler, ret, j));
+		TORRENT_ASSERT(f.jobs.empty());
+		TORRENT_ASSERT(f.active);
+		// a queue that runs out of jobs doesn't
+		// keep what it was allowed for later
+		f.deficit = 0;
+		f.active = false;
+		std::deque<flow*>::iterator i = std::find(m_active.begin(), m_active.end(), &f);
+		TORRENT_ASSERT(i != m_active.end());
+		if (i == m_active.begin()) m_turn_started = false;
+		m_active.erase(i);
+
+		std::map<piece_manager const*, torrent_queues>::iterator t
+			= m_torrents.find(f.storage);
+		TORRENT_ASSERT(t != m_torrents.end());
+		if (!t->second.aborted || t->second.reads.active
+			|| t->second.jobs.active) return;
+		m_torrents.erase(t);
 	}
 
-	enum action_flags_t
-	{
-		read_operation = 1
-		, buffer_operation = 2
-		, cancel_on_abort = 4
-	};
-
-	static const boost::uint8_t action_flags[] =
-	{
-		read_operation + buffer_operation + cancel_on_abort // read
-		, buffer_operation // write
-		, 0 // hash
-		, 0 // move_storage
-		, 0 // release_files
-		, 0 // delete_files
-		, 0 // check_fastresume
-		, read_operation + cancel_on_abort // check_files
-		, 0 // save_resume_data
-		, 0 // rename_file
-		, 0 // abort_thread
-		, 0 // clear_read_cache
-		, 0 // abort_torrent
-		, cancel_on_abort // update_settings
-		, read_operation + cancel_on_abort // read_and_hash
-		, read_operation + cancel_on_abort // cache_piece
-		, 0 // finalize_file
-	};
-
-	bool should_cancel_on_abort(disk_io_job const& j)
+	void disk_job_queue::remove_jobs(piece_manager const* s
+		, std::vector<disk_io_job>& jobs)
 	{
-		TORRENT_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
-		return action_flags[j.action] & cancel_on_abort;
-	}
+		for (std::deque<disk_io_job>::iterator i = m_immediate.begin();
+			i != m_immediate.end();)
+		{
+			if ((s && i->storage != s) || !should_cancel_on_abort(*i))
+			{
+				++i;
+				continue;
+			}
+			jobs.push_back(disk_io_job());
+			jobs.back().swap(*i);
+			i = m_immediate.erase(i);
+			--m_size;
+		}
 
-	bool is_read_operation(disk_io_job const& j)
-	{
-		TORRENT_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
-		return action_flags[j.action] & read_operation;
+		for (std::map<piece_manager const*, torrent_queues>::iterator t = m_torrents.begin();
+			t != m_torrents.end();)
+		{
+			if (s && t->first != s)
+			{
+				++t;
+				continue;
+			}
+			// the queues of the torrent are removed once both are
+			// empty, which may be in the calls to queue_emptied()
+			torrent_queues& q = t->second;
+			q.aborted = true;
+			if (!q.reads.active && !q.jobs.active)
+			{
+				m_torrents.erase(t++);
+				continue;
+			}
+			++t;
+			flow* flows[] = { &q.reads, &q.jobs };
+			bool emptied[] = { false, false };
+			for (int k = 0; k < 2; ++k)
+			{
+				flow& f = *flows[k];
+				if (!f.active) continue;
+				for (jobs_t::iterator i = f.jobs.begin(); i != f.jobs.end();)
+				{
+					if (!should_cancel_on_abort(i->second))
+					{
+						++i;
+						continue;
+					}
+					jobs.push_back(disk_io_job());
+					jobs.back().swap(i->second);
+					if (job_class(jobs.back()) == read_class) --m_num_reads;
+					f.jobs.erase(i++);
+					--m_size;
+				}
+				emptied[k] = f.jobs.empty();
+			}
+			for (int k = 0; k < 2; ++k)
+				if (emptied[k]) queue_emptied(*flows[k]);
+		}
 	}
 
-	bool operation_has_buffer(disk_io_job const& j)
+	void disk_job_queue::clear()
 	{
-		TORRENT_ASSERT(j.action >= 0 && j.action < int(sizeof(action_flags)));
-		return action_flags[j.action] & buffer_operation;
+		m_immediate.clear();
+		m_torrents.clear();
+		m_active.clear();
+		m_turn_started = false;
+		m_size = 0;
+		m_num_reads = 0;
 	}
 
-	void disk_io_thread::thread_fun()
+	void disk_io_worker::thread_fun()
 	{
 #ifdef TORRENT_DISK_STATS
-		m_log.open("disk_io_thread.log", std::ios::trunc);
+		char log_name[100];
+		snprintf(log_name, sizeof(log_name), "disk_io_thread_%d.log", m_index);
+		m_log.open(log_name, std::ios::trunc);
 #endif
 
 		// figure out how much physical RAM there is in
@@ -1575,41 +2889,42 @@ namespace libtorrent
 			}
 		}
 #endif
-		// 1 = forward in list, -1 = backwards in list
-		int elevator_direction = 1;
-
-		read_jobs_t::iterator elevator_job_pos = m_sorted_read_jobs.begin();
-		size_type last_elevator_pos = 0;
-		bool need_update_elevator_pos = false;
-		int immediate_jobs_in_row = 0;
+		m_queue.set_weights(m_settings);
 
 		for (;;)
 		{
 #ifdef TORRENT_DISK_STATS
 			m_log << log_time() << " idle" << std::endl;
 #endif
-			mutex::scoped_lock jl(m_queue_mutex);
+			// new jobs are sorted into the queue before every job
+			// is picked, for jobs of other torrents to be able to
+			// get ahead of the ones already queued
+			if (!m_intake.empty()) drain_intake();
 
-			while (m_jobs.empty() && m_sorted_read_jobs.empty() && !m_abort)
+			if (m_queue.empty() && !m_abort)
 			{
-				// if there hasn't been an event in one second
-				// see if we should flush the cache
-//				if (!m_signal.timed_wait(jl, boost::posix_time::seconds(1)))
-//					flush_expired_pieces();
-				m_signal.wait(jl);
-				m_signal.clear(jl);
+				mutex::scoped_lock jl(m_queue_mutex);
+				while (m_intake.start_wait())
+				{
+					// if there hasn't been an event in one second
+					// see if we should flush the cache
+//					if (!m_signal.timed_wait(jl, boost::posix_time::seconds(1)))
+//						flush_expired_pieces();
+					m_signal.wait(jl);
+					m_signal.clear(jl);
+				}
+				m_intake.end_wait();
+				jl.unlock();
+				drain_intake();
 			}
 
-			if (m_abort && m_jobs.empty())
+			if (m_abort && m_queue.empty())
 			{
-				jl.unlock();
-
 				mutex::scoped_lock l(m_piece_mutex);
 				// flush all disk caches
-				cache_piece_index_t& widx = m_pieces.get<0>();
-				for (cache_piece_index_t::iterator i = widx.begin()
-					, end(widx.end()); i != end; ++i)
-					flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+				for (cache_t::iterator i = m_pieces.begin()
+					, end(m_pieces.end()); i != end; ++i)
+					flush_range(*i, 0, INT_MAX, l);
 
 #ifdef TORRENT_DISABLE_POOL_ALLOCATOR
 				// since we're aborting the thread, we don't actually
@@ -1617,193 +2932,51 @@ namespace libtorrent
 				// clear the piece list and the memory will be freed when we
 				// destruct the m_pool. If we're not using a pool, we actually
 				// have to free everything individually though
-				cache_piece_index_t& idx = m_read_pieces.get<0>();
-				for (cache_piece_index_t::iterator i = idx.begin()
-					, end(idx.end()); i != end; ++i)
-					free_piece(const_cast<cached_piece_entry&>(*i), l);
+				for (cache_t::iterator i = m_read_pieces.begin()
+					, end(m_read_pieces.end()); i != end; ++i)
+					free_piece(*i, l);
 #endif
 
 				m_pieces.clear();
 				m_read_pieces.clear();
-				// release the io_service to allow the run() call to return
-				// we do this once we stop posting new callbacks to it.
-				m_work.reset();
+				l.unlock();
+				// the last thread to exit releases the io_service
+				m_io_thread.worker_exited();
 				return;
 			}
 
 			disk_io_job j;
 
-			ptime now = time_now_hires();
-			m_queue_time.add_sample(total_microseconds(now - j.start_time));
-			ptime operation_start = now;
-
-			// make sure we don't starve out the read queue by just issuing
-			// write jobs constantly, mix in a read job every now and then
-			// with a configurable ratio
-			// this rate must increase to every other jobs if the queued
-			// up read jobs increases too far.
-			int read_job_every = m_settings.read_job_every;
-
-			if (m_sorted_read_jobs.size() > m_settings.unchoke_slots_limit * 2)
-			{
-				int range = m_settings.unchoke_slots_limit;
-				int exceed = m_sorted_read_jobs.size() - range * 2;
-				read_job_every = (exceed * 1 + (range - exceed) * read_job_every) / 2;
-				if (read_job_every < 1) read_job_every = 1;
-			}
-
-			bool pick_read_job = m_jobs.empty()
-				|| (immediate_jobs_in_row >= read_job_every
-					&& !m_sorted_read_jobs.empty());
-
-			if (!pick_read_job)
-			{
-				// we have a job in the job queue. If it's
-				// a read operation and we are allowed to
-				// reorder jobs, sort it into the read job
-				// list and continue, otherwise just pop it
-				// and use it later
-				j = m_jobs.front();
-				m_jobs.pop_front();
-				if (j.action == disk_io_job::write)
-				{
-					TORRENT_ASSERT(m_queue_buffer_size >= j.buffer_size);
-					m_queue_buffer_size -= j.buffer_size;
-					
-					if (m_exceeded_write_queue)
-					{
-						int low_watermark = m_settings.max_queued_disk_bytes_low_watermark == 0
-							? m_settings.max_queued_disk_bytes * 7 / 8
-							: m_settings.max_queued_disk_bytes_low_watermark;
-						if (low_watermark >= m_settings.max_queued_disk_bytes)
-							low_watermark = m_settings.max_queued_disk_bytes * 7 / 8;
-
-						if (m_queue_buffer_size < low_watermark
-							|| m_settings.max_queued_disk_bytes == 0)
-						{
-							m_exceeded_write_queue = false;
-							// we just dropped below the high watermark of number of bytes
-							// queued for writing to the disk. Notify the session so that it
-							// can trigger all the connections waiting for this event
-							if (m_queue_callback) m_ios.post(m_queue_callback);
-						}
-					}
-				}
-
-				jl.unlock();
-
-				bool defer = false;
-
-				if (is_read_operation(j))
-				{
-					defer = true;
-
-					// at this point the operation we're looking
-					// at is a read operation. If this read operation
-					// can be fully satisfied by the read cache, handle
-					// it immediately
-					if (m_settings.use_read_cache)
-					{
-#ifdef TORRENT_DISK_STATS
-						m_log << log_time() << " check_cache_hit" << std::endl;
-#endif
-						// unfortunately we need to lock the cache
-						// if the cache querying function would be
-						// made asyncronous, this would not be
-						// necessary anymore
-						mutex::scoped_lock l(m_piece_mutex);
-						cache_piece_index_t::iterator p
-							= find_cached_piece(m_read_pieces, j, l);
-				
-						cache_piece_index_t& idx = m_read_pieces.get<0>();
-						// if it's a cache hit, process the job immediately
-						if (p != idx.end() && is_cache_hit(const_cast<cached_piece_entry&>(*p), j, l))
-							defer = false;
-					}
-				}
-
-				if (m_settings.use_disk_read_ahead && defer)
-				{
-					j.storage->hint_read_impl(j.piece, j.offset, j.buffer_size);
-				}
-
-				TORRENT_ASSERT(j.offset >= 0);
-				if (m_settings.allow_reordered_disk_operations && defer)
-				{
-#ifdef TORRENT_DISK_STATS
-					m_log << log_time() << " sorting_job" << std::endl;
-#endif
-					ptime sort_start = time_now_hires();
-
-					size_type phys_off = j.storage->physical_offset(j.piece, j.offset);
-					need_update_elevator_pos = need_update_elevator_pos || m_sorted_read_jobs.empty();
-					m_sorted_read_jobs.insert(std::pair<size_type, disk_io_job>(phys_off, j));
-
-					ptime now = time_now_hires();
-					m_sort_time.add_sample(total_microseconds(now - sort_start));
-					m_cache_stats.cumulative_sort_time += total_milliseconds(now - sort_start);
-					m_cache_stats.cumulative_job_time += total_milliseconds(now - operation_start);
-					continue;
-				}
+			ptime operation_start = time_now_hires();
 
-				++immediate_jobs_in_row;
-			}
-			else
+			m_queue.pop(j);
+			if (j.action == disk_io_job::write)
 			{
-				// the job queue is empty, pick the next read job
-				// from the sorted job list. So we don't need the
-				// job queue lock anymore
-				jl.unlock();
-
-				immediate_jobs_in_row = 0;
-
-				TORRENT_ASSERT(!m_sorted_read_jobs.empty());
-
-				// if m_sorted_read_jobs used to be empty,
-				// we need to update the elevator position
-				if (need_update_elevator_pos)
-				{
-					elevator_job_pos = m_sorted_read_jobs.lower_bound(last_elevator_pos);
-					need_update_elevator_pos = false;
-				}
-
-				// if we've reached the end, change the elevator direction
-				if (elevator_job_pos == m_sorted_read_jobs.end())
-				{
-					elevator_direction = -1;
-					--elevator_job_pos;
-				}
-				TORRENT_ASSERT(!m_sorted_read_jobs.empty());
-
-				TORRENT_ASSERT(elevator_job_pos != m_sorted_read_jobs.end());
-				j = elevator_job_pos->second;
-				read_jobs_t::iterator to_erase = elevator_job_pos;
-
-				// if we've reached the begining of the sorted list,
-				// change the elvator direction
-				if (elevator_job_pos == m_sorted_read_jobs.begin())
-					elevator_direction = 1;
-
-				// move the elevator before erasing the job we're processing
-				// to keep the iterator valid
-				if (elevator_direction > 0) ++elevator_job_pos;
-				else --elevator_job_pos;
-
-				TORRENT_ASSERT(to_erase != elevator_job_pos);
-				last_elevator_pos = to_erase->first;
-				m_sorted_read_jobs.erase(to_erase);
+				mutex::scoped_lock jl(m_queue_mutex);
+				m_io_thread.dequeue_write(j.storage.get(), j.buffer_size, jl);
 			}
 
 			// if there's a buffer in this job, it will be freed
 			// when this holder is destructed, unless it has been
 			// released.
-			disk_buffer_holder holder(*this
+			disk_buffer_holder holder(m_io_thread
 				, operation_has_buffer(j) ? j.buffer : 0);
 
 			flush_expired_pieces();
 
+			// the queue time includes the time the job
+			// waited for its torrent's turn
+			ptime service_start = time_now_hires();
+			int queue_time = total_microseconds(service_start - j.start_time);
+			m_queue_time.add_sample(queue_time);
+			TORRENT_ASSERT(j.action >= 0 && int(j.action) < int(cache_status::num_job_types));
+			m_cache_stats.queue_time_histogram[j.action].add_sample(queue_time);
+
 			int ret = 0;
 
+			// the read-ahead stream of a read or open_block job
+			int read_stream = -1;
+
 			TORRENT_ASSERT(j.storage
 				|| j.action == disk_io_job::abort_thread
 				|| j.action == disk_io_job::update_settings);
@@ -1842,7 +3015,11 @@ namespace libtorrent
 						m_file_pool.release(0);
 					}
 #endif
+					if (s.use_io_uring != m_ring.is_open()
+						|| (s.use_io_uring && s.io_uring_queue_depth != m_settings.io_uring_queue_depth))
+						update_io_uring(s);
 					m_settings = s;
+					m_queue.set_weights(m_settings);
 					m_file_pool.resize(m_settings.file_pool_size);
 #if defined __APPLE__ && defined __MACH__ && MAC_OS_X_VERSION_MIN_REQUIRED >= 1050
 					setiopolicy_np(IOPOL_TYPE_DISK, IOPOL_SCOPE_THREAD
@@ -1861,6 +3038,16 @@ namespace libtorrent
 						else
 							m_settings.cache_size = m_physical_ram / 8 / m_block_size;
 					}
+					{
+						// the workers that exist now have all been sent
+						// this job, so none of them is left out of the split
+						int workers = m_io_thread.num_workers();
+						mutex::scoped_lock l(m_piece_mutex);
+						m_cache_limit = (std::max)(m_settings.cache_size / workers, 1);
+						// track about as many pieces as fit in the read cache
+						m_read_frequency.resize(m_cache_limit
+							/ (std::max)(m_settings.read_cache_line_size, 1));
+					}
 					break;
 				}
 				case disk_io_job::abort_torrent:
@@ -1868,42 +3055,9 @@ namespace libtorrent
 #ifdef TORRENT_DISK_STATS
 					m_log << log_time() << " abort_torrent " << std::endl;
 #endif
-					mutex::scoped_lock jl(m_queue_mutex);
-					for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
-						i != m_jobs.end();)
-					{
-						if (i->storage != j.storage)
-						{
-							++i;
-							continue;
-						}
-						if (should_cancel_on_abort(*i))
-						{
-							if (i->action == disk_io_job::write)
-							{
-								TORRENT_ASSERT(m_queue_buffer_size >= i->buffer_size);
-								m_queue_buffer_size -= i->buffer_size;
-							}
-							post_callback(i->callback, *i, -3);
-							i = m_jobs.erase(i);
-							continue;
-						}
-						++i;
-					}
-					// now clear all the read jobs
-					for (read_jobs_t::iterator i = m_sorted_read_jobs.begin();
-						i != m_sorted_read_jobs.end();)
-					{
-						if (i->second.storage != j.storage)
-						{
-							++i;
-							continue;
-						}
-						post_callback(i->second.callback, i->second, -3);
-						if (elevator_job_pos == i) ++elevator_job_pos;
-						m_sorted_read_jobs.erase(i++);
-					}
-					jl.unlock();
+					std::vector<disk_io_job> cancelled;
+					m_queue.remove_jobs(j.storage.get(), cancelled);
+					cancel_jobs(cancelled);
 
 					mutex::scoped_lock l(m_piece_mutex);
 
@@ -1915,7 +3069,7 @@ namespace libtorrent
 					{
 						if (i->storage == j.storage)
 						{
-							drain_piece_bufs(const_cast<cached_piece_entry&>(*i), buffers, l);
+							drain_piece_bufs(*i, buffers, l);
 							i = m_read_pieces.erase(i);
 						}
 						else
@@ -1924,8 +3078,8 @@ namespace libtorrent
 						}
 					}
 					l.unlock();
-					if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
-					release_memory();
+					if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
+					m_io_thread.release_memory();
 					break;
 				}
 				case disk_io_job::abort_thread:
@@ -1933,39 +3087,11 @@ namespace libtorrent
 #ifdef TORRENT_DISK_STATS
 					m_log << log_time() << " abort_thread " << std::endl;
 #endif
-					// clear all read jobs
-					mutex::scoped_lock jl(m_queue_mutex);
-
-					for (std::deque<disk_io_job>::iterator i = m_jobs.begin();
-						i != m_jobs.end();)
-					{
-						if (should_cancel_on_abort(*i))
-						{
-							if (i->action == disk_io_job::write)
-							{
-								TORRENT_ASSERT(m_queue_buffer_size >= i->buffer_size);
-								m_queue_buffer_size -= i->buffer_size;
-							}
-							post_callback(i->callback, *i, -3);
-							i = m_jobs.erase(i);
-							continue;
-						}
-						++i;
-					}
-					jl.unlock();
-
-					for (read_jobs_t::iterator i = m_sorted_read_jobs.begin();
-						i != m_sorted_read_jobs.end();)
-					{
-						if (i->second.storage != j.storage)
-						{
-							++i;
-							continue;
-						}
-						post_callback(i->second.callback, i->second, -3);
-						if (elevator_job_pos == i) ++elevator_job_pos;
-						m_sorted_read_jobs.erase(i++);
-					}
+					// cancel the jobs of every storage that don't
+					// have to run, the rest are run before exiting
+					std::vector<disk_io_job> cancelled;
+					m_queue.remove_jobs(0, cancelled);
+					cancel_jobs(cancelled);
 
 					m_abort = true;
 					break;
@@ -1977,7 +3103,7 @@ namespace libtorrent
 #endif
 					INVARIANT_CHECK;
 					TORRENT_ASSERT(j.buffer == 0);
-					j.buffer = allocate_buffer("send buffer");
+					j.buffer = m_io_thread.allocate_buffer("send buffer");
 					TORRENT_ASSERT(j.buffer_size <= m_block_size);
 					if (j.buffer == 0)
 					{
@@ -1991,18 +3117,23 @@ namespace libtorrent
 #else
 						j.error = error::no_memory;
 #endif
-						j.str.clear();
+						j.clear_strings();
 						break;
 					}
 
-					disk_buffer_holder read_holder(*this, j.buffer);
+					disk_buffer_holder read_holder(m_io_thread, j.buffer);
 
 					// read the entire piece and verify the piece hash
 					// since we need to check the hash, this function
 					// will ignore the cache size limit (at least for
 					// reading and hashing, not for keeping it around)
+					// if there are hash threads, the piece is hashed by one
+					// of them, which also posts the completion handler
 					sha1_hash h;
-					ret = read_piece_from_cache_and_hash(j, h);
+					hash_thread::job hj;
+					bool async_hash = m_settings.hashing_threads > 0
+						&& !m_settings.disable_hash_checks;
+					ret = read_piece_from_cache_and_hash(j, h, async_hash ? &hj : 0);
 
 					// -2 means there's no space in the read cache
 					// or that the read cache is disabled
@@ -2011,13 +3142,25 @@ namespace libtorrent
 						test_error(j);
 						break;
 					}
+					if (async_hash && ret >= 0)
+					{
+						TORRENT_ASSERT(j.buffer == read_holder.get());
+						read_holder.release();
+#if TORRENT_DISK_STATS
+						m_io_thread.rename_buffer(j.buffer, "released send buffer");
+#endif
+						hj.handler = boost::bind(&disk_io_worker::on_piece_hashed, this, _1, j, ret);
+						m_io_thread.m_hash_thread.async_hash(hj);
+						ret = defer_handler;
+						break;
+					}
 					if (!m_settings.disable_hash_checks)
 						ret = (j.storage->info()->hash_for_piece(j.piece) == h)?ret:-3;
 					if (ret == -3)
 					{
 						j.storage->mark_failed(j.piece);
 						j.error = errors::failed_hash_check;
-						j.str.clear();
+						j.clear_strings();
 						j.buffer = 0;
 						break;
 					}
@@ -2025,7 +3168,7 @@ namespace libtorrent
 					TORRENT_ASSERT(j.buffer == read_holder.get());
 					read_holder.release();
 #if TORRENT_DISK_STATS
-					rename_buffer(j.buffer, "released send buffer");
+					m_io_thread.rename_buffer(j.buffer, "released send buffer");
 #endif
 					break;
 				}
@@ -2037,6 +3180,44 @@ namespace libtorrent
 					j.storage->finalize_file(j.piece);
 					break;
 				}
+				case disk_io_job::open_block:
+				{
+					if (test_error(j))
+					{
+						ret = -1;
+						break;
+					}
+
+					if (m_settings.adaptive_read_ahead)
+						read_stream = read_ahead_window(j);
+
+					// cached blocks are sent from the cache. Dirty blocks
+					// in the write cache aren't in the file yet
+					bool cached = false;
+					{
+						mutex::scoped_lock l(m_piece_mutex);
+						cached = find_cached_piece(m_read_pieces, j, l) != m_read_pieces.end()
+							|| find_cached_piece(m_pieces, j, l) != m_pieces.end();
+					}
+					if (!cached)
+					{
+						j.file_handle = j.storage->open_block_impl(j.piece, j.offset
+							, j.buffer_size, j.file_offset);
+					}
+#ifdef TORRENT_DISK_STATS
+					m_log << log_time() << " open_block " << (j.file_handle?"file":"fallback")
+						<< std::endl;
+#endif
+					if (j.file_handle)
+					{
+						// the block is sent straight from the file, it's
+						// only read ahead by the kernel
+						if (read_stream >= 0) read_ahead_done(j, read_stream, false, false);
+						ret = j.buffer_size;
+						break;
+					}
+					// otherwise, read the block into a buffer
+				}
 				case disk_io_job::read:
 				{
 					if (test_error(j))
@@ -2049,31 +3230,30 @@ namespace libtorrent
 #endif
 					INVARIANT_CHECK;
 					TORRENT_ASSERT(j.buffer == 0);
-					j.buffer = allocate_buffer("send buffer");
 					TORRENT_ASSERT(j.buffer_size <= m_block_size);
-					if (j.buffer == 0)
+
+					if (m_settings.adaptive_read_ahead && read_stream < 0)
+						read_stream = read_ahead_window(j);
+
+					// storages that map their files hand out the block
+					// as a view into the mapping, which is already in
+					// the page cache, instead of copying it into ours
+					if (map_block(j))
 					{
 #ifdef TORRENT_DISK_STATS
-						m_log << " read 0" << std::endl;
-#endif
-						ret = -1;
-#if BOOST_VERSION == 103500
-						j.error = error_code(boost::system::posix_error::not_enough_memory
-							, get_posix_category());
-#elif BOOST_VERSION > 103500
-						j.error = error_code(boost::system::errc::not_enough_memory
-							, get_posix_category());
-#else
-						j.error = error::no_memory;
+						m_log << " read-mapped " << j.buffer_size << std::endl;
 #endif
-						j.str.clear();
+						if (read_stream >= 0) read_ahead_done(j, read_stream, false, false);
+						ret = j.buffer_size;
 						break;
 					}
 
-					disk_buffer_holder read_holder(*this, j.buffer);
-
+					// on a cache hit, j.buffer is set to the cached block
+					// (or a copy of the requested part of it)
 					bool hit;
 					ret = try_read_from_cache(j, hit);
+					// -2 means the block was read without the cache
+					bool filled_cache = ret >= 0;
 
 #ifdef TORRENT_DISK_STATS
 					m_log << (hit?" read-cache-hit ":" read ") << j.buffer_size << std::endl;
@@ -2082,12 +3262,34 @@ namespace libtorrent
 					// or that the read cache is disabled
 					if (ret == -1)
 					{
-						j.buffer = 0;
+						TORRENT_ASSERT(j.buffer == 0);
 						test_error(j);
 						break;
 					}
 					else if (ret == -2)
 					{
+						TORRENT_ASSERT(j.buffer == 0);
+						j.buffer = m_io_thread.allocate_buffer("send buffer");
+						if (j.buffer == 0)
+						{
+#ifdef TORRENT_DISK_STATS
+							m_log << log_time() << " read 0" << std::endl;
+#endif
+							ret = -1;
+#if BOOST_VERSION == 103500
+							j.error = error_code(boost::system::posix_error::not_enough_memory
+								, get_posix_category());
+#elif BOOST_VERSION > 103500
+							j.error = error_code(boost::system::errc::not_enough_memory
+								, get_posix_category());
+#else
+							j.error = error::no_memory;
+#endif
+							j.clear_strings();
+							break;
+						}
+
+						disk_buffer_holder read_holder(m_io_thread, j.buffer);
 						file::iovec_t b = { j.buffer, j.buffer_size };
 						ret = j.storage->read_impl(&b, j.piece, j.offset, 1);
 						if (ret < 0)
@@ -2100,13 +3302,18 @@ namespace libtorrent
 							// this means the file wasn't big enough for this read
 							j.buffer = 0;
 							j.error = errors::file_too_short;
-							j.error_file.clear();
-							j.str.clear();
+							j.clear_strings();
 							ret = -1;
 							break;
 						}
 						++m_cache_stats.blocks_read;
 						hit = false;
+						{
+							mutex::scoped_lock l(m_piece_mutex);
+							++j.storage->m_cache_misses;
+						}
+						TORRENT_ASSERT(j.buffer == read_holder.get());
+						read_holder.release();
 					}
 					if (!hit)
 					{
@@ -2114,10 +3321,9 @@ namespace libtorrent
 						m_read_time.add_sample(total_microseconds(now - operation_start));
 						m_cache_stats.cumulative_read_time += total_milliseconds(now - operation_start);
 					}
-					TORRENT_ASSERT(j.buffer == read_holder.get());
-					read_holder.release();
+					if (read_stream >= 0) read_ahead_done(j, read_stream, hit, filled_cache);
 #if TORRENT_DISK_STATS
-					rename_buffer(j.buffer, "released send buffer");
+					m_io_thread.rename_buffer(j.buffer, "released send buffer");
 #endif
 					break;
 				}
@@ -2132,29 +3338,29 @@ namespace libtorrent
 					TORRENT_ASSERT(!j.storage->error());
 					TORRENT_ASSERT(j.cache_min_time >= 0);
 
-					if (in_use() >= m_settings.cache_size)
+					if (m_cache_stats.cache_size >= m_cache_limit)
 					{
-						flush_cache_blocks(l, in_use() - m_settings.cache_size + 1);
+						flush_cache_blocks(l, m_cache_stats.cache_size - m_cache_limit + 1);
 						if (test_error(j)) break;
 					}
 					TORRENT_ASSERT(!j.storage->error());
 
-					cache_piece_index_t& idx = m_pieces.get<0>();
-					cache_piece_index_t::iterator p = find_cached_piece(m_pieces, j, l);
+					cache_t::iterator p = find_cached_piece(m_pieces, j, l);
 					int block = j.offset / m_block_size;
 					TORRENT_ASSERT(j.buffer);
 					TORRENT_ASSERT(j.buffer_size <= m_block_size);
 					int piece_size = j.storage->info()->piece_size(j.piece);
 					int blocks_in_piece = (piece_size + m_block_size - 1) / m_block_size;
-					if (p != idx.end())
+					if (p != m_pieces.end())
 					{
 						bool recalc_contiguous = false;
 						TORRENT_ASSERT(p->blocks[block].buf == 0);
 						if (p->blocks[block].buf)
 						{
-							free_buffer(p->blocks[block].buf);
+							m_io_thread.free_buffer(p->blocks[block].buf);
 							--m_cache_stats.cache_size;
-							--const_cast<cached_piece_entry&>(*p).num_blocks;
+							add_cached_blocks(*p->storage, -1);
+							--p->num_blocks;
 						}
 						else if ((block > 0 && p->blocks[block-1].buf)
 							|| (block < blocks_in_piece-1 && p->blocks[block+1].buf)
@@ -2168,25 +3374,31 @@ namespace libtorrent
 						p->blocks[block].buf = j.buffer;
 						p->blocks[block].callback.swap(j.callback);
 #ifdef TORRENT_DISK_STATS
-						rename_buffer(j.buffer, "write cache");
+						m_io_thread.rename_buffer(j.buffer, "write cache");
 #endif
 						++m_cache_stats.cache_size;
-						++const_cast<cached_piece_entry&>(*p).num_blocks;
+						add_cached_blocks(*p->storage, 1);
+						++p->num_blocks;
 						if (recalc_contiguous)
 						{
-							const_cast<cached_piece_entry&>(*p).num_contiguous_blocks = contiguous_blocks(*p);
+							p->num_contiguous_blocks = contiguous_blocks(*p);
 						}
-						idx.modify(p, update_last_use(j.cache_min_time));
+						m_pieces.modify(p, update_last_use(j.cache_min_time));
 						// we might just have created a contiguous range
 						// that meets the requirement to be flushed. try it
 						// if we're in avoid_readback mode, don't do this. Only flush
 						// pieces when we need more space in the cache (which will avoid
 						// flushing blocks out-of-order) or when we issue a hash job,
 						// wich indicates the piece is completely downloaded
-						if (m_settings.disk_cache_algorithm != session_settings::avoid_readback)
-							flush_contiguous_blocks(const_cast<cached_piece_entry&>(*p)
-								, l, m_settings.write_cache_line_size);
-						if (p->num_blocks == 0) idx.erase(p);
+						// in direct I/O mode only whole pieces are flushed, to keep
+						// the writes large and aligned. The head and tail of a
+						// piece are the only parts that may need a read-back
+						if (m_settings.direct_io)
+							flush_contiguous_blocks(*p, l, (p->storage->info()->piece_size(p->piece)
+								+ m_block_size - 1) / m_block_size);
+						else if (m_settings.disk_cache_algorithm != session_settings::avoid_readback)
+							flush_contiguous_blocks(*p, l, m_settings.write_cache_line_size);
+						if (p->num_blocks == 0) m_pieces.erase(p);
 						test_error(j);
 						TORRENT_ASSERT(!j.storage->error());
 					}
@@ -2219,9 +3431,15 @@ namespace libtorrent
 					// free it at the end
 					holder.release();
 
-					if (in_use() > m_settings.cache_size)
+					if (j.storage->m_cache_hard_quota > 0)
 					{
-						flush_cache_blocks(l, in_use() - m_settings.cache_size);
+						enforce_hard_quota(j.storage.get(), 0, -1, l);
+						test_error(j);
+					}
+
+					if (m_cache_stats.cache_size > m_cache_limit)
+					{
+						flush_cache_blocks(l, m_cache_stats.cache_size - m_cache_limit);
 						test_error(j);
 					}
 					TORRENT_ASSERT(!j.storage->error());
@@ -2243,7 +3461,7 @@ namespace libtorrent
 					INVARIANT_CHECK;
 					TORRENT_ASSERT(j.buffer == 0);
 
-					cache_piece_index_t::iterator p;
+					cache_t::iterator p;
 					bool hit;
 					ret = cache_piece(j, p, hit, 0, l);
 					if (ret == -2) ret = -1;
@@ -2260,13 +3478,12 @@ namespace libtorrent
 					mutex::scoped_lock l(m_piece_mutex);
 					INVARIANT_CHECK;
 
-					cache_piece_index_t& idx = m_pieces.get<0>();
-					cache_piece_index_t::iterator i = find_cached_piece(m_pieces, j, l);
-					if (i != idx.end())
+					cache_t::iterator i = find_cached_piece(m_pieces, j, l);
+					if (i != m_pieces.end())
 					{
 						TORRENT_ASSERT(i->storage);
-						int ret = flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
-						idx.erase(i);
+						int ret = flush_range(*i, 0, INT_MAX, l);
+						m_pieces.erase(i);
 						if (test_error(j))
 						{
 							ret = -1;
@@ -2281,6 +3498,27 @@ namespace libtorrent
 						break;
 					}
 
+					if (m_settings.hashing_threads > 0)
+					{
+						// read the remainder of the piece and let a
+						// hash thread hash it and post the handler
+						hash_thread::job hj;
+						int readback = j.storage->read_piece_for_hash(j.piece, hj.ph, hj.bufs);
+						if (test_error(j))
+						{
+							ret = -1;
+							j.storage->mark_failed(j.piece);
+							break;
+						}
+
+						m_cache_stats.total_read_back += readback / m_block_size;
+
+						hj.handler = boost::bind(&disk_io_worker::on_piece_hashed, this, _1, j, 0);
+						m_io_thread.m_hash_thread.async_hash(hj);
+						ret = defer_handler;
+						break;
+					}
+
 					ptime hash_start = time_now_hires();
 
 					int readback = 0;
@@ -2299,6 +3537,7 @@ namespace libtorrent
 
 					ptime done = time_now_hires();
 					m_hash_time.add_sample(total_microseconds(done - hash_start));
+					++m_num_hashed;
 					m_cache_stats.cumulative_hash_time += total_milliseconds(done - hash_start);
 					break;
 				}
@@ -2308,13 +3547,15 @@ namespace libtorrent
 					m_log << log_time() << " move" << std::endl;
 #endif
 					TORRENT_ASSERT(j.buffer == 0);
-					ret = j.storage->move_storage_impl(j.str);
+					ret = j.storage->move_storage_impl(j.str());
 					if (ret != 0)
 					{
 						test_error(j);
 						break;
 					}
-					j.str = j.storage->save_path();
+					j.extra().str = j.storage->save_path();
+					j.extra().device = device_of(j.extra().str);
+					m_io_thread.set_device(j.storage.get(), j.extra().device);
 					break;
 				}
 				case disk_io_job::release_files:
@@ -2331,7 +3572,7 @@ namespace libtorrent
 					{
 						if (i->storage == j.storage)
 						{
-							flush_range(const_cast<cached_piece_entry&>(*i), 0, INT_MAX, l);
+							flush_range(*i, 0, INT_MAX, l);
 							i = m_pieces.erase(i);
 						}
 						else
@@ -2340,7 +3581,7 @@ namespace libtorrent
 						}
 					}
 					l.unlock();
-					release_memory();
+					m_io_thread.release_memory();
 
 					ret = j.storage->release_files_impl();
 					if (ret != 0) test_error(j);
@@ -2361,7 +3602,7 @@ namespace libtorrent
 					{
 						if (i->storage == j.storage)
 						{
-							free_piece(const_cast<cached_piece_entry&>(*i), l);
+							free_piece(*i, l);
 							i = m_read_pieces.erase(i);
 						}
 						else
@@ -2370,7 +3611,7 @@ namespace libtorrent
 						}
 					}
 					l.unlock();
-					release_memory();
+					m_io_thread.release_memory();
 					ret = 0;
 					break;
 				}
@@ -2385,33 +3626,35 @@ namespace libtorrent
 					INVARIANT_CHECK;
 
  					// delete all write cache entries for this storage
-					cache_piece_index_t& idx = m_pieces.get<0>();
-					cache_piece_index_t::iterator start = idx.lower_bound(std::pair<void*, int>(j.storage.get(), 0));
-					cache_piece_index_t::iterator end = idx.upper_bound(std::pair<void*, int>(j.storage.get(), INT_MAX));
-
 					// build a vector of all the buffers we need to free
 					// and free them all in one go
 					std::vector<char*> buffers;
 					torrent_info const& ti = *j.storage->info();
-					for (cache_piece_index_t::iterator i = start; i != end; ++i)
+					for (cache_t::iterator i = m_pieces.begin(); i != m_pieces.end();)
 					{
+						if (i->storage != j.storage)
+						{
+							++i;
+							continue;
+						}
 						int blocks_in_piece = (ti.piece_size(i->piece) + m_block_size - 1) / m_block_size;
-						cached_piece_entry& e = const_cast<cached_piece_entry&>(*i);
+						cached_piece_entry& e = *i;
 						for (int j = 0; j < blocks_in_piece; ++j)
 						{
 							if (i->blocks[j].buf == 0) continue;
 							buffers.push_back(i->blocks[j].buf);
 							i->blocks[j].buf = 0;
 							--m_cache_stats.cache_size;
+							add_cached_blocks(*e.storage, -1);
 							TORRENT_ASSERT(e.num_blocks > 0);
 							--e.num_blocks;
 						}
 						TORRENT_ASSERT(i->num_blocks == 0);
+						i = m_pieces.erase(i);
 					}
-					idx.erase(start, end);
 					l.unlock();
-					if (!buffers.empty()) free_multiple_buffers(&buffers[0], buffers.size());
-					release_memory();
+					if (!buffers.empty()) m_io_thread.free_multiple_buffers(&buffers[0], buffers.size());
+					m_io_thread.release_memory();
 
 					ret = j.storage->delete_files_impl();
 					if (ret != 0) test_error(j);
@@ -2422,10 +3665,22 @@ namespace libtorrent
 #ifdef TORRENT_DISK_STATS
 					m_log << log_time() << " check_fastresume" << std::endl;
 #endif
-					lazy_entry const* rd = (lazy_entry const*)j.buffer;
-					TORRENT_ASSERT(rd != 0);
-					ret = j.storage->check_fastresume(*rd, j.error);
+					if (j.binary_resume())
+					{
+						binary_resume_data const* rd = j.binary_resume();
+						ret = j.storage->check_fastresume(*rd, j.error);
+					}
+					else
+					{
+						lazy_entry const* rd = (lazy_entry const*)j.buffer;
+						TORRENT_ASSERT(rd != 0);
+						ret = j.storage->check_fastresume(*rd, j.error);
+					}
 					test_error(j);
+					// the device is passed back for the torrent to
+					// be checked in parallel with those on other drives
+					j.extra().device = device_of(j.storage->save_path());
+					m_io_thread.set_device(j.storage.get(), j.extra().device);
 					break;
 				}
 				case disk_io_job::check_files:
@@ -2456,18 +3711,24 @@ namespace libtorrent
 #endif
 
 						ptime hash_start = time_now_hires();
-						if (m_waiting_to_shutdown) break;
+						if (m_io_thread.m_waiting_to_shutdown) break;
 
 						ret = j.storage->check_files(j.piece, j.offset, j.error);
 
 						ptime done = time_now_hires();
 						m_hash_time.add_sample(total_microseconds(done - hash_start));
+						++m_num_hashed;
 						m_cache_stats.cumulative_hash_time += total_milliseconds(done - hash_start);
 
 						TORRENT_TRY {
 							TORRENT_ASSERT(j.callback);
 							if (j.callback && ret == piece_manager::need_full_check)
-								post_callback(j.callback, j, ret);
+							{
+								// the callback is called for every step of
+								// the check, post a copy of it
+								boost::function<void(int, disk_io_job const&)> progress = j.callback;
+								post_callback(progress, j, ret);
+							}
 						} TORRENT_CATCH(std::exception&) {}
 						if (ret != piece_manager::need_full_check) break;
 					}
@@ -2484,7 +3745,7 @@ namespace libtorrent
 						// offset needs to be reset to 0 so that the disk
 						// job sorting can be done correctly
 						j.offset = 0;
-						add_job(j, j.callback);
+						add_job(j);
 						continue;
 					}
 					break;
@@ -2494,8 +3755,8 @@ namespace libtorrent
 #ifdef TORRENT_DISK_STATS
 					m_log << log_time() << " save_resume_data" << std::endl;
 #endif
-					j.resume_data.reset(new entry(entry::dictionary_t));
-					j.storage->write_resume_data(*j.resume_data);
+					j.extra().resume_data.reset(new entry(entry::dictionary_t));
+					j.storage->write_resume_data(*j.extra().resume_data);
 					ret = 0;
 					break;
 				}
@@ -2504,7 +3765,7 @@ namespace libtorrent
 #ifdef TORRENT_DISK_STATS
 					m_log << log_time() << " rename_file" << std::endl;
 #endif
-					ret = j.storage->rename_file_impl(j.piece, j.str);
+					ret = j.storage->rename_file_impl(j.piece, j.str());
 					if (ret != 0)
 					{
 						test_error(j);
@@ -2518,7 +3779,7 @@ namespace libtorrent
 				TORRENT_DECLARE_DUMMY(std::exception, e);
 				ret = -1;
 				TORRENT_TRY {
-					j.str = e.what();
+					j.extra().str = e.what();
 				} TORRENT_CATCH(std::exception&) {}
 			}
 
@@ -2527,6 +3788,19 @@ namespace libtorrent
 			ptime done = time_now_hires();
 			m_job_time.add_sample(total_microseconds(done - operation_start));
 			m_cache_stats.cumulative_job_time += total_milliseconds(done - operation_start);
+			m_cache_stats.job_time_histogram[j.action].add_sample(
+				total_microseconds(done - service_start));
+
+			// the time from queueing the block until it's in the cache
+			// includes the time spent waiting for the disk whenever the
+			// write cache is flushed, which is what the write queue of
+			// the drive is adjusted to
+			if (j.action == disk_io_job::write)
+				m_io_thread.write_done(j.storage.get(), j.buffer_size
+					, total_microseconds(done - j.start_time));
+
+			// the hash thread completing this job posts its handler
+			if (ret == defer_handler) continue;
 
 //			if (!j.callback) std::cerr << "DISK THREAD: no callback specified" << std::endl;
 //			else std::cerr << "DISK THREAD: invoking callback" << std::endl;
@@ -2534,11 +3808,11 @@ namespace libtorrent
 				TORRENT_ASSERT(ret != -2 || j.error
 					|| j.action == disk_io_job::hash);
 #if TORRENT_DISK_STATS
-				if ((j.action == disk_io_job::read || j.action == disk_io_job::read_and_hash)
-					&& j.buffer != 0)
-					rename_buffer(j.buffer, "posted send buffer");
+				if ((j.action == disk_io_job::read || j.action == disk_io_job::read_and_hash
+					|| j.action == disk_io_job::open_block) && j.buffer != 0)
+					m_io_thread.rename_buffer(j.buffer, "posted send buffer");
 #endif
-				post_callback(j.callback, j, ret);
+				post_callback(j, ret);
 			} TORRENT_CATCH(std::exception&) {
 				TORRENT_ASSERT(false);
 			}
@@ -194,8 +194,8 @@ namespace libtorrent
 			"invalid entry type in slot list",
 			"invalid piece index in slot list",
 			"pieces needs to be reordered",
-			"",
-			"",
+			"truncated or corrupt binary resume data",
+			"unsupported binary resume data version",
 			"",
 			"",
 			"",
@@ -187,6 +187,7 @@ namespace libtorrent
 		s->mtime = ret.st_mtime;
 		s->ctime = ret.st_ctime;
 		s->mode = ret.st_mode;
+		s->device = ret.st_dev;
 	}
 
 	void rename(std::string const& inf, std::string const& newf, error_code& ec)
@@ -1654,6 +1655,25 @@ namespace libtorrent
 		return true;
 	}
 
+	bool file::sync(error_code& ec)
+	{
+		TORRENT_ASSERT(is_open());
+#ifdef TORRENT_WINDOWS
+		if (FlushFileBuffers(m_file_handle) == FALSE)
+		{
+			ec.assign(GetLastError(), get_system_category());
+			return false;
+		}
+#else
+		if (fsync(m_fd) != 0)
+		{
+			ec.assign(errno, get_posix_category());
+			return false;
+		}
+#endif
+		return true;
+	}
+
 	void file::finalize()
 	{
 #ifdef TORRENT_WINDOWS
@@ -31,15 +31,136 @@ POSSIBILITY OF SUCH DAMAGE.
 */
 
 #include <boost/version.hpp>
-#include <boost/bind.hpp>
 #include "libtorrent/pch.hpp"
 #include "libtorrent/assert.hpp"
 #include "libtorrent/file_pool.hpp"
 #include "libtorrent/error_code.hpp"
 #include "libtorrent/file_storage.hpp" // for file_entry
+#include <algorithm>
+#include <new>
 
 namespace libtorrent
 {
+	namespace
+	{
+		// returns true if a file opened with mode 'have' can't
+		// be used for an access that needs mode 'want'
+		bool needs_reopen(int have, int want)
+		{
+			return (((have & file::rw_mask) != file::read_write)
+				&& ((want & file::rw_mask) == file::read_write))
+				|| (have & file::no_buffer) != (want & file::no_buffer)
+				|| (have & file::random_access) != (want & file::random_access);
+		}
+	}
+
+	file_pool::file_pool(int size)
+		: m_size(size)
+		, m_low_prio_io(true)
+		, m_num_files(0)
+	{}
+
+	file_pool::~file_pool()
+	{
+		release(0);
+	}
+
+	file_pool::shard& file_pool::shard_for(void* st)
+	{
+		std::size_t h = std::size_t(st) >> 4;
+		h ^= (h >> 7) ^ (h >> 13);
+		return m_shards[h % num_shards];
+	}
+
+	int file_pool::shard::bucket(void* st, int file_index) const
+	{
+		TORRENT_ASSERT(!buckets.empty());
+		std::size_t h = (std::size_t(st) >> 4) ^ (std::size_t(file_index) * 2654435761u);
+		h ^= h >> 16;
+		return int(h & (buckets.size() - 1));
+	}
+
+	file_pool::lru_file_entry* file_pool::shard::find(void* st, int file_index) const
+	{
+		if (num_files == 0) return 0;
+		for (lru_file_entry* e = buckets[bucket(st, file_index)]; e; e = e->hash_next)
+		{
+			if (e->file_index == file_index && e->key == st) return e;
+		}
+		return 0;
+	}
+
+	void file_pool::shard::insert(lru_file_entry* e)
+	{
+		TORRENT_ASSERT(find(e->key, e->file_index) == 0);
+		if (num_files >= int(buckets.size()))
+			rehash((std::max)(int(buckets.size()) * 2, 16));
+
+		lru_file_entry*& b = buckets[bucket(e->key, e->file_index)];
+		e->hash_next = b;
+		b = e;
+
+		e->lru_next = 0;
+		e->lru_prev = lru_tail;
+		if (lru_tail) lru_tail->lru_next = e;
+		else lru_head = e;
+		lru_tail = e;
+		++num_files;
+	}
+
+	void file_pool::shard::erase(lru_file_entry* e)
+	{
+		lru_file_entry** i = &buckets[bucket(e->key, e->file_index)];
+		while (*i != e)
+		{
+			TORRENT_ASSERT(*i);
+			i = &(*i)->hash_next;
+		}
+		*i = e->hash_next;
+
+		if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+		else lru_head = e->lru_next;
+		if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+		else lru_tail = e->lru_prev;
+		e->hash_next = 0;
+		e->lru_prev = 0;
+		e->lru_next = 0;
+		--num_files;
+	}
+
+	void file_pool::shard::touch(lru_file_entry* e)
+	{
+		if (e == lru_tail) return;
+		if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+		else lru_head = e->lru_next;
+		e->lru_next->lru_prev = e->lru_prev;
+
+		e->lru_next = 0;
+		e->lru_prev = lru_tail;
+		lru_tail->lru_next = e;
+		lru_tail = e;
+	}
+
+	void file_pool::shard::rehash(int num_buckets)
+	{
+		TORRENT_ASSERT((num_buckets & (num_buckets - 1)) == 0);
+		std::vector<lru_file_entry*> old;
+		old.swap(buckets);
+		buckets.resize(num_buckets, 0);
+		for (std::vector<lru_file_entry*>::iterator i = old.begin()
+			, end(old.end()); i != end; ++i)
+		{
+			for (lru_file_entry* e = *i; e;)
+			{
+				lru_file_entry* next = e->hash_next;
+				lru_file_entry*& b = buckets[bucket(e->key, e->file_index)];
+				e->hash_next = b;
+				b = e;
+				e = next;
+			}
+		}
+	}
+
 	boost::intrusive_ptr<file> file_pool::open_file(void* st, std::string const& p
 		, file_storage::iterator fe, file_storage const& fs, int m, error_code& ec)
 	{
@@ -47,133 +168,209 @@ namespace libtorrent
 		TORRENT_ASSERT(is_complete(p));
 		TORRENT_ASSERT((m & file::rw_mask) == file::read_only
 			|| (m & file::rw_mask) == file::read_write);
-		mutex::scoped_lock l(m_mutex);
-		file_set::iterator i = m_files.find(std::make_pair(st, fs.file_index(*fe)));
-		if (i != m_files.end())
-		{
-			lru_file_entry& e = i->second;
-			e.last_use = time_now();
+		int file_index = fs.file_index(*fe);
+		shard& s = shard_for(st);
 
-			if (e.key != st && ((e.mode & file::rw_mask) != file::read_only
-				|| (m & file::rw_mask) != file::read_only))
+		// an entry whose file is open in the wrong mode is taken out of
+		// the cache, and the file is opened again below, like a new one
+		lru_file_entry* stale = 0;
+		{
+			mutex::scoped_lock l(s.mtx);
+			lru_file_entry* e = s.find(st, file_index);
+			if (e)
 			{
-				// this means that another instance of the storage
-				// is using the exact same file.
-#if BOOST_VERSION >= 103500
-				ec = errors::file_collision;
-#endif
-				return boost::intrusive_ptr<file>();
-			}
+				e->last_use = time_now();
+				s.touch(e);
 
-			e.key = st;
-			// if we asked for a file in write mode,
-			// and the cached file is is not opened in
-			// write mode, re-open it
-			if ((((e.mode & file::rw_mask) != file::read_write)
-				&& ((m & file::rw_mask) == file::read_write))
-				|| (e.mode & file::no_buffer) != (m & file::no_buffer)
-				|| (e.mode & file::random_access) != (m & file::random_access))
-			{
-				// close the file before we open it with
-				// the new read/write privilages
-				TORRENT_ASSERT(e.file_ptr->refcount() == 1);
-				e.file_ptr->close();
-				std::string full_path = combine_path(p, fs.file_path(*fe));
-				if (!e.file_ptr->open(full_path, m, ec))
+				if (e->key != st && ((e->mode & file::rw_mask) != file::read_only
+					|| (m & file::rw_mask) != file::read_only))
 				{
-					m_files.erase(i);
+					// this means that another instance of the storage
+					// is using the exact same file.
+#if BOOST_VERSION >= 103500
+					ec = errors::file_collision;
+#endif
 					return boost::intrusive_ptr<file>();
 				}
-#ifdef TORRENT_WINDOWS
-// file prio is supported on vista and up
-#if _WIN32_WINNT >= 0x0600
-				if (m_low_prio_io)
+
+				if (!needs_reopen(e->mode, m))
 				{
-					// TODO: load this function dynamically from Kernel32.dll
-					FILE_IO_PRIORITY_HINT_INFO priorityHint;
-					priorityHint.PriorityHint = IoPriorityHintLow;
-					SetFileInformationByHandle(e.file_ptr->native_handle(),
-						FileIoPriorityHintInfo, &priorityHint, sizeof(PriorityHint));
+					TORRENT_ASSERT((e->mode & file::no_buffer) == (m & file::no_buffer));
+					return e->file_ptr;
 				}
-#endif
-#endif
-				TORRENT_ASSERT(e.file_ptr->is_open());
-				e.mode = m;
+
+				// if we asked for a file in write mode, and the cached
+				// file is not opened in write mode, re-open it
+				s.erase(e);
+				--m_num_files;
+				stale = e;
 			}
-			TORRENT_ASSERT((e.mode & file::no_buffer) == (m & file::no_buffer));
-			return e.file_ptr;
 		}
-		// the file is not in our cache
-		if ((int)m_files.size() >= m_size)
-		{
-			// the file cache is at its maximum size, close
-			// the least recently used (lru) file from it
-			remove_oldest();
-		}
-		lru_file_entry e;
-		e.file_ptr.reset(new (std::nothrow)file);
-		if (!e.file_ptr)
+
+		// close the file before we open it with the new read/write
+		// privilages. If someone else still holds on to it, e.g. a
+		// peer sending a block straight out of it with sendfile(),
+		// the file is left open for them
+		delete stale;
+
+		// the file is not in our cache. If the cache is at its
+		// maximum size, close the least recently used file first
+		if (m_num_files >= size_limit()) remove_oldest();
+
+		// the file is opened without holding the lock, other
+		// threads may use the shard in the meantime
+		lru_file_entry* e = new (std::nothrow) lru_file_entry;
+		if (e) e->file_ptr.reset(new (std::nothrow) file);
+		if (e == 0 || !e->file_ptr)
 		{
+			delete e;
 			ec = error_code(ENOMEM, get_posix_category());
-			return e.file_ptr;
+			return boost::intrusive_ptr<file>();
 		}
 		std::string full_path = combine_path(p, fs.file_path(*fe));
-		if (!e.file_ptr->open(full_path, m, ec))
+		if (!e->file_ptr->open(full_path, m, ec))
+		{
+			delete e;
 			return boost::intrusive_ptr<file>();
-		e.mode = m;
-		e.key = st;
-		m_files.insert(std::make_pair(std::make_pair(st, fs.file_index(*fe)), e));
-		TORRENT_ASSERT(e.file_ptr->is_open());
-		return e.file_ptr;
+		}
+#ifdef TORRENT_WINDOWS
+// file prio is supported on vista and up
+#if _WIN32_WINNT >= 0x0600
+		if (m_low_prio_io)
+		{
+			// TODO: load this function dynamically from Kernel32.dll
+			FILE_IO_PRIORITY_HINT_INFO priorityHint;
+			priorityHint.PriorityHint = IoPriorityHintLow;
+			SetFileInformationByHandle(e->file_ptr->native_handle(),
+				FileIoPriorityHintInfo, &priorityHint, sizeof(PriorityHint));
+		}
+#endif
+#endif
+		e->mode = m;
+		e->key = st;
+		e->file_index = file_index;
+		TORRENT_ASSERT(e->file_ptr->is_open());
+		boost::intrusive_ptr<file> ret = e->file_ptr;
+
+		mutex::scoped_lock l(s.mtx);
+		lru_file_entry* other = s.find(st, file_index);
+		if (other)
+		{
+			// another thread opened the same file while we didn't hold
+			// the lock. Keep the handle that's good for both accesses
+			other->last_use = time_now();
+			s.touch(other);
+			if (!needs_reopen(other->mode, m)) ret = other->file_ptr;
+			else
+			{
+				other->file_ptr.swap(e->file_ptr);
+				other->mode = m;
+			}
+			l.unlock();
+			delete e;
+			return ret;
+		}
+		s.insert(e);
+		++m_num_files;
+		return ret;
 	}
 
 	void file_pool::remove_oldest()
 	{
-		file_set::iterator i = std::min_element(m_files.begin(), m_files.end()
-			, boost::bind(&lru_file_entry::last_use, boost::bind(&file_set::value_type::second, _1))
-				< boost::bind(&lru_file_entry::last_use, boost::bind(&file_set::value_type::second, _2)));
-		if (i == m_files.end()) return;
-		m_files.erase(i);
+		// the least recently used file is the oldest
+		// of the least recently used files of each shard
+		shard* oldest = 0;
+		ptime oldest_use = max_time();
+		for (int i = 0; i < num_shards; ++i)
+		{
+			shard& s = m_shards[i];
+			mutex::scoped_lock l(s.mtx);
+			if (s.lru_head == 0 || s.lru_head->last_use >= oldest_use) continue;
+			oldest = &s;
+			oldest_use = s.lru_head->last_use;
+		}
+		if (oldest == 0) return;
+
+		lru_file_entry* e = 0;
+		{
+			mutex::scoped_lock l(oldest->mtx);
+			// the shard may have changed since we looked at it
+			e = oldest->lru_head;
+			if (e == 0) return;
+			oldest->erase(e);
+			--m_num_files;
+		}
+		// closing the file may block, don't hold the lock
+		delete e;
 	}
 
 	void file_pool::release(void* st, int file_index)
 	{
-		mutex::scoped_lock l(m_mutex);
-		file_set::iterator i = m_files.find(std::make_pair(st, file_index));
-		if (i != m_files.end()) m_files.erase(i);
+		shard& s = shard_for(st);
+		lru_file_entry* e = 0;
+		{
+			mutex::scoped_lock l(s.mtx);
+			e = s.find(st, file_index);
+			if (e == 0) return;
+			s.erase(e);
+			--m_num_files;
+		}
+		delete e;
 	}
 
 	// closes files belonging to the specified
 	// storage. If 0 is passed, all files are closed
 	void file_pool::release(void* st)
 	{
-		mutex::scoped_lock l(m_mutex);
-		if (st == 0)
+		for (int i = 0; i < num_shards; ++i)
 		{
-			m_files.clear();
-			return;
-		}
+			shard& s = m_shards[i];
+			if (st != 0 && &s != &shard_for(st)) continue;
 
-		for (file_set::iterator i = m_files.begin();
-			i != m_files.end();)
-		{
-			if (i->second.key == st)
-				m_files.erase(i++);
-			else
-				++i;
+			// unlink the files while holding the lock,
+			// and close them after releasing it
+			lru_file_entry* closing = 0;
+			{
+				mutex::scoped_lock l(s.mtx);
+				for (lru_file_entry* e = s.lru_head; e;)
+				{
+					lru_file_entry* next = e->lru_next;
+					if (st == 0 || e->key == st)
+					{
+						s.erase(e);
+						--m_num_files;
+						e->lru_next = closing;
+						closing = e;
+					}
+					e = next;
+				}
+			}
+			while (closing)
+			{
+				lru_file_entry* next = closing->lru_next;
+				delete closing;
+				closing = next;
+			}
 		}
 	}
 
+	int file_pool::size_limit() const
+	{
+		mutex::scoped_lock l(m_size_mutex);
+		return m_size;
+	}
+
 	void file_pool::resize(int size)
 	{
 		TORRENT_ASSERT(size > 0);
-		if (size == m_size) return;
-		mutex::scoped_lock l(m_mutex);
-		m_size = size;
-		if (int(m_files.size()) <= m_size) return;
+		{
+			mutex::scoped_lock l(m_size_mutex);
+			if (size == m_size) return;
+			m_size = size;
+		}
 
 		// close the least recently used files
-		while (int(m_files.size()) > m_size)
+		while (m_num_files > size)
 			remove_oldest();
 	}
 
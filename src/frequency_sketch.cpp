@@ -0,0 +1,126 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/frequency_sketch.hpp"
+#include "libtorrent/assert.hpp"
+#include <algorithm>
+
+namespace
+{
+	// each row uses a different seed to pick its counter
+	boost::uint32_t const row_seeds[] =
+	{ 0xc3a5c85cu, 0xb492b66fu, 0x9ae16a3bu, 0x7f4a7c15u };
+
+	int const num_rows = sizeof(row_seeds) / sizeof(row_seeds[0]);
+}
+
+namespace libtorrent
+{
+	frequency_sketch::frequency_sketch()
+		: m_mask(0)
+		, m_samples(0)
+		, m_sample_size(0)
+	{}
+
+	void frequency_sketch::resize(int keys)
+	{
+		int width = 16;
+		while (width < keys) width *= 2;
+		if (width == m_mask + 1 && !m_table.empty()) return;
+
+		m_mask = width - 1;
+		m_sample_size = width * 10;
+		// two 4 bit counters per byte
+		m_table.assign(num_rows * width / 2, 0);
+		m_samples = 0;
+	}
+
+	void frequency_sketch::clear()
+	{
+		std::fill(m_table.begin(), m_table.end(), 0);
+		m_samples = 0;
+	}
+
+	int frequency_sketch::index(boost::uint32_t key, int row) const
+	{
+		// the finalizer of murmur3 (fmix32). Every bit of the key
+		// affects the low bits, so keys that collide in one row
+		// are unlikely to collide in the others
+		boost::uint32_t h = key ^ row_seeds[row];
+		h ^= h >> 16;
+		h *= 0x85ebca6bu;
+		h ^= h >> 13;
+		h *= 0xc2b2ae35u;
+		h ^= h >> 16;
+		return row * (m_mask + 1) + int(h & m_mask);
+	}
+
+	void frequency_sketch::increment(boost::uint32_t key)
+	{
+		if (m_table.empty()) return;
+
+		for (int r = 0; r < num_rows; ++r)
+		{
+			int i = index(key, r);
+			int shift = (i & 1) * 4;
+			boost::uint8_t& b = m_table[i / 2];
+			if (((b >> shift) & 0xf) < max_count) b += 1 << shift;
+		}
+
+		if (++m_samples >= m_sample_size) age();
+	}
+
+	int frequency_sketch::estimate(boost::uint32_t key) const
+	{
+		if (m_table.empty()) return 0;
+
+		int ret = max_count;
+		for (int r = 0; r < num_rows; ++r)
+		{
+			int i = index(key, r);
+			ret = (std::min)(ret, (m_table[i / 2] >> ((i & 1) * 4)) & 0xf);
+		}
+		return ret;
+	}
+
+	void frequency_sketch::age()
+	{
+		// halve both counters in every byte
+		for (std::vector<boost::uint8_t>::iterator i = m_table.begin()
+			, end(m_table.end()); i != end; ++i)
+			*i = (*i >> 1) & 0x77;
+		m_samples /= 2;
+	}
+}
+
@@ -0,0 +1,165 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/hash_thread.hpp"
+#include "libtorrent/disk_io_thread.hpp" // for disk_buffer_pool
+#include "libtorrent/time.hpp"
+#include "libtorrent/assert.hpp"
+
+#include <boost/bind.hpp>
+#include <algorithm> // for max
+
+namespace libtorrent
+{
+	hash_thread::hash_thread(disk_buffer_pool& pool)
+		: m_pool(pool)
+		, m_abort(false)
+		, m_cumulative_hash_time(0)
+		, m_num_hashed(0)
+	{}
+
+	hash_thread::~hash_thread()
+	{
+		TORRENT_ASSERT(m_threads.empty());
+	}
+
+	void hash_thread::async_hash(job const& j)
+	{
+		mutex::scoped_lock l(m_mutex);
+		TORRENT_ASSERT(!m_abort);
+		TORRENT_ASSERT(!m_threads.empty());
+		m_jobs.push_back(j);
+		m_cond.signal_all(l);
+	}
+
+	void hash_thread::set_num_threads(int n)
+	{
+		mutex::scoped_lock l(m_mutex);
+		if (m_abort) return;
+		while (int(m_threads.size()) < n)
+		{
+			m_threads.push_back(boost::shared_ptr<thread>(
+				new thread(boost::bind(&hash_thread::thread_fun, this))));
+		}
+	}
+
+	int hash_thread::num_threads() const
+	{
+		mutex::scoped_lock l(m_mutex);
+		return m_threads.size();
+	}
+
+	void hash_thread::stop()
+	{
+		mutex::scoped_lock l(m_mutex);
+		m_abort = true;
+		m_cond.signal_all(l);
+		std::vector<boost::shared_ptr<thread> > threads;
+		threads.swap(m_threads);
+		l.unlock();
+
+		for (std::vector<boost::shared_ptr<thread> >::iterator i = threads.begin()
+			, end(threads.end()); i != end; ++i)
+			(*i)->join();
+	}
+
+	int hash_thread::average_hash_time() const
+	{
+		mutex::scoped_lock l(m_mutex);
+		return m_hash_time.mean();
+	}
+
+	boost::uint32_t hash_thread::cumulative_hash_time() const
+	{
+		mutex::scoped_lock l(m_mutex);
+		return m_cumulative_hash_time;
+	}
+
+	boost::uint32_t hash_thread::num_hashed() const
+	{
+		mutex::scoped_lock l(m_mutex);
+		return m_num_hashed;
+	}
+
+	void hash_thread::thread_fun()
+	{
+		for (;;)
+		{
+			mutex::scoped_lock l(m_mutex);
+			while (m_jobs.empty() && !m_abort)
+				m_cond.wait(l);
+
+			// when aborting, the queue is drained first. The jobs
+			// own disk buffers and their handlers complete disk jobs
+			if (m_jobs.empty()) return;
+
+			job j = m_jobs.front();
+			m_jobs.pop_front();
+			l.unlock();
+
+			ptime hash_start = time_now_hires();
+
+			sha1_hash h;
+			if (j.work)
+			{
+				TORRENT_ASSERT(j.bufs.empty());
+				j.work();
+			}
+			else
+			{
+				for (std::vector<file::iovec_t>::iterator i = j.bufs.begin()
+					, end(j.bufs.end()); i != end; ++i)
+				{
+					j.ph.h.update((char const*)i->iov_base, i->iov_len);
+					j.ph.offset += i->iov_len;
+					m_pool.free_buffer((char*)i->iov_base);
+				}
+				h = j.ph.h.final();
+			}
+
+			ptime done = time_now_hires();
+
+			TORRENT_ASSERT(j.num_pieces > 0);
+			l.lock();
+			m_hash_time.add_sample(total_microseconds(done - hash_start)
+				/ (std::max)(j.num_pieces, 1));
+			m_cumulative_hash_time += total_milliseconds(done - hash_start);
+			m_num_hashed += j.num_pieces;
+			l.unlock();
+
+			if (j.handler) j.handler(h);
+		}
+	}
+}
+
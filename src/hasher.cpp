@@ -0,0 +1,473 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/hasher.hpp"
+#include "libtorrent/assert.hpp"
+#include "libtorrent/time.hpp"
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/once.hpp>
+#include <cstring>
+#include <climits>
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+// the multi-buffer SHA-1 implementation relies on the GCC vector
+// extensions, and on the target attribute and __builtin_cpu_supports()
+// for runtime dispatch on x86
+#if (defined __clang__ || (defined __GNUC__ \
+	&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))) \
+	&& (defined __x86_64__ || defined __i386__)
+#define TORRENT_SHA1_MB_X86 1
+#endif
+
+#if (defined __clang__ || (defined __GNUC__ \
+	&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8)))) \
+	&& (defined __ARM_NEON__ || defined __ARM_NEON || defined __aarch64__)
+#define TORRENT_SHA1_MB_NEON 1
+#endif
+
+#if defined TORRENT_SHA1_MB_X86 || defined TORRENT_SHA1_MB_NEON
+#define TORRENT_USE_SHA1_MB 1
+#endif
+
+namespace libtorrent
+{
+	namespace
+	{
+		typedef boost::uint32_t u32;
+		typedef boost::uint8_t u8;
+
+#ifdef TORRENT_USE_SHA1_MB
+
+		enum { max_lanes = 8 };
+
+		inline u32 load_be(u8 const* p)
+		{
+			return (u32(p[0]) << 24) | (u32(p[1]) << 16)
+				| (u32(p[2]) << 8) | u32(p[3]);
+		}
+
+		inline u32 rol(u32 v, int bits)
+		{ return (v << bits) | (v >> (32 - bits)); }
+
+		// hashes a single 64 byte block into state. Used for the
+		// digests of prefixes, which can't be hashed in lock-step
+		// with the other lanes
+		void sha1_block(u32* s, u8 const* p)
+		{
+			u32 w[80];
+			for (int i = 0; i < 16; ++i) w[i] = load_be(p + i * 4);
+			for (int i = 16; i < 80; ++i)
+				w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+			u32 a = s[0], b = s[1], c = s[2], d = s[3], e = s[4];
+			for (int i = 0; i < 80; ++i)
+			{
+				u32 f, k;
+				if (i < 20) { f = (b & (c ^ d)) ^ d; k = 0x5A827999; }
+				else if (i < 40) { f = b ^ c ^ d; k = 0x6ED9EBA1; }
+				else if (i < 60) { f = (b & c) | (d & (b | c)); k = 0x8F1BBCDC; }
+				else { f = b ^ c ^ d; k = 0xCA62C1D6; }
+				u32 t = rol(a, 5) + f + e + k + w[i];
+				e = d; d = c; c = rol(b, 30); b = a; a = t;
+			}
+			s[0] += a; s[1] += b; s[2] += c; s[3] += d; s[4] += e;
+		}
+
+		// writes the last len (< 64) bytes of a message of total_len
+		// bytes, followed by the SHA-1 padding, to tail. Returns the
+		// number of 64 byte blocks written (1 or 2)
+		int pad_tail(u8* tail, u8 const* data, int len, boost::uint64_t total_len)
+		{
+			TORRENT_ASSERT(len >= 0 && len < 64);
+			int blocks = len + 9 <= 64 ? 1 : 2;
+			std::memcpy(tail, data, len);
+			tail[len] = 0x80;
+			std::memset(tail + len + 1, 0, blocks * 64 - len - 1);
+			boost::uint64_t bits = total_len * 8;
+			for (int i = 0; i < 8; ++i)
+				tail[blocks * 64 - 1 - i] = u8(bits >> (i * 8));
+			return blocks;
+		}
+
+		void to_digest(u32 const* s, sha1_hash& h)
+		{
+			for (int i = 0; i < 5; ++i)
+			{
+				h[i * 4] = u8(s[i] >> 24);
+				h[i * 4 + 1] = u8(s[i] >> 16);
+				h[i * 4 + 2] = u8(s[i] >> 8);
+				h[i * 4 + 3] = u8(s[i]);
+			}
+		}
+
+		typedef u32 vec4 __attribute__((vector_size(16)));
+#ifdef TORRENT_SHA1_MB_X86
+		typedef u32 vec8 __attribute__((vector_size(32)));
+#endif
+
+		// hashes num_blocks consecutive 64 byte blocks from each of the
+		// Lanes buffers in data, one buffer per vector lane. state holds
+		// the five state words of every lane, as state[word * Lanes + lane].
+		// This is inlined into the entry points below, which are compiled
+		// for the instruction set the vector type maps to
+		template <class V, int Lanes>
+		inline __attribute__((always_inline))
+		void sha1_mb_blocks(u32* state, u8 const** data, int num_blocks)
+		{
+			V v[5];
+			std::memcpy(v, state, sizeof(v));
+			V k[4];
+			u32 const kv[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+			for (int i = 0; i < 4; ++i)
+				for (int l = 0; l < Lanes; ++l) k[i][l] = kv[i];
+
+			for (int blk = 0; blk < num_blocks; ++blk)
+			{
+				u32 words[16][Lanes];
+				for (int l = 0; l < Lanes; ++l)
+				{
+					u8 const* p = data[l] + blk * 64;
+					for (int i = 0; i < 16; ++i) words[i][l] = load_be(p + i * 4);
+				}
+				V w[16];
+				std::memcpy(w, words, sizeof(w));
+
+				V a = v[0], b = v[1], c = v[2], d = v[3], e = v[4];
+
+#define TORRENT_SHA1_W(i) (i < 16 ? w[i] : (w[i & 15] = ((w[(i+13)&15] ^ w[(i+8)&15] \
+	^ w[(i+2)&15] ^ w[i&15]) << 1) | ((w[(i+13)&15] ^ w[(i+8)&15] \
+	^ w[(i+2)&15] ^ w[i&15]) >> 31)))
+#define TORRENT_SHA1_ROUND(f, kk) { V t = ((a << 5) | (a >> 27)) + (f) + e + kk + TORRENT_SHA1_W(i); \
+	e = d; d = c; c = (b << 30) | (b >> 2); b = a; a = t; }
+
+				for (int i = 0; i < 20; ++i) TORRENT_SHA1_ROUND((b & (c ^ d)) ^ d, k[0])
+				for (int i = 20; i < 40; ++i) TORRENT_SHA1_ROUND(b ^ c ^ d, k[1])
+				for (int i = 40; i < 60; ++i) TORRENT_SHA1_ROUND((b & c) | (d & (b | c)), k[2])
+				for (int i = 60; i < 80; ++i) TORRENT_SHA1_ROUND(b ^ c ^ d, k[3])
+
+#undef TORRENT_SHA1_ROUND
+#undef TORRENT_SHA1_W
+
+				v[0] += a; v[1] += b; v[2] += c; v[3] += d; v[4] += e;
+			}
+			std::memcpy(state, v, sizeof(v));
+		}
+
+		typedef void (*sha1_mb_fun)(u32* state, u8 const** data, int num_blocks);
+
+#ifdef TORRENT_SHA1_MB_X86
+		__attribute__((target("sse2")))
+		void sha1_mb_sse2(u32* state, u8 const** data, int num_blocks)
+		{ sha1_mb_blocks<vec4, 4>(state, data, num_blocks); }
+
+		__attribute__((target("avx2")))
+		void sha1_mb_avx2(u32* state, u8 const** data, int num_blocks)
+		{ sha1_mb_blocks<vec8, 8>(state, data, num_blocks); }
+#else
+		void sha1_mb_neon(u32* state, u8 const** data, int num_blocks)
+		{ sha1_mb_blocks<vec4, 4>(state, data, num_blocks); }
+#endif
+
+		// picks the widest implementation the CPU supports. Returns
+		// 0 if there is none, in which case buffers are hashed one
+		// at a time
+		sha1_mb_fun select_sha1_mb(int& lanes)
+		{
+#ifdef TORRENT_SHA1_MB_X86
+			__builtin_cpu_init();
+			if (__builtin_cpu_supports("avx2")) { lanes = 8; return &sha1_mb_avx2; }
+			if (__builtin_cpu_supports("sse2")) { lanes = 4; return &sha1_mb_sse2; }
+			lanes = 1;
+			return 0;
+#else
+			lanes = 4;
+			return &sha1_mb_neon;
+#endif
+		}
+
+		struct lane_t
+		{
+			// the index of the buffer hashed in this lane, or -1
+			int buf;
+			// 0 = hashing up to the prefix, 1 = the remaining whole
+			// blocks, 2 = the last partial block and padding
+			int stage;
+			bool prefix;
+			u8 const* ptr;
+			// the number of blocks left in the current stage
+			int left;
+			u8 tail[128];
+		};
+
+		void hash_buffers_mb(sha1_mb_fun fun, int lanes
+			, char const* const* bufs, int const* lens, sha1_hash* digests, int num
+			, int prefix_len, sha1_hash* prefix_digests)
+		{
+			u32 state[5 * max_lanes];
+			lane_t lane[max_lanes];
+			u8 const* ptrs[max_lanes];
+			for (int l = 0; l < lanes; ++l)
+			{
+				lane[l].buf = -1;
+				lane[l].left = 0;
+			}
+
+			int next = 0;
+			for (;;)
+			{
+				int active = 0;
+				int num_blocks = INT_MAX;
+				u8 const* any_ptr = 0;
+				for (int l = 0; l < lanes; ++l)
+				{
+					lane_t& ln = lane[l];
+
+					// move the lane on to its next stage, or its next
+					// buffer, until it has blocks to hash
+					while (ln.left == 0)
+					{
+						if (ln.buf >= 0 && ln.stage == 2)
+						{
+							u32 s[5];
+							for (int i = 0; i < 5; ++i) s[i] = state[i * lanes + l];
+							to_digest(s, digests[ln.buf]);
+							if (prefix_digests && !ln.prefix)
+								prefix_digests[ln.buf] = digests[ln.buf];
+							ln.buf = -1;
+						}
+
+						if (ln.buf < 0)
+						{
+							if (next == num) break;
+							ln.buf = next++;
+							ln.stage = 0;
+							ln.ptr = (u8 const*)bufs[ln.buf];
+							ln.prefix = prefix_digests && prefix_len < lens[ln.buf];
+							ln.left = ln.prefix ? prefix_len / 64 : lens[ln.buf] / 64;
+							u32 const init[5] = { 0x67452301, 0xEFCDAB89
+								, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+							for (int i = 0; i < 5; ++i) state[i * lanes + l] = init[i];
+							continue;
+						}
+
+						int const len = lens[ln.buf];
+						if (ln.stage == 0)
+						{
+							if (ln.prefix)
+							{
+								// finish the prefix digest on a copy of the
+								// lane's state
+								u32 s[5];
+								for (int i = 0; i < 5; ++i) s[i] = state[i * lanes + l];
+								u8 tail[128];
+								int n = pad_tail(tail, ln.ptr, prefix_len & 63, prefix_len);
+								for (int i = 0; i < n; ++i) sha1_block(s, tail + i * 64);
+								to_digest(s, prefix_digests[ln.buf]);
+							}
+							ln.stage = 1;
+							ln.left = len / 64 - int(ln.ptr - (u8 const*)bufs[ln.buf]) / 64;
+							continue;
+						}
+
+						TORRENT_ASSERT(ln.stage == 1);
+						ln.stage = 2;
+						ln.left = pad_tail(ln.tail, ln.ptr, len & 63, len);
+						ln.ptr = ln.tail;
+					}
+					if (ln.buf < 0) continue;
+
+					++active;
+					num_blocks = (std::min)(num_blocks, ln.left);
+					any_ptr = ln.ptr;
+				}
+				if (active == 0) break;
+
+				// idle lanes hash the data of another lane. They have at
+				// least num_blocks blocks, and the result is ignored
+				for (int l = 0; l < lanes; ++l)
+					ptrs[l] = lane[l].buf >= 0 ? lane[l].ptr : any_ptr;
+
+				fun(state, ptrs, num_blocks);
+
+				for (int l = 0; l < lanes; ++l)
+				{
+					if (lane[l].buf < 0) continue;
+					lane[l].ptr += num_blocks * 64;
+					lane[l].left -= num_blocks;
+				}
+			}
+		}
+
+#endif // TORRENT_USE_SHA1_MB
+
+		// these are set once, by init_sha1_mb()
+		boost::once_flag sha1_mb_once = BOOST_ONCE_INIT;
+		int sha1_lanes = 0;
+#ifdef TORRENT_USE_SHA1_MB
+		sha1_mb_fun sha1_mb = 0;
+
+		// whether hasher is faster than the multi-buffer implementation,
+		// for each of the SHA-1 backends (see use_single_buffer()). Each
+		// is measured once, the first time it's needed
+		boost::once_flag measure_once[2] = { BOOST_ONCE_INIT, BOOST_ONCE_INIT };
+		bool single_faster[2] = { false, false };
+#endif
+
+		void select_sha1_impl()
+		{
+#ifdef TORRENT_USE_SHA1_MB
+			int lanes;
+			sha1_mb = select_sha1_mb(lanes);
+			sha1_lanes = lanes;
+#else
+			sha1_lanes = 1;
+#endif
+		}
+
+		void init_sha1_mb()
+		{
+			boost::call_once(sha1_mb_once, &select_sha1_impl);
+		}
+
+#ifdef TORRENT_USE_SHA1_MB
+		// hashes the same buffers with the multi-buffer implementation
+		// and with hasher, one at a time. Returns true if the latter is
+		// faster
+		bool measure_single_faster()
+		{
+			int const len = 64 * 1024;
+			std::vector<char> data(len * sha1_lanes, 'a');
+			char const* bufs[max_lanes];
+			int lens[max_lanes];
+			sha1_hash digests[max_lanes];
+			for (int i = 0; i < sha1_lanes; ++i)
+			{
+				bufs[i] = &data[i * len];
+				lens[i] = len;
+			}
+
+			// take the best of a few rounds, to not be thrown off by
+			// the thread being scheduled out
+			boost::int64_t best_mb = (std::numeric_limits<boost::int64_t>::max)();
+			boost::int64_t best_single = best_mb;
+			for (int round = 0; round < 3; ++round)
+			{
+				ptime start = time_now_hires();
+				hash_buffers_mb(sha1_mb, sha1_lanes, bufs, lens, digests
+					, sha1_lanes, 0, 0);
+				ptime mid = time_now_hires();
+				for (int i = 0; i < sha1_lanes; ++i)
+					digests[i] = hasher(bufs[i], lens[i]).final();
+				ptime end = time_now_hires();
+				best_mb = (std::min)(best_mb, total_microseconds(mid - start));
+				best_single = (std::min)(best_single, total_microseconds(end - mid));
+			}
+			return best_single < best_mb;
+		}
+
+		void measure_backend0() { single_faster[0] = measure_single_faster(); }
+		void measure_backend1() { single_faster[1] = measure_single_faster(); }
+#endif
+
+		// returns true if hashing buffers one at a time with hasher is
+		// faster than the multi-buffer implementation. That is the case
+		// when the SHA-1 backend uses the SHA instructions of the CPU,
+		// which depends on the backend and its version, so rather than
+		// guessing, both are timed the first time this is called
+		bool use_single_buffer()
+		{
+#ifdef TORRENT_USE_SHA1_MB
+			if (sha1_mb == 0 || sha1_lanes < 2) return true;
+#if !defined TORRENT_USE_OPENSSL && !defined TORRENT_USE_GCRYPT
+			// the built-in SHA-1 can be switched between its
+			// implementations at runtime (see SHA1_use_sha_ni())
+			int const backend = SHA1_has_sha_ni() ? 1 : 0;
+#else
+			int const backend = 0;
+#endif
+			boost::call_once(measure_once[backend]
+				, backend ? &measure_backend1 : &measure_backend0);
+			return single_faster[backend];
+#else
+			return true;
+#endif
+		}
+	}
+
+	int hash_batch_lanes()
+	{
+		init_sha1_mb();
+		if (use_single_buffer()) return 1;
+		return sha1_lanes;
+	}
+
+	void hash_buffers(char const* const* bufs, int const* lens
+		, sha1_hash* digests, int num
+		, int prefix_len, sha1_hash* prefix_digests)
+	{
+		TORRENT_ASSERT(num >= 0);
+		TORRENT_ASSERT(prefix_len >= 0);
+		init_sha1_mb();
+
+#ifdef TORRENT_USE_SHA1_MB
+		// with a single buffer there's nothing to hash in parallel
+		if (num > 1 && !use_single_buffer())
+		{
+			hash_buffers_mb(sha1_mb, sha1_lanes, bufs, lens, digests, num
+				, prefix_len, prefix_digests);
+			return;
+		}
+#endif
+
+		for (int i = 0; i < num; ++i)
+		{
+			hasher h;
+			int offset = 0;
+			if (prefix_digests && prefix_len < lens[i])
+			{
+				if (prefix_len > 0) h.update(bufs[i], prefix_len);
+				prefix_digests[i] = hasher(h).final();
+				offset = prefix_len;
+			}
+			if (lens[i] > offset) h.update(bufs[i] + offset, lens[i] - offset);
+			digests[i] = h.final();
+			if (prefix_digests && prefix_len >= lens[i])
+				prefix_digests[i] = digests[i];
+		}
+	}
+}
+
@@ -0,0 +1,316 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/io_uring.hpp"
+#include "libtorrent/assert.hpp"
+
+#if TORRENT_USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <cstring>
+#endif
+
+namespace libtorrent
+{
+	// defined in storage.cpp
+	int bufs_size(file::iovec_t const* bufs, int num_bufs);
+
+#if TORRENT_USE_IO_URING
+	namespace
+	{
+		int io_uring_setup(unsigned entries, io_uring_params* p)
+		{ return int(syscall(__NR_io_uring_setup, entries, p)); }
+
+		int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+		{ return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0)); }
+
+		// the ring indices are shared with the kernel
+		unsigned load_acquire(unsigned* p)
+		{ return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+
+		void store_release(unsigned* p, unsigned v)
+		{ __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+		__thread io_uring_queue* current_queue = 0;
+	}
+#endif
+
+	io_uring_queue::io_uring_queue()
+		: m_ring_fd(-1)
+		, m_depth(0)
+#if TORRENT_USE_IO_URING
+		, m_sq_ring(MAP_FAILED)
+		, m_sq_ring_size(0)
+		, m_cq_ring(MAP_FAILED)
+		, m_cq_ring_size(0)
+		, m_sqes(MAP_FAILED)
+		, m_sqes_size(0)
+#endif
+	{}
+
+	io_uring_queue::~io_uring_queue()
+	{
+		close();
+	}
+
+	bool io_uring_queue::open(int depth, error_code& ec)
+	{
+		close();
+#if TORRENT_USE_IO_URING
+		TORRENT_ASSERT(depth > 0);
+		io_uring_params p;
+		std::memset(&p, 0, sizeof(p));
+		m_ring_fd = io_uring_setup(depth, &p);
+		if (m_ring_fd < 0)
+		{
+			ec.assign(errno, get_posix_category());
+			m_ring_fd = -1;
+			return false;
+		}
+
+		m_sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		m_cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+		bool single_mmap = false;
+#ifdef IORING_FEAT_SINGLE_MMAP
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+		{
+			single_mmap = true;
+			m_sq_ring_size = (std::max)(m_sq_ring_size, m_cq_ring_size);
+		}
+#endif
+		m_sq_ring = mmap(0, m_sq_ring_size, PROT_READ | PROT_WRITE
+			, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQ_RING);
+		if (m_sq_ring == MAP_FAILED)
+		{
+			ec.assign(errno, get_posix_category());
+			close();
+			return false;
+		}
+		if (!single_mmap)
+		{
+			m_cq_ring = mmap(0, m_cq_ring_size, PROT_READ | PROT_WRITE
+				, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_CQ_RING);
+			if (m_cq_ring == MAP_FAILED)
+			{
+				ec.assign(errno, get_posix_category());
+				close();
+				return false;
+			}
+		}
+		m_sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+		m_sqes = mmap(0, m_sqes_size, PROT_READ | PROT_WRITE
+			, MAP_SHARED | MAP_POPULATE, m_ring_fd, IORING_OFF_SQES);
+		if (m_sqes == MAP_FAILED)
+		{
+			ec.assign(errno, get_posix_category());
+			close();
+			return false;
+		}
+
+		char* sq = (char*)m_sq_ring;
+		char* cq = single_mmap ? sq : (char*)m_cq_ring;
+		m_sq_head = (unsigned*)(sq + p.sq_off.head);
+		m_sq_tail = (unsigned*)(sq + p.sq_off.tail);
+		m_sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+		m_sq_array = (unsigned*)(sq + p.sq_off.array);
+		m_cq_head = (unsigned*)(cq + p.cq_off.head);
+		m_cq_tail = (unsigned*)(cq + p.cq_off.tail);
+		m_cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+		m_cqes = cq + p.cq_off.cqes;
+		m_depth = p.sq_entries;
+		return true;
+#else
+		ec = boost::asio::error::operation_not_supported;
+		return false;
+#endif
+	}
+
+	void io_uring_queue::close()
+	{
+		clear();
+#if TORRENT_USE_IO_URING
+		if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqes_size);
+		if (m_cq_ring != MAP_FAILED) munmap(m_cq_ring, m_cq_ring_size);
+		if (m_sq_ring != MAP_FAILED) munmap(m_sq_ring, m_sq_ring_size);
+		m_sqes = MAP_FAILED;
+		m_cq_ring = MAP_FAILED;
+		m_sq_ring = MAP_FAILED;
+		if (m_ring_fd >= 0) ::close(m_ring_fd);
+#endif
+		m_ring_fd = -1;
+		m_depth = 0;
+	}
+
+	int io_uring_queue::queue_readv(boost::intrusive_ptr<file> const& f
+		, size_type offset, file::iovec_t const* bufs, int num_bufs, int tag)
+	{
+#if TORRENT_USE_IO_URING
+		return queue_op(IORING_OP_READV, f, offset, bufs, num_bufs, tag);
+#else
+		return queue_op(0, f, offset, bufs, num_bufs, tag);
+#endif
+	}
+
+	int io_uring_queue::queue_writev(boost::intrusive_ptr<file> const& f
+		, size_type offset, file::iovec_t const* bufs, int num_bufs, int tag)
+	{
+#if TORRENT_USE_IO_URING
+		return queue_op(IORING_OP_WRITEV, f, offset, bufs, num_bufs, tag);
+#else
+		return queue_op(1, f, offset, bufs, num_bufs, tag);
+#endif
+	}
+
+	int io_uring_queue::queue_op(int opcode, boost::intrusive_ptr<file> const& f
+		, size_type offset, file::iovec_t const* bufs, int num_bufs, int tag)
+	{
+		TORRENT_ASSERT(num_bufs > 0);
+		TORRENT_ASSERT(f && f->is_open());
+		op_t o;
+		o.opcode = opcode;
+		o.f = f;
+		o.offset = offset;
+		o.first_buf = int(m_iovecs.size());
+		o.num_bufs = num_bufs;
+		o.size = bufs_size(bufs, num_bufs);
+		o.tag = tag;
+		o.result = 0;
+		m_iovecs.insert(m_iovecs.end(), bufs, bufs + num_bufs);
+		m_ops.push_back(o);
+		return int(m_ops.size()) - 1;
+	}
+
+	void io_uring_queue::clear()
+	{
+		m_ops.clear();
+		m_iovecs.clear();
+	}
+
+	bool io_uring_queue::submit(error_code& ec)
+	{
+#if TORRENT_USE_IO_URING
+		TORRENT_ASSERT(is_open());
+		TORRENT_ASSERT(!ec);
+
+		// the operations are submitted in rounds of at most m_depth,
+		// each round is waited for before the next one is submitted.
+		// That way neither of the rings can overflow
+		int next = 0;
+		int const num_ops = int(m_ops.size());
+		while (next < num_ops)
+		{
+			int const batch = (std::min)(num_ops - next, m_depth);
+			unsigned tail = *m_sq_tail;
+			unsigned const mask = *m_sq_mask;
+			for (int i = 0; i < batch; ++i)
+			{
+				op_t const& o = m_ops[next + i];
+				unsigned const idx = tail & mask;
+				io_uring_sqe* sqe = (io_uring_sqe*)m_sqes + idx;
+				std::memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode = o.opcode;
+				sqe->fd = o.f->native_handle();
+				sqe->off = o.offset;
+				sqe->addr = (unsigned long)&m_iovecs[o.first_buf];
+				sqe->len = o.num_bufs;
+				sqe->user_data = next + i;
+				m_sq_array[idx] = idx;
+				++tail;
+			}
+			store_release(m_sq_tail, tail);
+
+			int to_submit = batch;
+			int completed = 0;
+			while (completed < batch - to_submit || (to_submit > 0 && !ec))
+			{
+				int ret = io_uring_enter(m_ring_fd, ec ? 0 : to_submit, 1
+					, IORING_ENTER_GETEVENTS);
+				if (ret < 0)
+				{
+					if (errno == EINTR || errno == EAGAIN || errno == EBUSY) continue;
+					if (ec) return false;
+					ec.assign(errno, get_posix_category());
+					// take back the operations the kernel hasn't picked up.
+					// The ones that were already submitted may still be in
+					// flight, and we can't return before they complete,
+					// since they refer to the caller's buffers
+					store_release(m_sq_tail, load_acquire(m_sq_head));
+					continue;
+				}
+				if (!ec) to_submit -= ret;
+
+				unsigned head = *m_cq_head;
+				unsigned const cq_mask = *m_cq_mask;
+				while (head != load_acquire(m_cq_tail))
+				{
+					io_uring_cqe const* cqe = (io_uring_cqe const*)m_cqes + (head & cq_mask);
+					TORRENT_ASSERT(cqe->user_data < (boost::uint64_t)num_ops);
+					m_ops[cqe->user_data].result = cqe->res;
+					++head;
+					++completed;
+				}
+				store_release(m_cq_head, head);
+			}
+			if (ec) return false;
+			next += batch;
+		}
+		return true;
+#else
+		ec = boost::asio::error::operation_not_supported;
+		return false;
+#endif
+	}
+
+	io_uring_queue* thread_io_uring()
+	{
+#if TORRENT_USE_IO_URING
+		return current_queue;
+#else
+		return 0;
+#endif
+	}
+
+	void set_thread_io_uring(io_uring_queue* q)
+	{
+#if TORRENT_USE_IO_URING
+		current_queue = q;
+#else
+		TORRENT_ASSERT(q == 0);
+#endif
+	}
+}
+
@@ -0,0 +1,393 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/config.hpp"
+#include "libtorrent/mmap_storage.hpp"
+#include "libtorrent/storage.hpp"
+#include "libtorrent/session_settings.hpp"
+#include "libtorrent/file.hpp"
+#include "libtorrent/error_code.hpp"
+
+#if TORRENT_USE_MMAP
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <cstring>
+#include <limits>
+
+namespace libtorrent
+{
+	namespace
+	{
+		// allocates disk space for the first 'size' bytes of the file.
+		// Writing to a page of a shared mapping that has no disk space
+		// behind it raises SIGBUS once the disk is full, rather than
+		// failing the write
+		bool reserve_space(int fd, size_type size)
+		{
+#if TORRENT_HAS_FALLOCATE
+			return posix_fallocate(fd, 0, size) == 0;
+#else
+			return false;
+#endif
+		}
+	}
+
+	mmap_storage::file_mapping::~file_mapping()
+	{
+		if (base) munmap(base, size);
+	}
+
+	mmap_storage::mmap_storage(file_storage const& fs, file_storage const* mapped
+		, std::string const& path, file_pool& fp
+		, std::vector<boost::uint8_t> const& file_prio)
+		: default_storage(fs, mapped, path, fp, file_prio)
+		, m_mappings(fs.num_files())
+	{}
+
+	// the dirty pages of shared mappings are written back to the files
+	// after they're unmapped too, there's no need to wait for them here
+	mmap_storage::~mmap_storage() { unmap_files(false); }
+
+	boost::shared_ptr<mmap_storage::file_mapping> mmap_storage::map_file(
+		file_storage::iterator fe, bool write, size_type end, error_code& ec)
+	{
+		int index = fe - files().begin();
+		TORRENT_ASSERT(index >= 0 && index < int(m_mappings.size()));
+		{
+			mutex::scoped_lock l(m_mutex);
+			boost::shared_ptr<file_mapping> const& m = m_mappings[index];
+			if (m && (m->writable || !write) && m->size >= end) return m;
+		}
+
+		boost::intrusive_ptr<file> f = open_file(fe
+			, write ? file::read_write : file::read_only, ec);
+		if (write && ec == boost::system::errc::no_such_file_or_directory)
+		{
+			// this means the directory the file is in doesn't exist.
+			// so create it
+			ec.clear();
+			std::string path = combine_path(m_save_path, files().file_path(*fe));
+			create_directories(parent_path(path), ec);
+			if (!ec) f = open_file(fe, file::read_write, ec);
+		}
+		if (!f || ec) return boost::shared_ptr<file_mapping>();
+
+		// mappings have to start at a page boundary, so the whole file
+		// is mapped, up to the end of this file's data
+		size_type file_end = files().file_base(*fe) + fe->size;
+		size_type size = f->get_size(ec);
+		if (ec) return boost::shared_ptr<file_mapping>();
+
+		if (write)
+		{
+			// pages past the end of the file can't be written through
+			// the mapping. The file is extended to its full size up
+			// front
+			if (size < file_end)
+			{
+				if (!f->set_size(file_end, ec)) return boost::shared_ptr<file_mapping>();
+				size = file_end;
+			}
+
+			// and its disk space is reserved. If that fails (the disk
+			// is full, or the file system doesn't support it), the file
+			// is written the regular way, where running out of space is
+			// reported as an error
+			if (!reserve_space(f->native_handle(), file_end))
+				return boost::shared_ptr<file_mapping>();
+		}
+		if (size > file_end) size = file_end;
+
+		// files that are empty, or too big for the address space,
+		// are read and written the regular way
+		if (size == 0 || size > size_type((std::numeric_limits<size_t>::max)()))
+			return boost::shared_ptr<file_mapping>();
+
+		void* base = mmap(0, size_t(size), PROT_READ | (write ? PROT_WRITE : 0)
+			, MAP_SHARED, f->native_handle(), 0);
+		if (base == MAP_FAILED) return boost::shared_ptr<file_mapping>();
+
+		boost::shared_ptr<file_mapping> m(new file_mapping);
+		m->base = (char*)base;
+		m->size = size;
+		m->writable = write;
+
+		// views into the previous mapping keep it alive
+		// until they're done with it
+		mutex::scoped_lock l(m_mutex);
+		m_mappings[index] = m;
+		return m;
+	}
+
+	int mmap_storage::copy_bufs(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs, bool write)
+	{
+		TORRENT_ASSERT(bufs != 0);
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+		TORRENT_ASSERT(offset >= 0);
+		TORRENT_ASSERT(offset < m_files.piece_size(slot));
+		TORRENT_ASSERT(num_bufs > 0);
+
+		int bytes_left = 0;
+		for (int i = 0; i < num_bufs; ++i) bytes_left += bufs[i].iov_len;
+		int slot_size = static_cast<int>(m_files.piece_size(slot));
+		if (offset + bytes_left > slot_size)
+			bytes_left = slot_size - offset;
+
+		size_type tor_off = size_type(slot) * files().piece_length() + offset;
+		file_storage::iterator file_iter = files().file_at_offset(tor_off);
+		size_type file_offset = tor_off - file_iter->offset;
+
+		bool sync = write && m_settings && settings().mmap_sync_writes;
+
+		file::iovec_t const* buf = bufs;
+		int buf_offset = 0;
+		int transferred = 0;
+		for (; bytes_left > 0; ++file_iter, file_offset = 0)
+		{
+			TORRENT_ASSERT(file_iter != files().end());
+
+			int file_bytes = int((std::min)(size_type(bytes_left)
+				, file_iter->size - file_offset));
+			if (file_bytes <= 0) continue;
+
+			size_type pos = files().file_base(*file_iter) + file_offset;
+			int available = file_bytes;
+			boost::shared_ptr<file_mapping> m;
+			if (!file_iter->pad_file)
+			{
+				error_code ec;
+				m = map_file(file_iter, write, pos + file_bytes, ec);
+				if (ec)
+				{
+					set_error(combine_path(m_save_path, files().file_path(*file_iter)), ec);
+					return -1;
+				}
+				if (!m) return -2;
+
+				// the file may not have been completely downloaded
+				if (pos + file_bytes > m->size)
+					available = int((std::max)(m->size - pos, size_type(0)));
+			}
+
+			for (int done = 0; done < available;)
+			{
+				char* b = (char*)buf->iov_base + buf_offset;
+				int n = (std::min)(int(buf->iov_len) - buf_offset, available - done);
+				if (!m)
+				{
+					// pad files read as zeroes
+					if (!write) std::memset(b, 0, n);
+				}
+				else if (write) std::memcpy(m->base + pos + done, b, n);
+				else std::memcpy(b, m->base + pos + done, n);
+				done += n;
+				buf_offset += n;
+				if (buf_offset == int(buf->iov_len))
+				{
+					++buf;
+					buf_offset = 0;
+				}
+			}
+
+			if (m && sync && available > 0)
+			{
+				size_type start = pos & ~size_type(m_page_size - 1);
+				if (msync(m->base + start, size_t(pos + available - start), MS_SYNC) != 0)
+				{
+					set_error(combine_path(m_save_path, files().file_path(*file_iter))
+						, error_code(errno, get_posix_category()));
+					return -1;
+				}
+			}
+
+			transferred += available;
+			if (available != file_bytes) return transferred;
+			bytes_left -= file_bytes;
+		}
+		return transferred;
+	}
+
+	int mmap_storage::readv(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		int ret = copy_bufs(bufs, slot, offset, num_bufs, false);
+		if (ret != -2) return ret;
+		return default_storage::readv(bufs, slot, offset, num_bufs);
+	}
+
+	int mmap_storage::writev(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		int ret = copy_bufs(bufs, slot, offset, num_bufs, true);
+		if (ret != -2) return ret;
+		return default_storage::writev(bufs, slot, offset, num_bufs);
+	}
+
+	// writes are always made through the mappings, one slot at a time
+	int mmap_storage::writev_span(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		return storage_interface::writev_span(bufs, slot, offset, num_bufs);
+	}
+
+	char const* mmap_storage::map_block(int slot, int offset, int size
+		, boost::shared_ptr<void>& mapping)
+	{
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+		TORRENT_ASSERT(offset >= 0);
+
+		size_type tor_off = size_type(slot) * files().piece_length() + offset;
+		file_storage::iterator file_iter = files().file_at_offset(tor_off);
+		size_type in_file = tor_off - file_iter->offset;
+		if (file_iter->pad_file || in_file + size > file_iter->size)
+			return 0;
+
+		size_type pos = files().file_base(*file_iter) + in_file;
+		error_code ec;
+		boost::shared_ptr<file_mapping> m = map_file(file_iter, false, pos + size, ec);
+		if (!m || pos + size > m->size) return 0;
+
+		mapping = m;
+		return m->base + pos;
+	}
+
+	void mmap_storage::hint_read(int slot, int offset, int size)
+	{
+		size_type tor_off = size_type(slot) * files().piece_length() + offset;
+		file_storage::iterator file_iter = files().file_at_offset(tor_off);
+		size_type in_file = tor_off - file_iter->offset;
+
+		boost::shared_ptr<file_mapping> m;
+		if (!file_iter->pad_file && in_file + size <= file_iter->size)
+		{
+			mutex::scoped_lock l(m_mutex);
+			m = m_mappings[file_iter - files().begin()];
+		}
+		if (!m)
+		{
+			default_storage::hint_read(slot, offset, size);
+			return;
+		}
+
+		size_type pos = files().file_base(*file_iter) + in_file;
+		if (pos >= m->size) return;
+		size_type start = pos & ~size_type(m_page_size - 1);
+		size_type end = (std::min)(pos + size, m->size);
+		madvise(m->base + start, size_t(end - start), MADV_WILLNEED);
+	}
+
+	void mmap_storage::unmap_files(bool flush)
+	{
+		std::vector<boost::shared_ptr<file_mapping> > mappings;
+		{
+			mutex::scoped_lock l(m_mutex);
+			for (std::vector<boost::shared_ptr<file_mapping> >::iterator i
+				= m_mappings.begin(), end(m_mappings.end()); i != end; ++i)
+			{
+				if (!*i) continue;
+				mappings.push_back(*i);
+				i->reset();
+			}
+		}
+
+		if (!flush) return;
+		for (std::vector<boost::shared_ptr<file_mapping> >::iterator i
+			= mappings.begin(), end(mappings.end()); i != end; ++i)
+		{
+			if ((*i)->writable) msync((*i)->base, size_t((*i)->size), MS_SYNC);
+		}
+	}
+
+	void mmap_storage::finalize_file(int index)
+	{
+		TORRENT_ASSERT(index >= 0 && index < files().num_files());
+		if (index < 0 || index >= files().num_files()) return;
+
+		// the file is complete, write it back
+		boost::shared_ptr<file_mapping> m;
+		{
+			mutex::scoped_lock l(m_mutex);
+			m = m_mappings[index];
+		}
+		if (m && m->writable) msync(m->base, size_t(m->size), MS_SYNC);
+
+		default_storage::finalize_file(index);
+	}
+
+	bool mmap_storage::release_files()
+	{
+		unmap_files(true);
+		return default_storage::release_files();
+	}
+
+	bool mmap_storage::delete_files()
+	{
+		unmap_files(false);
+		return default_storage::delete_files();
+	}
+
+	bool mmap_storage::move_storage(std::string const& save_path)
+	{
+		// files copied to another device must not be written to
+		// through the old mappings
+		unmap_files(false);
+		return default_storage::move_storage(save_path);
+	}
+
+	storage_interface* mmap_storage_constructor(file_storage const& fs
+		, file_storage const* mapped, std::string const& path, file_pool& fp
+		, std::vector<boost::uint8_t> const& file_prio)
+	{
+		return new mmap_storage(fs, mapped, path, fp, file_prio);
+	}
+}
+
+#else
+
+namespace libtorrent
+{
+	storage_interface* mmap_storage_constructor(file_storage const& fs
+		, file_storage const* mapped, std::string const& path, file_pool& fp
+		, std::vector<boost::uint8_t> const& file_prio)
+	{
+		return new default_storage(fs, mapped, path, fp, file_prio);
+	}
+}
+
+#endif // TORRENT_USE_MMAP
+
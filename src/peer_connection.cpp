@@ -61,6 +61,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include <set>
 #endif
 
+#if TORRENT_USE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
 //#define TORRENT_CORRUPT_DATA
 
 using boost::shared_ptr;
@@ -104,6 +108,7 @@ namespace libtorrent
 		, m_downloaded_at_last_unchoke(0)
 		, m_uploaded_at_last_unchoke(0)
 		, m_disk_recv_buffer(ses, 0)
+		, m_send_file_bytes(0)
 		, m_socket(s)
 		, m_remote(endp)
 		, m_torrent(tor)
@@ -161,6 +166,8 @@ namespace libtorrent
 		, m_sent_suggests(false)
 		, m_holepunch_mode(false)
 		, m_ignore_stats(false)
+		, m_sending_file(false)
+		, m_sendfile_non_blocking(false)
 #if defined TORRENT_DEBUG || TORRENT_RELEASE_ASSERTS
 		, m_in_constructor(true)
 		, m_disconnect_started(false)
@@ -248,6 +255,7 @@ namespace libtorrent
 		, m_downloaded_at_last_unchoke(0)
 		, m_uploaded_at_last_unchoke(0)
 		, m_disk_recv_buffer(ses, 0)
+		, m_send_file_bytes(0)
 		, m_socket(s)
 		, m_remote(endp)
 		, m_receiving_block(piece_block::invalid)
@@ -304,6 +312,8 @@ namespace libtorrent
 		, m_sent_suggests(false)
 		, m_holepunch_mode(false)
 		, m_ignore_stats(false)
+		, m_sending_file(false)
+		, m_sendfile_non_blocking(false)
 #if defined TORRENT_DEBUG || TORRENT_RELEASE_ASSERTS
 		, m_in_constructor(true)
 		, m_disconnect_started(false)
@@ -2390,7 +2400,7 @@ namespace libtorrent
 				, performance_alert::too_high_disk_queue_limit));
 		}
 
-		if (!m_ses.can_write_to_disk()
+		if (!m_ses.can_write_to_disk(&fs)
 			&& m_ses.settings().max_queued_disk_bytes
 			&& t->alerts().should_post<performance_alert>()
 			&& (now - m_ses.m_last_disk_performance_warning) > seconds(10))
@@ -3637,7 +3647,7 @@ namespace libtorrent
 
 		p.remote_dl_rate = m_remote_dl_rate;
 		p.send_buffer_size = m_send_buffer.capacity();
-		p.used_send_buffer = m_send_buffer.size();
+		p.used_send_buffer = send_buffer_size();
 		p.receive_buffer_size = m_recv_buffer.capacity() + m_disk_recv_buffer_size;
 		p.used_receive_buffer = m_recv_pos;
 		p.write_state = m_channel_state[upload_channel];
@@ -4277,7 +4287,12 @@ namespace libtorrent
 
 			std::pair<int, int> cache = preferred_caching();
 
-			if (!t->seed_mode() || t->verified_piece(r.piece))
+			if ((!t->seed_mode() || t->verified_piece(r.piece)) && can_send_file())
+			{
+				t->filesystem().async_open_block(r, boost::bind(&peer_connection::on_disk_read_complete
+					, self(), _1, _2, r), cache.first, cache.second);
+			}
+			else if (!t->seed_mode() || t->verified_piece(r.piece))
 			{
 				t->filesystem().async_read(r, boost::bind(&peer_connection::on_disk_read_complete
 					, self(), _1, _2, r), cache.first, cache.second);
@@ -4352,7 +4367,20 @@ namespace libtorrent
 #if TORRENT_DISK_STATS
 		if (j.buffer) m_ses.m_disk_thread.rename_buffer(j.buffer, "dispatched send buffer");
 #endif
-		write_piece(r, buffer);
+		if (j.file_handle)
+		{
+			TORRENT_ASSERT(j.buffer == 0);
+			write_piece(r, j.file_handle, j.file_offset);
+		}
+		else if (j.view())
+		{
+			TORRENT_ASSERT(j.buffer == 0);
+			write_piece(r, j.view(), j.mapping());
+		}
+		else
+		{
+			write_piece(r, buffer);
+		}
 		setup_send();
 	}
 
@@ -4416,7 +4444,7 @@ namespace libtorrent
 #ifdef TORRENT_VERBOSE_LOGGING
 		peer_log(">>> REQUEST_BANDWIDTH [ upload: %d prio: %d "
 			"channels: %p %p %p %p limits: %d %d %d %d ignore: %d ]"
-			, int(m_send_buffer.size()), priority
+			, send_buffer_size(), priority
 			, bwc1, bwc2, bwc3, bwc4
 			, (bwc1?bwc1->throttle():0)
          , (bwc2?bwc2->throttle():0)
@@ -4425,7 +4453,7 @@ namespace libtorrent
 			, m_ignore_bandwidth_limits);
 #endif
 		return m_ses.m_upload_rate.request_bandwidth(self()
-			, (std::max)(m_send_buffer.size(), m_statistics.upload_rate() * 2
+			, (std::max)(send_buffer_size(), m_statistics.upload_rate() * 2
 				/ (1000 / m_ses.m_settings.tick_interval))
 			, priority
 			, bwc1, bwc2, bwc3, bwc4);
@@ -4474,7 +4502,7 @@ namespace libtorrent
 		shared_ptr<torrent> t = m_torrent.lock();
 
 		if (m_quota[upload_channel] == 0
-			&& !m_send_buffer.empty()
+			&& send_buffer_size() > 0
 			&& !m_connecting
 			&& t)
 		{
@@ -4512,7 +4540,7 @@ namespace libtorrent
 
 		int quota_left = m_quota[upload_channel];
 
-		if (m_send_buffer.empty()
+		if (send_buffer_size() == 0
 			&& m_reading_bytes > 0
 			&& quota_left > 0)
 		{
@@ -4545,12 +4573,12 @@ namespace libtorrent
 		if (!can_write())
 		{
 #ifdef TORRENT_VERBOSE_LOGGING
-			if (m_send_buffer.empty())
+			if (send_buffer_size() == 0)
 			{
 				peer_log(">>> SEND BUFFER DEPLETED ["
 					" quota: %d ignore: %s buf: %d connecting: %s disconnecting: %s pending_disk: %d ]"
 					, m_quota[upload_channel], m_ignore_bandwidth_limits?"yes":"no"
-					, int(m_send_buffer.size()), m_connecting?"yes":"no"
+					, send_buffer_size(), m_connecting?"yes":"no"
 					, m_disconnecting?"yes":"no", m_reading_bytes);
 			}
 			else
@@ -4558,15 +4586,43 @@ namespace libtorrent
 				peer_log(">>> CANNOT WRITE ["
 					" quota: %d ignore: %s buf: %d connecting: %s disconnecting: %s pending_disk: %d ]"
 					, m_quota[upload_channel], m_ignore_bandwidth_limits?"yes":"no"
-					, int(m_send_buffer.size()), m_connecting?"yes":"no"
+					, send_buffer_size(), m_connecting?"yes":"no"
 					, m_disconnecting?"yes":"no", m_reading_bytes);
 			}
 #endif
 			return;
 		}
 
-		// send the actual buffer
+#if TORRENT_USE_SENDFILE
+		if (!m_send_files.empty() && m_send_files.front().buffer_offset == 0)
+		{
+			// the next bytes to send are in a file. Wait for the socket
+			// to become writable, and then hand them to sendfile()
+			int amount_to_send = (std::min)(m_send_files.front().size, quota_left);
+			TORRENT_ASSERT(amount_to_send > 0);
+#ifdef TORRENT_VERBOSE_LOGGING
+			peer_log(">>> ASYNC_SENDFILE [ bytes: %d ]", amount_to_send);
+#endif
+#if defined TORRENT_ASIO_DEBUGGING
+			add_outstanding_async("peer_connection::on_send_data");
+#endif
+			m_sending_file = true;
+			TORRENT_ASSERT(m_socket->get<stream_socket>());
+			m_socket->get<stream_socket>()->async_write_some(asio::null_buffers()
+				, make_write_handler(boost::bind(&peer_connection::on_send_file_ready
+				, self(), _1, amount_to_send)));
+
+			if (m_channel_state[upload_channel] == peer_info::bw_disk)
+				m_ses.dec_disk_queue(upload_channel);
+			m_channel_state[upload_channel] = peer_info::bw_network;
+			return;
+		}
+#endif
+
+		// send the actual buffer, up to the next file to send
 		int amount_to_send = m_send_buffer.size();
+		if (!m_send_files.empty())
+			amount_to_send = m_send_files.front().buffer_offset;
 		if (amount_to_send > quota_left)
 			amount_to_send = quota_left;
 
@@ -4649,7 +4705,7 @@ namespace libtorrent
 				"can-write-to-disk: %s queue-limit: %d disconnecting: %s ]"
 				, m_quota[download_channel]
 				, (m_ignore_bandwidth_limits?"yes":"no")
-				, (m_ses.can_write_to_disk()?"yes":"no")
+				, (m_ses.can_write_to_disk(t ? t->storage() : 0)?"yes":"no")
 				, m_ses.settings().max_queued_disk_bytes
 				, (m_disconnecting?"yes":"no"));
 #endif
@@ -4854,11 +4910,71 @@ namespace libtorrent
 #endif
 	}
 
+	bool peer_connection::can_send_file() const
+	{
+#if TORRENT_USE_SENDFILE
+		return m_ses.settings().use_sendfile
+			&& m_socket->get<stream_socket>() != 0;
+#else
+		return false;
+#endif
+	}
+
+	void peer_connection::write_piece(peer_request const& r
+		, boost::intrusive_ptr<file> const& f, size_type file_offset)
+	{
+		char* buffer = m_ses.allocate_disk_buffer("send buffer");
+		if (buffer == 0)
+		{
+			disconnect(errors::no_memory);
+			return;
+		}
+		disk_buffer_holder holder(m_ses, buffer);
+		file::iovec_t b = { buffer, size_t(r.length) };
+		error_code ec;
+		size_type ret = f->readv(file_offset, &b, 1, ec);
+		if (!ec && ret < r.length) ec = errors::file_too_short;
+		if (ec)
+		{
+			disconnect(ec);
+			return;
+		}
+		write_piece(r, holder);
+	}
+
+	void peer_connection::write_piece(peer_request const& r, char const* view
+		, boost::shared_ptr<void> const& mapping)
+	{
+		char* buffer = m_ses.allocate_disk_buffer("send buffer");
+		if (buffer == 0)
+		{
+			disconnect(errors::no_memory);
+			return;
+		}
+		disk_buffer_holder holder(m_ses, buffer);
+		std::memcpy(buffer, view, r.length);
+		write_piece(r, holder);
+	}
+
+	void peer_connection::append_send_file(boost::intrusive_ptr<file> const& f
+		, size_type file_offset, int size)
+	{
+		TORRENT_ASSERT(can_send_file());
+		TORRENT_ASSERT(size > 0);
+		send_file_t sf;
+		sf.handle = f;
+		sf.offset = file_offset;
+		sf.size = size;
+		sf.buffer_offset = m_send_buffer.size();
+		m_send_files.push_back(sf);
+		m_send_file_bytes += size;
+	}
+
 	void peer_connection::send_buffer(char const* buf, int size, int flags
 		, void (*fun)(char*, int, void*), void* userdata)
 	{
 		if (flags == message_type_request)
-			m_requests_in_buffer.push_back(m_send_buffer.size() + size);
+			m_requests_in_buffer.push_back(send_buffer_size() + size);
 
 		int free_space = m_send_buffer.space_in_last_buffer();
 		if (free_space > size) free_space = size;
@@ -5043,7 +5159,7 @@ namespace libtorrent
 	{
 		// if we have requests or pending data to be sent or announcements to be made
 		// we want to send data
-		return !m_send_buffer.empty()
+		return send_buffer_size() > 0
 			&& m_quota[upload_channel] > 0
 			&& !m_connecting;
 	}
@@ -5057,7 +5173,7 @@ namespace libtorrent
 		if (!bw_limit) return false;
 
 		bool disk = m_ses.settings().max_queued_disk_bytes == 0
-			|| m_ses.can_write_to_disk()
+			|| m_ses.can_write_to_disk(t ? t->storage() : 0)
 			// don't block this peer because of disk saturation
 			// if we're not downloading any pieces from it
 			|| m_outstanding_bytes == 0;
@@ -5274,7 +5390,27 @@ namespace libtorrent
 
 		TORRENT_ASSERT(m_channel_state[upload_channel] == peer_info::bw_network);
 
-		m_send_buffer.pop_front(bytes_transferred);
+		if (m_sending_file)
+		{
+			m_sending_file = false;
+			TORRENT_ASSERT(!m_send_files.empty());
+			send_file_t& sf = m_send_files.front();
+			TORRENT_ASSERT(int(bytes_transferred) <= sf.size);
+			sf.offset += bytes_transferred;
+			sf.size -= bytes_transferred;
+			m_send_file_bytes -= bytes_transferred;
+			if (sf.size == 0) m_send_files.pop_front();
+		}
+		else
+		{
+			m_send_buffer.pop_front(bytes_transferred);
+			for (std::deque<send_file_t>::iterator i = m_send_files.begin()
+				, end(m_send_files.end()); i != end; ++i)
+			{
+				i->buffer_offset -= bytes_transferred;
+				TORRENT_ASSERT(i->buffer_offset >= 0);
+			}
+		}
 
 		for (std::vector<int>::iterator i = m_requests_in_buffer.begin()
 			, end(m_requests_in_buffer.end()); i != end; ++i)
@@ -5329,6 +5465,69 @@ namespace libtorrent
 		setup_send();
 	}
 
+	void peer_connection::on_send_file_ready(error_code const& error, int amount)
+	{
+		TORRENT_ASSERT(m_ses.is_network_thread());
+		TORRENT_ASSERT(m_sending_file);
+
+		if (error)
+		{
+			on_send_data(error, 0);
+			return;
+		}
+
+#if TORRENT_USE_SENDFILE
+		TORRENT_ASSERT(!m_send_files.empty());
+		send_file_t const& sf = m_send_files.front();
+		TORRENT_ASSERT(amount <= sf.size);
+		stream_socket* s = m_socket->get<stream_socket>();
+		TORRENT_ASSERT(s);
+		off_t offset = sf.offset;
+#if BOOST_VERSION >= 104700
+		int sock = s->native_handle();
+#else
+		int sock = s->native();
+#endif
+		if (!m_sendfile_non_blocking)
+		{
+			// asio only guarantees the socket is non-blocking for its
+			// own operations. sendfile() must not block the network
+			// thread when the send buffer fills up
+			error_code ec;
+#if BOOST_VERSION >= 104700
+			s->non_blocking(true, ec);
+#else
+			tcp::socket::non_blocking_io ioc(true);
+			s->io_control(ioc, ec);
+#endif
+			if (ec)
+			{
+				on_send_data(ec, 0);
+				return;
+			}
+			m_sendfile_non_blocking = true;
+		}
+
+		ssize_t ret = ::sendfile(sock, sf.handle->native_handle(), &offset, amount);
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			// the socket was writable, but not anymore. Wait again
+			s->async_write_some(asio::null_buffers()
+				, make_write_handler(boost::bind(&peer_connection::on_send_file_ready
+				, self(), _1, amount)));
+			return;
+		}
+
+		error_code ec;
+		if (ret < 0) ec.assign(errno, get_posix_category());
+		// the file was truncated after the block was opened
+		else if (ret == 0) ec = errors::file_too_short;
+		on_send_data(ec, ret > 0 ? ret : 0);
+#else
+		TORRENT_ASSERT(false);
+#endif
+	}
+
 #ifdef TORRENT_DEBUG
 	struct peer_count_t
 	{
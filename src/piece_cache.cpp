@@ -0,0 +1,267 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/piece_cache.hpp"
+#include <new>
+#include <algorithm>
+
+namespace libtorrent
+{
+	piece_cache::piece_cache()
+		: m_lru_head(0)
+		, m_lru_tail(0)
+		, m_protected_head(0)
+		, m_size(0)
+		, m_num_probation(0)
+		, m_ghost_seq(0)
+		, m_pool(sizeof(cached_piece_entry), 128)
+	{}
+
+	piece_cache::~piece_cache()
+	{
+		clear();
+	}
+
+	int piece_cache::bucket(void const* storage, int piece) const
+	{
+		TORRENT_ASSERT(!m_buckets.empty());
+		std::size_t h = (std::size_t(storage) >> 4) ^ (std::size_t(piece) * 2654435761u);
+		h ^= h >> 16;
+		return int(h & (m_buckets.size() - 1));
+	}
+
+	piece_cache::iterator piece_cache::find(void const* storage, int piece) const
+	{
+		if (m_size == 0) return iterator();
+		for (cached_piece_entry* e = m_buckets[bucket(storage, piece)]; e; e = e->hash_next)
+		{
+			if (e->piece == piece && e->storage.get() == storage)
+				return iterator(e);
+		}
+		return iterator();
+	}
+
+	piece_cache::iterator piece_cache::first_of(void const* storage) const
+	{
+		std::map<void const*, storage_list>::const_iterator i = m_storages.find(storage);
+		if (i == m_storages.end()) return iterator();
+		return iterator(i->second.head);
+	}
+
+	piece_cache::iterator piece_cache::insert(cached_piece_entry const& e, bool probation)
+	{
+		TORRENT_ASSERT(find(e.storage.get(), e.piece) == end());
+
+		if (m_size >= int(m_buckets.size()))
+			rehash((std::max)(int(m_buckets.size()) * 2, 64));
+
+		void* mem = m_pool.malloc();
+		if (mem == 0) return iterator();
+		cached_piece_entry* p = new (mem) cached_piece_entry(e);
+		p->probation = probation;
+
+		cached_piece_entry*& b = m_buckets[bucket(p->storage.get(), p->piece)];
+		p->hash_next = b;
+		b = p;
+		link_lru(p);
+		link_storage(p);
+		++m_size;
+		return iterator(p);
+	}
+
+	piece_cache::iterator piece_cache::erase(iterator i)
+	{
+		TORRENT_ASSERT(i != end());
+		cached_piece_entry* p = i.get();
+		iterator ret(p->lru_next);
+
+		cached_piece_entry** e = &m_buckets[bucket(p->storage.get(), p->piece)];
+		while (*e != p)
+		{
+			TORRENT_ASSERT(*e);
+			e = &(*e)->hash_next;
+		}
+		*e = p->hash_next;
+		unlink_lru(p);
+		unlink_storage(p);
+		--m_size;
+
+		p->~cached_piece_entry();
+		m_pool.free(p);
+		return ret;
+	}
+
+	void piece_cache::clear()
+	{
+		for (cached_piece_entry* p = m_lru_head; p;)
+		{
+			cached_piece_entry* next = p->lru_next;
+			p->~cached_piece_entry();
+			m_pool.free(p);
+			p = next;
+		}
+		std::fill(m_buckets.begin(), m_buckets.end(), (cached_piece_entry*)0);
+		m_lru_head = 0;
+		m_lru_tail = 0;
+		m_protected_head = 0;
+		m_storages.clear();
+		m_size = 0;
+		m_num_probation = 0;
+		m_ghosts.clear();
+		m_ghost_order.clear();
+	}
+
+	void piece_cache::promote(iterator i)
+	{
+		TORRENT_ASSERT(i != end());
+		if (!i->probation) return;
+		unlink_lru(i.get());
+		i->probation = false;
+		link_lru(i.get());
+		unlink_storage(i.get());
+		link_storage(i.get());
+	}
+
+	piece_cache::iterator piece_cache::oldest_probation() const
+	{
+		if (m_num_probation == 0) return iterator();
+		TORRENT_ASSERT(m_lru_head->probation);
+		return iterator(m_lru_head);
+	}
+
+	void piece_cache::add_ghost(void const* storage, int piece)
+	{
+		ghost_key k(storage, piece);
+		boost::uint32_t seq = m_ghost_seq++;
+		m_ghosts[k] = seq;
+		m_ghost_order.push_back(std::make_pair(k, seq));
+
+		int limit = (std::max)(m_size, 64);
+		while (int(m_ghost_order.size()) > limit)
+		{
+			std::map<ghost_key, boost::uint32_t>::iterator i
+				= m_ghosts.find(m_ghost_order.front().first);
+			// only forget the key if it hasn't been added again since
+			if (i != m_ghosts.end() && i->second == m_ghost_order.front().second)
+				m_ghosts.erase(i);
+			m_ghost_order.pop_front();
+		}
+	}
+
+	bool piece_cache::remove_ghost(void const* storage, int piece)
+	{
+		std::map<ghost_key, boost::uint32_t>::iterator i
+			= m_ghosts.find(ghost_key(storage, piece));
+		if (i == m_ghosts.end()) return false;
+		m_ghosts.erase(i);
+		return true;
+	}
+
+	void piece_cache::link_lru(cached_piece_entry* e)
+	{
+		if (e->probation)
+		{
+			++m_num_probation;
+			if (m_protected_head)
+			{
+				// insert in front of the protected segment
+				e->lru_next = m_protected_head;
+				e->lru_prev = m_protected_head->lru_prev;
+				if (e->lru_prev) e->lru_prev->lru_next = e;
+				else m_lru_head = e;
+				m_protected_head->lru_prev = e;
+				return;
+			}
+		}
+		else if (m_protected_head == 0)
+		{
+			m_protected_head = e;
+		}
+
+		e->lru_prev = m_lru_tail;
+		e->lru_next = 0;
+		if (m_lru_tail) m_lru_tail->lru_next = e;
+		else m_lru_head = e;
+		m_lru_tail = e;
+	}
+
+	void piece_cache::unlink_lru(cached_piece_entry* e)
+	{
+		if (e == m_protected_head) m_protected_head = e->lru_next;
+		if (e->probation) --m_num_probation;
+		if (e->lru_prev) e->lru_prev->lru_next = e->lru_next;
+		else m_lru_head = e->lru_next;
+		if (e->lru_next) e->lru_next->lru_prev = e->lru_prev;
+		else m_lru_tail = e->lru_prev;
+		e->lru_prev = 0;
+		e->lru_next = 0;
+	}
+
+	void piece_cache::link_storage(cached_piece_entry* e)
+	{
+		storage_list& l = m_storages[e->storage.get()];
+		e->storage_prev = l.tail;
+		e->storage_next = 0;
+		if (l.tail) l.tail->storage_next = e;
+		else l.head = e;
+		l.tail = e;
+	}
+
+	void piece_cache::unlink_storage(cached_piece_entry* e)
+	{
+		std::map<void const*, storage_list>::iterator i = m_storages.find(e->storage.get());
+		TORRENT_ASSERT(i != m_storages.end());
+		storage_list& l = i->second;
+		if (e->storage_prev) e->storage_prev->storage_next = e->storage_next;
+		else l.head = e->storage_next;
+		if (e->storage_next) e->storage_next->storage_prev = e->storage_prev;
+		else l.tail = e->storage_prev;
+		e->storage_prev = 0;
+		e->storage_next = 0;
+		if (l.head == 0) m_storages.erase(i);
+	}
+
+	void piece_cache::rehash(int num_buckets)
+	{
+		TORRENT_ASSERT((num_buckets & (num_buckets - 1)) == 0);
+		m_buckets.assign(num_buckets, (cached_piece_entry*)0);
+		for (cached_piece_entry* p = m_lru_head; p; p = p->lru_next)
+		{
+			cached_piece_entry*& b = m_buckets[bucket(p->storage.get(), p->piece)];
+			p->hash_next = b;
+			b = p;
+		}
+	}
+}
+
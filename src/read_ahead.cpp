@@ -0,0 +1,122 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/read_ahead.hpp"
+#include "libtorrent/assert.hpp"
+#include <algorithm>
+#include <climits>
+
+namespace libtorrent
+{
+	read_ahead::read_ahead()
+		: m_num_streams(0)
+		, m_tick(0)
+	{}
+
+	void read_ahead::clear()
+	{
+		m_num_streams = 0;
+	}
+
+	int read_ahead::find_stream(size_type offset, int block_size)
+	{
+		int lru = 0;
+		for (int i = 0; i < m_num_streams; ++i)
+		{
+			stream const& s = m_streams[i];
+			// allow the read to skip ahead up to one block, to not lose
+			// track of a stream just because a request was skipped
+			if (offset >= s.next_offset && offset <= s.next_offset + block_size)
+				return i;
+			if (s.last_use < m_streams[lru].last_use) lru = i;
+		}
+
+		int i = m_num_streams < max_streams ? m_num_streams++ : lru;
+		stream& s = m_streams[i];
+		s.next_offset = offset;
+		s.cache_end = offset;
+		s.prefetch_end = offset;
+		s.window = initial_window;
+		s.reads = 0;
+		s.last_use = m_tick;
+		return i;
+	}
+
+	int read_ahead::window(int i, int max_window) const
+	{
+		TORRENT_ASSERT(i >= 0 && i < m_num_streams);
+		return (std::max)((std::min)(m_streams[i].window, max_window), 1);
+	}
+
+	void read_ahead::record_read(int i, size_type offset, int size, bool hit
+		, size_type cache_end, int block_size, int max_window
+		, size_type& prefetch_start, int& prefetch_size)
+	{
+		TORRENT_ASSERT(i >= 0 && i < m_num_streams);
+		stream& s = m_streams[i];
+		prefetch_size = 0;
+
+		if (!hit)
+		{
+			if (s.reads > 0)
+			{
+				// if this block was read ahead, it was evicted before it
+				// was requested, the window is too big for the cache. If it
+				// wasn't, the stream went past the read-ahead and the
+				// window is too small
+				if (offset < s.cache_end) s.window = (std::max)(s.window / 2, 1);
+				else s.window = (std::min)(s.window * 2, max_window);
+			}
+			s.cache_end = (std::max)(s.cache_end, cache_end);
+		}
+
+		++s.reads;
+		s.next_offset = offset + size;
+		s.last_use = ++m_tick;
+
+		if (s.reads < sequential_reads) return;
+
+		// keep between one and two windows ahead of the
+		// stream prefetched by the kernel
+		size_type ahead = size_type(window(i, max_window)) * block_size;
+		size_type start = (std::max)(s.next_offset, (std::max)(s.cache_end, s.prefetch_end));
+		if (start - s.next_offset >= ahead) return;
+
+		size_type end = s.next_offset + ahead * 2;
+		prefetch_start = start;
+		prefetch_size = int((std::min)(end - start, size_type(INT_MAX)));
+		s.prefetch_end = end;
+	}
+}
+
@@ -0,0 +1,494 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/resume_store.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/io.hpp"
+#include "libtorrent/error.hpp"
+#include "libtorrent/assert.hpp"
+#include "libtorrent/escape_string.hpp" // for convert_to_native
+
+#include <boost/crc.hpp>
+#include <algorithm>
+#include <iterator>
+#include <cstring>
+
+// the log file starts with a header of a 4 byte tag and a 4 byte
+// version, followed by records:
+//
+//    4 bytes  size of the payload
+//    4 bytes  CRC32 of the info-hash and the payload
+//   20 bytes  info-hash
+//    payload  a bencoded dictionary. "s" maps the keys that were
+//             set to their new values and "d" lists the keys that
+//             were removed. If "r" is set, the torrent was removed
+//
+// integers are big endian
+
+namespace
+{
+	char const log_tag[] = "ltrs";
+	int const log_version = 1;
+	int const header_size = 8;
+	int const record_header_size = 8 + 20;
+
+	// logs smaller than this are never compacted
+	int const min_compact_size = 64 * 1024;
+
+	boost::uint32_t record_crc(libtorrent::sha1_hash const& ih
+		, char const* payload, int size)
+	{
+		boost::crc_32_type crc;
+		crc.process_bytes(ih.begin(), 20);
+		crc.process_bytes(payload, size);
+		return crc.checksum();
+	}
+
+	// the CRC32 and size of the bencoded value
+	void value_digest(libtorrent::entry const& v, boost::uint32_t& crc, int& size)
+	{
+		std::vector<char> buf;
+		libtorrent::bencode(std::back_inserter(buf), v);
+		boost::crc_32_type c;
+		c.process_bytes(&buf[0], buf.size());
+		crc = c.checksum();
+		size = buf.size();
+	}
+}
+
+namespace libtorrent
+{
+	namespace
+	{
+		// like rename(), but replaces the target if it exists on
+		// windows as well
+		void replace_file(std::string const& from, std::string const& to
+			, error_code& ec)
+		{
+#ifdef TORRENT_WINDOWS
+			ec.clear();
+#if TORRENT_USE_WSTRING
+			if (MoveFileExW(convert_to_wstring(from).c_str()
+				, convert_to_wstring(to).c_str()
+				, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == FALSE)
+#else
+			if (MoveFileExA(convert_to_native(from).c_str()
+				, convert_to_native(to).c_str()
+				, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) == FALSE)
+#endif
+				ec.assign(GetLastError(), get_system_category());
+#else
+			rename(from, to, ec);
+#endif
+		}
+	}
+
+	resume_store::resume_store()
+		: m_log_size(0)
+		, m_live_size(header_size)
+	{}
+
+	bool resume_store::open(std::string const& path, error_code& ec)
+	{
+		ec.clear();
+		close();
+		m_path = path;
+		if (!m_file.open(path, file::read_write | file::sparse, ec)) return false;
+
+		size_type size = replay(m_loaded, ec);
+		if (ec) return false;
+
+		if (size == 0)
+		{
+			char header[header_size];
+			char* ptr = header;
+			std::memcpy(ptr, log_tag, 4);
+			ptr += 4;
+			detail::write_uint32(log_version, ptr);
+			file::iovec_t b = { header, header_size };
+			if (m_file.writev(0, &b, 1, ec) != header_size) return false;
+			size = header_size;
+		}
+
+		// drop the part of a record that was being
+		// written when we crashed
+		if (!m_file.set_size(size, ec)) return false;
+		m_log_size = size;
+		return true;
+	}
+
+	void resume_store::close()
+	{
+		m_file.close();
+		m_state.clear();
+		m_loaded.clear();
+		m_pending.clear();
+		m_log_size = 0;
+		m_live_size = header_size;
+	}
+
+	bool resume_store::load(sha1_hash const& info_hash, std::vector<char>& buf)
+	{
+		std::map<sha1_hash, entry>::iterator i = m_loaded.find(info_hash);
+		if (i == m_loaded.end()) return false;
+		buf.clear();
+		bencode(std::back_inserter(buf), i->second);
+		m_loaded.erase(i);
+		return true;
+	}
+
+	void resume_store::torrents(std::vector<sha1_hash>& ret) const
+	{
+		ret.clear();
+		ret.reserve(m_state.size());
+		for (std::map<sha1_hash, torrent_state>::const_iterator i = m_state.begin()
+			, end(m_state.end()); i != end; ++i)
+			ret.push_back(i->first);
+	}
+
+	void resume_store::save(sha1_hash const& info_hash, entry const& rd)
+	{
+		if (rd.type() != entry::dictionary_t) return;
+
+		// resume data loaded from the log is stale now
+		m_loaded.erase(info_hash);
+
+		torrent_state& st = m_state[info_hash];
+		if (st.keys.empty()) m_live_size += record_header_size;
+		m_live_size -= st.size;
+
+		entry record(entry::dictionary_t);
+		entry::dictionary_type& set = record["s"].dict();
+		entry::list_type removed;
+
+		// the keys of a dictionary entry are sorted, and so
+		// are the keys of the state
+		std::vector<key_state> keys;
+		keys.reserve(rd.dict().size());
+		std::vector<key_state>::iterator old = st.keys.begin();
+		for (entry::dictionary_type::const_iterator i = rd.dict().begin()
+			, end(rd.dict().end()); i != end; ++i)
+		{
+			key_state k;
+			k.key = i->first;
+			value_digest(i->second, k.crc, k.size);
+			k.size += k.key.size() + 4;
+
+			while (old != st.keys.end() && old->key < k.key)
+			{
+				removed.push_back(entry(old->key));
+				++old;
+			}
+			if (old != st.keys.end() && old->key == k.key)
+			{
+				if (old->crc != k.crc) set[k.key] = i->second;
+				++old;
+			}
+			else
+			{
+				set[k.key] = i->second;
+			}
+			keys.push_back(k);
+		}
+		for (; old != st.keys.end(); ++old)
+			removed.push_back(entry(old->key));
+
+		st.keys.swap(keys);
+		st.size = 0;
+		for (std::vector<key_state>::iterator i = st.keys.begin()
+			, end(st.keys.end()); i != end; ++i)
+			st.size += i->size;
+		m_live_size += st.size;
+
+		if (set.empty() && removed.empty()) return;
+		if (!removed.empty()) record["d"] = removed;
+		add_record(m_pending, info_hash, record);
+	}
+
+	void resume_store::remove(sha1_hash const& info_hash)
+	{
+		m_loaded.erase(info_hash);
+		std::map<sha1_hash, torrent_state>::iterator i = m_state.find(info_hash);
+		if (i == m_state.end()) return;
+		m_live_size -= i->second.size + record_header_size;
+		m_state.erase(i);
+
+		entry record(entry::dictionary_t);
+		record["r"] = 1;
+		add_record(m_pending, info_hash, record);
+	}
+
+	bool resume_store::flush(error_code& ec)
+	{
+		ec.clear();
+		if (!write_pending(ec)) return false;
+		if (m_log_size > min_compact_size && m_log_size > m_live_size * 2)
+			return compact(ec);
+		return true;
+	}
+
+	bool resume_store::write_pending(error_code& ec)
+	{
+		if (m_pending.empty()) return true;
+		// the log is closed if a compaction failed to reopen it
+		if (!m_file.is_open()
+			&& !m_file.open(m_path, file::read_write | file::sparse, ec))
+			return false;
+		// a short write is retried from where it stopped. If the rest
+		// can't be written, the partial record is cut off the log, to
+		// not have the records appended later follow a torn one, and
+		// the pending records are kept to be written by the next flush
+		size_type written = 0;
+		while (written < size_type(m_pending.size()))
+		{
+			file::iovec_t b = { &m_pending[0] + written
+				, size_t(m_pending.size() - written) };
+			size_type ret = m_file.writev(m_log_size + written, &b, 1, ec);
+			if (!ec && ret <= 0)
+				ec = error_code(boost::system::errc::io_error, get_posix_category());
+			if (ec)
+			{
+				error_code ignore;
+				if (written > 0) m_file.set_size(m_log_size, ignore);
+				return false;
+			}
+			written += ret;
+		}
+		m_log_size += written;
+		m_pending.clear();
+		return true;
+	}
+
+	bool resume_store::compact(error_code& ec)
+	{
+		ec.clear();
+		if (!write_pending(ec)) return false;
+
+		// read back the whole log. This rebuilds the state of all
+		// torrents too. The current state is kept until the log
+		// has been read successfully
+		std::map<sha1_hash, entry> rd;
+		std::map<sha1_hash, torrent_state> old_state;
+		old_state.swap(m_state);
+		size_type old_live_size = m_live_size;
+		m_live_size = header_size;
+		replay(rd, ec);
+
+		std::string tmp = m_path + ".tmp";
+		if (ec || !write_log(tmp, rd, ec))
+		{
+			m_state.swap(old_state);
+			m_live_size = old_live_size;
+			return false;
+		}
+
+		// the new log has been synced by write_log(). If it can't
+		// replace the old one, we keep appending to the old log,
+		// which holds the same resume data
+		m_file.close();
+		replace_file(tmp, m_path, ec);
+		bool replaced = !ec;
+		error_code e;
+		if (!m_file.open(m_path, file::read_write | file::sparse, e))
+		{
+			if (!ec) ec = e;
+			return false;
+		}
+		if (!replaced) return false;
+		m_log_size = m_file.get_size(ec);
+		return !ec;
+	}
+
+	size_type resume_store::replay(std::map<sha1_hash, entry>& ret, error_code& ec)
+	{
+		size_type size = m_file.get_size(ec);
+		if (ec || size == 0) return 0;
+
+		// read the whole log at once
+		std::vector<char> buf(size);
+		file::iovec_t b = { &buf[0], buf.size() };
+		if (m_file.readv(0, &b, 1, ec) != size)
+		{
+			if (!ec) ec = errors::file_too_short;
+			return 0;
+		}
+
+		char const* ptr = &buf[0];
+		char const* end = ptr + buf.size();
+		if (size < header_size || std::memcmp(ptr, log_tag, 4) != 0)
+		{
+			ec = errors::invalid_file_tag;
+			return 0;
+		}
+		ptr += 4;
+		if (detail::read_uint32(ptr) != log_version)
+		{
+			ec = errors::invalid_file_tag;
+			return 0;
+		}
+
+		while (end - ptr >= record_header_size)
+		{
+			char const* record_start = ptr;
+			int payload_size = detail::read_uint32(ptr);
+			boost::uint32_t crc = detail::read_uint32(ptr);
+			sha1_hash ih;
+			std::memcpy(&ih[0], ptr, 20);
+			ptr += 20;
+
+			// a record that was only partially written, or
+			// was corrupted, ends the log
+			if (payload_size < 0 || end - ptr < payload_size
+				|| record_crc(ih, ptr, payload_size) != crc)
+			{
+				ptr = record_start;
+				break;
+			}
+
+			entry record = bdecode(ptr, ptr + payload_size);
+			ptr += payload_size;
+			if (record.type() != entry::dictionary_t) continue;
+			apply(ih, record, ret);
+		}
+		return ptr - &buf[0];
+	}
+
+	void resume_store::apply(sha1_hash const& ih, entry const& record
+		, std::map<sha1_hash, entry>& rd)
+	{
+		torrent_state& st = m_state[ih];
+		m_live_size -= st.size;
+		if (st.keys.empty()) m_live_size += record_header_size;
+
+		if (record.find_key("r"))
+		{
+			m_live_size -= record_header_size;
+			m_state.erase(ih);
+			rd.erase(ih);
+			return;
+		}
+
+		entry& e = rd[ih];
+		if (e.type() != entry::dictionary_t) e = entry(entry::dictionary_t);
+
+		entry const* set = record.find_key("s");
+		if (set && set->type() == entry::dictionary_t)
+		{
+			for (entry::dictionary_type::const_iterator i = set->dict().begin()
+				, end(set->dict().end()); i != end; ++i)
+			{
+				e[i->first] = i->second;
+
+				key_state k;
+				k.key = i->first;
+				value_digest(i->second, k.crc, k.size);
+				k.size += k.key.size() + 4;
+				std::vector<key_state>::iterator j = std::lower_bound(
+					st.keys.begin(), st.keys.end(), k);
+				if (j != st.keys.end() && j->key == k.key) *j = k;
+				else st.keys.insert(j, k);
+			}
+		}
+
+		entry const* removed = record.find_key("d");
+		if (removed && removed->type() == entry::list_t)
+		{
+			for (entry::list_type::const_iterator i = removed->list().begin()
+				, end(removed->list().end()); i != end; ++i)
+			{
+				if (i->type() != entry::string_t) continue;
+				e.dict().erase(i->string());
+				key_state k;
+				k.key = i->string();
+				std::vector<key_state>::iterator j = std::lower_bound(
+					st.keys.begin(), st.keys.end(), k);
+				if (j != st.keys.end() && j->key == k.key) st.keys.erase(j);
+			}
+		}
+
+		st.size = 0;
+		for (std::vector<key_state>::iterator i = st.keys.begin()
+			, end(st.keys.end()); i != end; ++i)
+			st.size += i->size;
+		m_live_size += st.size;
+	}
+
+	void resume_store::add_record(std::vector<char>& out, sha1_hash const& ih
+		, entry const& record)
+	{
+		std::vector<char> payload;
+		bencode(std::back_inserter(payload), record);
+
+		int start = out.size();
+		out.resize(start + record_header_size);
+		char* ptr = &out[start];
+		detail::write_uint32(payload.size(), ptr);
+		detail::write_uint32(record_crc(ih, &payload[0], payload.size()), ptr);
+		std::memcpy(ptr, ih.begin(), 20);
+		out.insert(out.end(), payload.begin(), payload.end());
+	}
+
+	bool resume_store::write_log(std::string const& path
+		, std::map<sha1_hash, entry> const& rd, error_code& ec)
+	{
+		std::vector<char> buf;
+		buf.resize(header_size);
+		char* ptr = &buf[0];
+		std::memcpy(ptr, log_tag, 4);
+		ptr += 4;
+		detail::write_uint32(log_version, ptr);
+
+		for (std::map<sha1_hash, entry>::const_iterator i = rd.begin()
+			, end(rd.end()); i != end; ++i)
+		{
+			entry record(entry::dictionary_t);
+			record["s"] = i->second;
+			add_record(buf, i->first, record);
+		}
+
+		file f;
+		if (!f.open(path, file::write_only | file::sparse, ec)) return false;
+		file::iovec_t b = { &buf[0], buf.size() };
+		if (f.writev(0, &b, 1, ec) != size_type(buf.size()))
+		{
+			if (!ec) ec = errors::file_too_short;
+			return false;
+		}
+		if (!f.set_size(buf.size(), ec)) return false;
+		// the log replaces the old one, make sure it's on
+		// disk before it's renamed
+		return f.sync(ec);
+	}
+}
+
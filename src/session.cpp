@@ -175,6 +175,13 @@ namespace libtorrent
 		// disallow the buffer size to grow for the uTP socket
 		set.utp_dynamic_sock_buf = false;
 
+		// every disk thread has its own job queue and cache
+		set.disk_io_threads = 1;
+
+		// hash pieces in the disk thread, to avoid holding
+		// on to the blocks of a piece while it's being hashed
+		set.hashing_threads = 0;
+
 		return set;
 	}
 
@@ -244,6 +251,16 @@ namespace libtorrent
 		// flush all blocks in-order
 		set.disk_cache_algorithm = session_settings::avoid_readback;
 
+		// with many peers reading different parts of different
+		// torrents, don't let pieces that are only read once push
+		// the popular ones out of the read cache
+		set.read_cache_algorithm = session_settings::read_cache_2q;
+		set.read_cache_admission_filter = true;
+
+		// peers downloading pieces in order get a read-ahead
+		// window that follows how well it's used
+		set.adaptive_read_ahead = true;
+
 		set.explicit_read_cache = false;
 		// prevent fast pieces to interfere with suggested pieces
 		// since we unchoke everyone, we don't need fast pieces anyway
@@ -740,6 +757,14 @@ namespace libtorrent
 		m_impl->m_disk_thread.get_cache_info(ih, ret);
 	}
 
+	void session::get_cache_info(sha1_hash const& ih
+		, std::vector<cached_piece_info>& ret
+		, torrent_cache_status& st) const
+	{
+		m_impl->m_disk_thread.get_cache_info(ih, ret);
+		TORRENT_SYNC_CALL2(get_torrent_cache_status, ih, &st);
+	}
+
 	cache_status session::get_cache_status() const
 	{
 		return m_impl->m_disk_thread.status();
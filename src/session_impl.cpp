@@ -364,6 +364,24 @@ namespace aux {
 		TORRENT_SETTING(boolean, always_send_user_agent)
 		TORRENT_SETTING(boolean, apply_ip_filter_to_trackers)
 		TORRENT_SETTING(integer, read_job_every)
+		TORRENT_SETTING(integer, disk_io_threads)
+		TORRENT_SETTING(integer, hashing_threads)
+		TORRENT_SETTING(boolean, use_io_uring)
+		TORRENT_SETTING(integer, io_uring_queue_depth)
+		TORRENT_SETTING(boolean, use_sendfile)
+		TORRENT_SETTING(integer, read_cache_algorithm)
+		TORRENT_SETTING(boolean, read_cache_admission_filter)
+		TORRENT_SETTING(boolean, adaptive_read_ahead)
+		TORRENT_SETTING(integer, active_checking)
+		TORRENT_SETTING(boolean, mmap_sync_writes)
+		TORRENT_SETTING(boolean, direct_io)
+		TORRENT_SETTING(integer, max_coalesced_write_size)
+		TORRENT_SETTING(integer, disk_write_latency_target)
+		TORRENT_SETTING(integer, disk_read_weight)
+		TORRENT_SETTING(integer, disk_write_weight)
+		TORRENT_SETTING(integer, disk_hash_weight)
+		TORRENT_SETTING(integer, disk_move_weight)
+		TORRENT_SETTING(integer, checking_batch_size)
 	};
 
 #undef TORRENT_SETTING
@@ -953,6 +971,10 @@ namespace aux {
 			":read job queue size limit"
 			":smooth upload rate"
 			":smooth download rate"
+			":disk read time p99:disk read time p999"
+			":disk write time p99:disk write time p999"
+			":disk hash time p99:disk hash time p999"
+			":disk queue time p99:disk queue time p999"
 			"\n\n", m_stats_logger);
 	}
 #endif
@@ -1577,7 +1599,23 @@ namespace aux {
 			|| m_settings.no_atime_storage!= s.no_atime_storage
 			|| m_settings.ignore_resume_timestamps != s.ignore_resume_timestamps
 			|| m_settings.no_recheck_incomplete_resume != s.no_recheck_incomplete_resume
-			|| m_settings.low_prio_disk != s.low_prio_disk)
+			|| m_settings.low_prio_disk != s.low_prio_disk
+			|| m_settings.disk_io_threads != s.disk_io_threads
+			|| m_settings.hashing_threads != s.hashing_threads
+			|| m_settings.use_io_uring != s.use_io_uring
+			|| m_settings.io_uring_queue_depth != s.io_uring_queue_depth
+			|| m_settings.read_cache_algorithm != s.read_cache_algorithm
+			|| m_settings.read_cache_admission_filter != s.read_cache_admission_filter
+			|| m_settings.adaptive_read_ahead != s.adaptive_read_ahead
+			|| m_settings.mmap_sync_writes != s.mmap_sync_writes
+			|| m_settings.direct_io != s.direct_io
+			|| m_settings.max_coalesced_write_size != s.max_coalesced_write_size
+			|| m_settings.disk_write_latency_target != s.disk_write_latency_target
+			|| m_settings.disk_read_weight != s.disk_read_weight
+			|| m_settings.disk_write_weight != s.disk_write_weight
+			|| m_settings.disk_hash_weight != s.disk_hash_weight
+			|| m_settings.disk_move_weight != s.disk_move_weight
+			|| m_settings.checking_batch_size != s.checking_batch_size)
 			update_disk_io_thread = true;
 
 		bool connections_limit_changed = m_settings.connections_limit != s.connections_limit;
@@ -1670,6 +1708,9 @@ namespace aux {
 		if (m_settings.dht_upload_rate_limit != s.dht_upload_rate_limit)
 			m_udp_socket.set_rate_limit(s.dht_upload_rate_limit);
 
+		// if more torrents may be checked at a time, start them now
+		bool check_more = s.active_checking > m_settings.active_checking;
+
 		m_settings = s;
 
 		if (m_settings.cache_buffer_chunk_size <= 0)
@@ -1679,6 +1720,7 @@ namespace aux {
 
 		if (connections_limit_changed) update_connections_limit();
 		if (unchoke_limit_changed) update_unchoke_limit();
+		if (check_more) start_queued_checks();
 	
 		// enable anonymous mode. We don't want to accept any incoming
 		// connections, except through a proxy.
@@ -2461,7 +2503,9 @@ namespace aux {
 		// way of limiting it
 		int limit = m_connections.size();
 
-		while (m_next_disk_peer != m_connections.end() && limit > 0 && can_write_to_disk())
+		// every drive has its own write queue, so it's up to
+		// each peer to decide whether it can read again
+		while (m_next_disk_peer != m_connections.end() && limit > 0)
 		{
 			--limit;
 			peer_connection* p = m_next_disk_peer->get();
@@ -2718,13 +2762,7 @@ namespace aux {
 		if (num_checking == 0 && num_queued > 0)
 		{
 			TORRENT_ASSERT(false);
-			check_queue_t::iterator i = std::min_element(m_queued_for_checking.begin()
-				, m_queued_for_checking.end(), boost::bind(&torrent::queue_position, _1)
-				< boost::bind(&torrent::queue_position, _2));
-			if (i != m_queued_for_checking.end())
-			{
-				(*i)->start_checking();
-			}
+			start_queued_checks();
 		}
 
 #ifndef TORRENT_DISABLE_DHT
@@ -3196,6 +3234,21 @@ namespace aux {
 
 			int total_job_time = cs.cumulative_job_time == 0 ? 1 : cs.cumulative_job_time;
 
+			// the latency percentiles are for the jobs completed since
+			// the last line was logged, not since the session started
+			latency_histogram read_time = cs.job_time_histogram[disk_io_job::read];
+			read_time -= m_last_cache_status.job_time_histogram[disk_io_job::read];
+			latency_histogram write_time = cs.job_time_histogram[disk_io_job::write];
+			write_time -= m_last_cache_status.job_time_histogram[disk_io_job::write];
+			latency_histogram hash_time = cs.job_time_histogram[disk_io_job::hash];
+			hash_time -= m_last_cache_status.job_time_histogram[disk_io_job::hash];
+			latency_histogram queue_time;
+			for (int i = 0; i < cache_status::num_job_types; ++i)
+			{
+				queue_time += cs.queue_time_histogram[i];
+				queue_time -= m_last_cache_status.queue_time_histogram[i];
+			}
+
 			fprintf(m_stats_logger
 				, "%f\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t"
 				  "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t"
@@ -3207,7 +3260,7 @@ namespace aux {
 				  "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t"
 				  "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%f\t%f\t"
 				  "%f\t%f\t%d\t%f\t%d\t%d\t%d\t%d\t%d\t%d\t"
-				  "%d\n"
+				  "%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\t%d\n"
 				, total_milliseconds(now - m_last_log_rotation) / 1000.f
 				, int(m_stat.total_upload() - m_last_uploaded)
 				, int(m_stat.total_download() - m_last_downloaded)
@@ -3309,6 +3362,14 @@ namespace aux {
 				, m_settings.unchoke_slots_limit * 2
 				, m_stat.low_pass_upload_rate()
 				, m_stat.low_pass_download_rate()
+				, read_time.percentile(0.99f)
+				, read_time.percentile(0.999f)
+				, write_time.percentile(0.99f)
+				, write_time.percentile(0.999f)
+				, hash_time.percentile(0.99f)
+				, hash_time.percentile(0.999f)
+				, queue_time.percentile(0.99f)
+				, queue_time.percentile(0.999f)
 			);
 			m_last_cache_status = cs;
 			m_last_failed = m_total_failed_bytes;
@@ -4141,16 +4202,32 @@ namespace aux {
 		return torrent_handle(torrent_ptr);
 	}
 
+	session_impl::check_queue_t::iterator session_impl::find_queued_check(torrent const* t)
+	{
+		check_queue_t::iterator i = m_queued_for_checking.begin();
+		for (; i != m_queued_for_checking.end(); ++i)
+			if (i->t.get() == t) break;
+		return i;
+	}
+
 	void session_impl::queue_check_torrent(boost::shared_ptr<torrent> const& t)
 	{
 		if (m_abort) return;
 		TORRENT_ASSERT(t->should_check_files());
 		TORRENT_ASSERT(t->state() != torrent_status::checking_files);
-		if (m_queued_for_checking.empty()) t->start_checking();
-		else t->set_state(torrent_status::queued_for_checking);
-		TORRENT_ASSERT(std::find(m_queued_for_checking.begin()
-			, m_queued_for_checking.end(), t) == m_queued_for_checking.end());
-		m_queued_for_checking.push_back(t);
+		TORRENT_ASSERT(find_queued_check(t.get()) == m_queued_for_checking.end());
+
+		queued_check c;
+		c.t = t;
+		// the device is found by the disk thread when the resume
+		// data is checked. If the save path doesn't exist yet, the
+		// torrent has nothing to check, the device doesn't matter
+		c.device = t->device();
+		m_queued_for_checking.push_back(c);
+
+		start_queued_checks();
+		if (t->state() != torrent_status::checking_files)
+			t->set_state(torrent_status::queued_for_checking);
 	}
 
 	void session_impl::dequeue_check_torrent(boost::shared_ptr<torrent> const& t)
@@ -4159,36 +4236,62 @@ namespace aux {
 		TORRENT_ASSERT(t->state() == torrent_status::checking_files
 			|| t->state() == torrent_status::queued_for_checking);
 
-		if (m_queued_for_checking.empty()) return;
+		check_queue_t::iterator done = find_queued_check(t.get());
+		TORRENT_ASSERT(done != m_queued_for_checking.end());
+		if (done == m_queued_for_checking.end()) return;
+
+		bool was_checking = t->state() == torrent_status::checking_files;
+		m_queued_for_checking.erase(done);
+
+		// only start a new one if we removed one that is checking
+		if (was_checking) start_queued_checks();
+	}
 
-		boost::shared_ptr<torrent> next_check = *m_queued_for_checking.begin();
-		check_queue_t::iterator done = m_queued_for_checking.end();
+	void session_impl::start_queued_checks()
+	{
+		if (m_paused) return;
+
+		// the devices torrents are being checked on
+		std::set<boost::uint64_t> busy_devices;
+		int num_checking = 0;
 		for (check_queue_t::iterator i = m_queued_for_checking.begin()
 			, end(m_queued_for_checking.end()); i != end; ++i)
 		{
-			// the reason m_paused is in there is because when the session
-			// is paused, all torrents  that are queued ar all of a sudden
-			// not supposed to be queued anymore. The first torrent that gets
-			// removed from the queue will hence trigger this assert, without
-			// the m_paused exception
-			TORRENT_ASSERT(*i == t || (*i)->should_check_files() || m_paused);
-			if (*i == t) done = i;
-			else if (next_check == t || next_check->queue_position() > (*i)->queue_position())
-				next_check = *i;
-		}
-		TORRENT_ASSERT(next_check != t || m_queued_for_checking.size() == 1);
-		// only start a new one if we removed the one that is checking
-		TORRENT_ASSERT(done != m_queued_for_checking.end());
-		if (done == m_queued_for_checking.end()) return;
+			if (i->t->state() != torrent_status::checking_files) continue;
+			++num_checking;
+			busy_devices.insert(i->device);
+		}
 
-		if (next_check != t
-			&& t->state() == torrent_status::checking_files
-			&& !m_paused)
+		int limit = (std::max)(m_settings.active_checking, 1);
+		while (num_checking < limit)
 		{
-			next_check->start_checking();
-		}
+			// pick the torrent first in the queue, preferring torrents
+			// on devices that aren't being checked already. Checking
+			// two torrents on the same drive is mostly spent seeking
+			check_queue_t::iterator next = m_queued_for_checking.end();
+			check_queue_t::iterator next_idle = m_queued_for_checking.end();
+			for (check_queue_t::iterator i = m_queued_for_checking.begin()
+				, end(m_queued_for_checking.end()); i != end; ++i)
+			{
+				torrent& t = *i->t;
+				if (t.state() == torrent_status::checking_files) continue;
+				// when the session is paused, all torrents that are
+				// queued are all of a sudden not supposed to be queued
+				// anymore, until they're removed from the queue
+				if (!t.should_check_files()) continue;
+				if (next == end || next->t->queue_position() > t.queue_position())
+					next = i;
+				if (busy_devices.count(i->device) == 0
+					&& (next_idle == end || next_idle->t->queue_position() > t.queue_position()))
+					next_idle = i;
+			}
+			if (next_idle != m_queued_for_checking.end()) next = next_idle;
+			if (next == m_queued_for_checking.end()) break;
 
-		m_queued_for_checking.erase(done);
+			++num_checking;
+			busy_devices.insert(next->device);
+			next->t->start_checking();
+		}
 	}
 
 	void session_impl::remove_torrent(const torrent_handle& h, int options)
@@ -4261,8 +4364,7 @@ namespace aux {
 		if (m_next_connect_torrent == m_torrents.end())
 			m_next_connect_torrent = m_torrents.begin();
 
-		std::list<boost::shared_ptr<torrent> >::iterator k
-			= std::find(m_queued_for_checking.begin(), m_queued_for_checking.end(), tptr);
+		check_queue_t::iterator k = find_queued_check(tptr.get());
 		if (k != m_queued_for_checking.end()) m_queued_for_checking.erase(k);
 		TORRENT_ASSERT(m_torrents.find(i_hash) == m_torrents.end());
 	}
@@ -4428,6 +4530,14 @@ namespace aux {
 		}
 	}
 
+	void session_impl::get_torrent_cache_status(sha1_hash const& ih
+		, torrent_cache_status* st)
+	{
+		boost::shared_ptr<torrent> t = find_torrent(ih).lock();
+		if (!t || t->get_storage() == 0) return;
+		m_disk_thread.get_torrent_cache_status(&t->filesystem(), *st);
+	}
+
 	session_status session_impl::status() const
 	{
 //		INVARIANT_CHECK;
@@ -5224,11 +5334,13 @@ namespace aux {
 		for (check_queue_t::const_iterator i = m_queued_for_checking.begin()
 			, end(m_queued_for_checking.end()); i != end; ++i)
 		{
-			if ((*i)->state() == torrent_status::checking_files) ++num_checking;
+			if (i->t->state() == torrent_status::checking_files) ++num_checking;
 		}
 
-		// the queue is either empty, or it has exactly one checking torrent in it
-		TORRENT_ASSERT(m_queued_for_checking.empty() || num_checking == 1);
+		// the queue is either empty, or it has at least one checking torrent
+		// in it. There may be more than active_checking, if it was lowered
+		// while they were being checked
+		TORRENT_ASSERT(m_queued_for_checking.empty() || num_checking >= 1 || m_paused);
 
 		std::set<int> unique;
 		int total_downloaders = 0;
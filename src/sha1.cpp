@@ -27,6 +27,16 @@ typedef boost::uint8_t u8;
 
 #include "libtorrent/config.hpp"
 
+// the x86 SHA extensions are used when the CPU supports them. This
+// requires a compiler that supports the target attribute
+#if (defined __clang__ || (defined __GNUC__ \
+	&& (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))) \
+	&& (defined __x86_64__ || defined __i386__)
+#define TORRENT_HAS_SHA_NI 1
+#include <immintrin.h>
+#include <cpuid.h>
+#endif
+
 struct TORRENT_EXPORT SHA_CTX
 {
 	u32 state[5];
@@ -37,6 +47,8 @@ struct TORRENT_EXPORT SHA_CTX
 TORRENT_EXPORT void SHA1_Init(SHA_CTX* context);
 TORRENT_EXPORT void SHA1_Update(SHA_CTX* context, u8 const* data, u32 len);
 TORRENT_EXPORT void SHA1_Final(u8* digest, SHA_CTX* context);
+TORRENT_EXPORT bool SHA1_has_sha_ni();
+TORRENT_EXPORT void SHA1_use_sha_ni(bool enable);
 
 namespace
 {
@@ -127,6 +139,135 @@ namespace
 		a = b = c = d = e = 0;
 	}
 
+#ifdef TORRENT_HAS_SHA_NI
+	bool check_sha_ni()
+	{
+		unsigned int eax, ebx, ecx, edx;
+		if (__get_cpuid_max(0, 0) < 7) return false;
+		__cpuid(1, eax, ebx, ecx, edx);
+		// SSSE3 and SSE4.1
+		if ((ecx & (1 << 9)) == 0 || (ecx & (1 << 19)) == 0) return false;
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		return (ebx & (1 << 29)) != 0;
+	}
+
+	// whether the CPU supports the SHA extensions. This is set by a
+	// static initializer, before any other thread can be hashing
+	bool const cpu_has_sha_ni = check_sha_ni();
+
+	// this is only changed by SHA1_use_sha_ni()
+	bool sha_ni_enabled = true;
+
+	bool use_sha_ni()
+	{
+		return cpu_has_sha_ni && sha_ni_enabled;
+	}
+
+	// hashes num_blocks consecutive 64 byte blocks using the
+	// SHA extensions. Each line of the macro is 4 rounds
+#define SHA1_NI_ROUNDS(e_in, e_out, m0, m1, m2, m3, f) \
+	e_in = _mm_sha1nexte_epu32(e_in, m0); \
+	e_out = abcd; \
+	m1 = _mm_sha1msg2_epu32(m1, m0); \
+	abcd = _mm_sha1rnds4_epu32(abcd, e_in, f); \
+	m3 = _mm_sha1msg1_epu32(m3, m0); \
+	m2 = _mm_xor_si128(m2, m0);
+
+	__attribute__((target("sha,sse4.1")))
+	void SHA1TransformNI(u32 state[5], u8 const* data, u32 num_blocks)
+	{
+		__m128i const mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+		__m128i abcd = _mm_loadu_si128((__m128i const*)state);
+		abcd = _mm_shuffle_epi32(abcd, 0x1b);
+		__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+		__m128i e1;
+
+		for (; num_blocks > 0; --num_blocks, data += 64)
+		{
+			__m128i const abcd_save = abcd;
+			__m128i const e0_save = e0;
+
+			__m128i msg0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)data), mask);
+			__m128i msg1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 16)), mask);
+			__m128i msg2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 32)), mask);
+			__m128i msg3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(data + 48)), mask);
+
+			// rounds 0-11
+			e0 = _mm_add_epi32(e0, msg0);
+			e1 = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+			e1 = _mm_sha1nexte_epu32(e1, msg1);
+			e0 = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+			msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+			e0 = _mm_sha1nexte_epu32(e0, msg2);
+			e1 = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+			msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+			msg0 = _mm_xor_si128(msg0, msg2);
+
+			// rounds 12-67
+			SHA1_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 0)
+			SHA1_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 0)
+			SHA1_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1)
+			SHA1_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 1)
+			SHA1_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 1)
+			SHA1_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 1)
+			SHA1_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 1)
+			SHA1_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2)
+			SHA1_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 2)
+			SHA1_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 2)
+			SHA1_NI_ROUNDS(e1, e0, msg1, msg2, msg3, msg0, 2)
+			SHA1_NI_ROUNDS(e0, e1, msg2, msg3, msg0, msg1, 2)
+			SHA1_NI_ROUNDS(e1, e0, msg3, msg0, msg1, msg2, 3)
+			SHA1_NI_ROUNDS(e0, e1, msg0, msg1, msg2, msg3, 3)
+
+			// rounds 68-79
+			e1 = _mm_sha1nexte_epu32(e1, msg1);
+			e0 = abcd;
+			msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+			abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+			msg3 = _mm_xor_si128(msg3, msg1);
+
+			e0 = _mm_sha1nexte_epu32(e0, msg2);
+			e1 = abcd;
+			msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+			abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+			e1 = _mm_sha1nexte_epu32(e1, msg3);
+			e0 = abcd;
+			abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+			e0 = _mm_sha1nexte_epu32(e0, e0_save);
+			abcd = _mm_add_epi32(abcd, abcd_save);
+		}
+
+		abcd = _mm_shuffle_epi32(abcd, 0x1b);
+		_mm_storeu_si128((__m128i*)state, abcd);
+		state[4] = _mm_extract_epi32(e0, 3);
+	}
+
+#undef SHA1_NI_ROUNDS
+#endif // TORRENT_HAS_SHA_NI
+
+	// hashes num_blocks consecutive 64 byte blocks
+	template <class BlkFun>
+	void transform_blocks(u32 state[5], u8 const* data, u32 num_blocks)
+	{
+#ifdef TORRENT_HAS_SHA_NI
+		if (use_sha_ni())
+		{
+			SHA1TransformNI(state, data, num_blocks);
+			return;
+		}
+#endif
+		for (u32 i = 0; i < num_blocks; ++i)
+			SHA1Transform<BlkFun>(state, data + i * 64);
+	}
+
 	void SHAPrintContext(SHA_CTX *context, char *msg)
 	{
 		using namespace std;
@@ -152,11 +293,10 @@ namespace
 		if ((j + len) > 63)
 		{
 			memcpy(&context->buffer[j], data, (i = 64-j));
-			SHA1Transform<BlkFun>(context->state, context->buffer);
-			for ( ; i + 63 < len; i += 64)
-			{
-				SHA1Transform<BlkFun>(context->state, &data[i]);
-			}
+			transform_blocks<BlkFun>(context->state, context->buffer, 1);
+			u32 num_blocks = (len - i) / 64;
+			transform_blocks<BlkFun>(context->state, &data[i], num_blocks);
+			i += num_blocks * 64;
 			j = 0;
 		}
 		else
@@ -211,6 +351,29 @@ void SHA1_Update(SHA_CTX* context, u8 const* data, u32 len)
 }
 
 
+// returns true if SHA1_Update() uses the x86 SHA extensions
+
+bool SHA1_has_sha_ni()
+{
+#ifdef TORRENT_HAS_SHA_NI
+	return use_sha_ni();
+#else
+	return false;
+#endif
+}
+
+// enables or disables the use of the x86 SHA extensions, if the CPU
+// supports them. They are enabled by default. This is used to compare
+// the performance of the implementations
+
+void SHA1_use_sha_ni(bool enable)
+{
+#ifdef TORRENT_HAS_SHA_NI
+	sha_ni_enabled = enable;
+#endif
+}
+
+
 // Add padding and return the message digest.
 
 void SHA1_Final(u8* digest, SHA_CTX* context)
@@ -178,7 +178,7 @@ namespace
 			if (ret != j.buffer_size) return;
 
 			hasher h;
-			h.update(j.buffer, j.buffer_size);
+			h.update(j.data(), j.buffer_size);
 			h.update((char const*)&m_salt, sizeof(m_salt));
 
 			std::pair<policy::iterator, policy::iterator> range
@@ -259,7 +259,7 @@ namespace
 			if (ret != j.buffer_size) return;
 
 			hasher h;
-			h.update(j.buffer, j.buffer_size);
+			h.update(j.data(), j.buffer_size);
 			h.update((char const*)&m_salt, sizeof(m_salt));
 			sha1_hash ok_digest = h.final();
 
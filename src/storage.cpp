@@ -66,6 +66,10 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/disk_buffer_holder.hpp"
 #include "libtorrent/alloca.hpp"
 #include "libtorrent/allocator.hpp" // page_size
+#include "libtorrent/io_uring.hpp"
+#include "libtorrent/binary_resume.hpp"
+#include "libtorrent/bencode.hpp"
+#include "libtorrent/bitfield.hpp"
 
 #include <cstdio>
 
@@ -277,6 +281,21 @@ namespace libtorrent
 		return ret;
 	}
 
+	// storages that don't know about the binary resume data
+	// format see it as bencoded resume data
+	bool storage_interface::verify_binary_resume_data(
+		binary_resume_data const& rd, error_code& error)
+	{
+		entry e;
+		rd.to_entry(e);
+		std::vector<char> buf;
+		bencode(std::back_inserter(buf), e);
+		lazy_entry le;
+		if (lazy_bdecode(&buf[0], &buf[0] + buf.size(), le, error) != 0)
+			return false;
+		return verify_resume_data(le, error);
+	}
+
 	int copy_bufs(file::iovec_t const* bufs, int bytes, file::iovec_t* target)
 	{
 		int size = 0;
@@ -659,7 +678,7 @@ namespace libtorrent
 		return int((data_start + m_files.piece_length() - 1) / m_files.piece_length());
 	}
 
-	bool default_storage::verify_resume_data(lazy_entry const& rd, error_code& error)
+	void default_storage::read_file_mapping(lazy_entry const& rd)
 	{
 		// TODO: make this more generic to not just work if files have been
 		// renamed, but also if they have been merged into a single file for instance
@@ -675,7 +694,7 @@ namespace libtorrent
 				m_mapped_files->rename_file(i, new_filename);
 			}
 		}
-		
+
 		lazy_entry const* file_priority = rd.dict_find_list("file_priority");
 		if (file_priority && file_priority->list_size()
 			== files().num_files())
@@ -684,6 +703,49 @@ namespace libtorrent
 			for (int i = 0; i < file_priority->list_size(); ++i)
 				m_file_priority[i] = boost::uint8_t(file_priority->list_int_value_at(i, 1));
 		}
+	}
+
+	bool default_storage::verify_file_sizes(
+		std::vector<std::pair<size_type, std::time_t> > const& file_sizes
+		, bool seed, bool compact, error_code& error)
+	{
+		if (file_sizes.empty())
+		{
+			error = errors::no_files_in_resume_data;
+			return false;
+		}
+
+		if (seed)
+		{
+			if (files().num_files() != (int)file_sizes.size())
+			{
+				error = errors::mismatching_number_of_files;
+				return false;
+			}
+
+			std::vector<std::pair<size_type, std::time_t> >::const_iterator
+				fs = file_sizes.begin();
+			// the resume data says we have the entire torrent
+			// make sure the file sizes are the right ones
+			for (file_storage::iterator i = files().begin()
+				, end(files().end()); i != end; ++i, ++fs)
+			{
+				if (!i->pad_file && i->size != fs->first)
+				{
+					error = errors::mismatching_file_size;
+					return false;
+				}
+			}
+		}
+		int flags = (compact ? compact_mode : 0)
+			| (settings().ignore_resume_timestamps ? ignore_timestamps : 0);
+
+		return match_filesizes(files(), m_save_path, file_sizes, flags, error);
+	}
+
+	bool default_storage::verify_resume_data(lazy_entry const& rd, error_code& error)
+	{
+		read_file_mapping(rd);
 
 		std::vector<std::pair<size_type, std::time_t> > file_sizes;
 		lazy_entry const* file_sizes_ent = rd.dict_find_list("file sizes");
@@ -692,7 +754,7 @@ namespace libtorrent
 			error = errors::missing_file_sizes;
 			return false;
 		}
-		
+
 		for (int i = 0; i < file_sizes_ent->list_size(); ++i)
 		{
 			lazy_entry const* e = file_sizes_ent->list_at(i);
@@ -710,9 +772,9 @@ namespace libtorrent
 			error = errors::no_files_in_resume_data;
 			return false;
 		}
-		
+
 		bool seed = false;
-		
+
 		lazy_entry const* slots = rd.dict_find_list("slots");
 		if (slots)
 		{
@@ -747,39 +809,59 @@ namespace libtorrent
 			return false;
 		}
 
-		bool full_allocation_mode = false;
-		if (rd.dict_find_string_value("allocation") != "compact")
-			full_allocation_mode = true;
+		return verify_file_sizes(file_sizes, seed
+			, rd.dict_find_string_value("allocation") == "compact", error);
+	}
 
-		if (seed)
+	bool default_storage::verify_binary_resume_data(
+		binary_resume_data const& rd, error_code& error)
+	{
+		if (rd.extra()) read_file_mapping(*rd.extra());
+
+		// the file sizes and the slot map are used straight
+		// out of the resume data buffer
+		if (rd.num_files() == 0)
 		{
-			if (files().num_files() != (int)file_sizes.size())
-			{
-				error = errors::mismatching_number_of_files;
-				return false;
-			}
+			error = errors::missing_file_sizes;
+			return false;
+		}
 
-			std::vector<std::pair<size_type, std::time_t> >::iterator
-				fs = file_sizes.begin();
-			// the resume data says we have the entire torrent
-			// make sure the file sizes are the right ones
-			for (file_storage::iterator i = files().begin()
-				, end(files().end()); i != end; ++i, ++fs)
+		std::vector<std::pair<size_type, std::time_t> > file_sizes;
+		rd.file_sizes(file_sizes);
+
+		bool seed = false;
+		if (rd.has_slot_map())
+		{
+			if (rd.num_slots() == m_files.num_pieces())
 			{
-				if (!i->pad_file && i->size != fs->first)
+				seed = true;
+				for (int i = 0; i < rd.num_slots(); ++i)
 				{
-					error = errors::mismatching_file_size;
-					return false;
+					if (rd.slot_at(i) >= 0) continue;
+					seed = false;
+					break;
 				}
 			}
 		}
-		int flags = (full_allocation_mode ? 0 : compact_mode)
-			| (settings().ignore_resume_timestamps ? ignore_timestamps : 0);
-
-		return match_filesizes(files(), m_save_path, file_sizes, flags, error);
+		else if (rd.num_pieces() > 0)
+		{
+			if (rd.num_pieces() == m_files.num_pieces())
+			{
+				bitfield have;
+				have.borrow_bytes((char*)rd.pieces(), rd.num_pieces());
+				seed = have.count() == rd.num_pieces();
+			}
+		}
+		else
+		{
+			error = errors::missing_pieces;
+			return false;
+		}
 
+		return verify_file_sizes(file_sizes, seed, rd.compact(), error);
 	}
 
+
 	// returns true on success
 	bool default_storage::move_storage(std::string const& sp)
 	{
@@ -965,7 +1047,7 @@ ret:
 		}
 #endif
 		fileop op = { &file::writev, &default_storage::write_unaligned
-			, m_settings ? settings().disk_io_write_mode : 0, file::read_write };
+			, m_settings ? settings().disk_io_write_mode : 0, file::read_write, false };
 #ifdef TORRENT_DISK_STATS
 		int ret = readwritev(bufs, slot, offset, num_bufs, op);
 		if (pool)
@@ -979,6 +1061,14 @@ ret:
 #endif
 	}
 
+	int default_storage::writev_span(file::iovec_t const* bufs, int slot, int offset
+		, int num_bufs)
+	{
+		fileop op = { &file::writev, &default_storage::write_unaligned
+			, m_settings ? settings().disk_io_write_mode : 0, file::read_write, true };
+		return readwritev(bufs, slot, offset, num_bufs, op);
+	}
+
 	size_type default_storage::physical_offset(int slot, int offset)
 	{
 		TORRENT_ASSERT(slot >= 0);
@@ -1011,6 +1101,33 @@ ret:
 		return ret;
 	}
 
+	boost::intrusive_ptr<file> default_storage::open_block(int slot, int offset
+		, int size, size_type& file_offset)
+	{
+		TORRENT_ASSERT(slot >= 0);
+		TORRENT_ASSERT(slot < m_files.num_pieces());
+		TORRENT_ASSERT(offset >= 0);
+
+		size_type tor_off = size_type(slot) * files().piece_length() + offset;
+		file_storage::iterator file_iter = files().file_at_offset(tor_off);
+		size_type in_file = tor_off - file_iter->offset;
+		if (file_iter->pad_file || in_file + size > file_iter->size)
+			return boost::intrusive_ptr<file>();
+
+		error_code ec;
+		boost::intrusive_ptr<file> f = open_file(file_iter, file::read_only, ec);
+		if (!f || ec) return boost::intrusive_ptr<file>();
+
+		// the file must be at least as big as the block, otherwise
+		// the peer would be sent a truncated block. Unbuffered files
+		// can't be used with sendfile()
+		file_offset = files().file_base(*file_iter) + in_file;
+		if ((f->open_mode() & file::no_buffer)
+			|| f->get_size(ec) < file_offset + size || ec)
+			return boost::intrusive_ptr<file>();
+		return f;
+	}
+
 	void default_storage::hint_read(int slot, int offset, int size)
 	{
 		size_type start = slot * (size_type)m_files.piece_length() + offset;
@@ -1048,18 +1165,19 @@ ret:
 			if (file_offset + file_bytes_left > file_iter->size)
 				file_bytes_left = (std::max)(static_cast<int>(file_iter->size - file_offset), 0);
 
-			if (file_bytes_left == 0) continue;
-
-			if (file_iter->pad_file) continue;
+			if (file_bytes_left == 0 || file_iter->pad_file)
+			{
+				file_offset = 0;
+				continue;
+			}
 
 			error_code ec;
 			file_handle = open_file(file_iter, file::read_only, ec);
 
 			// failing to hint that we want to read is not a big deal
 			// just swollow the error and keep going
-			if (!file_handle || ec) continue;
-
-			file_handle->hint_read(file_offset, file_bytes_left);
+			if (file_handle && !ec)
+				file_handle->hint_read(file_offset, file_bytes_left);
 			file_offset = 0;
 		}
 	}
@@ -1076,7 +1194,7 @@ ret:
 		}
 #endif
 		fileop op = { &file::readv, &default_storage::read_unaligned
-			, m_settings ? settings().disk_io_read_mode : 0, file::read_only };
+			, m_settings ? settings().disk_io_read_mode : 0, file::read_only, false };
 #ifdef TORRENT_SIMULATE_SLOW_READ
 		boost::thread::sleep(boost::get_system_time()
 			+ boost::posix_time::milliseconds(1000));
@@ -1143,7 +1261,7 @@ ret:
 		int bytes_left = size;
 		int slot_size = static_cast<int>(m_files.piece_size(slot));
 
-		if (offset + bytes_left > slot_size)
+		if (!op.span_slots && offset + bytes_left > slot_size)
 			bytes_left = slot_size - offset;
 
 		TORRENT_ASSERT(bytes_left >= 0);
@@ -1152,6 +1270,15 @@ ret:
 		int counter = 0;
 #endif
 
+		// if this thread has an io_uring, the file operations are queued
+		// up and submitted together, once all of them are known. Large
+		// operations are split into chunks, for the device to work on
+		// concurrently
+		io_uring_queue* ring = thread_io_uring();
+		if (ring && !ring->is_open()) ring = 0;
+		if (ring) ring->clear();
+		const int io_uring_chunk_size = 128 * 1024;
+
 		file::iovec_t* tmp_bufs = TORRENT_ALLOCA(file::iovec_t, num_bufs);
 		file::iovec_t* current_buf = TORRENT_ALLOCA(file::iovec_t, num_bufs);
 		copy_bufs(bufs, size, current_buf);
@@ -1212,6 +1339,7 @@ ret:
 				std::string path = combine_path(m_save_path, files().file_path(*file_iter));
 				TORRENT_ASSERT(ec);
 				set_error(path, ec);
+				if (ring) ring->clear();
 				return -1;
 			}
 
@@ -1219,14 +1347,47 @@ ret:
 			TORRENT_ASSERT(count_bufs(tmp_bufs, file_bytes_left) == num_tmp_bufs);
 			TORRENT_ASSERT(num_tmp_bufs <= num_bufs);
 			int bytes_transferred = 0;
+			size_type adjusted_offset = files().file_base(*file_iter) + file_offset;
+
+			// files opened in no_buffer mode have alignment requirements
+			// that are handled by the blocking calls
+			if (ring && (file_handle->open_mode() & file::no_buffer) == 0)
+			{
+				int file_index = file_iter - files().begin();
+				for (file::iovec_t* i = tmp_bufs, *end(tmp_bufs + num_tmp_bufs); i != end;)
+				{
+					file::iovec_t* chunk_end = i;
+					int chunk_size = 0;
+					do
+					{
+						chunk_size += chunk_end->iov_len;
+						++chunk_end;
+					} while (chunk_end != end
+						&& chunk_size + int(chunk_end->iov_len) <= io_uring_chunk_size);
+
+					if (op.mode == file::read_only)
+						ring->queue_readv(file_handle, adjusted_offset, i, chunk_end - i, file_index);
+					else
+						ring->queue_writev(file_handle, adjusted_offset, i, chunk_end - i, file_index);
+					adjusted_offset += chunk_size;
+					i = chunk_end;
+				}
+				file_offset = 0;
+				advance_bufs(current_buf, file_bytes_left);
+				continue;
+			}
+
 			// if the file is opened in no_buffer mode, and the
 			// read is unaligned, we need to fall back on a slow
 			// special read that reads aligned buffers and copies
-			// it into the one supplied
-			size_type adjusted_offset = files().file_base(*file_iter) + file_offset;
+			// it into the one supplied. An unaligned size is only
+			// allowed at the end of the file, where file::writev()
+			// truncates the file to it
 			if ((file_handle->open_mode() & file::no_buffer)
 				&& ((adjusted_offset & (file_handle->pos_alignment()-1)) != 0
-				|| (uintptr_t(tmp_bufs->iov_base) & (file_handle->buf_alignment()-1)) != 0))
+				|| (uintptr_t(tmp_bufs->iov_base) & (file_handle->buf_alignment()-1)) != 0
+				|| ((file_bytes_left & (file_handle->size_alignment()-1)) != 0
+					&& file_offset + file_bytes_left < file_iter->size)))
 			{
 				bytes_transferred = (int)(this->*op.unaligned_op)(file_handle, adjusted_offset
 					, tmp_bufs, num_tmp_bufs, ec);
@@ -1241,15 +1402,51 @@ ret:
 			if (ec)
 			{
 				set_error(combine_path(m_save_path, files().file_path(*file_iter)), ec);
+				if (ring) ring->clear();
 				return -1;
 			}
 
 			if (file_bytes_left != bytes_transferred)
+			{
+				if (ring) ring->clear();
 				return bytes_transferred;
+			}
 
 			advance_bufs(current_buf, bytes_transferred);
 			TORRENT_ASSERT(count_bufs(current_buf, bytes_left - file_bytes_left) <= num_bufs);
 		}
+
+		if (ring && ring->num_queued() > 0)
+		{
+			error_code ec;
+			if (!ring->submit(ec))
+			{
+				set_error(m_save_path, ec);
+				ring->clear();
+				return -1;
+			}
+
+			// the operations are checked in file order. The first one that
+			// failed or came up short determines the result, just like
+			// with the blocking calls
+			for (int i = 0; i < ring->num_queued(); ++i)
+			{
+				int ret = ring->result(i);
+				if (ret < 0)
+				{
+					set_error(combine_path(m_save_path, files().file_path(*(files().begin() + ring->tag(i))))
+						, error_code(-ret, get_posix_category()));
+					ring->clear();
+					return -1;
+				}
+				if (ret != ring->size(i))
+				{
+					ring->clear();
+					return ret;
+				}
+			}
+			ring->clear();
+		}
 		return size;
 	}
 
@@ -1276,32 +1473,63 @@ ret:
 
 		// allocate a temporary, aligned, buffer
 		aligned_holder aligned_buf(aligned_size);
-		file::iovec_t b = {aligned_buf.get(), aligned_size};
+		file::iovec_t b = { aligned_buf.get(), size_t(aligned_size) };
 		size_type ret = file_handle->readv(aligned_start, &b, 1, ec);
 		if (ret < 0)
 		{
 			TORRENT_ASSERT(ec);
 			return ret;
 		}
-		if (ret < aligned_size) return (std::max)(size - (start_adjust - ret), size_type(0));
+
+		// the aligned range extends past the end of the range that was
+		// asked for, so it's expected to come up short at the tail of
+		// the file. Only the bytes that were asked for count
+		int read_size = int((std::min)(ret - start_adjust, size_type(size)));
+		if (read_size <= 0) return 0;
 
 		char* read_buf = aligned_buf.get() + start_adjust;
-		for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i != end; ++i)
+		int left = read_size;
+		for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i != end && left > 0; ++i)
 		{
-			memcpy(i->iov_base, read_buf, i->iov_len);
-			read_buf += i->iov_len;
+			int len = (std::min)(int(i->iov_len), left);
+			memcpy(i->iov_base, read_buf, len);
+			read_buf += len;
+			left -= len;
 		}
 
-		return size;
+		return read_size;
+	}
+
+	namespace
+	{
+		// reads the aligned 'sector' at 'offset' back from the file, for
+		// it to be partially overwritten. Whatever is past the end of the
+		// file is zeroed
+		bool read_sector(file& f, size_type offset, char* buf, int sector
+			, size_type file_size, error_code& ec)
+		{
+			int len = 0;
+			if (offset < file_size)
+			{
+				file::iovec_t b = { buf, size_t(sector) };
+				size_type ret = f.readv(offset, &b, 1, ec);
+				if (ret < 0) return false;
+				len = int((std::min)(ret, size_type(sector)));
+			}
+			if (len < sector) memset(buf + len, 0, sector - len);
+			return true;
+		}
 	}
 
 	// this is the really expensive one. To write unaligned, we need to read
-	// an aligned block, overlay the unaligned buffer, and then write it back
+	// back the partial sectors at the head and the tail of the range, overlay
+	// the unaligned buffer on them, and write the whole aligned range back
 	size_type default_storage::write_unaligned(boost::intrusive_ptr<file> const& file_handle
 		, size_type file_offset, file::iovec_t const* bufs, int num_bufs, error_code& ec)
 	{
+		const int sector = file_handle->size_alignment();
 		const int pos_align = file_handle->pos_alignment()-1;
-		const int size_align = file_handle->size_alignment()-1;
+		const int size_align = sector-1;
 
 		const int size = bufs_size(bufs, num_bufs);
 		const int start_adjust = file_offset & pos_align;
@@ -1311,16 +1539,23 @@ ret:
 			? ((size+start_adjust) & ~size_align) + size_align + 1 : size + start_adjust;
 		TORRENT_ASSERT((aligned_size & size_align) == 0);
 
+		size_type file_size = file_handle->get_size(ec);
+		if (ec) return -1;
+
 		// allocate a temporary, aligned, buffer
 		aligned_holder aligned_buf(aligned_size);
-		file::iovec_t b = {aligned_buf.get(), aligned_size};
-		size_type ret = file_handle->readv(aligned_start, &b, 1, ec);
-		if (ret < 0)
-		{
-			TORRENT_ASSERT(ec);
-			return ret;
-		}
-		if (ret < aligned_size) return (std::max)(size - (start_adjust - ret), size_type(0));
+
+		// the sectors that are only partially covered by the write
+		if (start_adjust != 0
+			&& !read_sector(*file_handle, aligned_start, aligned_buf.get()
+				, sector, file_size, ec))
+			return -1;
+		const int tail = aligned_size - sector;
+		if (((start_adjust + size) & size_align) != 0
+			&& (tail > 0 || start_adjust == 0)
+			&& !read_sector(*file_handle, aligned_start + tail
+				, aligned_buf.get() + tail, sector, file_size, ec))
+			return -1;
 
 		// OK, we read the portion of the file. Now, overlay the buffer we're writing 
 
@@ -1332,14 +1567,23 @@ ret:
 		}
 
 		// write the buffer back to disk
-		ret = file_handle->writev(aligned_start, &b, 1, ec);
+		file::iovec_t b = { aligned_buf.get(), size_t(aligned_size) };
+		size_type ret = file_handle->writev(aligned_start, &b, 1, ec);
 
 		if (ret < 0)
 		{
 			TORRENT_ASSERT(ec);
 			return ret;
 		}
-		if (ret < aligned_size) return (std::max)(size - (start_adjust - ret), size_type(0));
+		if (ret < aligned_size) return (std::max)(ret - start_adjust, size_type(0));
+
+		// the aligned write may have extended the file past the end of
+		// the range. Don't let the padding at its tail make it longer
+		// than it's supposed to be
+		size_type end_of_write = file_offset + size;
+		if (aligned_start + aligned_size > (std::max)(file_size, end_of_write)
+			&& !file_handle->set_size((std::max)(file_size, end_of_write), ec))
+			return -1;
 		return size;
 	}
 
@@ -1349,7 +1593,7 @@ ret:
 		, int offset
 		, int size)
 	{
-		file::iovec_t b = { (file::iovec_base_t)buf, size };
+		file::iovec_t b = { (file::iovec_base_t)buf, size_t(size) };
 		return writev(&b, slot, offset, 1);
 	}
 
@@ -1359,7 +1603,7 @@ ret:
 		, int offset
 		, int size)
 	{
-		file::iovec_t b = { (file::iovec_base_t)buf, size };
+		file::iovec_t b = { (file::iovec_base_t)buf, size_t(size) };
 		return readv(&b, slot, offset, 1);
 	}
 
@@ -1371,6 +1615,10 @@ ret:
 			|| (cache_setting == session_settings::disable_os_cache_for_aligned_files
 			&& ((fe->offset + files().file_base(*fe)) & (m_page_size-1)) == 0))
 			mode |= file::no_buffer;
+		// in direct I/O mode every file bypasses the page cache, the
+		// unaligned heads and tails are handled by read_unaligned()
+		// and write_unaligned()
+		if (m_settings && settings().direct_io) mode |= file::no_buffer;
 		if (!m_allocate_files) mode |= file::sparse;
 		if (m_settings && settings().no_atime_storage) mode |= file::no_atime;
 
@@ -1461,6 +1709,14 @@ ret:
 		, m_last_piece(-1)
 		, m_storage_constructor(sc)
 		, m_io_thread(io)
+		, m_disk_worker(-1)
+		, m_write_queue(0)
+		, m_queued_write_bytes(0)
+		, m_cache_soft_quota(0)
+		, m_cache_hard_quota(0)
+		, m_cached_blocks(0)
+		, m_cache_hits(0)
+		, m_cache_misses(0)
 		, m_torrent(torrent)
 	{
 		m_storage->m_disk_pool = &m_io_thread;
@@ -1530,7 +1786,7 @@ ret:
 		disk_io_job j;
 		j.storage = this;
 		j.action = disk_io_job::move_storage;
-		j.str = p;
+		j.extra().str = p;
 		m_io_thread.add_job(j, handler);
 	}
 
@@ -1545,13 +1801,24 @@ ret:
 		m_io_thread.add_job(j, handler);
 	}
 
+	void piece_manager::async_check_fastresume(binary_resume_data const* resume_data
+		, boost::function<void(int, disk_io_job const&)> const& handler)
+	{
+		TORRENT_ASSERT(resume_data != 0);
+		disk_io_job j;
+		j.storage = this;
+		j.action = disk_io_job::check_fastresume;
+		j.extra().binary_resume = resume_data;
+		m_io_thread.add_job(j, handler);
+	}
+
 	void piece_manager::async_rename_file(int index, std::string const& name
 		, boost::function<void(int, disk_io_job const&)> const& handler)
 	{
 		disk_io_job j;
 		j.storage = this;
 		j.piece = index;
-		j.str = name;
+		j.extra().str = name;
 		j.action = disk_io_job::rename_file;
 		m_io_thread.add_job(j, handler);
 	}
@@ -1631,6 +1898,26 @@ ret:
 #endif
 	}
 
+	void piece_manager::async_open_block(
+		peer_request const& r
+		, boost::function<void(int, disk_io_job const&)> const& handler
+		, int cache_line_size
+		, int cache_expiry)
+	{
+		disk_io_job j;
+		j.storage = this;
+		j.action = disk_io_job::open_block;
+		j.piece = r.piece;
+		j.offset = r.start;
+		j.buffer_size = r.length;
+		j.buffer = 0;
+		j.max_cache_line = cache_line_size;
+		j.cache_min_time = cache_expiry;
+
+		TORRENT_ASSERT(r.length <= 16 * 1024);
+		m_io_thread.add_job(j, handler);
+	}
+
 	int piece_manager::async_write(
 		peer_request const& r
 		, disk_buffer_holder& buffer
@@ -1691,6 +1978,56 @@ ret:
 		return ph.h.final();
 	}
 
+	int piece_manager::read_piece_for_hash(int piece, partial_hash& ph
+		, std::vector<file::iovec_t>& bufs)
+	{
+		TORRENT_ASSERT(!m_storage->error());
+		TORRENT_ASSERT(bufs.empty());
+
+		std::map<int, partial_hash>::iterator i = m_piece_hasher.find(piece);
+		if (i != m_piece_hasher.end())
+		{
+			ph = i->second;
+			m_piece_hasher.erase(i);
+		}
+
+		int slot = slot_for(piece);
+		TORRENT_ASSERT(slot != has_no_slot);
+
+		int size = m_files.piece_size(piece) - ph.offset;
+		if (size <= 0) return 0;
+
+		disk_buffer_pool* pool = m_storage->disk_pool();
+		int block_size = pool->block_size();
+		int num_blocks = (size + block_size - 1) / block_size;
+		bufs.resize(num_blocks);
+		for (int i = 0; i < num_blocks; ++i)
+		{
+			bufs[i].iov_base = pool->allocate_buffer("hash temp");
+			if (bufs[i].iov_base == 0)
+			{
+				for (int k = 0; k < i; ++k)
+					pool->free_buffer((char*)bufs[k].iov_base);
+				bufs.clear();
+				m_storage->set_error("", errors::no_memory);
+				return 0;
+			}
+			bufs[i].iov_len = (std::min)(block_size, size);
+			size -= bufs[i].iov_len;
+		}
+		TORRENT_ASSERT(size == 0);
+
+		int ret = m_storage->readv(&bufs[0], slot, ph.offset, num_blocks);
+		if (m_storage->error())
+		{
+			for (int i = 0; i < num_blocks; ++i)
+				pool->free_buffer((char*)bufs[i].iov_base);
+			bufs.clear();
+			return 0;
+		}
+		return ret;
+	}
+
 	int piece_manager::move_storage_impl(std::string const& save_path)
 	{
 		if (m_storage->move_storage(save_path))
@@ -1751,12 +2088,31 @@ ret:
 
 	void piece_manager::hint_read_impl(int piece_index, int offset, int size)
 	{
-		m_last_piece = piece_index;
+		// this is also called to prefetch ahead of read streams. A hint
+		// isn't a read, so it doesn't update m_last_piece
 		int slot = slot_for(piece_index);
-		if (slot <= 0) return;
+		if (slot < 0) return;
 		m_storage->hint_read(slot, offset, size);
 	}
 
+	boost::intrusive_ptr<file> piece_manager::open_block_impl(int piece_index
+		, int offset, int size, size_type& file_offset)
+	{
+		m_last_piece = piece_index;
+		int slot = slot_for(piece_index);
+		if (slot < 0) return boost::intrusive_ptr<file>();
+		return m_storage->open_block(slot, offset, size, file_offset);
+	}
+
+	char const* piece_manager::map_block_impl(int piece_index
+		, int offset, int size, boost::shared_ptr<void>& mapping)
+	{
+		m_last_piece = piece_index;
+		int slot = slot_for(piece_index);
+		if (slot < 0) return 0;
+		return m_storage->map_block(slot, offset, size, mapping);
+	}
+
 	int piece_manager::read_impl(
 		file::iovec_t* bufs
 		, int piece_index
@@ -1792,7 +2148,74 @@ ret:
 		// only save the partial hash if the write succeeds
 		if (ret != size) return ret;
 
-		if (m_storage->settings().disable_hash_checks) return ret;
+		update_partial_hash(iov, piece_index, offset, num_bufs);
+		return ret;
+	}
+
+	int piece_manager::write_span_impl(
+		file::iovec_t* bufs
+	  , int piece_index
+	  , int offset
+	  , int num_bufs)
+	{
+		TORRENT_ASSERT(bufs);
+		TORRENT_ASSERT(offset >= 0);
+		TORRENT_ASSERT(num_bufs > 0);
+		TORRENT_ASSERT(piece_index >= 0 && piece_index < m_files.num_pieces());
+
+		int size = bufs_size(bufs, num_bufs);
+		if (offset + size <= m_files.piece_size(piece_index))
+			return write_impl(bufs, piece_index, offset, num_bufs);
+
+		// in compact mode the pieces aren't stored in order
+		// on disk, and have to be written one at a time
+		bool written = false;
+		if (m_storage_mode != storage_mode_compact)
+		{
+			file::iovec_t* iov = TORRENT_ALLOCA(file::iovec_t, num_bufs);
+			std::copy(bufs, bufs + num_bufs, iov);
+			int ret = m_storage->writev_span(iov, piece_index, offset, num_bufs);
+			if (ret != -2 && ret != size) return ret;
+			written = ret == size;
+		}
+
+		int ret = 0;
+		while (num_bufs > 0)
+		{
+			TORRENT_ASSERT(piece_index < m_files.num_pieces());
+			int left = m_files.piece_size(piece_index) - offset;
+			int piece_bufs = 0;
+			int piece_bytes = 0;
+			while (piece_bufs < num_bufs && piece_bytes < left)
+				piece_bytes += bufs[piece_bufs++].iov_len;
+			TORRENT_ASSERT(piece_bytes <= left);
+
+			if (written)
+			{
+				m_last_piece = piece_index;
+				update_partial_hash(bufs, piece_index, offset, piece_bufs);
+			}
+			else
+			{
+				int r = write_impl(bufs, piece_index, offset, piece_bufs);
+				if (r < 0) return r;
+				if (r != piece_bytes) return ret + r;
+			}
+			ret += piece_bytes;
+			bufs += piece_bufs;
+			num_bufs -= piece_bufs;
+			offset = 0;
+			++piece_index;
+		}
+		return ret;
+	}
+
+	void piece_manager::update_partial_hash(file::iovec_t const* bufs
+		, int piece_index, int offset, int num_bufs)
+	{
+		if (m_storage->settings().disable_hash_checks) return;
+
+		int size = bufs_size(bufs, num_bufs);
 
 #if defined TORRENT_PARTIAL_HASH_LOG && TORRENT_USE_IOSTREAM
 		std::ofstream out("partial_hash.log", std::ios::app);
@@ -1804,7 +2227,7 @@ ret:
 			TORRENT_ASSERT(ph.offset == 0);
 			ph.offset = size;
 
-			for (file::iovec_t* i = iov, *end(iov + num_bufs); i < end; ++i)
+			for (file::iovec_t const* i = bufs, *end(bufs + num_bufs); i < end; ++i)
 				ph.h.update((char const*)i->iov_base, i->iov_len);
 
 #if defined TORRENT_PARTIAL_HASH_LOG && TORRENT_USE_IOSTREAM
@@ -1838,7 +2261,7 @@ ret:
 						<< " entries: " << m_piece_hasher.size()
 						<< " ]" << std::endl;
 #endif
-					for (file::iovec_t* b = iov, *end(iov + num_bufs); b < end; ++b)
+					for (file::iovec_t const* b = bufs, *end(bufs + num_bufs); b < end; ++b)
 					{
 						i->second.h.update((char const*)b->iov_base, b->iov_len);
 						i->second.offset += b->iov_len;
@@ -1870,8 +2293,6 @@ ret:
 			}
 #endif
 		}
-		
-		return ret;
 	}
 
 	size_type piece_manager::physical_offset(
@@ -2074,6 +2495,8 @@ ret:
 		TORRENT_ASSERT(m_files.piece_length() > 0);
 		
 		m_current_slot = 0;
+		// digests left over from an interrupted check are stale
+		clear_slot_hashes();
 
 		// if we don't have any resume data, return
 		if (rd.type() == lazy_entry::none_t) return check_no_fastresume(error);
@@ -2100,10 +2523,6 @@ ret:
 		if (!m_storage->verify_resume_data(rd, error))
 			return check_no_fastresume(error);
 
-		// assume no piece is out of place (i.e. in a slot
-		// other than the one it should be in)
-		bool out_of_place = false;
-
 		// if we don't have a piece map, we need the slots
 		// if we're in compact mode, we also need the slots map
 		if (storage_mode == storage_mode_compact || rd.dict_find("pieces") == 0)
@@ -2116,137 +2535,212 @@ ret:
 				return check_no_fastresume(error);
 			}
 
-			if ((int)slots->list_size() > m_files.num_pieces())
+			std::vector<int> slot_map;
+			slot_map.reserve(slots->list_size());
+			for (int i = 0; i < slots->list_size(); ++i)
 			{
-				error = errors::too_many_slots;
-				return check_no_fastresume(error);
-			}
-
-			if (m_storage_mode == storage_mode_compact)
-			{
-				int num_pieces = int(m_files.num_pieces());
-				m_slot_to_piece.resize(num_pieces, unallocated);
-				m_piece_to_slot.resize(num_pieces, has_no_slot);
-				for (int i = 0; i < slots->list_size(); ++i)
+				lazy_entry const* e = slots->list_at(i);
+				if (e->type() != lazy_entry::int_t)
 				{
-					lazy_entry const* e = slots->list_at(i);
-					if (e->type() != lazy_entry::int_t)
-					{
-						error = errors::invalid_slot_list;
-						return check_no_fastresume(error);
-					}
-
-					int index = int(e->int_value());
-					if (index >= num_pieces || index < -2)
-					{
-						error = errors::invalid_piece_index;
-						return check_no_fastresume(error);
-					}
-					if (index >= 0)
-					{
-						m_slot_to_piece[i] = index;
-						m_piece_to_slot[index] = i;
-						if (i != index) out_of_place = true;
-					}
-					else if (index == unassigned)
-					{
-						if (m_storage_mode == storage_mode_compact)
-							m_free_slots.push_back(i);
-					}
-					else
-					{
-						TORRENT_ASSERT(index == unallocated);
-						if (m_storage_mode == storage_mode_compact)
-							m_unallocated_slots.push_back(i);
-					}
+					error = errors::invalid_slot_list;
+					return check_no_fastresume(error);
 				}
+				slot_map.push_back(int(e->int_value()));
 			}
-			else
+			return check_slot_map(slot_map, error);
+		}
+		else if (m_storage_mode == storage_mode_compact)
+		{
+			// read piece map
+			lazy_entry const* pieces = rd.dict_find("pieces");
+			if (pieces == 0 || pieces->type() != lazy_entry::string_t)
 			{
-				for (int i = 0; i < slots->list_size(); ++i)
-				{
-					lazy_entry const* e = slots->list_at(i);
-					if (e->type() != lazy_entry::int_t)
-					{
-						error = errors::invalid_slot_list;
-						return check_no_fastresume(error);
-					}
-
-					int index = int(e->int_value());
-					if (index != i && index >= 0)
-					{
-						error = errors::invalid_piece_index;
-						return check_no_fastresume(error);
-					}
-				}
+				error = errors::missing_pieces;
+				return check_no_fastresume(error);
 			}
 
-			// This will corrupt the storage
-			// use while debugging to find
-			// states that cannot be scanned
-			// by check_pieces.
-			//		m_storage->shuffle();
-
-			if (m_storage_mode == storage_mode_compact)
+			if ((int)pieces->string_length() != m_files.num_pieces())
 			{
-				if (m_unallocated_slots.empty()) switch_to_full_mode();
+				error = errors::too_many_slots;
+				return check_no_fastresume(error);
 			}
-			else
-			{
-				TORRENT_ASSERT(m_free_slots.empty());
-				TORRENT_ASSERT(m_unallocated_slots.empty());
 
-				if (out_of_place)
-				{
-					// in this case we're in full allocation mode, but
-					// we're resuming a compact allocated storage
-					m_state = state_expand_pieces;
-					m_current_slot = 0;
-					error = errors::pieces_need_reorder;
-					TORRENT_ASSERT(int(m_piece_to_slot.size()) == m_files.num_pieces());
-					return need_full_check;
-				}
-			}
+			bitfield have(m_files.num_pieces(), false);
+			char const* have_pieces = pieces->string_ptr();
+			for (int i = 0; i < m_files.num_pieces(); ++i)
+				if (have_pieces[i] & 1) have.set_bit(i);
+			check_piece_map(have);
+		}
 
+		return check_init_storage(error);
+	}
+
+	// the same as check_fastresume() for bencoded resume data. The pieces
+	// bitfield and the slot map are used as they are in the buffer
+	int piece_manager::check_fastresume(
+		binary_resume_data const& rd, error_code& error)
+	{
+		mutex::scoped_lock lock(m_mutex);
+
+		INVARIANT_CHECK;
+
+		TORRENT_ASSERT(m_files.piece_length() > 0);
+		TORRENT_ASSERT(rd.valid());
+
+		m_current_slot = 0;
+		// digests left over from an interrupted check are stale
+		clear_slot_hashes();
+
+		int block_size = (std::min)(16 * 1024, m_files.piece_length());
+		if (rd.blocks_per_piece() != 0
+			&& rd.blocks_per_piece() != m_files.piece_length() / block_size)
+		{
+			error = errors::invalid_blocks_per_piece;
+			return check_no_fastresume(error);
 		}
-		else if (m_storage_mode == storage_mode_compact)
+
+		storage_mode_t storage_mode = rd.compact()
+			? storage_mode_compact : storage_mode_sparse;
+
+		if (!m_storage->verify_binary_resume_data(rd, error))
+			return check_no_fastresume(error);
+
+		if (storage_mode == storage_mode_compact || rd.num_pieces() == 0)
 		{
-			// read piece map
-			lazy_entry const* pieces = rd.dict_find("pieces");
-			if (pieces == 0 || pieces->type() != lazy_entry::string_t)
+			if (!rd.has_slot_map())
 			{
-				error = errors::missing_pieces;
+				error = errors::missing_slots;
 				return check_no_fastresume(error);
 			}
 
-			if ((int)pieces->string_length() != m_files.num_pieces())
+			std::vector<int> slot_map(rd.num_slots());
+			for (int i = 0; i < rd.num_slots(); ++i)
+				slot_map[i] = rd.slot_at(i);
+			return check_slot_map(slot_map, error);
+		}
+		else if (m_storage_mode == storage_mode_compact)
+		{
+			if (rd.num_pieces() != m_files.num_pieces())
 			{
 				error = errors::too_many_slots;
 				return check_no_fastresume(error);
 			}
 
+			check_piece_map(bitfield(rd.pieces(), rd.num_pieces()));
+		}
+
+		return check_init_storage(error);
+	}
+
+	int piece_manager::check_slot_map(std::vector<int> const& slots
+		, error_code& error)
+	{
+		// assume no piece is out of place (i.e. in a slot
+		// other than the one it should be in)
+		bool out_of_place = false;
+
+		if ((int)slots.size() > m_files.num_pieces())
+		{
+			error = errors::too_many_slots;
+			return check_no_fastresume(error);
+		}
+
+		if (m_storage_mode == storage_mode_compact)
+		{
 			int num_pieces = int(m_files.num_pieces());
 			m_slot_to_piece.resize(num_pieces, unallocated);
 			m_piece_to_slot.resize(num_pieces, has_no_slot);
-			char const* have_pieces = pieces->string_ptr();
-			for (int i = 0; i < num_pieces; ++i)
+			for (int i = 0; i < int(slots.size()); ++i)
 			{
-				if (have_pieces[i] & 1)
+				int index = slots[i];
+				if (index >= num_pieces || index < -2)
+				{
+					error = errors::invalid_piece_index;
+					return check_no_fastresume(error);
+				}
+				if (index >= 0)
 				{
-					m_slot_to_piece[i] = i;
-					m_piece_to_slot[i] = i;
+					m_slot_to_piece[i] = index;
+					m_piece_to_slot[index] = i;
+					if (i != index) out_of_place = true;
+				}
+				else if (index == unassigned)
+				{
+					if (m_storage_mode == storage_mode_compact)
+						m_free_slots.push_back(i);
 				}
 				else
 				{
-					m_free_slots.push_back(i);
+					TORRENT_ASSERT(index == unallocated);
+					if (m_storage_mode == storage_mode_compact)
+						m_unallocated_slots.push_back(i);
+				}
+			}
+		}
+		else
+		{
+			for (int i = 0; i < int(slots.size()); ++i)
+			{
+				int index = slots[i];
+				if (index != i && index >= 0)
+				{
+					error = errors::invalid_piece_index;
+					return check_no_fastresume(error);
 				}
 			}
+		}
+
+		// This will corrupt the storage
+		// use while debugging to find
+		// states that cannot be scanned
+		// by check_pieces.
+		//		m_storage->shuffle();
+
+		if (m_storage_mode == storage_mode_compact)
+		{
 			if (m_unallocated_slots.empty()) switch_to_full_mode();
 		}
+		else
+		{
+			TORRENT_ASSERT(m_free_slots.empty());
+			TORRENT_ASSERT(m_unallocated_slots.empty());
+
+			if (out_of_place)
+			{
+				// in this case we're in full allocation mode, but
+				// we're resuming a compact allocated storage
+				m_state = state_expand_pieces;
+				m_current_slot = 0;
+				error = errors::pieces_need_reorder;
+				TORRENT_ASSERT(int(m_piece_to_slot.size()) == m_files.num_pieces());
+				return need_full_check;
+			}
+		}
 
 		return check_init_storage(error);
 	}
 
+	void piece_manager::check_piece_map(bitfield const& have)
+	{
+		TORRENT_ASSERT(int(have.size()) == m_files.num_pieces());
+		int num_pieces = int(m_files.num_pieces());
+		m_slot_to_piece.resize(num_pieces, unallocated);
+		m_piece_to_slot.resize(num_pieces, has_no_slot);
+		for (int i = 0; i < num_pieces; ++i)
+		{
+			if (have[i])
+			{
+				m_slot_to_piece[i] = i;
+				m_piece_to_slot[i] = i;
+			}
+			else
+			{
+				m_free_slots.push_back(i);
+			}
+		}
+		if (m_unallocated_slots.empty()) switch_to_full_mode();
+	}
+
 /*
    state chart:
 
@@ -2420,6 +2914,8 @@ ret:
 
 			// clear the memory we've been using
 			std::multimap<sha1_hash, int>().swap(m_hash_to_piece);
+			std::vector<slot_hash>().swap(m_slot_hashes);
+			m_check_batch.reset();
 
 			if (m_storage_mode != storage_mode_compact)
 			{
@@ -2474,6 +2970,189 @@ ret:
 		return ret;
 	}
 
+	// a batch of consecutive slots read by the full check. While its
+	// digests are computed by the hash threads, the next batch is read.
+	// It's reference counted, since the hash threads may still be
+	// hashing it when the check is interrupted
+	struct check_batch : boost::noncopyable
+	{
+		enum { max_bufs = 32 };
+
+		check_batch(int size)
+			: buffer(size)
+			, first_slot(0)
+			, num_bufs(0)
+			, complete(false)
+			, small_piece_size(0)
+			, outstanding(0)
+		{}
+
+		// hashes the buffers in the range [begin, end)
+		void hash(int begin, int end)
+		{
+			hash_buffers(bufs + begin, lens + begin, digests + begin, end - begin
+				, small_piece_size, small_digests + begin);
+			mutex::scoped_lock l(m_mutex);
+			TORRENT_ASSERT(outstanding > 0);
+			if (--outstanding == 0) m_cond.signal_all(l);
+		}
+
+		// blocks until all parts of the batch have been hashed
+		void wait()
+		{
+			mutex::scoped_lock l(m_mutex);
+			while (outstanding > 0) m_cond.wait(l);
+		}
+
+		aligned_holder buffer;
+		int first_slot;
+		int num_bufs;
+		// true if all the slots that were asked for could
+		// be read. If not, the slot following the batch is
+		// left to check_one_piece()
+		bool complete;
+		char const* bufs[max_bufs];
+		int lens[max_bufs];
+		sha1_hash digests[max_bufs];
+		sha1_hash small_digests[max_bufs];
+		int small_piece_size;
+
+		// the number of parts of the batch that
+		// haven't been hashed yet
+		int outstanding;
+		mutex m_mutex;
+		condition m_cond;
+	};
+
+	void piece_manager::clear_slot_hashes()
+	{
+		m_slot_hashes.clear();
+		m_check_batch.reset();
+	}
+
+	boost::shared_ptr<check_batch> piece_manager::read_check_batch(int first_slot
+		, int num_slots, int small_piece_size)
+	{
+		num_slots = (std::min)(num_slots, m_files.num_pieces() - first_slot);
+		boost::shared_ptr<check_batch> ret;
+		if (num_slots <= 0) return ret;
+
+		ret.reset(new check_batch(num_slots * m_files.piece_length()));
+		check_batch& b = *ret;
+		b.first_slot = first_slot;
+		b.small_piece_size = small_piece_size;
+		for (; b.num_bufs < num_slots; ++b.num_bufs)
+		{
+			int slot = first_slot + b.num_bufs;
+			char* buf = b.buffer.get() + b.num_bufs * m_files.piece_length();
+			int piece_size = m_files.piece_size(slot);
+			file::iovec_t iov = { buf, size_t(piece_size) };
+			if (m_storage->readv(&iov, slot, 0, 1) != piece_size)
+			{
+				// leave this slot to check_one_piece(), which
+				// handles missing files and read errors
+				clear_error();
+				break;
+			}
+			b.bufs[b.num_bufs] = buf;
+			b.lens[b.num_bufs] = piece_size;
+		}
+		b.complete = b.num_bufs == num_slots;
+		if (b.num_bufs == 0) ret.reset();
+		return ret;
+	}
+
+	void piece_manager::hash_check_batch(boost::shared_ptr<check_batch> const& b)
+	{
+		hash_thread& threads = m_io_thread.hash_threads();
+		int num_threads = threads.num_threads();
+		if (num_threads == 0)
+		{
+			b->outstanding = 1;
+			b->hash(0, b->num_bufs);
+			return;
+		}
+
+		// split the batch across the threads, but keep
+		// each part large enough to fill the SIMD lanes
+		int lanes = hash_batch_lanes();
+		int parts = (std::min)(num_threads, (b->num_bufs + lanes - 1) / lanes);
+		if (parts < 1) parts = 1;
+		int part_size = (b->num_bufs + parts - 1) / parts;
+		b->outstanding = (b->num_bufs + part_size - 1) / part_size;
+		for (int i = 0; i < b->num_bufs; i += part_size)
+		{
+			int end = (std::min)(i + part_size, b->num_bufs);
+			hash_thread::job hj;
+			hj.work = boost::bind(&check_batch::hash, b, i, end);
+			hj.num_pieces = end - i;
+			threads.async_hash(hj);
+		}
+	}
+
+	void piece_manager::hash_slot_batch(int small_piece_size)
+	{
+		// drop the digests of slots that were skipped
+		std::vector<slot_hash>::iterator i = m_slot_hashes.begin();
+		while (i != m_slot_hashes.end() && i->slot < m_current_slot) ++i;
+		m_slot_hashes.erase(m_slot_hashes.begin(), i);
+		if (!m_slot_hashes.empty()) return;
+
+		// the batch being hashed in the background, if any. It follows
+		// the digests that were just used up. If the check skipped past
+		// it, it's useless
+		boost::shared_ptr<check_batch> b;
+		b.swap(m_check_batch);
+		if (b && (b->first_slot > m_current_slot
+			|| b->first_slot + b->num_bufs <= m_current_slot))
+			b.reset();
+
+		// batching costs memory for a buffer of several pieces. Only
+		// do it when we're optimizing for speed and the pieces can
+		// actually be hashed in parallel, either in SIMD lanes or
+		// by the hash threads
+		bool batching = m_storage->settings().optimize_hashing_for_speed;
+		int num_threads = m_io_thread.hash_threads().num_threads();
+		int batch = hash_batch_lanes() * (std::max)(num_threads, 1);
+		batch = (std::min)(batch, m_storage->settings().checking_batch_size
+			/ m_files.piece_length());
+		batch = (std::min)(batch, int(check_batch::max_bufs));
+		if (batch <= 1) batching = false;
+
+		if (!b)
+		{
+			if (!batching) return;
+			b = read_check_batch(m_current_slot, batch, small_piece_size);
+			if (!b) return;
+			hash_check_batch(b);
+		}
+
+		// read the next batch while this one is being hashed. Ask the
+		// kernel to start reading the one after it, to keep reads in
+		// flight on all the files (and drives) it spans while we wait
+		int next_slot = b->first_slot + b->num_bufs;
+		if (batching && num_threads > 0 && b->complete
+			&& next_slot < m_files.num_pieces())
+		{
+			int end = (std::min)(next_slot + 2 * batch, m_files.num_pieces());
+			for (int slot = next_slot + batch; slot < end; ++slot)
+				m_storage->hint_read(slot, 0, m_files.piece_size(slot));
+
+			m_check_batch = read_check_batch(next_slot, batch, small_piece_size);
+			if (m_check_batch) hash_check_batch(m_check_batch);
+		}
+
+		b->wait();
+		for (int k = m_current_slot - b->first_slot; k < b->num_bufs; ++k)
+		{
+			slot_hash sh;
+			sh.slot = b->first_slot + k;
+			sh.large_hash = b->digests[k];
+			sh.small_hash = b->small_digests[k];
+			m_slot_hashes.push_back(sh);
+		}
+	}
+
 	// -1 = error, 0 = ok, >0 = skip this many pieces
 	int piece_manager::check_one_piece(int& have_piece)
 	{
@@ -2498,16 +3177,31 @@ ret:
 		int small_piece_size = m_files.piece_size(m_files.num_pieces() - 1);
 		bool read_short = true;
 		sha1_hash small_hash;
-		if (piece_size == small_piece_size)
+		sha1_hash large_hash;
+
+		hash_slot_batch(small_piece_size);
+		if (!m_slot_hashes.empty() && m_slot_hashes.front().slot == m_current_slot)
 		{
-			num_read = hash_for_slot(m_current_slot, ph, piece_size, 0, 0);
+			large_hash = m_slot_hashes.front().large_hash;
+			if (piece_size != small_piece_size)
+				small_hash = m_slot_hashes.front().small_hash;
+			m_slot_hashes.erase(m_slot_hashes.begin());
+			read_short = false;
 		}
 		else
 		{
-			num_read = hash_for_slot(m_current_slot, ph, piece_size
-				, small_piece_size, &small_hash);
+			if (piece_size == small_piece_size)
+			{
+				num_read = hash_for_slot(m_current_slot, ph, piece_size, 0, 0);
+			}
+			else
+			{
+				num_read = hash_for_slot(m_current_slot, ph, piece_size
+					, small_piece_size, &small_hash);
+			}
+			read_short = num_read != piece_size;
+			if (!read_short) large_hash = ph.h.final();
 		}
-		read_short = num_read != piece_size;
 
 		if (read_short)
 		{
@@ -2527,7 +3221,6 @@ ret:
 			return skip_file();
 		}
 
-		sha1_hash large_hash = ph.h.final();
 		int piece_index = identify_data(large_hash, small_hash, m_current_slot);
 
 		if (piece_index >= 0) have_piece = piece_index;
@@ -2541,6 +3234,10 @@ ret:
 		const bool this_should_move = piece_index >= 0 && m_slot_to_piece[piece_index] != unallocated;
 		const bool other_should_move = m_piece_to_slot[m_current_slot] != has_no_slot;
 
+		// moving pieces around invalidates the digests of
+		// the slots we've hashed ahead
+		if (this_should_move || other_should_move) clear_slot_hashes();
+
 		// check if this piece should be swapped with any other slot
 		// this section will ensure that the storage is correctly sorted
 		// libtorrent will never leave the storage in a state that
@@ -338,6 +338,7 @@ namespace libtorrent
 		, m_ses(ses)
 		, m_trackerid(p.trackerid)
 		, m_save_path(complete(p.save_path))
+		, m_device(0)
 		, m_url(p.url)
 		, m_uuid(p.uuid)
 		, m_source_feed_url(p.source_feed_url)
@@ -408,6 +409,8 @@ namespace libtorrent
 		, m_magnet_link(false)
 		, m_apply_ip_filter(p.apply_ip_filter)
 		, m_merge_resume_trackers(p.merge_resume_trackers)
+		, m_cache_soft_quota(0)
+		, m_cache_hard_quota(0)
 	{
 		if (!m_apply_ip_filter) ++m_ses.m_non_filtered_torrents;
 
@@ -430,9 +433,13 @@ namespace libtorrent
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
 				(*m_ses.m_logger) << time_now_string() << " adding magnet link with resume data\n";
 #endif
-				if (lazy_bdecode(&(*p.resume_data)[0], &(*p.resume_data)[0]
-					+ p.resume_data->size(), tmp, ec, &pos) == 0
-					&& tmp.type() == lazy_entry::dict_t
+				char const* rd_buf = &(*p.resume_data)[0];
+				int rd_size = p.resume_data->size();
+				binary_resume_data brd;
+				bool ok = binary_resume_data::is_binary(rd_buf, rd_size)
+					? brd.parse(rd_buf, rd_size, tmp, ec)
+					: lazy_bdecode(rd_buf, rd_buf + rd_size, tmp, ec, &pos) == 0;
+				if (ok && tmp.type() == lazy_entry::dict_t
 					&& (info = tmp.dict_find_dict("info")))
 				{
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
@@ -770,12 +777,17 @@ namespace libtorrent
 
 			if (!m_resume_data.empty())
 			{
-				int pos;
+				int pos = 0;
 				error_code ec;
-				if (lazy_bdecode(&m_resume_data[0], &m_resume_data[0]
-					+ m_resume_data.size(), m_resume_entry, ec, &pos) != 0)
+				char const* rd_buf = &m_resume_data[0];
+				int rd_size = m_resume_data.size();
+				bool ok = binary_resume_data::is_binary(rd_buf, rd_size)
+					? m_binary_resume.parse(rd_buf, rd_size, m_resume_entry, ec)
+					: lazy_bdecode(rd_buf, rd_buf + rd_size, m_resume_entry, ec, &pos) == 0;
+				if (!ok)
 				{
 					std::vector<char>().swap(m_resume_data);
+					lazy_entry().swap(m_resume_entry);
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
 					(*m_ses.m_logger) << time_now_string() << " fastresume data for "
 						<< torrent_file().name() << " rejected: " << ec.message()
@@ -1019,7 +1031,7 @@ namespace libtorrent
 
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
 		(*m_ses.m_logger) << "disk error: '" << j.error.message()
-			<< " in file " << j.error_file
+			<< " in file " << j.error_file()
 			<< " in torrent " << torrent_file().name()
 			<< "\n";
 #endif
@@ -1045,17 +1057,17 @@ namespace libtorrent
 			)
 		{
 			if (alerts().should_post<file_error_alert>())
-				alerts().post_alert(file_error_alert(j.error_file, get_handle(), j.error));
+				alerts().post_alert(file_error_alert(j.error_file(), get_handle(), j.error));
 			if (c) c->disconnect(errors::no_memory);
 			return;
 		}
 
 		// notify the user of the error
 		if (alerts().should_post<file_error_alert>())
-			alerts().post_alert(file_error_alert(j.error_file, get_handle(), j.error));
+			alerts().post_alert(file_error_alert(j.error_file(), get_handle(), j.error));
 
 		// put the torrent in an error-state
-		set_error(j.error, j.error_file);
+		set_error(j.error, j.error_file());
 
 		if (j.action == disk_io_job::write)
 		{
@@ -1088,7 +1100,7 @@ namespace libtorrent
 		}
 		else
 		{
-			std::memcpy(rp->piece_data.get() + r.start, j.buffer, r.length);
+			std::memcpy(rp->piece_data.get() + r.start, j.data(), r.length);
 		}
 
 		if (rp->blocks_left == 0)
@@ -1286,6 +1298,9 @@ namespace libtorrent
 			, (storage_mode_t)m_storage_mode, m_file_priority);
 		m_storage = m_owning_storage.get();
 
+		if (m_cache_soft_quota > 0 || m_cache_hard_quota > 0)
+			m_ses.m_disk_thread.set_cache_quota(m_storage, m_cache_soft_quota, m_cache_hard_quota);
+
 		if (has_picker())
 		{
 			int blocks_per_piece = (m_torrent_file->piece_length() + block_size() - 1) / block_size();
@@ -1312,6 +1327,7 @@ namespace libtorrent
 			m_ses.m_io_service.post(boost::bind(&torrent::files_checked, shared_from_this()));
 			std::vector<char>().swap(m_resume_data);
 			lazy_entry().swap(m_resume_entry);
+			m_binary_resume.clear();
 			return;
 		}
 
@@ -1320,15 +1336,25 @@ namespace libtorrent
 		if (m_resume_entry.type() == lazy_entry::dict_t)
 		{
 			int ev = 0;
-			if (m_resume_entry.dict_find_string_value("file-format") != "libtorrent resume file")
-				ev = errors::invalid_file_tag;
-	
-			std::string info_hash = m_resume_entry.dict_find_string_value("info-hash");
-			if (!ev && info_hash.empty())
-				ev = errors::missing_info_hash;
+			if (m_binary_resume.valid())
+			{
+				// the binary format has its own tag, and
+				// the info-hash is in its header
+				if (m_binary_resume.info_hash() != m_torrent_file->info_hash())
+					ev = errors::mismatching_info_hash;
+			}
+			else
+			{
+				if (m_resume_entry.dict_find_string_value("file-format") != "libtorrent resume file")
+					ev = errors::invalid_file_tag;
+		
+				std::string info_hash = m_resume_entry.dict_find_string_value("info-hash");
+				if (!ev && info_hash.empty())
+					ev = errors::missing_info_hash;
 
-			if (!ev && sha1_hash(info_hash) != m_torrent_file->info_hash())
-				ev = errors::mismatching_info_hash;
+				if (!ev && sha1_hash(info_hash) != m_torrent_file->info_hash())
+					ev = errors::mismatching_info_hash;
+			}
 
 			if (ev && m_ses.m_alerts.should_post<fastresume_rejected_alert>())
 			{
@@ -1345,6 +1371,7 @@ namespace libtorrent
 #endif
 				std::vector<char>().swap(m_resume_data);
 				lazy_entry().swap(m_resume_entry);
+				m_binary_resume.clear();
 			}
 			else
 			{
@@ -1408,9 +1435,18 @@ namespace libtorrent
 			}
 		}
 
-		m_storage->async_check_fastresume(&m_resume_entry
-			, boost::bind(&torrent::on_resume_data_checked
-			, shared_from_this(), _1, _2));
+		if (m_binary_resume.valid())
+		{
+			m_storage->async_check_fastresume(&m_binary_resume
+				, boost::bind(&torrent::on_resume_data_checked
+				, shared_from_this(), _1, _2));
+		}
+		else
+		{
+			m_storage->async_check_fastresume(&m_resume_entry
+				, boost::bind(&torrent::on_resume_data_checked
+				, shared_from_this(), _1, _2));
+		}
 	}
 
 	bt_peer_connection* torrent::find_introducer(tcp::endpoint const& ep) const
@@ -1444,12 +1480,15 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(m_ses.is_network_thread());
 
+		m_device = j.device();
+
 		if (ret == piece_manager::fatal_disk_error)
 		{
 			handle_disk_error(j);
 			set_state(torrent_status::queued_for_checking);
 			std::vector<char>().swap(m_resume_data);
 			lazy_entry().swap(m_resume_entry);
+			m_binary_resume.clear();
 			return;
 		}
 
@@ -1566,27 +1605,50 @@ namespace libtorrent
 
 			if (!j.error && m_resume_entry.type() == lazy_entry::dict_t)
 			{
-				// parse have bitmask
-				lazy_entry const* pieces = m_resume_entry.dict_find("pieces");
-				if (pieces && pieces->type() == lazy_entry::string_t
-					&& int(pieces->string_length()) == m_torrent_file->num_pieces())
+				if (m_binary_resume.valid())
 				{
-					char const* pieces_str = pieces->string_ptr();
-					for (int i = 0, end(pieces->string_length()); i < end; ++i)
+					binary_resume_data const& rd = m_binary_resume;
+					if (rd.num_pieces() == m_torrent_file->num_pieces())
+					{
+						for (int i = 0, end(rd.num_pieces()); i < end; ++i)
+						{
+							if (rd.have_piece(i)) we_have(i);
+							if (m_seed_mode && rd.verified_piece(i)) m_verified.set_bit(i);
+						}
+					}
+					else if (rd.has_slot_map())
 					{
-						if (pieces_str[i] & 1) we_have(i);
-						if (m_seed_mode && (pieces_str[i] & 2)) m_verified.set_bit(i);
+						for (int i = 0; i < rd.num_slots(); ++i)
+						{
+							int piece = rd.slot_at(i);
+							if (piece >= 0) we_have(piece);
+						}
 					}
 				}
 				else
 				{
-					lazy_entry const* slots = m_resume_entry.dict_find("slots");
-					if (slots && slots->type() == lazy_entry::list_t)
+					// parse have bitmask
+					lazy_entry const* pieces = m_resume_entry.dict_find("pieces");
+					if (pieces && pieces->type() == lazy_entry::string_t
+						&& int(pieces->string_length()) == m_torrent_file->num_pieces())
 					{
-						for (int i = 0; i < slots->list_size(); ++i)
+						char const* pieces_str = pieces->string_ptr();
+						for (int i = 0, end(pieces->string_length()); i < end; ++i)
 						{
-							int piece = slots->list_int_value_at(i, -1);
-							if (piece >= 0) we_have(piece);
+							if (pieces_str[i] & 1) we_have(i);
+							if (m_seed_mode && (pieces_str[i] & 2)) m_verified.set_bit(i);
+						}
+					}
+					else
+					{
+						lazy_entry const* slots = m_resume_entry.dict_find("slots");
+						if (slots && slots->type() == lazy_entry::list_t)
+						{
+							for (int i = 0; i < slots->list_size(); ++i)
+							{
+								int piece = slots->list_int_value_at(i, -1);
+								if (piece >= 0) we_have(piece);
+							}
 						}
 					}
 				}
@@ -1645,6 +1707,7 @@ namespace libtorrent
 
 		std::vector<char>().swap(m_resume_data);
 		lazy_entry().swap(m_resume_entry);
+		m_binary_resume.clear();
 	}
 
 	void torrent::queue_torrent_check()
@@ -1698,6 +1761,7 @@ namespace libtorrent
 
 		std::vector<char>().swap(m_resume_data);
 		lazy_entry().swap(m_resume_entry);
+		m_binary_resume.clear();
 		m_storage->async_check_fastresume(&m_resume_entry
 			, boost::bind(&torrent::on_force_recheck
 			, shared_from_this(), _1, _2));
@@ -1750,7 +1814,7 @@ namespace libtorrent
 		{
 			if (m_ses.m_alerts.should_post<file_error_alert>())
 			{
-				m_ses.m_alerts.post_alert(file_error_alert(j.error_file, get_handle(), j.error));
+				m_ses.m_alerts.post_alert(file_error_alert(j.error_file(), get_handle(), j.error));
 			}
 #if defined TORRENT_VERBOSE_LOGGING || defined TORRENT_LOGGING || defined TORRENT_ERROR_LOGGING
 			(*m_ses.m_logger) << time_now_string() << ": fatal disk error ["
@@ -1759,7 +1823,7 @@ namespace libtorrent
 				" ]\n";
 #endif
 			pause();
-			set_error(j.error, j.error_file);
+			set_error(j.error, j.error_file());
 			return;
 		}
 
@@ -3198,7 +3262,7 @@ namespace libtorrent
 	{
 		TORRENT_ASSERT(m_ses.is_network_thread());
 
-		if (!j.resume_data)
+		if (!j.resume_data())
 		{
 			alerts().post_alert(save_resume_data_failed_alert(get_handle(), j.error));
 		}
@@ -3206,8 +3270,8 @@ namespace libtorrent
 		{
 			m_need_save_resume_data = false;
 			m_last_saved_resume = time(0);
-			write_resume_data(*j.resume_data);
-			alerts().post_alert(save_resume_data_alert(j.resume_data
+			write_resume_data(*j.resume_data());
+			alerts().post_alert(save_resume_data_alert(j.resume_data()
 				, get_handle()));
 		}
 	}
@@ -3219,8 +3283,8 @@ namespace libtorrent
 		if (ret == 0)
 		{
 			if (alerts().should_post<file_renamed_alert>())
-				alerts().post_alert(file_renamed_alert(get_handle(), j.str, j.piece));
-			m_torrent_file->rename_file(j.piece, j.str);
+				alerts().post_alert(file_renamed_alert(get_handle(), j.str(), j.piece));
+			m_torrent_file->rename_file(j.piece, j.str());
 		}
 		else
 		{
@@ -5602,9 +5666,10 @@ namespace libtorrent
 		{
 			if (alerts().should_post<storage_moved_alert>())
 			{
-				alerts().post_alert(storage_moved_alert(get_handle(), j.str));
+				alerts().post_alert(storage_moved_alert(get_handle(), j.str()));
 			}
-			m_save_path = j.str;
+			m_save_path = j.str();
+			m_device = j.device();
 		}
 		else
 		{
@@ -5660,10 +5725,10 @@ namespace libtorrent
 					++found;
 					if (i->second->should_check_files()) ++found_active;
 				}
-			// the case of 2 is in the special case where one switches over from
-			// checking to complete.
+			// there may be more than active_checking, if it was lowered
+			// while they were being checked, and one more in the special
+			// case where one switches over from checking to complete.
 			TORRENT_ASSERT(found_active >= 1);
-			TORRENT_ASSERT(found_active <= 2);
 			TORRENT_ASSERT(found >= 1);
 		}
 
@@ -5882,6 +5947,16 @@ namespace libtorrent
 		m_max_uploads = limit;
 	}
 
+	void torrent::set_cache_quota(int soft, int hard)
+	{
+		TORRENT_ASSERT(m_ses.is_network_thread());
+		if (soft < 0) soft = 0;
+		if (hard < 0) hard = 0;
+		m_cache_soft_quota = soft;
+		m_cache_hard_quota = hard;
+		if (m_storage) m_ses.m_disk_thread.set_cache_quota(m_storage, soft, hard);
+	}
+
 	void torrent::set_max_connections(int limit)
 	{
 		TORRENT_ASSERT(m_ses.is_network_thread());
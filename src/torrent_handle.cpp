@@ -233,6 +233,12 @@ namespace libtorrent
 		return r;
 	}
 
+	void torrent_handle::set_cache_quota(int soft, int hard) const
+	{
+		INVARIANT_CHECK;
+		TORRENT_ASYNC_CALL2(set_cache_quota, soft, hard);
+	}
+
 	void torrent_handle::set_max_connections(int max_connections) const
 	{
 		INVARIANT_CHECK;
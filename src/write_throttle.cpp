@@ -0,0 +1,134 @@
+/*
+
+Copyright (c) 2011, Arvid Norberg
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions
+are met:
+
+    * Redistributions of source code must retain the above copyright
+      notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above copyright
+      notice, this list of conditions and the following disclaimer in
+      the documentation and/or other materials provided with the distribution.
+    * Neither the name of the author nor the names of its
+      contributors may be used to endorse or promote products derived
+      from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+POSSIBILITY OF SUCH DAMAGE.
+
+*/
+
+#include "libtorrent/pch.hpp"
+
+#include "libtorrent/write_throttle.hpp"
+#include "libtorrent/assert.hpp"
+#include <algorithm>
+
+namespace libtorrent
+{
+	write_throttle::write_throttle()
+		: m_queued(0)
+		, m_limit(0)
+		, m_min_limit(0)
+		, m_max_limit(0)
+		, m_low_watermark(0)
+		, m_step(0)
+		, m_latency_target(0)
+		, m_window(0)
+		, m_slow_start(true)
+		, m_cut(false)
+		, m_exceeded(false)
+	{}
+
+	bool write_throttle::set_limits(int min_limit, int max_limit, int low_watermark
+		, int step, int latency_target)
+	{
+		TORRENT_ASSERT(min_limit <= max_limit);
+		// a new throttle starts out at the lower end of
+		// the range, and grows from there in slow start
+		if (m_limit == 0) m_limit = min_limit;
+		m_min_limit = min_limit;
+		m_max_limit = max_limit;
+		m_limit = (std::max)((std::min)(m_limit, max_limit), min_limit);
+		m_low_watermark = low_watermark;
+		m_step = step;
+		m_latency_target = latency_target;
+		return update_exceeded();
+	}
+
+	void write_throttle::queue(int bytes)
+	{
+		m_queued += bytes;
+		update_exceeded();
+	}
+
+	bool write_throttle::dequeue(int bytes)
+	{
+		TORRENT_ASSERT(m_queued >= bytes);
+		m_queued -= bytes;
+		return update_exceeded();
+	}
+
+	bool write_throttle::write_done(int bytes, int latency)
+	{
+		if (m_min_limit == m_max_limit) return false;
+
+		if (latency > m_latency_target && !m_cut)
+		{
+			m_limit = (std::max)(m_limit - m_limit / 4, m_min_limit);
+			m_slow_start = false;
+			m_cut = true;
+		}
+
+		m_window += bytes;
+		if (m_window >= m_limit)
+		{
+			if (!m_cut)
+			{
+				if (m_slow_start)
+					m_limit = m_limit > m_max_limit / 2 ? m_max_limit : m_limit * 2;
+				else
+					m_limit = m_limit > m_max_limit - m_step ? m_max_limit : m_limit + m_step;
+			}
+			m_window = 0;
+			m_cut = false;
+		}
+		return update_exceeded();
+	}
+
+	bool write_throttle::update_exceeded()
+	{
+		if (m_max_limit == 0)
+		{
+			bool ret = m_exceeded;
+			m_exceeded = false;
+			return ret;
+		}
+
+		if (!m_exceeded)
+		{
+			if (m_queued >= m_limit) m_exceeded = true;
+			return false;
+		}
+
+		int low_watermark = m_low_watermark;
+		if (low_watermark == 0 || low_watermark >= m_limit)
+			low_watermark = m_limit * 7 / 8;
+		if (m_queued >= low_watermark) return false;
+		m_exceeded = false;
+		return true;
+	}
+}
+
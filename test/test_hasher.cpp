@@ -32,6 +32,8 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/hasher.hpp"
 #include <boost/lexical_cast.hpp>
+#include <vector>
+#include <algorithm>
 #include "libtorrent/escape_string.hpp" // from_hex
 
 #include "test.hpp"
@@ -60,10 +62,14 @@ char const* result_array[4] =
 };
 
 
-int test_main()
-{
-	using namespace libtorrent;
+// the built-in SHA-1 implementation can be switched between the
+// portable C code and the x86 SHA extensions
+#if !defined TORRENT_USE_OPENSSL && !defined TORRENT_USE_GCRYPT
+#define TEST_BUILTIN_SHA1 1
+#endif
 
+void test_vectors()
+{
 	for (int test = 0; test < 4; ++test)
 	{
 		hasher h;
@@ -74,6 +80,56 @@ int test_main()
 		from_hex(result_array[test], 40, (char*)&result[0]);
 		TEST_CHECK(result == h.final());
 	}
+}
+
+// hash_buffers() must produce the same digests as hasher, for
+// buffers of different sizes hashed in the same batch
+void test_hash_buffers()
+{
+	std::vector<char> data(100000);
+	for (int i = 0; i < int(data.size()); ++i) data[i] = char(i * 7 + (i >> 8));
+
+	char const* bufs[11];
+	int lens[11] = { 0, 1, 55, 56, 64, 100, 119, 128, 1000, 16 * 1024, 100000 };
+	for (int i = 0; i < 11; ++i) bufs[i] = &data[0] + i;
+	for (int i = 0; i < 11; ++i) lens[i] = (std::min)(lens[i], int(data.size()) - i);
+
+	for (int prefix = 0; prefix < 200; prefix += 37)
+	{
+		sha1_hash digests[11];
+		sha1_hash prefix_digests[11];
+		hash_buffers(bufs, lens, digests, 11, prefix, prefix_digests);
+		for (int i = 0; i < 11; ++i)
+		{
+			hasher h;
+			if (lens[i] > 0) h.update(bufs[i], lens[i]);
+			TEST_CHECK(digests[i] == h.final());
+
+			hasher ph;
+			int prefix_len = (std::min)(prefix, lens[i]);
+			if (prefix_len > 0) ph.update(bufs[i], prefix_len);
+			TEST_CHECK(prefix_digests[i] == ph.final());
+		}
+	}
+}
+
+int test_main()
+{
+	using namespace libtorrent;
+
+	test_vectors();
+	test_hash_buffers();
+
+#ifdef TEST_BUILTIN_SHA1
+	// with the SHA extensions disabled, the portable code is used. It's
+	// slower than the multi-buffer implementation, so hash_buffers()
+	// should measure that and use it, if there is one. The throughput
+	// of each is printed by examples/hash_benchmark
+	SHA1_use_sha_ni(false);
+	test_vectors();
+	test_hash_buffers();
+	SHA1_use_sha_ni(true);
+#endif
 
 	return 0;
 }
@@ -49,6 +49,15 @@ POSSIBILITY OF SUCH DAMAGE.
 #include "libtorrent/timestamp_history.hpp"
 #include "libtorrent/enum_net.hpp"
 #include "libtorrent/bloom_filter.hpp"
+#include "libtorrent/piece_cache.hpp"
+#include "libtorrent/frequency_sketch.hpp"
+#include "libtorrent/mpsc_queue.hpp"
+#include "libtorrent/latency_histogram.hpp"
+#include "libtorrent/read_ahead.hpp"
+#include "libtorrent/write_throttle.hpp"
+#include "libtorrent/resume_store.hpp"
+#include "libtorrent/binary_resume.hpp"
+#include "libtorrent/thread.hpp"
 #include "libtorrent/aux_/session_impl.hpp"
 #ifndef TORRENT_DISABLE_DHT
 #include "libtorrent/kademlia/node_id.hpp"
@@ -382,6 +391,20 @@ namespace libtorrent
 
 TORRENT_EXPORT void find_control_url(int type, char const* string, parse_state& state);
 
+struct set_num_blocks
+{
+	set_num_blocks(int n_): n(n_) {}
+	void operator()(libtorrent::cached_piece_entry& p) const { p.num_blocks = n; }
+	int n;
+};
+
+// pushes 0-9999 tagged with the producer id onto the queue
+void mpsc_producer(mpsc_queue<std::pair<int, int> >* q, int id)
+{
+	for (int i = 0; i < 10000; ++i)
+		q->push(q->allocate(std::make_pair(id, i)));
+}
+
 address rand_v4()
 {
 	return address_v4((rand() << 16 | rand()) & 0xffffffff);
@@ -544,6 +567,461 @@ int test_main()
 	TEST_CHECK(!filter.find(k3));
 	TEST_CHECK(filter.find(k4));
 
+	// test frequency_sketch
+	{
+		frequency_sketch s;
+		TEST_EQUAL(s.estimate(1), 0);
+		s.resize(100);
+		for (int i = 0; i < 5; ++i) s.increment(1);
+		s.increment(2);
+		TEST_CHECK(s.estimate(1) >= 5);
+		TEST_CHECK(s.estimate(2) >= 1);
+		TEST_CHECK(s.estimate(1) > s.estimate(2));
+		TEST_EQUAL(s.estimate(3), 0);
+
+		// the counters saturate
+		for (int i = 0; i < 20; ++i) s.increment(3);
+		TEST_EQUAL(s.estimate(3), frequency_sketch::max_count);
+
+		// after 10 times the width (128) increments, all
+		// counters are halved
+		for (int i = 0; i < 1280 - 26; ++i) s.increment(4);
+		TEST_EQUAL(s.estimate(3), frequency_sketch::max_count / 2);
+
+		s.clear();
+		TEST_EQUAL(s.estimate(3), 0);
+
+		// keys that only differ in their high bits don't
+		// collide with each other in every row
+		for (int i = 0; i < 10; ++i) s.increment(0x10000);
+		int aliases = 0;
+		for (boost::uint32_t k = 2; k < 10000; ++k)
+			if (s.estimate(k << 16) > 0) ++aliases;
+		TEST_CHECK(aliases < 10);
+	}
+
+	// test latency_histogram
+	{
+		latency_histogram h;
+		TEST_EQUAL(h.num_samples(), 0);
+		TEST_EQUAL(h.percentile(0.99f), 0);
+
+		h.add_sample(0);
+		h.add_sample(1);
+		TEST_EQUAL(h.buckets[0], 2);
+		h.add_sample(2);
+		h.add_sample(3);
+		TEST_EQUAL(h.buckets[1], 2);
+		h.add_sample(1000);
+		TEST_EQUAL(h.buckets[9], 1);
+		h.add_sample(0x7fffffff);
+		TEST_EQUAL(h.buckets[latency_histogram::num_buckets - 1], 1);
+
+		// 98 fast samples and 2 slow ones. The 99th percentile
+		// is in the bucket of the slow ones
+		h.clear();
+		for (int i = 0; i < 98; ++i) h.add_sample(100);
+		h.add_sample(5000);
+		h.add_sample(5000);
+		TEST_EQUAL(h.num_samples(), 100);
+		TEST_EQUAL(h.percentile(0.5f), 128);
+		TEST_EQUAL(h.percentile(0.99f), 8192);
+		TEST_EQUAL(h.percentile(1.f), 8192);
+
+		// the difference of two snapshots only
+		// has the samples added in between
+		latency_histogram snapshot = h;
+		h.add_sample(5000);
+		h -= snapshot;
+		TEST_EQUAL(h.num_samples(), 1);
+		TEST_EQUAL(h.percentile(0.5f), 8192);
+		h += snapshot;
+		TEST_EQUAL(h.num_samples(), 101);
+	}
+
+	// test read_ahead
+	{
+		int const bs = 0x4000;
+		read_ahead ra;
+		size_type start;
+		int size;
+
+		// a new stream starts with the initial window, and isn't
+		// prefetched for until it's sequential
+		int s = ra.find_stream(0, bs);
+		TEST_EQUAL(ra.window(s, 128), int(read_ahead::initial_window));
+		TEST_EQUAL(ra.window(s, 2), 2);
+		ra.record_read(s, 0, bs, false, 4 * bs, bs, 128, start, size);
+		TEST_EQUAL(size, 0);
+		TEST_EQUAL(ra.window(s, 128), 4);
+
+		// the next read continues the stream. It's now sequential and
+		// the kernel is asked to prefetch past the cached blocks, up to
+		// two windows ahead
+		TEST_EQUAL(ra.find_stream(bs, bs), s);
+		ra.record_read(s, bs, bs, true, 0, bs, 128, start, size);
+		TEST_EQUAL(start, 4 * bs);
+		TEST_EQUAL(size, 6 * bs);
+
+		// a read somewhere else starts another stream
+		int s2 = ra.find_stream(1000 * bs, bs);
+		TEST_CHECK(s2 != s);
+
+		// still more than a window prefetched
+		TEST_EQUAL(ra.find_stream(2 * bs, bs), s);
+		ra.record_read(s, 2 * bs, bs, true, 0, bs, 128, start, size);
+		TEST_EQUAL(size, 0);
+		TEST_EQUAL(ra.find_stream(3 * bs, bs), s);
+		ra.record_read(s, 3 * bs, bs, true, 0, bs, 128, start, size);
+		TEST_EQUAL(size, 0);
+
+		// missing the cache past the read-ahead doubles the window
+		TEST_EQUAL(ra.find_stream(4 * bs, bs), s);
+		ra.record_read(s, 4 * bs, bs, false, 12 * bs, bs, 128, start, size);
+		TEST_EQUAL(ra.window(s, 128), 8);
+		TEST_EQUAL(start, 12 * bs);
+		TEST_EQUAL(size, 9 * bs);
+
+		// missing blocks that were read ahead means they were
+		// evicted, which halves the window
+		TEST_EQUAL(ra.find_stream(5 * bs, bs), s);
+		ra.record_read(s, 5 * bs, bs, false, 6 * bs, bs, 128, start, size);
+		TEST_EQUAL(ra.window(s, 128), 4);
+
+		// the window never grows past the max
+		for (int i = 0; i < 10; ++i)
+		{
+			size_type off = size_type(6 + i) * bs;
+			TEST_EQUAL(ra.find_stream(off, bs), s);
+			ra.record_read(s, off, bs, false, off + bs, bs, 16, start, size);
+		}
+		TEST_EQUAL(ra.window(s, 128), 16);
+
+		// when all streams are in use, a new one
+		// replaces the least recently used
+		for (int i = 0; i < read_ahead::max_streams - 2; ++i)
+		{
+			int n = ra.find_stream(size_type(100000 + i * 1000) * bs, bs);
+			TEST_CHECK(n != s && n != s2);
+			ra.record_read(n, size_type(100000 + i * 1000) * bs, bs, true, 0, bs, 128, start, size);
+		}
+		TEST_EQUAL(ra.find_stream(size_type(200000) * bs, bs), s2);
+	}
+
+	// test write_throttle
+	{
+		int const bs = 0x4000;
+		write_throttle wt;
+		TEST_CHECK(!wt.set_limits(4 * bs, 64 * bs, 0, bs, 500000));
+		TEST_EQUAL(wt.limit(), 4 * bs);
+
+		// the queue is blocked at the limit, and unblocked
+		// once it drops below 7/8 of it
+		wt.queue(4 * bs);
+		TEST_CHECK(wt.exceeded());
+		TEST_CHECK(wt.dequeue(bs));
+		TEST_CHECK(!wt.exceeded());
+		TEST_CHECK(!wt.dequeue(3 * bs));
+		TEST_EQUAL(wt.queued(), 0);
+
+		// in slow start, the limit doubles for every
+		// limit worth of bytes written in time
+		for (int i = 0; i < 4; ++i) wt.write_done(bs, 1000);
+		TEST_EQUAL(wt.limit(), 8 * bs);
+		for (int i = 0; i < 8; ++i) wt.write_done(bs, 1000);
+		TEST_EQUAL(wt.limit(), 16 * bs);
+
+		// a late write cuts it by a quarter, but only once per window
+		wt.write_done(bs, 600000);
+		TEST_EQUAL(wt.limit(), 12 * bs);
+		wt.write_done(bs, 600000);
+		TEST_EQUAL(wt.limit(), 12 * bs);
+		for (int i = 0; i < 10; ++i) wt.write_done(bs, 1000);
+		TEST_EQUAL(wt.limit(), 12 * bs);
+
+		// out of slow start, it grows by one step per window
+		for (int i = 0; i < 12; ++i) wt.write_done(bs, 1000);
+		TEST_EQUAL(wt.limit(), 13 * bs);
+
+		// lowering the max limit clamps the limit, and may block the queue
+		wt.queue(8 * bs);
+		TEST_CHECK(!wt.exceeded());
+		TEST_CHECK(!wt.set_limits(4 * bs, 8 * bs, 0, bs, 500000));
+		TEST_EQUAL(wt.limit(), 8 * bs);
+		TEST_CHECK(wt.exceeded());
+		// raising it again doesn't grow the limit right away
+		TEST_CHECK(!wt.set_limits(4 * bs, 64 * bs, 0, bs, 500000));
+		TEST_EQUAL(wt.limit(), 8 * bs);
+		TEST_CHECK(!wt.dequeue(bs));
+		TEST_CHECK(wt.dequeue(bs));
+
+		// a fixed limit with a low watermark
+		write_throttle fixed;
+		fixed.set_limits(8 * bs, 8 * bs, 2 * bs, bs, 0);
+		fixed.queue(8 * bs);
+		TEST_CHECK(fixed.exceeded());
+		TEST_CHECK(!fixed.write_done(bs, 1000000));
+		TEST_EQUAL(fixed.limit(), 8 * bs);
+		TEST_CHECK(!fixed.dequeue(5 * bs));
+		TEST_CHECK(fixed.dequeue(2 * bs));
+
+		// a max limit of 0 means there is no limit
+		write_throttle unlimited;
+		unlimited.set_limits(0, 0, 0, bs, 0);
+		unlimited.queue(1000 * bs);
+		TEST_CHECK(!unlimited.exceeded());
+	}
+
+	// test resume_store
+	{
+		error_code ec;
+		std::string path = "test_resume_store.log";
+		remove(path, ec);
+
+		sha1_hash ih1 = hasher("1", 1).final();
+		sha1_hash ih2 = hasher("2", 1).final();
+		entry rd1(entry::dictionary_t);
+		rd1["pieces"] = std::string(1000, '\0');
+		rd1["total_uploaded"] = 100;
+		rd1["file_priority"] = entry::list_type();
+		entry rd2(entry::dictionary_t);
+		rd2["pieces"] = std::string(500, '\1');
+
+		{
+			resume_store rs;
+			TEST_CHECK(rs.open(path, ec));
+			rs.save(ih1, rd1);
+			rs.save(ih2, rd2);
+			TEST_CHECK(rs.flush(ec));
+		}
+		size_type initial_size = file_size(path);
+
+		{
+			resume_store rs;
+			TEST_CHECK(rs.open(path, ec));
+			std::vector<sha1_hash> torrents;
+			rs.torrents(torrents);
+			TEST_EQUAL(torrents.size(), 2);
+
+			std::vector<char> buf;
+			TEST_CHECK(rs.load(ih1, buf));
+			TEST_CHECK(bdecode(buf.begin(), buf.end()) == rd1);
+			// each torrent is only loaded once
+			TEST_CHECK(!rs.load(ih1, buf));
+
+			// only the key that changed is appended
+			rd1["total_uploaded"] = 200;
+			rs.save(ih1, rd1);
+			rs.save(ih2, rd2);
+			TEST_CHECK(rs.flush(ec));
+			TEST_CHECK(file_size(path) > initial_size);
+			TEST_CHECK(file_size(path) < initial_size + 100);
+
+			// a removed key is removed when loading too
+			rd1.dict().erase("file_priority");
+			rs.save(ih1, rd1);
+			rs.remove(ih2);
+			TEST_CHECK(rs.flush(ec));
+		}
+
+		// a record that was only partially written is dropped
+		{
+			file f(path, file::read_write, ec);
+			size_type size = f.get_size(ec);
+			char garbage[40];
+			std::memset(garbage, 0, sizeof(garbage));
+			garbage[3] = 100;
+			file::iovec_t b = { garbage, sizeof(garbage) };
+			f.writev(size, &b, 1, ec);
+		}
+
+		{
+			resume_store rs;
+			TEST_CHECK(rs.open(path, ec));
+			std::vector<char> buf;
+			TEST_CHECK(rs.load(ih1, buf));
+			TEST_CHECK(bdecode(buf.begin(), buf.end()) == rd1);
+			TEST_CHECK(!rs.load(ih2, buf));
+
+			// compacting leaves a single record per torrent
+			TEST_CHECK(rs.compact(ec));
+			TEST_EQUAL(rs.log_size(), file_size(path));
+			TEST_CHECK(rs.log_size() < initial_size);
+
+			// when compacting fails, records are still
+			// appended to the old log
+			create_directory(path + ".tmp", ec);
+			TEST_CHECK(!rs.compact(ec));
+			remove(path + ".tmp", ec);
+			rd1["total_uploaded"] = 300;
+			rs.save(ih1, rd1);
+			TEST_CHECK(rs.flush(ec));
+		}
+
+		{
+			resume_store rs;
+			TEST_CHECK(rs.open(path, ec));
+			std::vector<char> buf;
+			TEST_CHECK(rs.load(ih1, buf));
+			TEST_CHECK(bdecode(buf.begin(), buf.end()) == rd1);
+		}
+		remove(path, ec);
+	}
+
+	// test binary resume data
+	{
+		error_code ec;
+		sha1_hash ih = hasher("1", 1).final();
+		entry rd(entry::dictionary_t);
+		rd["file-format"] = "libtorrent resume file";
+		rd["file-version"] = 1;
+		rd["info-hash"] = std::string(ih.begin(), ih.end());
+		rd["blocks per piece"] = 4;
+		rd["allocation"] = "compact";
+		std::string pieces(21, '\0');
+		pieces[0] = 1;
+		pieces[9] = 3;
+		pieces[20] = 1;
+		rd["pieces"] = pieces;
+		entry::list_type& slots = rd["slots"].list();
+		slots.push_back(entry(0));
+		slots.push_back(entry(-2));
+		slots.push_back(entry(9));
+		slots.push_back(entry(-1));
+		entry::list_type& fl = rd["file sizes"].list();
+		entry::list_type fs;
+		fs.push_back(entry(size_type(0x100000000LL)));
+		fs.push_back(entry(1234));
+		fl.push_back(entry(fs));
+		rd["total_uploaded"] = 100;
+		rd["mapped_files"].list().push_back(entry("a"));
+
+		std::vector<char> buf;
+		TEST_CHECK(write_binary_resume_data(rd, buf, ec));
+		TEST_CHECK(!ec);
+		TEST_CHECK(binary_resume_data::is_binary(&buf[0], buf.size()));
+
+		lazy_entry extra;
+		binary_resume_data brd;
+		TEST_CHECK(brd.parse(&buf[0], buf.size(), extra, ec));
+		TEST_CHECK(brd.valid());
+		TEST_CHECK(brd.info_hash() == ih);
+		TEST_CHECK(brd.compact());
+		TEST_EQUAL(brd.blocks_per_piece(), 4);
+		TEST_EQUAL(brd.num_pieces(), 21);
+		TEST_CHECK(brd.have_piece(0));
+		TEST_CHECK(!brd.have_piece(1));
+		TEST_CHECK(brd.have_piece(9));
+		TEST_CHECK(brd.verified_piece(9));
+		TEST_CHECK(!brd.verified_piece(20));
+		TEST_CHECK(brd.have_piece(20));
+		TEST_CHECK(brd.has_slot_map());
+		TEST_EQUAL(brd.num_slots(), 4);
+		TEST_EQUAL(brd.slot_at(1), -2);
+		TEST_EQUAL(brd.slot_at(2), 9);
+		TEST_EQUAL(brd.num_files(), 1);
+		TEST_CHECK(brd.file_size_at(0) == std::make_pair(size_type(0x100000000LL), std::time_t(1234)));
+		TEST_EQUAL(extra.dict_find_int_value("total_uploaded"), 100);
+		TEST_CHECK(extra.dict_find("pieces") == 0);
+
+		// converting it back gives the same resume data
+		entry rd2;
+		brd.to_entry(rd2);
+		TEST_CHECK(rd2 == rd);
+
+		// a flipped bit is caught by the checksum
+		buf[60] ^= 1;
+		TEST_CHECK(!brd.parse(&buf[0], buf.size(), extra, ec));
+		TEST_EQUAL(ec.value(), errors::invalid_binary_resume_data);
+		TEST_CHECK(!brd.valid());
+		buf[60] ^= 1;
+
+		// and so is a truncated buffer
+		TEST_CHECK(!brd.parse(&buf[0], buf.size() - 1, extra, ec));
+
+		// bencoded resume data is not binary
+		std::vector<char> bencoded;
+		bencode(std::back_inserter(bencoded), rd);
+		TEST_CHECK(!binary_resume_data::is_binary(&bencoded[0], bencoded.size()));
+	}
+
+	// test mpsc_queue
+	{
+		typedef mpsc_queue<int> queue_t;
+		queue_t q;
+		std::deque<int> out;
+		TEST_CHECK(q.empty());
+		TEST_EQUAL(q.pop_all(out), 0);
+
+		// nobody is waiting, so no push asks for a wakeup
+		for (int i = 0; i < 3; ++i) TEST_CHECK(!q.push(q.allocate(i)));
+		TEST_CHECK(!q.empty());
+
+		// the consumer should not go to sleep with elements queued
+		TEST_CHECK(!q.start_wait());
+		q.end_wait();
+
+		// elements come out in the order they were pushed
+		TEST_EQUAL(q.pop_all(out), 3);
+		TEST_EQUAL(out.size(), 3);
+		for (int i = 0; i < 3; ++i) TEST_EQUAL(out[i], i);
+		TEST_CHECK(q.empty());
+
+		// only the first push after the consumer went
+		// to sleep needs to wake it up
+		TEST_CHECK(q.start_wait());
+		TEST_CHECK(q.push(q.allocate(3)));
+		TEST_CHECK(!q.push(q.allocate(4)));
+		q.end_wait();
+		TEST_EQUAL(q.pop_all(out), 2);
+		TEST_EQUAL(out.back(), 4);
+
+		// nodes are recycled once their elements are popped
+		queue_t::node* n = q.allocate(6);
+		q.push(n);
+		TEST_EQUAL(q.pop_all(out), 1);
+		TEST_CHECK(q.allocate(7) == n);
+		q.push(n);
+		TEST_EQUAL(q.pop_all(out), 1);
+		TEST_EQUAL(out.back(), 7);
+
+		// allocate_swap() moves the element in, and leaves
+		// the source default constructed
+		int v = 8;
+		q.push(q.allocate_swap(v));
+		TEST_EQUAL(v, 0);
+		TEST_EQUAL(q.pop_all(out), 1);
+		TEST_EQUAL(out.back(), 8);
+
+		// the destructor frees elements that were never popped
+		q.push(q.allocate(5));
+
+		// with concurrent producers, every producer's
+		// elements still come out in order
+		mpsc_queue<std::pair<int, int> > mq;
+		std::vector<std::pair<int, int> > res;
+		thread t1(boost::bind(&mpsc_producer, &mq, 0));
+		thread t2(boost::bind(&mpsc_producer, &mq, 1));
+		thread t3(boost::bind(&mpsc_producer, &mq, 2));
+		int next[3] = {0, 0, 0};
+		bool in_order = true;
+		while (res.size() < 30000)
+		{
+			int num = mq.pop_all(res);
+			for (int i = res.size() - num; i < int(res.size()); ++i)
+			{
+				if (res[i].second != next[res[i].first]) in_order = false;
+				++next[res[i].first];
+			}
+		}
+		t1.join();
+		t2.join();
+		t3.join();
+		TEST_CHECK(in_order);
+		TEST_CHECK(mq.empty());
+		for (int i = 0; i < 3; ++i) TEST_EQUAL(next[i], 10000);
+	}
+
 	// test timestamp_history
 	{
 		timestamp_history h;
@@ -561,6 +1039,110 @@ int test_main()
 		TEST_EQUAL(h.base(), 0xfffffff3);
 	}
 
+	// test piece_cache
+	{
+		piece_cache c;
+		TEST_CHECK(c.empty());
+		TEST_CHECK(c.begin() == c.end());
+
+		// insert enough entries to force a few rehashes
+		for (int i = 0; i < 300; ++i)
+		{
+			cached_piece_entry e;
+			e.piece = i;
+			e.num_blocks = i;
+			TEST_CHECK(c.insert(e) != c.end());
+		}
+		TEST_EQUAL(c.size(), 300);
+		for (int i = 0; i < 300; ++i)
+		{
+			piece_cache::iterator p = c.find(0, i);
+			TEST_CHECK(p != c.end());
+			if (p != c.end()) TEST_EQUAL(p->num_blocks, i);
+		}
+		TEST_CHECK(c.find(0, 300) == c.end());
+		TEST_CHECK(c.find(&c, 0) == c.end());
+
+		// entries are iterated least recently used first, and
+		// modify() moves the entry to the back of the list
+		TEST_EQUAL(c.begin()->piece, 0);
+		c.modify(c.find(0, 0), set_num_blocks(1000));
+		TEST_EQUAL(c.begin()->piece, 1);
+		TEST_EQUAL(c.find(0, 0)->num_blocks, 1000);
+
+		// the pieces of a storage are listed in the same order
+		TEST_EQUAL(c.first_of(0)->piece, 1);
+		TEST_CHECK(c.first_of(&c) == c.end());
+
+		int num_even = 0;
+		for (piece_cache::iterator i = c.begin(); i != c.end();)
+		{
+			if (i->piece & 1) i = c.erase(i);
+			else { ++i; ++num_even; }
+		}
+		TEST_EQUAL(num_even, 150);
+		TEST_EQUAL(c.size(), 150);
+		TEST_CHECK(c.find(0, 3) == c.end());
+		TEST_CHECK(c.find(0, 4) != c.end());
+
+		int num_in_storage = 0;
+		int last = -1;
+		for (piece_cache::iterator i = c.first_of(0); i != c.end();
+			i = piece_cache::next_of(i), ++num_in_storage)
+		{
+			TEST_CHECK((i->piece & 1) == 0);
+			// piece 0 was used last
+			TEST_CHECK(i->piece > last || i->piece == 0);
+			last = i->piece;
+		}
+		TEST_EQUAL(num_in_storage, 150);
+		TEST_EQUAL(last, 0);
+
+		c.clear();
+		TEST_CHECK(c.empty());
+		TEST_CHECK(c.begin() == c.end());
+		TEST_CHECK(c.first_of(0) == c.end());
+	}
+
+	// test the probationary segment and the ghost list of piece_cache
+	{
+		piece_cache c;
+		cached_piece_entry e;
+		e.piece = 0;
+		c.insert(e);
+		e.piece = 1;
+		c.insert(e, true);
+		e.piece = 2;
+		c.insert(e, true);
+		TEST_EQUAL(c.num_probation(), 2);
+		TEST_EQUAL(c.begin()->piece, 1);
+		TEST_EQUAL(c.oldest_probation()->piece, 1);
+		TEST_EQUAL(c.oldest_protected()->piece, 0);
+
+		// using a probationary piece doesn't move it
+		c.modify(c.find(0, 1), set_num_blocks(1));
+		TEST_EQUAL(c.begin()->piece, 1);
+
+		c.promote(c.find(0, 1));
+		TEST_EQUAL(c.num_probation(), 1);
+		TEST_EQUAL(c.begin()->piece, 2);
+		TEST_EQUAL(c.oldest_protected()->piece, 0);
+		c.erase(c.find(0, 0));
+		TEST_EQUAL(c.oldest_protected()->piece, 1);
+		c.erase(c.find(0, 2));
+		TEST_CHECK(c.oldest_probation() == c.end());
+		TEST_EQUAL(c.num_probation(), 0);
+
+		c.add_ghost(0, 2);
+		TEST_CHECK(c.remove_ghost(0, 2));
+		TEST_CHECK(!c.remove_ghost(0, 2));
+
+		// only the 64 most recently evicted pieces are remembered
+		for (int i = 0; i < 100; ++i) c.add_ghost(0, 100 + i);
+		TEST_CHECK(!c.remove_ghost(0, 100));
+		TEST_CHECK(c.remove_ghost(0, 199));
+	}
+
 	// test packet_buffer
 	{
 		packet_buffer pb;
@@ -32,6 +32,7 @@ POSSIBILITY OF SUCH DAMAGE.
 
 #include "libtorrent/storage.hpp"
 #include "libtorrent/file_pool.hpp"
+#include "libtorrent/mmap_storage.hpp"
 #include "libtorrent/hasher.hpp"
 #include "libtorrent/session.hpp"
 #include "libtorrent/alert_types.hpp"
@@ -79,8 +80,8 @@ void on_check_resume_data(int ret, disk_io_job const& j, bool* done)
 			std::cerr << " success" << std::endl;
 			break;
 		case piece_manager::fatal_disk_error:
-			std::cerr << " disk error: " << j.str
-				<< " file: " << j.error_file << std::endl;
+			std::cerr << " disk error: " << j.str()
+				<< " file: " << j.error_file() << std::endl;
 			break;
 		case piece_manager::need_full_check:
 			std::cerr << " need full check" << std::endl;
@@ -103,8 +104,8 @@ void on_check_files(int ret, disk_io_job const& j, bool* done)
 			*done = true;
 			break;
 		case piece_manager::fatal_disk_error:
-			std::cerr << " disk error: " << j.str
-				<< " file: " << j.error_file << std::endl;
+			std::cerr << " disk error: " << j.str()
+				<< " file: " << j.error_file() << std::endl;
 			*done = true;
 			break;
 		case piece_manager::need_full_check:
@@ -126,16 +127,16 @@ void on_read(int ret, disk_io_job const& j, bool* done)
 	if (ret < 0)
 	{
 		std::cerr << j.error.message() << std::endl;
-		std::cerr << j.error_file << std::endl;
+		std::cerr << j.error_file() << std::endl;
 
 	}
 }
 
 void on_move_storage(int ret, bool* done, disk_io_job const& j, std::string path)
 {
-	std::cerr << "on_move_storage ret: " << ret << " path: " << j.str << std::endl;
+	std::cerr << "on_move_storage ret: " << ret << " path: " << j.str() << std::endl;
 	TEST_EQUAL(ret, 0);
-	TEST_EQUAL(j.str, path);
+	TEST_EQUAL(j.str(), path);
 	*done = true;
 }
 
@@ -417,6 +418,152 @@ void run_elevator_test()
 	}
 }
 
+void push_job(disk_job_queue& q, int action, int piece
+	, boost::intrusive_ptr<piece_manager>& pm, size_type sort_key = -1)
+{
+	disk_io_job j;
+	j.action = (disk_io_job::action_t)action;
+	j.storage = pm;
+	j.piece = piece;
+	q.push(j, sort_key);
+}
+
+void test_disk_job_queue()
+{
+	io_service ios;
+	file_pool fp;
+	boost::intrusive_ptr<torrent_info> ti = ::create_torrent(0, 16, 100);
+
+	disk_io_thread dio(ios, &nop, fp);
+	boost::intrusive_ptr<piece_manager> pm1(new piece_manager(boost::shared_ptr<void>(), ti, ""
+		, fp, dio, &create_test_storage, storage_mode_sparse, std::vector<boost::uint8_t>()));
+	boost::intrusive_ptr<piece_manager> pm2(new piece_manager(boost::shared_ptr<void>(), ti, ""
+		, fp, dio, &create_test_storage, storage_mode_sparse, std::vector<boost::uint8_t>()));
+
+	{
+		session_settings set;
+		disk_job_queue q(16 * 1024);
+		q.set_weights(set);
+		disk_io_job j;
+
+		// a torrent with a deep read queue doesn't hold up
+		// the reads of another torrent for more than one turn
+		for (int i = 0; i < 20; ++i)
+			push_job(q, disk_io_job::read, i, pm1, i);
+		push_job(q, disk_io_job::read, 50, pm2, 50);
+		TEST_EQUAL(q.size(), 21);
+		TEST_EQUAL(q.num_reads(), 21);
+
+		for (int i = 0; i < set.disk_read_weight; ++i)
+		{
+			TEST_CHECK(q.pop(j));
+			TEST_CHECK(j.storage == pm1);
+			TEST_EQUAL(j.piece, i);
+		}
+		TEST_CHECK(q.pop(j));
+		TEST_CHECK(j.storage == pm2);
+		TEST_EQUAL(j.piece, 50);
+
+		for (int i = set.disk_read_weight; i < 20; ++i)
+		{
+			TEST_CHECK(q.pop(j));
+			TEST_CHECK(j.storage == pm1);
+			TEST_EQUAL(j.piece, i);
+		}
+		TEST_CHECK(q.empty());
+		TEST_CHECK(!q.pop(j));
+
+		// jobs other than reads are run in the order they were
+		// issued, and jobs without a storage jump the queue
+		push_job(q, disk_io_job::write, 3, pm1);
+		push_job(q, disk_io_job::hash, 3, pm1);
+		push_job(q, disk_io_job::write, 1, pm1);
+		disk_io_job settings_job;
+		settings_job.action = disk_io_job::update_settings;
+		q.push(settings_job);
+
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::update_settings);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::write);
+		TEST_EQUAL(j.piece, 3);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::hash);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::write);
+		TEST_EQUAL(j.piece, 1);
+		TEST_CHECK(q.empty());
+
+		// a check of the files costs more than a turn's worth
+		// of hashing, the other torrent's reads go first
+		push_job(q, disk_io_job::check_files, 0, pm1);
+		push_job(q, disk_io_job::read, 7, pm2, 7);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::read);
+		TEST_CHECK(j.storage == pm2);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::check_files);
+		TEST_CHECK(q.empty());
+
+		// two torrents being checked take turns, the queue skips
+		// ahead rather than going around until one is allowed a check
+		push_job(q, disk_io_job::check_files, 0, pm1);
+		push_job(q, disk_io_job::check_files, 0, pm2);
+		push_job(q, disk_io_job::hash, 0, pm2);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::check_files);
+		TEST_CHECK(j.storage == pm1);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::check_files);
+		TEST_CHECK(j.storage == pm2);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::hash);
+		TEST_CHECK(q.empty());
+
+		// aborting a torrent cancels its reads, but its
+		// writes still have to be flushed
+		push_job(q, disk_io_job::read, 1, pm1, 1);
+		push_job(q, disk_io_job::write, 2, pm1);
+		push_job(q, disk_io_job::read, 3, pm1, 3);
+		push_job(q, disk_io_job::read, 4, pm2, 4);
+		std::vector<disk_io_job> cancelled;
+		q.remove_jobs(pm1.get(), cancelled);
+		TEST_EQUAL(cancelled.size(), 2);
+		TEST_EQUAL(q.size(), 2);
+		TEST_EQUAL(q.num_reads(), 1);
+
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::write);
+		TEST_CHECK(j.storage == pm1);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::read);
+		TEST_CHECK(j.storage == pm2);
+		TEST_CHECK(q.empty());
+
+		// abort_torrent goes ahead of the torrent's queued jobs,
+		// the writes it doesn't cancel still run after it, in order
+		push_job(q, disk_io_job::write, 1, pm1);
+		push_job(q, disk_io_job::read, 2, pm1, 2);
+		push_job(q, disk_io_job::write, 3, pm1);
+		push_job(q, disk_io_job::abort_torrent, 0, pm1);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::abort_torrent);
+		cancelled.clear();
+		q.remove_jobs(pm1.get(), cancelled);
+		TEST_EQUAL(cancelled.size(), 1);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::write);
+		TEST_EQUAL(j.piece, 1);
+		TEST_CHECK(q.pop(j));
+		TEST_EQUAL(j.action, disk_io_job::write);
+		TEST_EQUAL(j.piece, 3);
+		TEST_CHECK(q.empty());
+	}
+
+	dio.abort();
+	dio.join();
+}
+
 void run_until(io_service& ios, bool const& done)
 {
 	while (!done)
@@ -665,7 +812,7 @@ namespace
 		std::cerr << "check_files_fill_array ret: " << ret
 			<< " piece: " << j.piece
 			<< " have: " << j.offset
-			<< " str: " << j.str
+			<< " str: " << j.str()
 			<< " e: " << j.error.message()
 			<< std::endl;
 
@@ -749,6 +896,83 @@ void test_check_files(std::string const& test_path
 	io.join();
 }
 
+// checks a torrent large enough for the full check to read and
+// hash several batches of pieces, with the hashing spread across
+// hash threads while the next batch is read
+void test_check_files_pipelined(std::string const& test_path)
+{
+	error_code ec;
+	const int piece_size = 16 * 1024;
+	const int num_pieces = 40;
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+	file_storage fs;
+	fs.add_file("temp_storage/test1.tmp", piece_size * 17);
+	fs.add_file("temp_storage/test2.tmp", piece_size * 5);
+	fs.add_file("temp_storage/test3.tmp", piece_size * 18);
+
+	std::vector<char> data(piece_size * num_pieces);
+	std::generate(data.begin(), data.end(), std::rand);
+
+	libtorrent::create_torrent t(fs, piece_size, -1, 0);
+	for (int i = 0; i < num_pieces; ++i)
+		t.set_hash(i, hasher(&data[i * piece_size], piece_size).final());
+
+	// piece 9 is corrupt and test2.tmp (pieces 17 - 21) is missing
+	data[9 * piece_size + 100] ^= 0x55;
+
+	create_directory(combine_path(test_path, "temp_storage"), ec);
+	std::ofstream f;
+	f.open(combine_path(test_path, "temp_storage/test1.tmp").c_str()
+		, std::ios::trunc | std::ios::binary);
+	f.write(&data[0], piece_size * 17);
+	f.close();
+	f.open(combine_path(test_path, "temp_storage/test3.tmp").c_str()
+		, std::ios::trunc | std::ios::binary);
+	f.write(&data[piece_size * 22], piece_size * 18);
+	f.close();
+
+	std::vector<char> buf;
+	bencode(std::back_inserter(buf), t.generate());
+	boost::intrusive_ptr<torrent_info> info = new torrent_info(&buf[0], buf.size(), ec);
+
+	file_pool fp;
+	libtorrent::asio::io_service ios;
+	disk_io_thread io(ios, boost::function<void()>(), fp);
+
+	session_settings set;
+	set.hashing_threads = 3;
+	set.optimize_hashing_for_speed = true;
+	disk_io_job sj;
+	sj.buffer = (char*)&set;
+	sj.action = disk_io_job::update_settings;
+	io.add_job(sj);
+
+	boost::shared_ptr<int> dummy(new int);
+	boost::intrusive_ptr<piece_manager> pm = new piece_manager(dummy, info
+		, test_path, fp, io, default_storage_constructor, storage_mode_sparse
+		, std::vector<boost::uint8_t>());
+
+	bool done = false;
+	lazy_entry frd;
+	pm->async_check_fastresume(&frd, boost::bind(&on_check_resume_data, _1, _2, &done));
+	ios.reset();
+	run_until(ios, done);
+
+	bool pieces[num_pieces];
+	std::fill(pieces, pieces + num_pieces, false);
+	done = false;
+	pm->async_check_files(boost::bind(&check_files_fill_array, _1, _2, pieces, &done));
+	run_until(ios, done);
+
+	for (int i = 0; i < num_pieces; ++i)
+	{
+		bool expected = i != 9 && (i < 17 || i >= 22);
+		TEST_EQUAL(pieces[i], expected);
+	}
+	io.abort();
+	io.join();
+}
+
 void run_test(std::string const& test_path, bool unbuffered)
 {
 	std::cerr << "\n=== " << test_path << " ===\n" << std::endl;
@@ -847,6 +1071,7 @@ void run_test(std::string const& test_path, bool unbuffered)
 	std::cerr << "=== test 6 ===" << std::endl;
 	test_check_files(test_path, storage_mode_sparse, unbuffered);
 	test_check_files(test_path, storage_mode_compact, unbuffered);
+	test_check_files_pipelined(test_path);
 }
 
 void test_fastresume(std::string const& test_path)
@@ -1019,10 +1244,369 @@ void test_rename_file_in_fastresume(std::string const& test_path)
 		<< "': " << ec.message() << std::endl;
 }
 
+void test_file_pool(std::string const& test_path)
+{
+	std::cerr << "=== test file_pool ===" << std::endl;
+	error_code ec;
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+	create_directory(combine_path(test_path, "temp_storage"), ec);
+	if (ec) std::cerr << "create_directory: " << ec.message() << std::endl;
+
+	file_storage fs;
+	fs.add_file("temp_storage/test1.tmp", 10);
+	fs.add_file("temp_storage/test2.tmp", 10);
+	fs.add_file("temp_storage/test3.tmp", 10);
+	fs.add_file("temp_storage/test4.tmp", 10);
+	fs.add_file("temp_storage/test5.tmp", 10);
+
+	// two storages using the same files
+	int st1 = 0;
+	int st2 = 0;
+
+	file_pool fp(3);
+	std::vector<boost::intrusive_ptr<file> > files;
+	for (file_storage::iterator i = fs.begin(); i != fs.end(); ++i)
+	{
+		files.push_back(fp.open_file(&st1, test_path, i, fs, file::read_write, ec));
+		TEST_CHECK(files.back());
+	}
+
+	// only the 3 most recently used files are kept open. The
+	// first one has been closed, opening it again is a new handle
+	boost::intrusive_ptr<file> f = fp.open_file(&st1, test_path, fs.begin(), fs, file::read_write, ec);
+	TEST_CHECK(f && f != files[0]);
+	f = fp.open_file(&st1, test_path, fs.begin() + 4, fs, file::read_write, ec);
+	TEST_CHECK(f == files[4]);
+
+	// each storage has its own handles
+	boost::intrusive_ptr<file> f2 = fp.open_file(&st2, test_path, fs.begin() + 4, fs, file::read_write, ec);
+	TEST_CHECK(f2 && f2 != files[4]);
+
+	// releasing a storage only closes its own files
+	fp.release(&st1);
+	f = fp.open_file(&st2, test_path, fs.begin() + 4, fs, file::read_write, ec);
+	TEST_CHECK(f == f2);
+	f = fp.open_file(&st1, test_path, fs.begin() + 4, fs, file::read_write, ec);
+	TEST_CHECK(f && f != files[4]);
+
+	fp.release(&st2, 4);
+	f = fp.open_file(&st2, test_path, fs.begin() + 4, fs, file::read_write, ec);
+	TEST_CHECK(f && f != f2);
+
+	// a file that's still in use when it's reopened in write mode
+	// (e.g. by a peer sending from it) stays open for its user
+	fp.release(0);
+	boost::intrusive_ptr<file> ro = fp.open_file(&st1, test_path, fs.begin(), fs, file::read_only, ec);
+	TEST_CHECK(ro);
+	f = fp.open_file(&st1, test_path, fs.begin(), fs, file::read_write, ec);
+	TEST_CHECK(f && f != ro);
+	TEST_CHECK(ro->is_open());
+	TEST_CHECK((f->open_mode() & file::rw_mask) == file::read_write);
+
+	fp.release(0);
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+}
+
+void test_mmap_storage(std::string const& test_path)
+{
+	std::cerr << "=== test mmap_storage ===" << std::endl;
+	error_code ec;
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+
+	// the first piece spans both files
+	file_storage fs;
+	fs.set_piece_length(piece_size);
+	fs.add_file("temp_storage/test1.tmp", half);
+	fs.add_file("temp_storage/test2.tmp", piece_size * 2 - half);
+	fs.set_num_pieces(2);
+
+	session_settings set;
+	file_pool fp;
+	disk_buffer_pool dp(16 * 1024);
+	char* piece = page_aligned_allocator::malloc(piece_size);
+	boost::shared_ptr<void> mapping;
+	char const* view = 0;
+
+	{
+	boost::scoped_ptr<storage_interface> s(
+		mmap_storage_constructor(fs, 0, test_path, fp, std::vector<boost::uint8_t>()));
+	s->m_settings = &set;
+	s->m_disk_pool = &dp;
+
+	int ret = s->write(piece0, 0, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	// synchronous writes go through the mapping too
+	set.mmap_sync_writes = true;
+	ret = s->write(piece1, 1, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	TEST_EQUAL(ret, piece_size);
+	set.mmap_sync_writes = false;
+
+	ret = s->read(piece, 0, 3, piece_size - 3);
+	if (ret != piece_size - 3) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + piece_size - 3, piece0 + 3));
+
+	// blocks that span files can't be mapped
+	TEST_CHECK(s->map_block(0, half - 16, 32, mapping) == 0);
+
+#if TORRENT_USE_MMAP
+	view = s->map_block(1, 16 * 1024, 16 * 1024, mapping);
+	TEST_CHECK(view != 0 && mapping);
+	if (view) TEST_CHECK(std::equal(view, view + 16 * 1024, piece1 + 16 * 1024));
+#endif
+
+	s->release_files();
+	}
+
+	// the view stays valid as long as the mapping is held on to
+	if (view) TEST_CHECK(std::equal(view, view + 16 * 1024, piece1 + 16 * 1024));
+	mapping.reset();
+
+	// the files are regular files, readable by default_storage
+	{
+	boost::scoped_ptr<storage_interface> s(
+		default_storage_constructor(fs, 0, test_path, fp, std::vector<boost::uint8_t>()));
+	s->m_settings = &set;
+	s->m_disk_pool = &dp;
+
+	int ret = s->read(piece, 0, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + piece_size, piece0));
+	ret = s->read(piece, 1, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + piece_size, piece1));
+	}
+
+	page_aligned_allocator::free(piece);
+	fp.release(0);
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+}
+
+void test_direct_io(std::string const& test_path)
+{
+	std::cerr << "=== test direct_io ===" << std::endl;
+	error_code ec;
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+
+	// neither the second nor the third file starts on a sector
+	// boundary, and the pieces end in the middle of the second file
+	file_storage fs;
+	fs.set_piece_length(piece_size);
+	fs.add_file("temp_storage/test1.tmp", 1000);
+	fs.add_file("temp_storage/test2.tmp", piece_size * 2 - 1100);
+	fs.add_file("temp_storage/test3.tmp", 100);
+	fs.set_num_pieces(2);
+
+	session_settings set;
+	set.direct_io = true;
+	file_pool fp;
+	disk_buffer_pool dp(16 * 1024);
+	char* piece = page_aligned_allocator::malloc(piece_size);
+
+	boost::scoped_ptr<storage_interface> s(
+		default_storage_constructor(fs, 0, test_path, fp, std::vector<boost::uint8_t>()));
+	s->m_settings = &set;
+	s->m_disk_pool = &dp;
+
+	// write the last piece first, to make sure writing the first
+	// one doesn't truncate the second file
+	std::memcpy(piece, piece1, piece_size);
+	int ret = s->write(piece, 1, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	std::memcpy(piece, piece0, piece_size);
+	ret = s->write(piece, 0, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+
+	// and an unaligned block in the middle of a piece
+	ret = s->write(piece2 + 3, 1, 3, 5000);
+	if (ret != 5000) print_error(ret, s);
+
+	ret = s->read(piece, 0, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + piece_size, piece0));
+	ret = s->read(piece, 1, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + 3, piece1));
+	TEST_CHECK(std::equal(piece + 3, piece + 5003, piece2 + 3));
+	TEST_CHECK(std::equal(piece + 5003, piece + piece_size, piece1 + 5003));
+
+	ret = s->read(piece, 1, piece_size - 50, 50);
+	if (ret != 50) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + 50, piece1 + piece_size - 50));
+
+	s->release_files();
+	fp.release(0);
+
+	std::string base = combine_path(test_path, "temp_storage");
+	TEST_EQUAL(file_size(combine_path(base, "test1.tmp")), 1000);
+	TEST_EQUAL(file_size(combine_path(base, "test2.tmp")), piece_size * 2 - 1100);
+	TEST_EQUAL(file_size(combine_path(base, "test3.tmp")), 100);
+
+	page_aligned_allocator::free(piece);
+	remove_all(base, ec);
+}
+
+void test_writev_span(std::string const& test_path)
+{
+	std::cerr << "=== test writev_span ===" << std::endl;
+	error_code ec;
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+
+	file_storage fs;
+	fs.set_piece_length(piece_size);
+	fs.add_file("temp_storage/test1.tmp", half);
+	fs.add_file("temp_storage/test2.tmp", piece_size * 2);
+	fs.add_file("temp_storage/test3.tmp", piece_size - half);
+	fs.set_num_pieces(3);
+
+	session_settings set;
+	file_pool fp;
+	disk_buffer_pool dp(16 * 1024);
+	char* piece = page_aligned_allocator::malloc(piece_size);
+
+	{
+	boost::scoped_ptr<storage_interface> s(
+		default_storage_constructor(fs, 0, test_path, fp, std::vector<boost::uint8_t>()));
+	s->m_settings = &set;
+	s->m_disk_pool = &dp;
+
+	// the second half of piece 0, all of piece 1 and the first
+	// half of piece 2, in a single call
+	file::iovec_t iov[3] = {
+		{ piece0 + half, half }, { piece1, piece_size }, { piece2, half } };
+	int ret = s->writev_span(iov, 0, half, 3);
+	if (ret != piece_size * 2) print_error(ret, s);
+
+	ret = s->read(piece, 0, half, half);
+	if (ret != half) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + half, piece0 + half));
+	ret = s->read(piece, 1, 0, piece_size);
+	if (ret != piece_size) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + piece_size, piece1));
+	ret = s->read(piece, 2, 0, half);
+	if (ret != half) print_error(ret, s);
+	TEST_CHECK(std::equal(piece, piece + half, piece2));
+	}
+
+	// storages that can't write across slots say so
+	{
+	boost::scoped_ptr<storage_interface> s(
+		mmap_storage_constructor(fs, 0, test_path, fp, std::vector<boost::uint8_t>()));
+	s->m_settings = &set;
+	s->m_disk_pool = &dp;
+#if TORRENT_USE_MMAP
+	file::iovec_t iov[2] = { { piece0 + half, half }, { piece1, piece_size } };
+	TEST_EQUAL(s->writev_span(iov, 0, half, 2), -2);
+#endif
+	s->release_files();
+	}
+
+	page_aligned_allocator::free(piece);
+	fp.release(0);
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+}
+
+void on_write(int ret, disk_io_job const& j, int* outstanding)
+{
+	TEST_EQUAL(ret, j.buffer_size);
+	--*outstanding;
+}
+
+// the write cache holds the end of piece 0 and the start of pieces 1 and
+// 2 when the storage goes over its hard quota. Flushing piece 0 writes
+// and erases the blocks of the following pieces too
+void test_hard_quota_flush(std::string const& test_path)
+{
+	std::cerr << "=== test hard quota flush ===" << std::endl;
+	error_code ec;
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+
+	file_storage fs;
+	fs.add_file("temp_storage/test1.tmp", 3 * piece_size);
+	libtorrent::create_torrent t(fs, piece_size, -1, 0);
+	t.set_hash(0, hasher(piece0, piece_size).final());
+	t.set_hash(1, hasher(piece1, piece_size).final());
+	t.set_hash(2, hasher(piece2, piece_size).final());
+	std::vector<char> buf;
+	bencode(std::back_inserter(buf), t.generate());
+	boost::intrusive_ptr<torrent_info> info = new torrent_info(&buf[0], buf.size(), ec);
+
+	file_pool fp;
+	libtorrent::asio::io_service ios;
+	disk_io_thread io(ios, boost::function<void()>(), fp);
+
+	// blocks are written with writev(), which is what
+	// lets a write span several pieces
+	session_settings set;
+	set.coalesce_writes = false;
+	disk_io_job sj;
+	sj.buffer = (char*)&set;
+	sj.action = disk_io_job::update_settings;
+	io.add_job(sj);
+
+	boost::shared_ptr<int> dummy(new int);
+	boost::intrusive_ptr<piece_manager> pm = new piece_manager(dummy, info
+		, test_path, fp, io, default_storage_constructor, storage_mode_sparse
+		, std::vector<boost::uint8_t>());
+
+	bool done = false;
+	lazy_entry frd;
+	pm->async_check_fastresume(&frd, boost::bind(&on_check_resume_data, _1, _2, &done));
+	ios.reset();
+	run_until(ios, done);
+
+	io.set_cache_quota(pm.get(), 0, 3);
+
+	struct { int piece; int start; char const* data; } const writes[] = {
+		{ 0, piece_size - block_size, piece0 + piece_size - block_size },
+		{ 1, 0, piece1 },
+		{ 2, 0, piece2 },
+		{ 2, block_size, piece2 + block_size },
+	};
+	int outstanding = 0;
+	for (int i = 0; i < int(sizeof(writes) / sizeof(writes[0])); ++i)
+	{
+		peer_request r;
+		r.piece = writes[i].piece;
+		r.start = writes[i].start;
+		r.length = block_size;
+		disk_buffer_holder holder(io, io.allocate_buffer("send buffer"));
+		std::memcpy(holder.get(), writes[i].data, block_size);
+		++outstanding;
+		pm->async_write(r, holder, boost::bind(&on_write, _1, _2, &outstanding));
+	}
+	while (outstanding > 0)
+	{
+		ios.reset();
+		ios.run_one(ec);
+	}
+
+	torrent_cache_status st;
+	io.get_torrent_cache_status(pm.get(), st);
+	TEST_CHECK(st.cached_blocks <= 3);
+
+	for (int i = 0; i < int(sizeof(writes) / sizeof(writes[0])); ++i)
+	{
+		peer_request r;
+		r.piece = writes[i].piece;
+		r.start = writes[i].start;
+		r.length = block_size;
+		pm->async_read(r, boost::bind(&on_read_piece, _1, _2, writes[i].data, block_size));
+	}
+	done = false;
+	pm->async_release_files(boost::bind(&signal_bool, &done, "async_release_files"));
+	run_until(ios, done);
+
+	io.abort();
+	io.join();
+	remove_all(combine_path(test_path, "temp_storage"), ec);
+}
+
 int test_main()
 {
 
 	run_elevator_test();
+	test_disk_job_queue();
 
 	// initialize test pieces
 	for (char* p = piece0, *end(piece0 + piece_size); p < end; ++p)
@@ -1048,6 +1632,11 @@ int test_main()
 		}
 	}
 
+	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_file_pool, _1));
+	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_mmap_storage, _1));
+	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_direct_io, _1));
+	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_writev_span, _1));
+	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_hard_quota_flush, _1));
 	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_fastresume, _1));
 	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&test_rename_file_in_fastresume, _1));
 	std::for_each(test_paths.begin(), test_paths.end(), boost::bind(&run_test, _1, true));